@@ -49,6 +49,20 @@ ADB_MUTEX_DEFINE( D_lock );
 int HOST = 0;
 int gListenAll = 0;
 
+/* the window we advertise: how many WRTEs per stream we take before OKAY */
+static unsigned local_window = DEFAULT_WINDOW;
+
+static unsigned parse_window(const char *value)
+{
+    unsigned long window = strtoul(value, NULL, 10);
+
+    if (window < 1)
+        return 1;
+    if (window > MAX_WINDOW)
+        return MAX_WINDOW;
+    return window;
+}
+
 static int auth_enabled = 0;
 
 #if !ADB_HOST
@@ -196,19 +210,95 @@ void adb_qemu_trace(const char* fmt, ...)
 }
 #endif  /* !ADB_HOST */
 
-apacket *get_apacket(void)
+/* Freed packets are kept for reuse instead of going back to malloc:
+** stream data moves in MAX_PAYLOAD packets, and allocating one of those
+** per WRTE meant faulting its pages in again every time.  Packets pass
+** between the transport threads and the main loop, so the pools are
+** shared and locked.
+*/
+typedef struct apacket_pool {
+    apacket *first;
+    unsigned count;
+    unsigned max;
+    size_t capacity;
+} apacket_pool;
+
+ADB_MUTEX_DEFINE( packet_pool_lock );
+
+static apacket_pool small_pool = { NULL, 0, 64, MAX_PAYLOAD_V1 };
+static apacket_pool large_pool = { NULL, 0, 2 * DEFAULT_WINDOW, MAX_PAYLOAD };
+static apacket_stats packet_stats;
+
+static apacket *pool_get(apacket_pool *pool)
 {
-    apacket *p = malloc(sizeof(apacket));
-    if(p == 0) fatal("failed to allocate an apacket");
-    memset(p, 0, sizeof(apacket) - MAX_PAYLOAD);
+    apacket *p;
+
+    adb_mutex_lock(&packet_pool_lock);
+    p = pool->first;
+    if(p) {
+        pool->first = p->next;
+        pool->count--;
+        packet_stats.reused++;
+        packet_stats.pooled--;
+    } else {
+        packet_stats.allocated++;
+    }
+    adb_mutex_unlock(&packet_pool_lock);
+
+    if(p == 0) {
+        p = malloc(sizeof(apacket) + pool->capacity);
+        if(p == 0) fatal("failed to allocate an apacket");
+    }
+    memset(p, 0, sizeof(apacket));
+    p->data = (unsigned char*) (&p->msg + 1);
+    p->capacity = pool->capacity;
     return p;
 }
 
+apacket *get_apacket(void)
+{
+    return pool_get(&small_pool);
+}
+
+apacket *get_large_apacket(void)
+{
+    return pool_get(&large_pool);
+}
+
 void put_apacket(apacket *p)
 {
+    apacket_pool *pool;
+
+    pool = (p->capacity == MAX_PAYLOAD) ? &large_pool : &small_pool;
+    adb_mutex_lock(&packet_pool_lock);
+    if(pool->count < pool->max) {
+        p->next = pool->first;
+        pool->first = p;
+        pool->count++;
+        packet_stats.pooled++;
+        p = 0;
+    } else {
+        packet_stats.released++;
+    }
+    adb_mutex_unlock(&packet_pool_lock);
+
     free(p);
 }
 
+void get_apacket_stats(apacket_stats *stats)
+{
+    adb_mutex_lock(&packet_pool_lock);
+    *stats = packet_stats;
+    adb_mutex_unlock(&packet_pool_lock);
+}
+
+/* the traffic counters are only touched from the main loop */
+void count_packet_sent(apacket *p)
+{
+    packet_stats.packets_sent++;
+    packet_stats.bytes_sent += p->msg.data_length;
+}
+
 void handle_online(atransport *t)
 {
     D("adb: online\n");
@@ -287,7 +377,7 @@ static void send_close(unsigned local, unsigned remote, atransport *t)
 static size_t fill_connect_data(char *buf, size_t bufsize)
 {
 #if ADB_HOST
-    return snprintf(buf, bufsize, "host::") + 1;
+    return snprintf(buf, bufsize, "host::window=%u;", local_window) + 1;
 #else
     static const char *cnxn_props[] = {
         "ro.product.name",
@@ -309,6 +399,8 @@ static size_t fill_connect_data(char *buf, size_t bufsize)
         remaining -= len;
         buf += len;
     }
+    len = snprintf(buf, remaining, "window=%u;", local_window);
+    remaining -= len;
 
     return bufsize - remaining + 1;
 #endif
@@ -321,8 +413,9 @@ static void send_connect(atransport *t)
     cp->msg.command = A_CNXN;
     cp->msg.arg0 = A_VERSION;
     cp->msg.arg1 = MAX_PAYLOAD;
+        /* the remote hasn't told us how much it accepts yet */
     cp->msg.data_length = fill_connect_data((char *)cp->data,
-                                            sizeof(cp->data));
+                                            MAX_PAYLOAD_V1);
     send_packet(cp, t);
 }
 
@@ -371,7 +464,7 @@ static void send_auth_publickey(atransport *t)
     apacket *p = get_apacket();
     int ret;
 
-    ret = adb_auth_get_userkey(p->data, sizeof(p->data));
+    ret = adb_auth_get_userkey(p->data, p->capacity);
     if (!ret) {
         D("Failed to get user public key\n");
         put_apacket(p);
@@ -456,6 +549,8 @@ void parse_banner(char *banner, atransport *t)
                         qual_overwrite(&t->model, cp);
                     else if (!strcmp(key, "ro.product.device"))
                         qual_overwrite(&t->device, cp);
+                    else if (!strcmp(key, "window"))
+                        t->window = parse_window(cp);
                 }
                 key = adb_strtok_r(NULL, prop_seps, &save);
             }
@@ -502,6 +597,8 @@ void handle_packet(apacket *p, atransport *t)
             ((char*) (&(p->msg.command)))[2],
             ((char*) (&(p->msg.command)))[3]);
     print_packet("recv", p);
+    packet_stats.packets_received++;
+    packet_stats.bytes_received += p->msg.data_length;
 
     switch(p->msg.command){
     case A_SYNC:
@@ -522,7 +619,19 @@ void handle_packet(apacket *p, atransport *t)
             handle_offline(t);
         }
 
+            /* older peers send 4096, and can't take anything bigger */
+        t->max_payload = p->msg.arg1;
+        if(t->max_payload > MAX_PAYLOAD) {
+            t->max_payload = MAX_PAYLOAD;
+        } else if(t->max_payload < MAX_PAYLOAD_V1) {
+            t->max_payload = MAX_PAYLOAD_V1;
+        }
+        D("adb: max payload %d\n", (int) t->max_payload);
+
+            /* older peers don't advertise a window and stop-and-wait */
+        t->window = 1;
         parse_banner((char*) p->data, t);
+        D("adb: window %d\n", t->window);
 
         if (HOST || !auth_enabled) {
             handle_online(t);
@@ -578,6 +687,8 @@ void handle_packet(apacket *p, atransport *t)
                 if(s->peer == 0) {
                     s->peer = create_remote_socket(p->msg.arg0, t);
                     s->peer->peer = s;
+                } else {
+                    remote_socket_acked(s->peer, p);
                 }
                 s->ready(s);
             }
@@ -598,9 +709,14 @@ void handle_packet(apacket *p, atransport *t)
                 unsigned rid = p->msg.arg0;
                 p->len = p->msg.data_length;
 
+                if(s->peer) remote_socket_owe_ready(s->peer);
                 if(s->enqueue(s, p) == 0) {
                     D("Enqueue the socket\n");
-                    send_ready(s->id, rid, t);
+                    if(s->peer) {
+                        s->peer->ready(s->peer);
+                    } else {
+                        send_ready(s->id, rid, t);
+                    }
                 }
                 return;
             }
@@ -1252,6 +1368,11 @@ int adb_main(int is_daemon, int server_port)
     umask(000);
 #endif
 
+    // ADB_WINDOW overrides the window we advertise, for benchmarking.
+    const char* window = getenv("ADB_WINDOW");
+    if (window != NULL)
+        local_window = parse_window(window);
+
     atexit(adb_cleanup);
 #ifdef HAVE_WIN32_PROC
     SetConsoleCtrlHandler( ctrlc_handler, TRUE );
@@ -1603,6 +1724,23 @@ int handle_host_request(char *service, transport_type ttype, char* serial, int r
         return 0;
     }
 
+    // returns the packet allocator and traffic counters
+    if (!strcmp(service, "packet-stats")) {
+        apacket_stats stats;
+        char out[256];
+        get_apacket_stats(&stats);
+        snprintf(out, sizeof out,
+                 "packets: %lu allocated, %lu reused, %lu released, %lu pooled\n"
+                 "sent: %lu packets, %llu bytes\n"
+                 "received: %lu packets, %llu bytes\n",
+                 stats.allocated, stats.reused, stats.released, stats.pooled,
+                 stats.packets_sent, stats.bytes_sent,
+                 stats.packets_received, stats.bytes_received);
+        snprintf(buf, sizeof buf, "OKAY%04x%s", (unsigned)strlen(out), out);
+        writex(reply_fd, buf, strlen(buf));
+        return 0;
+    }
+
     // returns our value for ADB_SERVER_VERSION
     if (!strcmp(service, "version")) {
         char version[12];
@@ -21,7 +21,20 @@
 
 #include "transport.h"  /* readx(), writex() */
 
-#define MAX_PAYLOAD 4096
+/* Every peer accepts payloads of MAX_PAYLOAD_V1.  Larger ones may only be
+** sent once the other side's CONNECT says it takes them; see
+** atransport.max_payload.
+*/
+#define MAX_PAYLOAD_V1 (4*1024)
+#define MAX_PAYLOAD    (256*1024)
+
+/* How many WRTE messages a stream may have in flight before it waits for
+** an OKAY.  Each side advertises the window it accepts in its CONNECT
+** banner; peers that don't advertise one get 1, which is plain
+** stop-and-wait.  See atransport.window.
+*/
+#define DEFAULT_WINDOW 8
+#define MAX_WINDOW     64
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -60,13 +73,34 @@ struct apacket
 {
     apacket *next;
 
+        /* the payload follows msg in the same allocation, so the two can
+        ** go out in one write, and is recycled with it: MAX_PAYLOAD_V1
+        ** bytes, or MAX_PAYLOAD for packets from get_large_apacket()
+        */
+    unsigned char *data;
+    size_t capacity;
+
     unsigned len;
     unsigned char *ptr;
 
     amessage msg;
-    unsigned char data[MAX_PAYLOAD];
 };
 
+/* counters kept by the packet allocator and the protocol engine,
+** reported by the host:packet-stats service
+*/
+typedef struct apacket_stats {
+    unsigned long allocated;    /* packets that had to be malloc()ed */
+    unsigned long reused;       /* packets handed out again from a pool */
+    unsigned long released;     /* packets freed because a pool was full */
+    unsigned long pooled;       /* packets waiting in the pools now */
+
+    unsigned long packets_sent;
+    unsigned long long bytes_sent;
+    unsigned long packets_received;
+    unsigned long long bytes_received;
+} apacket_stats;
+
 /* An asocket represents one half of a connection between a local and
 ** remote entity.  A local asocket is bound to a file descriptor.  A
 ** remote asocket is bound to the protocol engine.
@@ -183,6 +217,12 @@ struct atransport
     fdevent transport_fde;
     int ref_count;
     unsigned sync_token;
+        /* largest payload the remote accepts, from its CONNECT message */
+    size_t max_payload;
+        /* WRTEs the remote accepts per stream before it has to OKAY
+        ** them, from its CONNECT banner
+        */
+    unsigned window;
     int connection_state;
     int online;
     transport_type type;
@@ -247,6 +287,8 @@ asocket *create_local_socket(int fd);
 asocket *create_local_service_socket(const char *destination);
 
 asocket *create_remote_socket(unsigned id, atransport *t);
+void remote_socket_owe_ready(asocket *s);
+void remote_socket_acked(asocket *s, apacket *p);
 void connect_to_remote(asocket *s, const char *destination);
 void connect_to_smartsocket(asocket *s);
 
@@ -332,9 +374,14 @@ void remount_service(int fd, void *cookie);
 char * get_log_file_path(const char * log_name);
 #endif
 
-/* packet allocator */
+/* packet allocator: get_apacket() packets hold MAX_PAYLOAD_V1 bytes,
+** which is enough for anything but stream data
+*/
 apacket *get_apacket(void);
+apacket *get_large_apacket(void);
 void put_apacket(apacket *p);
+void get_apacket_stats(apacket_stats *stats);
+void count_packet_sent(apacket *p);
 
 int check_header(apacket *p);
 int check_data(apacket *p);
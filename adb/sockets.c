@@ -127,6 +127,23 @@ restart:
     adb_mutex_unlock(&socket_list_lock);
 }
 
+/* returns the largest payload that can be sent from s: whatever
+** the transport behind it or its peer negotiated
+*/
+static size_t get_max_payload(asocket *s)
+{
+    size_t max_payload = MAX_PAYLOAD;
+
+    if(s->transport && s->transport->max_payload < max_payload) {
+        max_payload = s->transport->max_payload;
+    }
+    if(s->peer && s->peer->transport &&
+       s->peer->transport->max_payload < max_payload) {
+        max_payload = s->peer->transport->max_payload;
+    }
+    return max_payload;
+}
+
 static int local_socket_enqueue(asocket *s, apacket *p)
 {
     D("LS(%d): enqueue %d\n", s->id, p->len);
@@ -318,10 +335,11 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
 
 
     if(ev & FDE_READ){
-        apacket *p = get_apacket();
+        apacket *p = get_large_apacket();
         unsigned char *x = p->data;
-        size_t avail = MAX_PAYLOAD;
-        int r;
+        const size_t max_payload = get_max_payload(s);
+        size_t avail = max_payload;
+        int r = 0;
         int is_eof = 0;
 
         while(avail > 0) {
@@ -343,10 +361,10 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
         }
         D("LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d\n",
           s->id, s->fd, r, is_eof, s->fde.force_eof);
-        if((avail == MAX_PAYLOAD) || (s->peer == 0)) {
+        if((avail == max_payload) || (s->peer == 0)) {
             put_apacket(p);
         } else {
-            p->len = MAX_PAYLOAD - avail;
+            p->len = max_payload - avail;
 
             r = s->peer->enqueue(s->peer, p);
             D("LS(%d): fd=%d post peer->enqueue(). r=%d\n", s->id, s->fd, r);
@@ -460,10 +478,16 @@ static asocket *create_host_service_socket(const char *name, const char* serial)
 typedef struct aremotesocket {
     asocket      socket;
     adisconnect  disconnect;
+        /* WRTEs we sent that the remote has not OKAYed yet */
+    unsigned     in_flight;
+        /* WRTEs the remote sent that we have not OKAYed yet */
+    unsigned     owed;
 } aremotesocket;
 
 static int remote_socket_enqueue(asocket *s, apacket *p)
 {
+    aremotesocket *rs = (aremotesocket*) s;
+
     D("entered remote_socket_enqueue RS(%d) WRITE fd=%d peer.fd=%d\n",
       s->id, s->fd, s->peer->fd);
     p->msg.command = A_WRTE;
@@ -471,20 +495,62 @@ static int remote_socket_enqueue(asocket *s, apacket *p)
     p->msg.arg1 = s->id;
     p->msg.data_length = p->len;
     send_packet(p, s->transport);
-    return 1;
+
+        /* keep our peer reading until the remote's window is full */
+    rs->in_flight++;
+    return (rs->in_flight < s->transport->window) ? 0 : 1;
 }
 
 static void remote_socket_ready(asocket *s)
 {
-    D("entered remote_socket_ready RS(%d) OKAY fd=%d peer.fd=%d\n",
-      s->id, s->fd, s->peer->fd);
+    aremotesocket *rs = (aremotesocket*) s;
+    unsigned count = rs->owed;
+
+    D("entered remote_socket_ready RS(%d) OKAY fd=%d peer.fd=%d owed=%d\n",
+      s->id, s->fd, s->peer->fd, count);
     apacket *p = get_apacket();
     p->msg.command = A_OKAY;
     p->msg.arg0 = s->peer->id;
     p->msg.arg1 = s->id;
+        /* one OKAY covers every WRTE our peer has taken since the last
+        ** one.  peers that don't speak windows never have more than one
+        ** outstanding, so they never see the count
+        */
+    if(count > 1) {
+        p->data[0] = count;
+        p->data[1] = count >> 8;
+        p->data[2] = count >> 16;
+        p->data[3] = count >> 24;
+        p->msg.data_length = 4;
+    }
+    rs->owed = 0;
     send_packet(p, s->transport);
 }
 
+/* called for every WRTE arriving for s's peer: it is owed an OKAY
+** until the peer has taken the data and calls s->ready()
+*/
+void remote_socket_owe_ready(asocket *s)
+{
+    ((aremotesocket*) s)->owed++;
+}
+
+/* called for every OKAY after the first one: it acknowledges one WRTE,
+** or as many as its payload counts
+*/
+void remote_socket_acked(asocket *s, apacket *p)
+{
+    aremotesocket *rs = (aremotesocket*) s;
+    unsigned count = 1;
+
+    if(p->msg.data_length == 4) {
+        count = p->data[0] | (p->data[1] << 8) | (p->data[2] << 16) |
+                ((unsigned) p->data[3] << 24);
+    }
+    rs->in_flight = (count < rs->in_flight) ? rs->in_flight - count : 0;
+    D("RS(%d): acked %d, %d in flight\n", s->id, count, rs->in_flight);
+}
+
 static void remote_socket_close(asocket *s)
 {
     D("entered remote_socket_close RS(%d) CLOSE fd=%d peer->fd=%d\n",
@@ -542,9 +608,9 @@ void connect_to_remote(asocket *s, const char *destination)
 {
     D("Connect_to_remote call RS(%d) fd=%d\n", s->id, s->fd);
     apacket *p = get_apacket();
-    int len = strlen(destination) + 1;
+    size_t len = strlen(destination) + 1;
 
-    if(len > (MAX_PAYLOAD-1)) {
+    if(len > (p->capacity-1)) {
         fatal("destination oversized");
     }
 
@@ -667,7 +733,7 @@ static int smart_socket_enqueue(asocket *s, apacket *p)
         s->pkt_first = p;
         s->pkt_last = p;
     } else {
-        if((s->pkt_first->len + p->len) > MAX_PAYLOAD) {
+        if((s->pkt_first->len + p->len) > s->pkt_first->capacity) {
             D("SS(%d): overflow\n", s->id);
             put_apacket(p);
             goto fail;
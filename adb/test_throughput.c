@@ -0,0 +1,452 @@
+/* a throughput test program: connects to the ADB server, reads from a
+** dev:/dev/zero stream on a device (or, with -w, pushes to /dev/null on it
+** over sync:) and reports MB/s.
+**
+** every extra argument is a window size; for each one the server is restarted
+** with ADB_WINDOW set to it, so the device gets that many WRTE packets in
+** flight per stream when sending to us.  for a loopback run, start an adbd
+** listening on tcp:5555 with the same ADB_WINDOW (it governs the -w direction)
+** and then:
+**
+**     test_throughput -s 127.0.0.1:5555 1 2 4 8 16
+**
+** after each run it also prints how many packets the server had to malloc
+** rather than take from its pools (see host:packet-stats).
+**
+** -d <ms> puts a relay between the server and the device that delays every
+** chunk by that much each way, to mimic a network with a real round trip.
+*/
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <memory.h>
+
+static void
+panic( const char*  msg )
+{
+    fprintf(stderr, "PANIC: %s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+static int
+unix_write( int  fd, const char*  buf, int  len )
+{
+    int  result = 0;
+    while (len > 0) {
+        int  len2 = write(fd, buf, len);
+        if (len2 < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        result += len2;
+        len -= len2;
+        buf += len2;
+    }
+    return  result;
+}
+
+static int
+unix_read( int  fd, char*  buf, int  len )
+{
+    int  result = 0;
+    while (len > 0) {
+        int  len2 = read(fd, buf, len);
+        if (len2 < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        if (len2 == 0)
+            return -1;
+        result += len2;
+        len -= len2;
+        buf += len2;
+    }
+    return  result;
+}
+
+static double
+now( void )
+{
+    struct timeval  tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+tcp_socket( int  port, int  do_listen )
+{
+    struct sockaddr_in   addr;
+    int                  s, on = 1;
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    s = socket( PF_INET, SOCK_STREAM, 0 );
+    if (s < 0)
+        return -1;
+    if (do_listen) {
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(s, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+            listen(s, 4) < 0) {
+            close(s);
+            return -1;
+        }
+    } else if (connect(s, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/* sends a sync message header: the id and a little-endian length */
+static void
+sync_header( int  s, const char*  id, unsigned  len )
+{
+    char  header[8];
+
+    memcpy(header, id, 4);
+    header[4] = len;
+    header[5] = len >> 8;
+    header[6] = len >> 16;
+    header[7] = len >> 24;
+    if (unix_write(s, header, 8) < 0)
+        panic( "could not send sync message" );
+}
+
+/* sends a request to the server and waits for its OKAY */
+static void
+request( int  s, const char*  req )
+{
+    char  buffer[1024];
+    int   len;
+
+    len = snprintf( buffer, sizeof buffer, "%04x%s", (int)strlen(req), req );
+    if (unix_write(s, buffer, len) < 0)
+        panic( "could not send request" );
+    if (unix_read(s, buffer, 4) != 4)
+        panic( "could not read answer" );
+    if (memcmp(buffer, "OKAY", 4)) {
+        fprintf(stderr, "'%s' failed: %.4s\n", req, buffer);
+        exit(1);
+    }
+}
+
+/* the relay forwards one direction of a connection, holding every chunk
+** back until delay seconds after it arrived
+*/
+typedef struct chunk  chunk;
+struct chunk {
+    chunk*  next;
+    double  due;
+    int     len;
+    char    data[65536];
+};
+
+typedef struct {
+    int              from;
+    int              to;
+    double           delay;
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    chunk*           first;
+    chunk*           last;
+    int              eof;
+} relay;
+
+static void*
+relay_reader( void*  _r )
+{
+    relay*  r = _r;
+
+    for (;;) {
+        chunk*  c = malloc(sizeof(chunk));
+        c->len  = read(r->from, c->data, sizeof(c->data));
+        c->due  = now() + r->delay;
+        c->next = NULL;
+        pthread_mutex_lock(&r->lock);
+        if (c->len <= 0) {
+            free(c);
+            r->eof = 1;
+        } else if (r->last) {
+            r->last->next = c;
+        } else {
+            r->first = c;
+        }
+        if (!r->eof)
+            r->last = c;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        if (r->eof)
+            return NULL;
+    }
+}
+
+static void*
+relay_writer( void*  _r )
+{
+    relay*  r = _r;
+
+    for (;;) {
+        chunk*  c;
+        double  wait;
+
+        pthread_mutex_lock(&r->lock);
+        while (r->first == NULL && !r->eof)
+            pthread_cond_wait(&r->cond, &r->lock);
+        c = r->first;
+        if (c) {
+            r->first = c->next;
+            if (r->first == NULL)
+                r->last = NULL;
+        }
+        pthread_mutex_unlock(&r->lock);
+        if (c == NULL)
+            break;
+
+        wait = c->due - now();
+        if (wait > 0)
+            usleep(wait * 1000000);
+        if (unix_write(r->to, c->data, c->len) < 0) {
+            free(c);
+            break;
+        }
+        free(c);
+    }
+    shutdown(r->to, SHUT_WR);
+    return NULL;
+}
+
+static void
+relay_start( int  from, int  to, double  delay )
+{
+    relay*     r = calloc(1, sizeof(relay));
+    pthread_t  t;
+
+    r->from  = from;
+    r->to    = to;
+    r->delay = delay;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    pthread_create(&t, NULL, relay_reader, r);
+    pthread_create(&t, NULL, relay_writer, r);
+}
+
+static pid_t  relay_pid;
+
+static void
+relay_stop( void )
+{
+    if (relay_pid > 0)
+        kill(relay_pid, SIGKILL);
+}
+
+/* listens on relay_port and relays every connection to device_port */
+static void
+relay_serve( int  relay_port, int  device_port, double  delay )
+{
+    int  ls = tcp_socket(relay_port, 1);
+
+    if (ls < 0)
+        panic( "could not listen for the relay" );
+    relay_pid = fork();
+    if (relay_pid != 0) {
+        close(ls);
+        atexit(relay_stop);
+        return;
+    }
+    for (;;) {
+        int  a = accept(ls, NULL, NULL);
+        int  b;
+
+        if (a < 0)
+            continue;
+        b = tcp_socket(device_port, 0);
+        if (b < 0) {
+            close(a);
+            continue;
+        }
+        relay_start(a, b, delay);
+        relay_start(b, a, delay);
+    }
+}
+
+/* returns how many packets the server has had to malloc so far, or -1 */
+static long
+server_allocations( void )
+{
+    char   buffer[1024];
+    long   allocated;
+    int    s, len;
+
+    s = tcp_socket(5037, 0);
+    if (s < 0)
+        return -1;
+    len = snprintf( buffer, sizeof buffer, "%04xhost:packet-stats", 17 );
+    if (unix_write(s, buffer, len) < 0 || unix_read(s, buffer, 8) != 8 ||
+        memcmp(buffer, "OKAY", 4) || sscanf(buffer + 4, "%04x", &len) != 1 ||
+        len >= (int)sizeof(buffer) || unix_read(s, buffer, len) != len) {
+        close(s);
+        return -1;
+    }
+    close(s);
+    buffer[len] = 0;
+    if (sscanf(buffer, "packets: %ld allocated", &allocated) != 1)
+        return -1;
+    return allocated;
+}
+
+static double
+measure( const char*  serial, int  megabytes, int  to_device )
+{
+    static char  buffer[65536];
+    char         req[256];
+    long long    total = (long long)megabytes << 20;
+    long long    done = 0;
+    double       start;
+    int          s;
+
+    s = tcp_socket(5037, 0);
+    if (s < 0)
+        panic( "could not connect to server" );
+
+    if (serial) {
+        snprintf(req, sizeof req, "host:transport:%s", serial);
+        request(s, req);
+    } else {
+        request(s, "host:transport-any");
+    }
+    request(s, to_device ? "sync:" : "dev:/dev/zero");
+
+    start = now();
+    if (to_device) {
+        static const char  path[] = "/dev/null,33188";
+
+        sync_header(s, "SEND", sizeof(path) - 1);
+        unix_write(s, path, sizeof(path) - 1);
+    }
+    while (done < total) {
+        int  len = sizeof(buffer);
+        if (total - done < len)
+            len = total - done;
+        if (to_device) {
+            sync_header(s, "DATA", len);
+            len = unix_write(s, buffer, len);
+        } else {
+            len = read(s, buffer, len);
+        }
+        if (len <= 0)
+            panic( "stream closed" );
+        done += len;
+    }
+    if (to_device) {
+            /* the push is done once the device has written everything */
+        sync_header(s, "DONE", 0);
+        if (unix_read(s, buffer, 8) != 8 || memcmp(buffer, "OKAY", 4))
+            panic( "push failed" );
+    }
+    close(s);
+
+    return megabytes / (now() - start);
+}
+
+static void
+usage( void )
+{
+    fprintf(stderr, "usage: test_throughput [-a <adb>] [-s <serial>] "
+            "[-n <megabytes>] [-d <ms>] [-w] [window...]\n");
+    exit(1);
+}
+
+int  main( int  argc, char**  argv )
+{
+    const char*  adb = "adb";
+    const char*  serial = NULL;
+    char         relayed[64];
+    char         cmd[512];
+    int          megabytes = 256;
+    int          delay_ms = 0;
+    int          to_device = 0;
+    long         allocated;
+    double       rate;
+    int          c, i, s;
+
+    while ((c = getopt(argc, argv, "a:s:n:d:w")) != -1) {
+        switch (c) {
+        case 'a': adb = optarg; break;
+        case 's': serial = optarg; break;
+        case 'n': megabytes = atoi(optarg); break;
+        case 'd': delay_ms = atoi(optarg); break;
+        case 'w': to_device = 1; break;
+        default: usage();
+        }
+    }
+    if (megabytes <= 0 || delay_ms < 0)
+        usage();
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (delay_ms > 0) {
+        int  port;
+        if (serial == NULL || sscanf(strchr(serial, ':') ? strchr(serial, ':') + 1 : "",
+                                     "%d", &port) != 1)
+            usage();
+        relay_serve(port + 1000, port, delay_ms / 1000.0);
+        snprintf(relayed, sizeof relayed, "127.0.0.1:%d", port + 1000);
+        serial = relayed;
+    }
+
+    if (optind == argc) {
+        if (serial && strchr(serial, ':')) {
+            snprintf(cmd, sizeof cmd, "%s connect %s >/dev/null", adb, serial);
+            system(cmd);
+        }
+        allocated = server_allocations();
+        rate      = measure(serial, megabytes, to_device);
+        allocated = server_allocations() - allocated;
+
+        printf("%.1f MB/s, %ld packets allocated\n", rate, allocated);
+        return 0;
+    }
+
+    printf("window    MB/s  allocated\n");
+    for (i = optind; i < argc; i++) {
+        int  window = atoi(argv[i]);
+
+        snprintf(cmd, sizeof cmd, "%s kill-server >/dev/null 2>&1", adb);
+        system(cmd);
+            /* the old server may take a moment to let go of its port */
+        while ((s = tcp_socket(5037, 0)) >= 0) {
+            close(s);
+            usleep(100000);
+        }
+        snprintf(cmd, sizeof cmd, "ADB_WINDOW=%d %s start-server >/dev/null 2>&1",
+                 window, adb);
+        system(cmd);
+        if (serial && strchr(serial, ':')) {
+            snprintf(cmd, sizeof cmd, "%s connect %s >/dev/null", adb, serial);
+            system(cmd);
+        }
+        snprintf(cmd, sizeof cmd, "%s %s%s wait-for-device", adb,
+                 serial ? "-s " : "", serial ? serial : "");
+        system(cmd);
+
+        allocated = server_allocations();
+        rate      = measure(serial, megabytes, to_device);
+        allocated = server_allocations() - allocated;
+
+        printf("%6d  %6.1f  %9ld\n", window, rate, allocated);
+        fflush(stdout);
+    }
+    return 0;
+}
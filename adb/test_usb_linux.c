@@ -0,0 +1,608 @@
+/* a test program for usb_linux.c that needs no device: usb_linux.c is
+** included below with ioctl() and ppoll() redirected to a simulated
+** usbdevfs.  a "bus" thread plays the device, working through the queued
+** transfers in order at a set speed, and an "irq" thread hands each one
+** back a set time after it finished, the way the host controller's
+** interrupt would.
+**
+**     gcc -O2 -DADB_HOST=1 -D_GNU_SOURCE -I../include -o test_usb_linux \
+**         test_usb_linux.c -lpthread -lrt
+**
+** it first checks the data both ways, zero length markers, kicking a
+** stalled read, unplugging, and transfers the kernel turns down as too
+** big.  then it reports MB/s for reading and writing packets shaped like
+** transport_usb.c's: a 24 byte header, then the payload.  to compare with
+** one transfer at a time, build with -DUSB_URBS=1 and run with -x 4096.
+*/
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/sysmacros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/usb/ch9.h>
+
+#define MOCK_MAX  64
+
+/* the simulated bus: speeds are set from the command line */
+static struct {
+    pthread_mutex_t       lock;
+    pthread_cond_t        bus_cond;
+    pthread_cond_t        irq_cond;
+    int                   efd;      /* readable while there is something to reap */
+
+    double                bandwidth;    /* bytes per second */
+    double                overhead;     /* seconds per transfer */
+    double                latency;      /* from the end of a transfer to its interrupt */
+    unsigned              max_xfer;     /* larger transfers get EINVAL, 0 for no limit */
+    int                   stall;        /* IN transfers wait until discarded */
+    int                   gone;         /* unplugged */
+    int                   quit;
+
+        /* transfers waiting for the bus, the one on it, those waiting
+        ** for their interrupt, and those the reaper may have
+        */
+    struct usbdevfs_urb*  queued[MOCK_MAX];
+    int                   nqueued;
+    struct usbdevfs_urb*  wire;
+    struct usbdevfs_urb*  finished[MOCK_MAX];
+    double                due[MOCK_MAX];
+    int                   nfinished;
+    struct usbdevfs_urb*  reapable[MOCK_MAX];
+    int                   nreapable;
+    double                bus_free;
+
+    unsigned long long    in_pos;       /* bytes sent to the host so far */
+    unsigned long long    out_pos;      /* bytes received from it */
+    unsigned long         mismatches;
+    unsigned long         zero_length;
+    unsigned long         transfers;
+} mock = {
+    .lock      = PTHREAD_MUTEX_INITIALIZER,
+    .bus_cond  = PTHREAD_COND_INITIALIZER,
+    .irq_cond  = PTHREAD_COND_INITIALIZER,
+    .bandwidth = 40e6,
+    .overhead  = 5e-6,
+    .latency   = 125e-6,
+};
+
+static double
+now( void )
+{
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sleep_until( double  t )
+{
+    struct timespec  ts;
+    ts.tv_sec  = (time_t) t;
+    ts.tv_nsec = (long) ((t - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* the byte at offset n of either stream */
+static unsigned char
+pattern( unsigned long long  n )
+{
+    return (unsigned char) (n * 7 + (n >> 9));
+}
+
+static void
+mock_wake_reaper( void )
+{
+    uint64_t  one = 1;
+    write(mock.efd, &one, sizeof(one));
+}
+
+static void
+mock_remove( struct usbdevfs_urb**  list, int*  count, int  i )
+{
+    memmove(list + i, list + i + 1, (*count - i - 1) * sizeof(*list));
+    (*count)--;
+}
+
+/* must be called with the lock held */
+static void
+mock_give_back( struct usbdevfs_urb*  urb, int  status )
+{
+    urb->status = status;
+    urb->actual_length = 0;
+    mock.reapable[mock.nreapable++] = urb;
+    mock_wake_reaper();
+}
+
+static void*
+mock_bus_thread( void*  unused )
+{
+    prctl(PR_SET_TIMERSLACK, 1);
+    pthread_mutex_lock(&mock.lock);
+    for (;;) {
+        struct usbdevfs_urb*  urb;
+        double                start, end;
+        unsigned char*        buf;
+        int                   i;
+
+        while (!mock.quit && (mock.nqueued == 0 ||
+               (mock.stall && (mock.queued[0]->endpoint & USB_DIR_IN))))
+            pthread_cond_wait(&mock.bus_cond, &mock.lock);
+        if (mock.quit)
+            break;
+
+        urb = mock.wire = mock.queued[0];
+        mock_remove(mock.queued, &mock.nqueued, 0);
+        start = now();
+        if (start < mock.bus_free)
+            start = mock.bus_free;
+        end = start + mock.overhead + urb->buffer_length / mock.bandwidth;
+        mock.bus_free = end;
+
+        pthread_mutex_unlock(&mock.lock);
+        sleep_until(end);
+        pthread_mutex_lock(&mock.lock);
+
+            /* discarded or unplugged in the meantime */
+        if (mock.wire != urb)
+            continue;
+        mock.wire = NULL;
+
+        buf = urb->buffer;
+        if (urb->endpoint & USB_DIR_IN) {
+            for (i = 0; i < urb->buffer_length; i++)
+                buf[i] = pattern(mock.in_pos + i);
+            mock.in_pos += urb->buffer_length;
+        } else {
+            for (i = 0; i < urb->buffer_length; i++)
+                if (buf[i] != pattern(mock.out_pos + i))
+                    mock.mismatches++;
+            mock.out_pos += urb->buffer_length;
+            if (urb->buffer_length == 0)
+                mock.zero_length++;
+        }
+        urb->status = 0;
+        urb->actual_length = urb->buffer_length;
+        mock.transfers++;
+
+        mock.finished[mock.nfinished] = urb;
+        mock.due[mock.nfinished] = end + mock.latency;
+        mock.nfinished++;
+        pthread_cond_signal(&mock.irq_cond);
+    }
+    pthread_mutex_unlock(&mock.lock);
+    return NULL;
+}
+
+static void*
+mock_irq_thread( void*  unused )
+{
+    prctl(PR_SET_TIMERSLACK, 1);
+    pthread_mutex_lock(&mock.lock);
+    for (;;) {
+        while (!mock.quit && mock.nfinished == 0)
+            pthread_cond_wait(&mock.irq_cond, &mock.lock);
+        if (mock.quit)
+            break;
+
+        if (mock.due[0] > now()) {
+            double  due = mock.due[0];
+            pthread_mutex_unlock(&mock.lock);
+            sleep_until(due);
+            pthread_mutex_lock(&mock.lock);
+            continue;
+        }
+        mock.reapable[mock.nreapable++] = mock.finished[0];
+        memmove(mock.due, mock.due + 1, (mock.nfinished - 1) * sizeof(double));
+        mock_remove(mock.finished, &mock.nfinished, 0);
+        mock_wake_reaper();
+    }
+    pthread_mutex_unlock(&mock.lock);
+    return NULL;
+}
+
+static int
+mock_submit( struct usbdevfs_urb*  urb )
+{
+    int  result = 0;
+
+    pthread_mutex_lock(&mock.lock);
+    if (mock.gone) {
+        errno = ENODEV;
+        result = -1;
+    } else if (mock.max_xfer && (unsigned) urb->buffer_length > mock.max_xfer) {
+        errno = EINVAL;
+        result = -1;
+    } else {
+        mock.queued[mock.nqueued++] = urb;
+        pthread_cond_signal(&mock.bus_cond);
+    }
+    pthread_mutex_unlock(&mock.lock);
+    return result;
+}
+
+static int
+mock_discard( struct usbdevfs_urb*  urb )
+{
+    int  i, result = 0;
+
+    pthread_mutex_lock(&mock.lock);
+    for (i = 0; i < mock.nqueued && mock.queued[i] != urb; i++)
+        ;
+    if (i < mock.nqueued) {
+        mock_remove(mock.queued, &mock.nqueued, i);
+        mock_give_back(urb, -ENOENT);
+    } else if (mock.wire == urb) {
+        mock.wire = NULL;
+        mock_give_back(urb, -ENOENT);
+    } else {
+        errno = EINVAL;
+        result = -1;
+    }
+    pthread_mutex_unlock(&mock.lock);
+    return result;
+}
+
+static int
+mock_reap( struct usbdevfs_urb**  out )
+{
+    uint64_t  count;
+    int       result = 0;
+
+    pthread_mutex_lock(&mock.lock);
+    if (mock.nreapable > 0) {
+        *out = mock.reapable[0];
+        mock_remove(mock.reapable, &mock.nreapable, 0);
+    } else if (mock.gone) {
+        errno = ENODEV;
+        result = -1;
+    } else {
+        read(mock.efd, &count, sizeof(count));
+        errno = EAGAIN;
+        result = -1;
+    }
+    pthread_mutex_unlock(&mock.lock);
+    return result;
+}
+
+/* the kernel gives back everything in flight when a device goes away */
+static void
+mock_unplug( void )
+{
+    pthread_mutex_lock(&mock.lock);
+    mock.gone = 1;
+    while (mock.nqueued > 0) {
+        mock_give_back(mock.queued[0], -ESHUTDOWN);
+        mock_remove(mock.queued, &mock.nqueued, 0);
+    }
+    if (mock.wire) {
+        mock_give_back(mock.wire, -ESHUTDOWN);
+        mock.wire = NULL;
+    }
+    while (mock.nfinished > 0) {
+        mock.reapable[mock.nreapable++] = mock.finished[0];
+        memmove(mock.due, mock.due + 1, (mock.nfinished - 1) * sizeof(double));
+        mock_remove(mock.finished, &mock.nfinished, 0);
+    }
+    mock_wake_reaper();
+    pthread_mutex_unlock(&mock.lock);
+}
+
+static void
+mock_reset( void )
+{
+    uint64_t  count;
+
+    pthread_mutex_lock(&mock.lock);
+    mock.gone = mock.stall = 0;
+    mock.max_xfer = 0;
+    mock.in_pos = mock.out_pos = 0;
+    mock.mismatches = mock.zero_length = mock.transfers = 0;
+    read(mock.efd, &count, sizeof(count));
+    pthread_mutex_unlock(&mock.lock);
+}
+
+static int
+mock_ioctl( int  fd, unsigned long  request, ... )
+{
+    va_list  args;
+    void*    arg;
+
+    va_start(args, request);
+    arg = va_arg(args, void*);
+    va_end(args);
+
+    switch (request) {
+    case USBDEVFS_CLAIMINTERFACE:
+        return 0;
+    case USBDEVFS_SUBMITURB:
+        return mock_submit(arg);
+    case USBDEVFS_DISCARDURB:
+        return mock_discard(arg);
+    case USBDEVFS_REAPURBNDELAY:
+        return mock_reap(arg);
+    case USBDEVFS_CONTROL:
+        errno = EPIPE;      /* no serial number */
+        return -1;
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+/* usbdevfs polls writable when there is something to reap, and hangs up
+** once the device is gone; the eventfd stands in for both
+*/
+static int
+mock_ppoll( struct pollfd*  fds, nfds_t  nfds, const struct timespec*  timeout,
+            const sigset_t*  sigmask )
+{
+    struct pollfd  efd = { mock.efd, POLLIN, 0 };
+    int            result = ppoll(&efd, 1, timeout, sigmask);
+
+    if (result > 0)
+        fds[0].revents = mock.gone ? (POLLHUP | POLLERR) : POLLOUT;
+    return result;
+}
+
+#define ioctl  mock_ioctl
+#define ppoll  mock_ppoll
+#include "usb_linux.c"
+#undef ioctl
+#undef ppoll
+
+/* what usb_linux.c needs from the rest of adb */
+int  adb_trace_mask;
+ADB_MUTEX_DEFINE( D_lock );
+
+void fatal_errno( const char*  fmt, ... )
+{
+    fprintf(stderr, "fatal: %s\n", strerror(errno));
+    exit(1);
+}
+
+int is_adb_interface( int  vid, int  pid, int  usb_class, int  usb_subclass, int  usb_protocol )
+{
+    return 1;
+}
+
+static usb_handle*  registered;
+
+void register_usb_transport( usb_handle*  usb, const char*  serial, const char*  devpath,
+                             unsigned  writeable )
+{
+    registered = usb;
+}
+
+void unregister_usb_transport( usb_handle*  usb )
+{
+}
+
+static void
+fail( const char*  msg )
+{
+    fprintf(stderr, "FAILED: %s\n", msg);
+    exit(1);
+}
+
+static usb_handle*
+open_device( unsigned  zero_mask, unsigned  max_packet )
+{
+    mock_reset();
+    registered = NULL;
+    register_device("/dev/null", NULL, 0x81, 0x01, 0, 0, zero_mask, max_packet);
+    if (registered == NULL)
+        fail("could not open the simulated device");
+    return registered;
+}
+
+static void
+close_device( usb_handle*  h )
+{
+    usb_kick(h);
+    usb_close(h);
+}
+
+/* reads len bytes and checks they carry on the device's stream */
+static int
+read_checked( usb_handle*  h, unsigned char*  buf, int  len, unsigned long long*  pos )
+{
+    int  i;
+
+    if (usb_read(h, buf, len))
+        return -1;
+    for (i = 0; i < len; i++)
+        if (buf[i] != pattern(*pos + i))
+            fail("read data out of order");
+    *pos += len;
+    return 0;
+}
+
+static int
+write_pattern( usb_handle*  h, unsigned char*  buf, int  len, unsigned long long*  pos )
+{
+    int  i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = pattern(*pos + i);
+    *pos += len;
+    return usb_write(h, buf, len);
+}
+
+static unsigned char  buffer[MAX_PAYLOAD];
+
+static void
+check_streams( void )
+{
+    usb_handle*         h = open_device(0, 512);
+    unsigned long long  in = 0, out = 0;
+    int                 i;
+
+    srand(1);
+    for (i = 0; i < 200; i++) {
+        int  len = rand() % MAX_PAYLOAD + 1;
+        if (read_checked(h, buffer, 24, &in) || read_checked(h, buffer, len, &in))
+            fail("read");
+        if (write_pattern(h, buffer, 24, &out) || write_pattern(h, buffer, len, &out))
+            fail("write");
+    }
+    if (mock.mismatches || mock.out_pos != out)
+        fail("written data did not arrive in order");
+    close_device(h);
+
+        /* protocol 01 devices need a zero length transfer after a write
+        ** that ends on a packet boundary
+        */
+    h = open_device(511, 512);
+    out = 0;
+    if (write_pattern(h, buffer, 4096, &out) || write_pattern(h, buffer, 100, &out))
+        fail("write with zero length markers");
+    if (mock.zero_length != 1 || mock.mismatches)
+        fail("zero length markers");
+    close_device(h);
+    printf("data: ok\n");
+}
+
+static void*
+stalled_read( void*  _h )
+{
+    return (void*) (intptr_t) usb_read(_h, buffer, 4096);
+}
+
+/* a read stuck on a device that sends nothing has to come back when the
+** handle is kicked, or when the device goes away
+*/
+static void
+check_kick( int  unplug )
+{
+    usb_handle*  h = open_device(0, 512);
+    pthread_t    t;
+    void*        result;
+
+    mock.stall = 1;
+    pthread_create(&t, NULL, stalled_read, h);
+    usleep(50000);
+    if (unplug)
+        mock_unplug();
+    else
+        usb_kick(h);
+    pthread_join(t, &result);
+    if (result == 0)
+        fail("stalled read succeeded");
+    if (usb_write(h, buffer, 24) == 0)
+        fail("write after the end succeeded");
+    close_device(h);
+    printf("%s: ok\n", unplug ? "unplug" : "kick");
+}
+
+/* older kernels turn down transfers over 16KB */
+static void
+check_limit( void )
+{
+    usb_handle*         h = open_device(0, 1024);
+    unsigned long long  in = 0;
+
+    mock.max_xfer = 16384;
+    if (read_checked(h, buffer, MAX_PAYLOAD, &in))
+        fail("read with limited transfers");
+    if (h->xfer_size != 16384)
+        fail("transfer size did not come down to the limit");
+    close_device(h);
+    printf("limit: ok\n");
+}
+
+static void
+bench( int  payload, int  megabytes, unsigned  max_packet, unsigned  xfer_size )
+{
+    long long           total = (long long) megabytes << 20;
+    long long           done;
+    unsigned long long  pos = 0;
+    usb_handle*         h;
+    double              start, rate[2];
+    int                 writing;
+
+    for (writing = 0; writing < 2; writing++) {
+        h = open_device(0, max_packet);
+        if (xfer_size)
+            h->xfer_size = xfer_size;
+        start = now();
+        for (done = 0; done < total; done += payload) {
+            int  r = writing ? write_pattern(h, buffer, 24, &pos) ||
+                               write_pattern(h, buffer, payload, &pos)
+                             : read_checked(h, buffer, 24, &pos) ||
+                               read_checked(h, buffer, payload, &pos);
+            if (r)
+                fail("transfer");
+        }
+        rate[writing] = megabytes / (now() - start);
+        if (mock.mismatches)
+            fail("written data did not arrive in order");
+        close_device(h);
+        pos = 0;
+    }
+    printf("%7d  %9.1f  %10.1f\n", payload, rate[0], rate[1]);
+}
+
+static void
+usage( void )
+{
+    fprintf(stderr, "usage: test_usb_linux [-b <MB/s>] [-l <usecs>] [-o <usecs>] "
+            "[-p <max packet>] [-x <transfer size>] [-n <megabytes>]\n");
+    exit(1);
+}
+
+int  main( int  argc, char**  argv )
+{
+    static const int  payloads[] = { 4096, 65536, MAX_PAYLOAD };
+    unsigned          max_packet = 512, xfer_size = 0;
+    int               megabytes = 32;
+    struct sigaction  actions;
+    pthread_t         t;
+    int               c, i;
+
+    while ((c = getopt(argc, argv, "b:l:o:p:x:n:")) != -1) {
+        switch (c) {
+        case 'b': mock.bandwidth = atof(optarg) * 1e6; break;
+        case 'l': mock.latency = atof(optarg) / 1e6; break;
+        case 'o': mock.overhead = atof(optarg) / 1e6; break;
+        case 'p': max_packet = atoi(optarg); break;
+        case 'x': xfer_size = atoi(optarg); break;
+        case 'n': megabytes = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (mock.bandwidth <= 0 || megabytes <= 0)
+        usage();
+
+        /* what usb_init() does, without starting to scan for real devices */
+    memset(&actions, 0, sizeof(actions));
+    actions.sa_handler = sigalrm_handler;
+    sigaction(SIGALRM, &actions, NULL);
+
+    mock.efd = eventfd(0, EFD_NONBLOCK);
+    pthread_create(&t, NULL, mock_bus_thread, NULL);
+    pthread_create(&t, NULL, mock_irq_thread, NULL);
+
+    check_streams();
+    check_kick(0);
+    check_kick(1);
+    check_limit();
+
+    printf("%d URBs in flight, %.0f MB/s bus, %.0f us interrupt latency\n",
+           USB_URBS, mock.bandwidth / 1e6, mock.latency * 1e6);
+    printf("payload  read MB/s  write MB/s\n");
+    for (i = 0; i < (int) (sizeof(payloads) / sizeof(payloads[0])); i++)
+        bench(payloads[i], megabytes, max_packet, xfer_size);
+    return 0;
+}
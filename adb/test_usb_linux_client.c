@@ -0,0 +1,580 @@
+/* a test program for the FunctionFS side of usb_linux_client.c that needs
+** no USB controller: usb_linux_client.c is included below with its AIO
+** system calls going to a simulated pair of endpoints.  the simulated
+** controller puts each request on the bus as it is submitted, after those
+** before it, at a set speed; it completes a set latency after the bus is
+** done with it, plus the time to copy its data to or from the caller.
+**
+**     gcc -O2 -DADB_HOST=0 -D_GNU_SOURCE -I../include \
+**         -o test_usb_linux_client test_usb_linux_client.c -lpthread -lrt
+**
+** the simulated host sends 24 byte headers and payloads in turn, the way
+** transport_usb.c does, with a zero length packet after any transfer that
+** ends on a packet boundary.  the program checks the data both ways, a
+** kick during a stalled read, and falling back to read() and write() when
+** the endpoints can't do AIO, then reports MB/s.  to compare with one
+** request per read or write, build with -DUSB_FFS_AIO_REQS=1
+** -DUSB_FFS_AIO_SIZE=262144.
+*/
+#include <endian.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/aio_abi.h>
+
+/* bionic's htole16() and htole32() can go in static initializers, glibc's
+** can't
+*/
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#undef htole16
+#undef htole32
+#define htole16(x)  (x)
+#define htole32(x)  (x)
+#endif
+
+#define MOCK_MAX  64
+
+typedef struct {
+    aio_context_t  ctx;
+    struct iocb*   iocb;
+    long           res;
+    double         due;
+} mock_event;
+
+static struct {
+    pthread_mutex_t     lock;
+    pthread_cond_t      event_cond;
+
+    double              bandwidth;  /* bytes per second on the bus */
+    double              copy_rate;  /* bytes per second to or from the caller */
+    double              latency;    /* from the end of a request to its completion */
+    int                 bulk_out;   /* the fd reads come from */
+    int                 stall;      /* reads wait until cancelled */
+    int                 no_aio;     /* io_submit() fails as on older kernels */
+    aio_context_t       contexts;
+
+    struct iocb*        queued[MOCK_MAX];
+    aio_context_t       queued_ctx[MOCK_MAX];
+    int                 nqueued;
+    mock_event          events[MOCK_MAX];
+    int                 nevents;
+    double              bus_free;
+
+        /* the host sends transfers of 24 bytes and host_payload bytes in
+        ** turn, and a zero length packet after those that end on a
+        ** 512 byte boundary
+        */
+    int                 host_payload;
+    int                 transfers;
+    int                 left;
+    int                 zero_length;
+    unsigned long long  out_pos;    /* bytes sent by the host */
+    unsigned long long  in_pos;     /* bytes it received */
+    unsigned long       mismatches;
+} mock = {
+    .lock       = PTHREAD_MUTEX_INITIALIZER,
+    .event_cond = PTHREAD_COND_INITIALIZER,
+    .bandwidth  = 40e6,
+    .copy_rate  = 500e6,
+    .latency    = 50e-6,
+};
+
+static double
+now( void )
+{
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+to_timespec( double  t, struct timespec*  ts )
+{
+    ts->tv_sec  = (time_t) t;
+    ts->tv_nsec = (long) ((t - ts->tv_sec) * 1e9);
+}
+
+/* the data is a pattern with a prime period, so an offset by a packet or
+** a whole transfer shows; it's kept in a table to make filling and
+** checking buffers cheap
+*/
+#define PATTERN_PERIOD  65521
+#define PATTERN_SPAN    (256*1024)  /* the most a request can cover */
+
+static unsigned char  pattern_table[PATTERN_PERIOD + PATTERN_SPAN];
+
+static void
+pattern_init( void )
+{
+    int  i;
+
+    for (i = 0; i < (int) sizeof(pattern_table); i++)
+        pattern_table[i] = (unsigned char) ((i % PATTERN_PERIOD) * 7 + (i % PATTERN_PERIOD >> 9));
+}
+
+static void
+pattern_fill( unsigned char*  buf, unsigned long long  pos, int  len )
+{
+    memcpy(buf, pattern_table + pos % PATTERN_PERIOD, len);
+}
+
+static int
+pattern_check( const unsigned char*  buf, unsigned long long  pos, int  len )
+{
+    return memcmp(buf, pattern_table + pos % PATTERN_PERIOD, len) == 0;
+}
+
+/* must be called with the lock held */
+static void
+mock_complete( aio_context_t  ctx, struct iocb*  cb, long  res, double  due )
+{
+    mock_event*  e = &mock.events[mock.nevents++];
+
+    e->ctx  = ctx;
+    e->iocb = cb;
+    e->res  = res;
+    e->due  = due;
+    pthread_cond_broadcast(&mock.event_cond);
+}
+
+/* how much of a read of len bytes the host's side fills */
+static int
+mock_host_send( unsigned char*  buf, int  len )
+{
+    int  n;
+
+    if (mock.zero_length) {
+        mock.zero_length = 0;
+        return 0;
+    }
+    if (mock.left == 0)
+        mock.left = (mock.transfers++ & 1) ? mock.host_payload : 24;
+    n = (len < mock.left) ? len : mock.left;
+    pattern_fill(buf, mock.out_pos, n);
+    mock.out_pos += n;
+    mock.left -= n;
+    if (mock.left == 0 && n == len &&
+        ((mock.transfers & 1) ? 24 : mock.host_payload) % 512 == 0)
+        mock.zero_length = 1;
+    return n;
+}
+
+/* puts a request on the bus.  must be called with the lock held */
+static void
+mock_transfer( aio_context_t  ctx, struct iocb*  cb )
+{
+    unsigned char*  buf = (unsigned char*) (uintptr_t) cb->aio_buf;
+    double          start;
+    long            n;
+
+    if (cb->aio_lio_opcode == IOCB_CMD_PREAD) {
+        n = mock_host_send(buf, cb->aio_nbytes);
+    } else {
+        n = cb->aio_nbytes;
+        if (!pattern_check(buf, mock.in_pos, n))
+            mock.mismatches++;
+        mock.in_pos += n;
+    }
+
+    start = now();
+    if (start < mock.bus_free)
+        start = mock.bus_free;
+    mock.bus_free = start + n / mock.bandwidth;
+    mock_complete(ctx, cb, n, mock.bus_free + mock.latency + n / mock.copy_rate);
+}
+
+static long
+mock_io_setup( unsigned  nr, aio_context_t*  ctx )
+{
+    *ctx = ++mock.contexts;
+    return 0;
+}
+
+static long
+mock_io_submit( aio_context_t  ctx, long  nr, struct iocb**  iocbs )
+{
+    int  i;
+
+    if (mock.no_aio) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&mock.lock);
+    for (i = 0; i < nr; i++) {
+            /* a stalled read waits for a host that sends nothing */
+        if (mock.stall && iocbs[i]->aio_lio_opcode == IOCB_CMD_PREAD) {
+            mock.queued[mock.nqueued] = iocbs[i];
+            mock.queued_ctx[mock.nqueued] = ctx;
+            mock.nqueued++;
+        } else {
+            mock_transfer(ctx, iocbs[i]);
+        }
+    }
+    pthread_mutex_unlock(&mock.lock);
+    return nr;
+}
+
+static long
+mock_io_getevents( aio_context_t  ctx, long  min_nr, long  nr,
+                   struct io_event*  events, struct timespec*  timeout )
+{
+    long  got = 0;
+    int   i;
+
+    pthread_mutex_lock(&mock.lock);
+    for (;;) {
+        double  t = now(), next = 0;
+        int     ready = 0;
+
+        for (i = 0; i < mock.nevents; i++) {
+            if (mock.events[i].ctx != ctx)
+                continue;
+            if (mock.events[i].due <= t)
+                ready++;
+            else if (next == 0 || mock.events[i].due < next)
+                next = mock.events[i].due;
+        }
+        if (ready >= min_nr)
+            break;
+        if (next) {
+            struct timespec  ts;
+            pthread_mutex_unlock(&mock.lock);
+            to_timespec(next, &ts);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            pthread_mutex_lock(&mock.lock);
+        } else {
+            pthread_cond_wait(&mock.event_cond, &mock.lock);
+        }
+    }
+    for (i = 0; i < mock.nevents && got < nr; ) {
+        mock_event*  e = &mock.events[i];
+        if (e->ctx != ctx || e->due > now()) {
+            i++;
+            continue;
+        }
+        events[got].data = e->iocb->aio_data;
+        events[got].obj  = (uintptr_t) e->iocb;
+        events[got].res  = e->res;
+        events[got].res2 = 0;
+        got++;
+        mock.nevents--;
+        memmove(e, e + 1, (mock.nevents - i) * sizeof(*e));
+    }
+    pthread_mutex_unlock(&mock.lock);
+    return got;
+}
+
+static long
+mock_io_cancel( aio_context_t  ctx, struct iocb*  cb, struct io_event*  result )
+{
+    int  i;
+
+    pthread_mutex_lock(&mock.lock);
+    for (i = 0; i < mock.nqueued && mock.queued[i] != cb; i++)
+        ;
+    if (i < mock.nqueued) {
+        mock.nqueued--;
+        memmove(mock.queued + i, mock.queued + i + 1, (mock.nqueued - i) * sizeof(*mock.queued));
+        memmove(mock.queued_ctx + i, mock.queued_ctx + i + 1,
+                (mock.nqueued - i) * sizeof(*mock.queued_ctx));
+            /* like the kernel, hand it back through io_getevents() */
+        mock_complete(ctx, cb, -ECONNRESET, now());
+    } else {
+            /* or it may still be on the bus */
+        for (i = 0; i < mock.nevents; i++)
+            if (mock.events[i].iocb == cb && mock.events[i].due > now())
+                break;
+        if (i == mock.nevents) {
+            pthread_mutex_unlock(&mock.lock);
+            errno = EINVAL;
+            return -1;
+        }
+        mock.events[i].res = -ECONNRESET;
+        mock.events[i].due = now();
+        pthread_cond_broadcast(&mock.event_cond);
+    }
+    pthread_mutex_unlock(&mock.lock);
+    errno = EINPROGRESS;
+    return -1;
+}
+
+static long
+mock_syscall( long  nr, ... )
+{
+    va_list  args;
+    long     a, b, c, d, e;
+
+    va_start(args, nr);
+    a = va_arg(args, long);
+    b = va_arg(args, long);
+    c = va_arg(args, long);
+    d = va_arg(args, long);
+    e = va_arg(args, long);
+    va_end(args);
+
+    switch (nr) {
+    case __NR_io_setup:
+        return mock_io_setup(a, (aio_context_t*) b);
+    case __NR_io_submit:
+        return mock_io_submit(a, b, (struct iocb**) c);
+    case __NR_io_getevents:
+        return mock_io_getevents(a, b, c, (struct io_event*) d, (struct timespec*) e);
+    case __NR_io_cancel:
+        return mock_io_cancel(a, (struct iocb*) b, (struct io_event*) c);
+    default:
+        errno = ENOSYS;
+        return -1;
+    }
+}
+
+#define syscall  mock_syscall
+#include "usb_linux_client.c"
+#undef syscall
+
+/* what usb_linux_client.c needs from the rest of adb */
+int  adb_trace_mask;
+ADB_MUTEX_DEFINE( D_lock );
+
+void fatal_errno( const char*  fmt, ... )
+{
+    fprintf(stderr, "fatal: %s: %s\n", fmt, strerror(errno));
+    exit(1);
+}
+
+void register_usb_transport( usb_handle*  usb, const char*  serial, const char*  devpath,
+                             unsigned  writeable )
+{
+}
+
+static void
+fail( const char*  msg )
+{
+    fprintf(stderr, "FAILED: %s\n", msg);
+    exit(1);
+}
+
+/* what usb_ffs_init() and usb_ffs_open_thread() do, with pipes standing in
+** for the endpoints for when it falls back to read() and write()
+*/
+static usb_handle*
+open_device( int  payload, int*  host )
+{
+    usb_handle*  h = calloc(1, sizeof(usb_handle));
+    int          out[2], in[2];
+
+    pipe(out);
+    pipe(in);
+    h->bulk_out = out[0];
+    h->bulk_in  = in[1];
+    h->control  = adb_open("/dev/null", O_RDWR);
+    host[0] = out[1];
+    host[1] = in[0];
+    adb_cond_init(&h->notify, 0);
+    adb_mutex_init(&h->lock, 0);
+    usb_ffs_init_io(h);
+    h->kick = usb_ffs_kick;
+
+    pthread_mutex_lock(&mock.lock);
+    mock.bulk_out = h->bulk_out;
+    mock.host_payload = payload;
+    mock.transfers = mock.left = mock.zero_length = 0;
+    mock.out_pos = mock.in_pos = 0;
+    mock.mismatches = 0;
+    mock.stall = mock.no_aio = 0;
+    pthread_mutex_unlock(&mock.lock);
+    return h;
+}
+
+static void
+close_device( usb_handle*  h, int*  host )
+{
+    usb_kick(h);
+    adb_close(host[0]);
+    adb_close(host[1]);
+    free(h);
+}
+
+static int
+read_checked( usb_handle*  h, unsigned char*  buf, int  len, unsigned long long*  pos )
+{
+    if (usb_read(h, buf, len))
+        return -1;
+    if (!pattern_check(buf, *pos, len))
+        fail("read data out of order");
+    *pos += len;
+    return 0;
+}
+
+static int
+write_pattern( usb_handle*  h, unsigned char*  buf, int  len, unsigned long long*  pos )
+{
+    pattern_fill(buf, *pos, len);
+    *pos += len;
+    return usb_write(h, buf, len);
+}
+
+static unsigned char  buffer[MAX_PAYLOAD];
+
+static void
+check_streams( void )
+{
+    static const int    payloads[] = { 1, 512, 4096, 16384, 40000, MAX_PAYLOAD };
+    unsigned long long  in, out;
+    usb_handle*         h;
+    int                 host[2];
+    int                 i, j;
+
+    for (i = 0; i < (int) (sizeof(payloads) / sizeof(payloads[0])); i++) {
+        h = open_device(payloads[i], host);
+        if (h->read != usb_ffs_aio_read)
+            fail("not using AIO");
+        in = out = 0;
+        for (j = 0; j < 20; j++) {
+            if (read_checked(h, buffer, 24, &in) ||
+                read_checked(h, buffer, payloads[i], &in))
+                fail("read");
+            if (write_pattern(h, buffer, 24, &out) ||
+                write_pattern(h, buffer, payloads[i], &out))
+                fail("write");
+        }
+        if (mock.mismatches || mock.in_pos != out)
+            fail("written data did not arrive in order");
+        close_device(h, host);
+    }
+    printf("data: ok\n");
+}
+
+static void*
+stalled_read( void*  h )
+{
+    return (void*) (intptr_t) usb_read(h, buffer, MAX_PAYLOAD);
+}
+
+/* a kick has to get a read waiting on a silent host back */
+static void
+check_kick( void )
+{
+    usb_handle*  h;
+    pthread_t    t;
+    void*        result;
+    int          host[2];
+
+    h = open_device(4096, host);
+    mock.stall = 1;
+    pthread_create(&t, NULL, stalled_read, h);
+    usleep(50000);
+    usb_kick(h);
+    pthread_join(t, &result);
+    if (result == 0)
+        fail("stalled read succeeded");
+    if (h->read_aio.pending != 0)
+        fail("requests left queued");
+    if (usb_write(h, buffer, 24) == 0)
+        fail("write after the kick succeeded");
+    adb_close(host[0]);
+    adb_close(host[1]);
+    free(h);
+    printf("kick: ok\n");
+}
+
+/* endpoints without AIO fail io_submit() with EINVAL */
+static void
+check_fallback( void )
+{
+    unsigned long long  pos = 0;
+    usb_handle*         h;
+    int                 host[2];
+
+    h = open_device(4096, host);
+    mock.no_aio = 1;
+    pattern_fill(buffer, 0, 100);
+    adb_write(host[0], buffer, 100);
+    if (read_checked(h, buffer, 60, &pos) || read_checked(h, buffer, 40, &pos))
+        fail("read after falling back");
+    if (h->read != usb_ffs_read || h->write != usb_ffs_write)
+        fail("did not fall back to read and write");
+    close_device(h, host);
+    printf("fallback: ok\n");
+}
+
+static void
+bench( int  payload, int  megabytes )
+{
+    long long           total = (long long) megabytes << 20;
+    long long           done;
+    unsigned long long  pos;
+    usb_handle*         h;
+    double              start, rate[2];
+    int                 host[2];
+    int                 writing;
+
+    for (writing = 0; writing < 2; writing++) {
+        h = open_device(payload, host);
+        pos = 0;
+        start = now();
+        for (done = 0; done < total; done += payload) {
+            int  r = writing ? write_pattern(h, buffer, 24, &pos) ||
+                               write_pattern(h, buffer, payload, &pos)
+                             : read_checked(h, buffer, 24, &pos) ||
+                               read_checked(h, buffer, payload, &pos);
+            if (r)
+                fail("transfer");
+        }
+        rate[writing] = megabytes / (now() - start);
+        if (mock.mismatches)
+            fail("written data did not arrive in order");
+        close_device(h, host);
+    }
+    printf("%7d  %9.1f  %10.1f\n", payload, rate[0], rate[1]);
+}
+
+static void
+usage( void )
+{
+    fprintf(stderr, "usage: test_usb_linux_client [-b <MB/s>] [-c <MB/s>] "
+            "[-l <usecs>] [-n <megabytes>]\n");
+    exit(1);
+}
+
+int  main( int  argc, char**  argv )
+{
+    static const int  payloads[] = { 4096, 65536, MAX_PAYLOAD };
+    int               megabytes = 32;
+    int               c, i;
+
+    while ((c = getopt(argc, argv, "b:c:l:n:")) != -1) {
+        switch (c) {
+        case 'b': mock.bandwidth = atof(optarg) * 1e6; break;
+        case 'c': mock.copy_rate = atof(optarg) * 1e6; break;
+        case 'l': mock.latency = atof(optarg) / 1e6; break;
+        case 'n': megabytes = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (mock.bandwidth <= 0 || mock.copy_rate <= 0 || megabytes <= 0)
+        usage();
+
+    pattern_init();
+        /* the simulated completions are microseconds apart */
+    prctl(PR_SET_TIMERSLACK, 1);
+
+    check_streams();
+    check_kick();
+    check_fallback();
+
+    printf("%d requests of %d bytes in flight, %.0f MB/s bus, %.0f MB/s copies, "
+           "%.0f us latency\n", USB_FFS_AIO_REQS, USB_FFS_AIO_SIZE,
+           mock.bandwidth / 1e6, mock.copy_rate / 1e6, mock.latency * 1e6);
+    printf("payload  read MB/s  write MB/s\n");
+    for (i = 0; i < (int) (sizeof(payloads) / sizeof(payloads[0])); i++)
+        bench(payloads[i], megabytes);
+    return 0;
+}
@@ -226,6 +226,7 @@ void send_packet(apacket *p, atransport *t)
     p->msg.data_check = sum;
 
     print_packet("send", p);
+    count_packet_sent(p);
 
     if (t == NULL) {
         D("Transport is null \n");
@@ -272,7 +273,7 @@ static void *output_thread(void *_t)
 
     D("%s: data pump started\n", t->serial);
     for(;;) {
-        p = get_apacket();
+        p = get_large_apacket();
 
         if(t->read_from_remote(p, t) == 0){
             D("%s: received remote packet, sending to transport\n",
@@ -1165,8 +1166,8 @@ int check_header(apacket *p)
         return -1;
     }
 
-    if(p->msg.data_length > MAX_PAYLOAD) {
-        D("check_header(): %d > MAX_PAYLOAD\n", p->msg.data_length);
+    if(p->msg.data_length > p->capacity) {
+        D("check_header(): %d > %d\n", p->msg.data_length, (int) p->capacity);
         return -1;
     }
 
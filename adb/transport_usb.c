@@ -90,7 +90,7 @@ static int remote_write(apacket *p, atransport *t)
         return -1;
     }
     if(p->msg.data_length == 0) return 0;
-    if(usb_write(t->usb, &p->data, size)) {
+    if(usb_write(t->usb, p->data, size)) {
         D("remote usb: 2 - write terminated\n");
         return -1;
     }
@@ -117,6 +117,8 @@ void init_usb_transport(atransport *t, usb_handle *h, int state)
     t->read_from_remote = remote_read;
     t->write_to_remote = remote_write;
     t->sync_token = 1;
+    t->max_payload = MAX_PAYLOAD_V1;
+    t->window = 1;
     t->connection_state = state;
     t->type = kTransportUsb;
     t->usb = h;
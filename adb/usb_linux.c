@@ -26,6 +26,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
+#include <poll.h>
+#include <signal.h>
 
 #include <linux/usbdevice_fs.h>
 #include <linux/version.h>
@@ -45,6 +47,13 @@
 /* usb scan debugging is waaaay too verbose */
 #define DBGX(x...)
 
+/* transfers kept queued per direction, so the bus has the next one to
+** go on with while we are still reaping the last
+*/
+#ifndef USB_URBS
+#define USB_URBS  8
+#endif
+
 ADB_MUTEX_DEFINE( usb_lock );
 
 struct usb_handle
@@ -60,11 +69,16 @@ struct usb_handle
     unsigned zero_mask;
     unsigned writeable;
 
-    struct usbdevfs_urb urb_in;
-    struct usbdevfs_urb urb_out;
+        /* bytes per transfer: picked from the endpoint's packet size,
+        ** and halved whenever the kernel turns a transfer down
+        */
+    unsigned xfer_size;
+
+    struct usbdevfs_urb urb_in[USB_URBS];
+    struct usbdevfs_urb urb_out[USB_URBS];
 
-    int urb_in_busy;
-    int urb_out_busy;
+    int urb_in_busy[USB_URBS];
+    int urb_out_busy[USB_URBS];
     int dead;
 
     adb_cond_t notify;
@@ -73,7 +87,7 @@ struct usb_handle
     // for garbage collecting disconnected devices
     int mark;
 
-    // ID of thread currently in REAPURB
+    // reaps completed transfers in both directions (writeable handles only)
     pthread_t reaper_thread;
 };
 
@@ -118,7 +132,8 @@ static void kick_disconnected_devices()
 
 static void register_device(const char *dev_name, const char *devpath,
                             unsigned char ep_in, unsigned char ep_out,
-                            int ifc, int serial_index, unsigned zero_mask);
+                            int ifc, int serial_index, unsigned zero_mask,
+                            unsigned max_packet);
 
 static inline int badname(const char *name)
 {
@@ -130,7 +145,7 @@ static inline int badname(const char *name)
 
 static void find_usb_device(const char *base,
         void (*register_device_callback)
-                (const char *, const char *, unsigned char, unsigned char, int, int, unsigned))
+                (const char *, const char *, unsigned char, unsigned char, int, int, unsigned, unsigned))
 {
     char busname[32], devname[32];
     unsigned char local_ep_in, local_ep_out;
@@ -289,7 +304,8 @@ static void find_usb_device(const char *base,
 
                         register_device_callback(devname, devpath,
                                 local_ep_in, local_ep_out,
-                                interface->bInterfaceNumber, device->iSerialNumber, zero_mask);
+                                interface->bInterfaceNumber, device->iSerialNumber, zero_mask,
+                                __le16_to_cpu(ep1->wMaxPacketSize));
                         break;
                     }
                 } else {
@@ -308,137 +324,175 @@ void usb_cleanup()
 {
 }
 
-static int usb_bulk_write(usb_handle *h, const void *data, int len)
+/* marks a transfer the reaper got back from the kernel as done */
+static void usb_reaped(usb_handle *h, struct usbdevfs_urb *urb)
 {
-    struct usbdevfs_urb *urb = &h->urb_out;
-    int res;
-    struct timeval tv;
-    struct timespec ts;
-
-    memset(urb, 0, sizeof(*urb));
-    urb->type = USBDEVFS_URB_TYPE_BULK;
-    urb->endpoint = h->ep_out;
-    urb->status = -1;
-    urb->buffer = (void*) data;
-    urb->buffer_length = len;
-
-    D("++ write ++\n");
-
-    adb_mutex_lock(&h->lock);
-    if(h->dead) {
-        res = -1;
-        goto fail;
+    if(urb >= h->urb_in && urb < h->urb_in + USB_URBS) {
+        D("[ reap urb - IN complete ]\n");
+        h->urb_in_busy[urb - h->urb_in] = 0;
+    } else if(urb >= h->urb_out && urb < h->urb_out + USB_URBS) {
+        D("[ reap urb - OUT complete ]\n");
+        h->urb_out_busy[urb - h->urb_out] = 0;
     }
-    do {
-        res = ioctl(h->desc, USBDEVFS_SUBMITURB, urb);
-    } while((res < 0) && (errno == EINTR));
+}
 
-    if(res < 0) {
-        goto fail;
-    }
+static int usb_pending(usb_handle *h)
+{
+    int i, n = 0;
 
-    res = -1;
-    h->urb_out_busy = 1;
-    for(;;) {
-        /* time out after five seconds */
-        gettimeofday(&tv, NULL);
-        ts.tv_sec = tv.tv_sec + 5;
-        ts.tv_nsec = tv.tv_usec * 1000L;
-        res = pthread_cond_timedwait(&h->notify, &h->lock, &ts);
-        if(res < 0 || h->dead) {
-            break;
-        }
-        if(h->urb_out_busy == 0) {
-            if(urb->status == 0) {
-                res = urb->actual_length;
-            }
-            break;
-        }
+    for(i = 0; i < USB_URBS; i++) {
+        n += h->urb_in_busy[i] + h->urb_out_busy[i];
     }
-fail:
-    adb_mutex_unlock(&h->lock);
-    D("-- write --\n");
-    return res;
+    return n;
 }
 
-static int usb_bulk_read(usb_handle *h, void *data, int len)
+/* hands every completed transfer back to the thread that queued it, until
+** the handle is dead and nothing is left in the kernel
+*/
+static void *usb_reaper(void *_h)
 {
-    struct usbdevfs_urb *urb = &h->urb_in;
-    struct usbdevfs_urb *out = NULL;
+    usb_handle *h = _h;
+    struct usbdevfs_urb *out;
+    struct pollfd pfd;
+    sigset_t alrm, wait_mask;
     int res;
 
-    memset(urb, 0, sizeof(*urb));
-    urb->type = USBDEVFS_URB_TYPE_BULK;
-    urb->endpoint = h->ep_in;
-    urb->status = -1;
-    urb->buffer = data;
-    urb->buffer_length = len;
-
+        /* usb_kick() wakes us with SIGALRM.  it is kept blocked except
+        ** inside ppoll(), so one sent before we get there isn't lost
+        */
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, &wait_mask);
+    sigdelset(&wait_mask, SIGALRM);
 
     adb_mutex_lock(&h->lock);
-    if(h->dead) {
-        res = -1;
-        goto fail;
-    }
-    do {
-        res = ioctl(h->desc, USBDEVFS_SUBMITURB, urb);
-    } while((res < 0) && (errno == EINTR));
+    while(!h->dead || usb_pending(h)) {
+        adb_mutex_unlock(&h->lock);
+        pfd.fd = h->desc;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        ppoll(&pfd, 1, NULL, &wait_mask);
+        adb_mutex_lock(&h->lock);
 
-    if(res < 0) {
-        goto fail;
+        while((res = ioctl(h->desc, USBDEVFS_REAPURBNDELAY, &out)) == 0) {
+            D("[ urb @%p status = %d, actual = %d ]\n",
+                out, out->status, out->actual_length);
+            usb_reaped(h, out);
+        }
+        if(errno == ENODEV) {
+                /* unplugged: the kernel has given back all it had */
+            D("[ reap urb - device gone ]\n");
+            h->dead = 1;
+            memset(h->urb_in_busy, 0, sizeof(h->urb_in_busy));
+            memset(h->urb_out_busy, 0, sizeof(h->urb_out_busy));
+        }
+        adb_cond_broadcast(&h->notify);
     }
+    adb_mutex_unlock(&h->lock);
+    D("[ usb reaper for %s done ]\n", h->fname);
+    return NULL;
+}
+
+/* moves len bytes through the bulk endpoint ep, keeping up to USB_URBS
+** transfers of h->xfer_size queued, and returns how many bytes went
+** through or -1.  a transfer that comes back short ends the request.
+** nothing is left queued on the caller's buffer when this returns, even
+** on errors.
+*/
+static int usb_bulk_transfer(usb_handle *h, struct usbdevfs_urb *urbs,
+                             int *busy, unsigned char ep,
+                             unsigned char *data, int len)
+{
+    struct usbdevfs_urb *urb;
+    int first = 0, queued = 0;  /* oldest transfer in flight, and how many */
+    int submitted = 0;          /* transfers queued so far */
+    int sent = 0;               /* bytes given to those transfers */
+    int done = 0;               /* bytes they have moved */
+    int stop = 0, failed = 0, cancelled = 0;
+    int i, res;
 
-    h->urb_in_busy = 1;
+    adb_mutex_lock(&h->lock);
     for(;;) {
-        D("[ reap urb - wait ]\n");
-        h->reaper_thread = pthread_self();
-        adb_mutex_unlock(&h->lock);
-        res = ioctl(h->desc, USBDEVFS_REAPURB, &out);
-        int saved_errno = errno;
-        adb_mutex_lock(&h->lock);
-        h->reaper_thread = 0;
-        if(h->dead) {
-            res = -1;
-            break;
-        }
-        if(res < 0) {
-            if(saved_errno == EINTR) {
-                continue;
+            /* top the queue up.  a zero length write is one empty transfer */
+        while(!stop && !failed && !h->dead && queued < USB_URBS &&
+              (sent < len || submitted == 0)) {
+            int n = (first + queued) % USB_URBS;
+            int xfer = len - sent;
+
+            if(xfer > (int) h->xfer_size) {
+                xfer = h->xfer_size;
             }
-            D("[ reap urb - error ]\n");
-            break;
-        }
-        D("[ urb @%p status = %d, actual = %d ]\n",
-            out, out->status, out->actual_length);
-
-        if(out == &h->urb_in) {
-            D("[ reap urb - IN complete ]\n");
-            h->urb_in_busy = 0;
-            if(urb->status == 0) {
-                res = urb->actual_length;
-            } else {
-                res = -1;
+
+            urb = &urbs[n];
+            memset(urb, 0, sizeof(*urb));
+            urb->type = USBDEVFS_URB_TYPE_BULK;
+            urb->endpoint = ep;
+            urb->status = -1;
+            urb->buffer = data + sent;
+            urb->buffer_length = xfer;
+
+            do {
+                res = ioctl(h->desc, USBDEVFS_SUBMITURB, urb);
+            } while((res < 0) && (errno == EINTR));
+
+            if(res < 0) {
+                    /* older kernels take 16KB per transfer at most, newer
+                    ** ones limit what may be queued altogether
+                    */
+                if((errno == EINVAL || errno == ENOMEM) && h->xfer_size > 4096) {
+                    h->xfer_size /= 2;
+                    D("[ usb transfers of %u bytes for %s ]\n", h->xfer_size, h->fname);
+                    continue;
+                }
+                D("[ submit urb - error %d ]\n", errno);
+                failed = 1;
+                break;
             }
+            busy[n] = 1;
+            queued++;
+            submitted++;
+            sent += xfer;
+        }
+        if(queued == 0) {
             break;
         }
-        if(out == &h->urb_out) {
-            D("[ reap urb - OUT compelete ]\n");
-            h->urb_out_busy = 0;
-            adb_cond_broadcast(&h->notify);
+
+        while(busy[first]) {
+            adb_cond_wait(&h->notify, &h->lock);
+        }
+        urb = &urbs[first];
+        first = (first + 1) % USB_URBS;
+        queued--;
+
+        if(h->dead || urb->status != 0) {
+            D("[ urb status = %d, dead = %d ]\n", urb->status, h->dead);
+            failed = 1;
+        } else if(!stop) {
+            done += urb->actual_length;
+            stop = urb->actual_length < urb->buffer_length;
+        }
+        if((failed || stop) && queued && !cancelled) {
+                /* the rest still has to come back before we can return,
+                ** and whatever it read would follow a gap.  cancelling
+                ** a transfer that has completed already is harmless
+                */
+            failed = cancelled = 1;
+            for(i = 0; i < queued; i++) {
+                ioctl(h->desc, USBDEVFS_DISCARDURB, &urbs[(first + i) % USB_URBS]);
+            }
         }
     }
-fail:
     adb_mutex_unlock(&h->lock);
-    return res;
+    return (failed || h->dead) ? -1 : done;
 }
 
-
 int usb_write(usb_handle *h, const void *_data, int len)
 {
     unsigned char *data = (unsigned char*) _data;
     int n;
     int need_zero = 0;
 
+    D("++ write ++\n");
     if(h->zero_mask) {
             /* if we need 0-markers and our transfer
             ** is an even multiple of the packet size,
@@ -449,25 +503,21 @@ int usb_write(usb_handle *h, const void *_data, int len)
         }
     }
 
-    while(len > 0) {
-        int xfer = (len > 4096) ? 4096 : len;
-
-        n = usb_bulk_write(h, data, xfer);
-        if(n != xfer) {
-            D("ERROR: n = %d, errno = %d (%s)\n",
-                n, errno, strerror(errno));
-            return -1;
-        }
-
-        len -= xfer;
-        data += xfer;
+    n = usb_bulk_transfer(h, h->urb_out, h->urb_out_busy, h->ep_out, data, len);
+    if(n != len) {
+        D("ERROR: n = %d, errno = %d (%s)\n",
+            n, errno, strerror(errno));
+        return -1;
     }
 
     if(need_zero){
-        n = usb_bulk_write(h, _data, 0);
-        return n;
+        n = usb_bulk_transfer(h, h->urb_out, h->urb_out_busy, h->ep_out, data, 0);
+        if(n != 0) {
+            return -1;
+        }
     }
 
+    D("-- write --\n");
     return 0;
 }
 
@@ -477,28 +527,13 @@ int usb_read(usb_handle *h, void *_data, int len)
     int n;
 
     D("++ usb_read ++\n");
-    while(len > 0) {
-        int xfer = (len > 4096) ? 4096 : len;
-
-        D("[ usb read %d fd = %d], fname=%s\n", xfer, h->desc, h->fname);
-        n = usb_bulk_read(h, data, xfer);
-        D("[ usb read %d ] = %d, fname=%s\n", xfer, n, h->fname);
-        if(n != xfer) {
-            if((errno == ETIMEDOUT) && (h->desc != -1)) {
-                D("[ timeout ]\n");
-                if(n > 0){
-                    data += n;
-                    len -= n;
-                }
-                continue;
-            }
-            D("ERROR: n = %d, errno = %d (%s)\n",
-                n, errno, strerror(errno));
-            return -1;
-        }
-
-        len -= xfer;
-        data += xfer;
+    D("[ usb read %d fd = %d], fname=%s\n", len, h->desc, h->fname);
+    n = usb_bulk_transfer(h, h->urb_in, h->urb_in_busy, h->ep_in, data, len);
+    D("[ usb read %d ] = %d, fname=%s\n", len, n, h->fname);
+    if(n != len) {
+        D("ERROR: n = %d, errno = %d (%s)\n",
+            n, errno, strerror(errno));
+        return -1;
     }
 
     D("-- usb_read --\n");
@@ -507,31 +542,28 @@ int usb_read(usb_handle *h, void *_data, int len)
 
 void usb_kick(usb_handle *h)
 {
+    int i;
+
     D("[ kicking %p (fd = %d) ]\n", h, h->desc);
     adb_mutex_lock(&h->lock);
     if(h->dead == 0) {
         h->dead = 1;
 
         if (h->writeable) {
-            /* HACK ALERT!
-            ** Sometimes we get stuck in ioctl(USBDEVFS_REAPURB).
-            ** This is a workaround for that problem.
+            /* cancel any pending transfers.  they come back to the
+            ** reaper like any other, and it wakes the threads that
+            ** queued them; the signal gets it out of ppoll() when
+            ** nothing was pending, so it sees we are dead
             */
-            if (h->reaper_thread) {
-                pthread_kill(h->reaper_thread, SIGALRM);
+            for(i = 0; i < USB_URBS; i++) {
+                if(h->urb_in_busy[i]) {
+                    ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_in[i]);
+                }
+                if(h->urb_out_busy[i]) {
+                    ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_out[i]);
+                }
             }
-
-            /* cancel any pending transactions
-            ** these will quietly fail if the txns are not active,
-            ** but this ensures that a reader blocked on REAPURB
-            ** will get unblocked
-            */
-            ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_in);
-            ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_out);
-            h->urb_in.status = -ENODEV;
-            h->urb_out.status = -ENODEV;
-            h->urb_in_busy = 0;
-            h->urb_out_busy = 0;
+            pthread_kill(h->reaper_thread, SIGALRM);
             adb_cond_broadcast(&h->notify);
         } else {
             unregister_usb_transport(h);
@@ -543,6 +575,15 @@ void usb_kick(usb_handle *h)
 int usb_close(usb_handle *h)
 {
     D("[ usb close ... ]\n");
+    if(h->writeable) {
+            /* normally we were kicked already, and the reaper is done */
+        adb_mutex_lock(&h->lock);
+        h->dead = 1;
+        adb_mutex_unlock(&h->lock);
+        pthread_kill(h->reaper_thread, SIGALRM);
+        pthread_join(h->reaper_thread, NULL);
+    }
+
     adb_mutex_lock(&usb_lock);
     h->next->prev = h->prev;
     h->prev->next = h->next;
@@ -559,7 +600,8 @@ int usb_close(usb_handle *h)
 
 static void register_device(const char *dev_name, const char *devpath,
                             unsigned char ep_in, unsigned char ep_out,
-                            int interface, int serial_index, unsigned zero_mask)
+                            int interface, int serial_index, unsigned zero_mask,
+                            unsigned max_packet)
 {
     usb_handle* usb = 0;
     int n = 0;
@@ -591,11 +633,22 @@ static void register_device(const char *dev_name, const char *devpath,
     usb->zero_mask = zero_mask;
     usb->writeable = 1;
 
+        /* full speed devices get the 4KB transfers they always had.  with
+        ** faster ones (512 byte packets for high speed, 1024 for SuperSpeed)
+        ** larger transfers mean fewer completions to turn around
+        */
+    if(max_packet >= 1024) {
+        usb->xfer_size = 64 * 1024;
+    } else if(max_packet >= 512) {
+        usb->xfer_size = 16 * 1024;
+    } else {
+        usb->xfer_size = 4096;
+    }
+
     adb_cond_init(&usb->notify, 0);
     adb_mutex_init(&usb->lock, 0);
     /* initialize mark to 1 so we don't get garbage collected after the device scan */
     usb->mark = 1;
-    usb->reaper_thread = 0;
 
     usb->desc = unix_open(usb->fname, O_RDWR);
     if(usb->desc < 0) {
@@ -608,6 +661,7 @@ static void register_device(const char *dev_name, const char *devpath,
         D("[ usb open %s fd = %d]\n", usb->fname, usb->desc);
         n = ioctl(usb->desc, USBDEVFS_CLAIMINTERFACE, &interface);
         if(n != 0) goto fail;
+        if(pthread_create(&usb->reaper_thread, NULL, usb_reaper, usb)) goto fail;
     }
 
         /* read the device's serial number */
@@ -19,12 +19,15 @@
 #include <unistd.h>
 #include <string.h>
 
+#include <linux/aio_abi.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "sysdeps.h"
 
@@ -37,6 +40,29 @@
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
+/* with AIO on the FunctionFS endpoints, reads and writes go out as
+** requests of up to USB_FFS_AIO_SIZE bytes, USB_FFS_AIO_REQS at a time,
+** so the controller has the next one queued when the last completes
+*/
+#ifndef USB_FFS_AIO_REQS
+#define USB_FFS_AIO_REQS  16
+#endif
+#ifndef USB_FFS_AIO_SIZE
+#define USB_FFS_AIO_SIZE  16384
+#endif
+
+struct usb_aio
+{
+    aio_context_t ctx;
+    struct iocb iocb[USB_FFS_AIO_REQS];
+    struct iocb *iocbs[USB_FFS_AIO_REQS];
+    struct io_event events[USB_FFS_AIO_REQS];
+    long result[USB_FFS_AIO_REQS];
+
+    // requests submitted and not collected yet, under the handle's lock
+    int pending;
+};
+
 struct usb_handle
 {
     adb_cond_t notify;
@@ -53,6 +79,11 @@ struct usb_handle
     int control;
     int bulk_out; /* "out" from the host's perspective => source for adbd */
     int bulk_in;  /* "in" from the host's perspective => sink for adbd */
+
+    // FunctionFS with AIO: one context for each direction
+    struct usb_aio read_aio;
+    struct usb_aio write_aio;
+    int kicked;
 };
 
 static const struct {
@@ -203,11 +234,20 @@ static int usb_adb_read(usb_handle *h, void *data, int len)
     int n;
 
     D("about to read (fd=%d, len=%d)\n", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if(n != len) {
-        D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
-            h->fd, n, errno, strerror(errno));
-        return -1;
+    while(len > 0) {
+            /* the f_adb driver fails reads bigger than its 4096 byte
+            ** buffer, so read large payloads a piece at a time
+            */
+        int xfer = (len > 4096) ? 4096 : len;
+
+        n = adb_read(h->fd, data, xfer);
+        if(n != xfer) {
+            D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
+                h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        len -= xfer;
+        data = (char *)data + xfer;
     }
     D("[ done fd=%d ]\n", h->fd);
     return 0;
@@ -333,6 +373,10 @@ static void *usb_ffs_open_thread(void *x)
             adb_sleep_ms(1000);
         }
 
+        adb_mutex_lock(&usb->lock);
+        usb->kicked = 0;
+        adb_mutex_unlock(&usb->lock);
+
         D("[ usb_thread - registering device ]\n");
         register_usb_transport(usb, 0, 0, 1);
     }
@@ -411,10 +455,187 @@ static int usb_ffs_read(usb_handle *h, void *data, int len)
     return 0;
 }
 
+/* bionic has no wrappers for the AIO system calls */
+static int io_setup(unsigned nr, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int io_getevents(aio_context_t ctx, long min_nr, long nr,
+                        struct io_event *events, struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static int io_cancel(aio_context_t ctx, struct iocb *iocb, struct io_event *result)
+{
+    return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+/* cancels what is still queued in aio.  the requests come back through
+** io_getevents() to the thread waiting for them, which returns once it
+** has them all.  one that already completed just fails to cancel.
+** called with the handle's lock held
+*/
+static void usb_ffs_cancel_aio(struct usb_aio *aio, int from)
+{
+    struct io_event event;
+    int i;
+
+    for (i = from; i < aio->pending; i++)
+        io_cancel(aio->ctx, &aio->iocb[i], &event);
+}
+
+/* moves len bytes through the endpoint fd with up to USB_FFS_AIO_REQS
+** requests in flight.  returns 0 once all of them are through, -1 on
+** errors.  nothing is left queued on the caller's buffer when this returns.
+*/
+static int usb_ffs_do_aio(usb_handle *h, struct usb_aio *aio, int fd,
+                          char *data, int len, int read)
+{
+    int done = 0;
+
+    while (done < len) {
+        int n, i, got, offset = done, failed = 0;
+
+        adb_mutex_lock(&h->lock);
+        if (h->kicked) {
+            adb_mutex_unlock(&h->lock);
+            return -1;
+        }
+        for (n = 0; n < USB_FFS_AIO_REQS && offset < len; n++) {
+            struct iocb *cb = &aio->iocb[n];
+            int xfer = len - offset;
+
+            if (xfer > USB_FFS_AIO_SIZE)
+                xfer = USB_FFS_AIO_SIZE;
+
+            memset(cb, 0, sizeof(*cb));
+            cb->aio_data = n;
+            cb->aio_fildes = fd;
+            cb->aio_lio_opcode = read ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+            cb->aio_buf = (uintptr_t) (data + offset);
+            cb->aio_nbytes = xfer;
+            aio->iocbs[n] = cb;
+            offset += xfer;
+        }
+        n = io_submit(aio->ctx, n, aio->iocbs);
+        aio->pending = (n > 0) ? n : 0;
+        adb_mutex_unlock(&h->lock);
+
+        if (n < 0 && errno == EINVAL && done == 0) {
+                /* the endpoints don't do AIO on this kernel */
+            D("[ no AIO on fd=%d, using read and write ]\n", fd);
+            h->read = usb_ffs_read;
+            h->write = usb_ffs_write;
+            return read ? usb_ffs_read(h, data, len) : usb_ffs_write(h, data, len);
+        }
+        if (n <= 0) {
+            D("[ aio submit fd=%d failed: errno=%d ]\n", fd, errno);
+            return -1;
+        }
+
+        for (got = 0; got < n; ) {
+            int r = io_getevents(aio->ctx, 1, n - got, aio->events, NULL);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                    /* the requests still point at the caller's buffer */
+                fatal_errno("io_getevents failed");
+            }
+            for (i = 0; i < r; i++)
+                aio->result[aio->events[i].data] = aio->events[i].res;
+            got += r;
+
+                /* a request that comes back short ends the host's transfer.
+                ** anything queued after it would read past that, so stop
+                */
+            adb_mutex_lock(&h->lock);
+            for (i = 0; i < r; i++) {
+                int k = aio->events[i].data;
+                if (!failed && k < n - 1 &&
+                    aio->result[k] < (long) aio->iocb[k].aio_nbytes) {
+                    failed = 1;
+                    usb_ffs_cancel_aio(aio, k + 1);
+                }
+            }
+            adb_mutex_unlock(&h->lock);
+        }
+
+        adb_mutex_lock(&h->lock);
+        aio->pending = 0;
+        adb_mutex_unlock(&h->lock);
+
+        for (i = 0; i < n; i++) {
+            if (aio->result[i] < 0 || failed) {
+                D("[ aio fd=%d request %d: %ld ]\n", fd, i, aio->result[i]);
+                errno = (aio->result[i] < 0) ? -aio->result[i] : EIO;
+                return -1;
+            }
+                /* only the last one can be short: a zero length packet
+                ** ending the host's previous transfer, or the end of a
+                ** read.  go round again for whatever is left
+                */
+            done += aio->result[i];
+        }
+    }
+    return 0;
+}
+
+static int usb_ffs_aio_write(usb_handle *h, const void *data, int len)
+{
+    D("about to write (fd=%d, len=%d)\n", h->bulk_in, len);
+    if (usb_ffs_do_aio(h, &h->write_aio, h->bulk_in, (char *) data, len, 0)) {
+        D("ERROR: fd = %d, errno = %d (%s)\n",
+            h->bulk_in, errno, strerror(errno));
+        return -1;
+    }
+    D("[ done fd=%d ]\n", h->bulk_in);
+    return 0;
+}
+
+static int usb_ffs_aio_read(usb_handle *h, void *data, int len)
+{
+    D("about to read (fd=%d, len=%d)\n", h->bulk_out, len);
+    if (usb_ffs_do_aio(h, &h->read_aio, h->bulk_out, data, len, 1)) {
+        D("ERROR: fd = %d, errno = %d (%s)\n",
+            h->bulk_out, errno, strerror(errno));
+        return -1;
+    }
+    D("[ done fd=%d ]\n", h->bulk_out);
+    return 0;
+}
+
+/* uses AIO on the endpoints if the kernel has it, read and write if not */
+static void usb_ffs_init_io(usb_handle *h)
+{
+    h->write = usb_ffs_write;
+    h->read = usb_ffs_read;
+
+    if (io_setup(USB_FFS_AIO_REQS, &h->read_aio.ctx) ||
+        io_setup(USB_FFS_AIO_REQS, &h->write_aio.ctx)) {
+        D("[ usb_init - no AIO: errno=%d ]\n", errno);
+        return;
+    }
+    h->write = usb_ffs_aio_write;
+    h->read = usb_ffs_aio_read;
+}
+
 static void usb_ffs_kick(usb_handle *h)
 {
     int err;
 
+    adb_mutex_lock(&h->lock);
+    h->kicked = 1;
+    usb_ffs_cancel_aio(&h->read_aio, 0);
+    usb_ffs_cancel_aio(&h->write_aio, 0);
+    adb_mutex_unlock(&h->lock);
+
     err = ioctl(h->bulk_in, FUNCTIONFS_CLEAR_HALT);
     if (err < 0)
         D("[ kick: source (fd=%d) clear halt failed (%d) ]", h->bulk_in, errno);
@@ -443,8 +664,7 @@ static void usb_ffs_init()
 
     h = calloc(1, sizeof(usb_handle));
 
-    h->write = usb_ffs_write;
-    h->read = usb_ffs_read;
+    usb_ffs_init_io(h);
     h->kick = usb_ffs_kick;
 
     h->control  = -1;
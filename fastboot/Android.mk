@@ -24,6 +24,7 @@ LOCAL_MODULE_TAGS := debug
 
 ifeq ($(HOST_OS),linux)
   LOCAL_SRC_FILES += usb_linux.c util_linux.c
+  LOCAL_LDLIBS += -lpthread
 endif
 
 ifeq ($(HOST_OS),darwin)
@@ -76,6 +76,7 @@ char *mkmsg(const char *fmt, ...)
 #define OP_NOTICE     4
 #define OP_FORMAT     5
 #define OP_DOWNLOAD_SPARSE 6
+#define OP_DOWNLOAD_FD 7
 
 typedef struct Action Action;
 
@@ -89,7 +90,9 @@ struct Action
     char cmd[CMD_SIZE];
     const char *prod;
     void *data;
+    int fd;
     unsigned size;
+    int threads;
 
     const char *msg;
     int (*func)(Action *a, int status, char *resp);
@@ -411,13 +414,29 @@ void fb_queue_flash(const char *ptn, void *data, unsigned sz)
     a->msg = mkmsg("writing '%s'", ptn);
 }
 
-void fb_queue_flash_sparse(const char *ptn, struct sparse_file *s, unsigned sz)
+/* Takes over fd, which is closed once it has been sent */
+void fb_queue_flash_fd(const char *ptn, int fd, unsigned sz)
+{
+    Action *a;
+
+    a = queue_action(OP_DOWNLOAD_FD, "");
+    a->fd = fd;
+    a->size = sz;
+    a->msg = mkmsg("sending '%s' (%d KB)", ptn, sz / 1024);
+
+    a = queue_action(OP_COMMAND, "flash:%s", ptn);
+    a->msg = mkmsg("writing '%s'", ptn);
+}
+
+void fb_queue_flash_sparse(const char *ptn, struct sparse_file *s, unsigned sz,
+        int threads)
 {
     Action *a;
 
     a = queue_action(OP_DOWNLOAD_SPARSE, "");
     a->data = s;
     a->size = 0;
+    a->threads = threads;
     a->msg = mkmsg("sending sparse '%s' (%d KB)", ptn, sz / 1024);
 
     a = queue_action(OP_COMMAND, "flash:%s", ptn);
@@ -625,7 +644,13 @@ int fb_execute_queue(usb_handle *usb)
             status = a->func(a, status, status ? fb_get_error() : "");
             if (status) break;
         } else if (a->op == OP_DOWNLOAD_SPARSE) {
-            status = fb_download_data_sparse(usb, a->data);
+            status = fb_download_data_sparse(usb, a->data, a->threads);
+            status = a->func(a, status, status ? fb_get_error() : "");
+            if (status) break;
+        } else if (a->op == OP_DOWNLOAD_FD) {
+            status = fb_download_data_fd(usb, a->fd, a->size);
+            close(a->fd);
+            a->fd = -1;
             status = a->func(a, status, status ? fb_get_error() : "");
             if (status) break;
         } else {
@@ -73,6 +73,7 @@ static unsigned short vendor_id = 0;
 static int long_listing = 0;
 static int64_t sparse_limit = -1;
 static int64_t target_sparse_limit = -1;
+static int sparse_threads = -1;
 
 unsigned page_size = 2048;
 unsigned base_addr      = 0x10000000;
@@ -307,6 +308,8 @@ void usage(void)
             "  -n <page size>                           specify the nand page size. default: 2048\n"
             "  -S <size>[K|M|G]                         automatically sparse files greater than\n"
             "                                           size.  0 to disable\n"
+            "  -t <threads>                             read sparse images ahead on this many\n"
+            "                                           threads.  0 for one per cpu\n"
         );
 }
 
@@ -589,7 +592,6 @@ static int needs_erase(const char *part)
 void do_flash(usb_handle *usb, const char *pname, const char *fname)
 {
     int64_t sz64;
-    void *data;
     int64_t limit;
 
     sz64 = file_size(fname);
@@ -601,13 +603,18 @@ void do_flash(usb_handle *usb, const char *pname, const char *fname)
         }
         while (*s) {
             sz64 = sparse_file_len(*s, true, false);
-            fb_queue_flash_sparse(pname, *s++, sz64);
+            fb_queue_flash_sparse(pname, *s++, sz64, sparse_threads);
         }
     } else {
-        unsigned int sz;
-        data = load_file(fname, &sz);
-        if (data == 0) die("cannot load '%s': %s\n", fname, strerror(errno));
-        fb_queue_flash(pname, data, sz);
+        /* Sent straight from the file, so it is never loaded into memory */
+        int fd = open(fname, O_RDONLY | O_BINARY);
+        if (fd < 0 || sz64 < 0) {
+            die("cannot load '%s': %s\n", fname, strerror(errno));
+        }
+        if (sz64 > UINT32_MAX) {
+            die("'%s' is too large to send without sparse images\n", fname);
+        }
+        fb_queue_flash_fd(pname, fd, sz64);
     }
 }
 
@@ -623,8 +630,6 @@ void do_update_signature(zipfile_t zip, char *fn)
 
 void do_update(char *fn, int erase_first)
 {
-    void *zdata;
-    unsigned zsize;
     void *data;
     unsigned sz;
     zipfile_t zip;
@@ -633,11 +638,8 @@ void do_update(char *fn, int erase_first)
 
     fb_queue_query_save("product", cur_product, sizeof(cur_product));
 
-    zdata = load_file(fn, &zsize);
-    if (zdata == 0) die("failed to load '%s': %s", fn, strerror(errno));
-
-    zip = init_zipfile(zdata, zsize);
-    if(zip == 0) die("failed to access zipdata in '%s'");
+    zip = open_zipfile(fn);
+    if(zip == 0) die("failed to access zipdata in '%s'", fn);
 
     data = unzip_file(zip, "android-info.txt", &sz);
     if (data == 0) {
@@ -832,7 +834,7 @@ int main(int argc, char **argv)
 
     while (1) {
         int option_index = 0;
-        c = getopt_long(argc, argv, "wub:k:n:r:s:S:lp:c:i:m:h", longopts, NULL);
+        c = getopt_long(argc, argv, "wub:k:n:r:s:S:t:lp:c:i:m:h", longopts, NULL);
         if (c < 0) {
             break;
         }
@@ -882,6 +884,16 @@ int main(int argc, char **argv)
                     die("invalid sparse limit");
             }
             break;
+        case 't': {
+                char *endptr = NULL;
+                long val;
+
+                val = strtol(optarg, &endptr, 0);
+                if (!endptr || *endptr != '\0' || val < 0 || val > INT_MAX)
+                    die("invalid thread count '%s'", optarg);
+                sparse_threads = (int)val;
+                break;
+            }
         case 'u':
             erase_first = 0;
             break;
@@ -37,7 +37,8 @@ struct sparse_file;
 int fb_command(usb_handle *usb, const char *cmd);
 int fb_command_response(usb_handle *usb, const char *cmd, char *response);
 int fb_download_data(usb_handle *usb, const void *data, unsigned size);
-int fb_download_data_sparse(usb_handle *usb, struct sparse_file *s);
+int fb_download_data_fd(usb_handle *usb, int fd, unsigned size);
+int fb_download_data_sparse(usb_handle *usb, struct sparse_file *s, int threads);
 char *fb_get_error(void);
 
 #define FB_COMMAND_SZ 64
@@ -47,7 +48,9 @@ char *fb_get_error(void);
 int fb_getvar(struct usb_handle *usb, char *response, const char *fmt, ...);
 int fb_format_supported(usb_handle *usb, const char *partition);
 void fb_queue_flash(const char *ptn, void *data, unsigned sz);
-void fb_queue_flash_sparse(const char *ptn, struct sparse_file *s, unsigned sz);
+void fb_queue_flash_fd(const char *ptn, int fd, unsigned sz);
+void fb_queue_flash_sparse(const char *ptn, struct sparse_file *s, unsigned sz,
+        int threads);
 void fb_queue_erase(const char *ptn);
 void fb_queue_format(const char *ptn, int skip_if_not_supported);
 void fb_queue_require(const char *prod, const char *var, int invert,
@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <sparse/sparse.h>
 
@@ -219,6 +220,54 @@ int fb_download_data(usb_handle *usb, const void *data, unsigned size)
     }
 }
 
+#define FD_BUF_SIZE (1024 * 1024)
+
+/*
+ * Sends size bytes read from fd, a window at a time, so that images don't have
+ * to be loaded into memory before they are sent.
+ */
+int fb_download_data_fd(usb_handle *usb, int fd, unsigned size)
+{
+    char cmd[64];
+    char *buf;
+    unsigned to_read;
+    int r;
+
+    buf = malloc(FD_BUF_SIZE);
+    if (buf == 0) {
+        sprintf(ERROR, "out of memory");
+        return -1;
+    }
+
+    sprintf(cmd, "download:%08x", size);
+    r = _command_start(usb, cmd, size, 0);
+    if (r < 0) {
+        goto out;
+    }
+
+    while (size > 0) {
+        to_read = min(size, FD_BUF_SIZE);
+        r = read(fd, buf, to_read);
+        if (r <= 0) {
+            sprintf(ERROR, "image read failed (%s)",
+                    r < 0 ? strerror(errno) : "short file");
+            r = -1;
+            goto out;
+        }
+        r = _command_data(usb, buf, r);
+        if (r < 0) {
+            goto out;
+        }
+        size -= r;
+    }
+
+    r = _command_end(usb);
+
+out:
+    free(buf);
+    return r;
+}
+
 #define USB_BUF_SIZE 512
 static char usb_buf[USB_BUF_SIZE];
 static int usb_buf_len;
@@ -288,7 +337,8 @@ static int fb_download_data_sparse_flush(usb_handle *usb)
     return 0;
 }
 
-int fb_download_data_sparse(usb_handle *usb, struct sparse_file *s)
+/* threads >= 0 reads the image ahead on that many threads, 0 for one per cpu */
+int fb_download_data_sparse(usb_handle *usb, struct sparse_file *s, int threads)
 {
     char cmd[64];
     int r;
@@ -303,7 +353,12 @@ int fb_download_data_sparse(usb_handle *usb, struct sparse_file *s)
         return -1;
     }
 
-    r = sparse_file_callback(s, true, false, fb_download_data_sparse_write, usb);
+    if (threads >= 0) {
+        r = sparse_file_callback_threaded(s, true, false,
+                fb_download_data_sparse_write, usb, threads);
+    } else {
+        r = sparse_file_callback(s, true, false, fb_download_data_sparse_write, usb);
+    }
     if (r < 0) {
         return -1;
     }
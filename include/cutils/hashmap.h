@@ -41,6 +41,44 @@ typedef struct Hashmap Hashmap;
 Hashmap* hashmapCreate(size_t initialCapacity,
         int (*hash)(void* key), bool (*equals)(void* keyA, void* keyB));
 
+/**
+ * Creates a hash map that threads can share without locking it.  Lookups
+ * take no lock, so they scale with the number of reading threads, and
+ * changes lock only the part of the map that holds the key, so writers
+ * rarely wait for each other and a part that grows holds up no others.
+ * Returns NULL if memory allocation fails.
+ *
+ * A lookup racing with a change may still call equals with a key just
+ * removed, so a key must stay valid until no lookup can be using it.
+ * hashmapForEach() callbacks must not call other functions on the map.
+ *
+ * @param initialCapacity number of expected entries
+ * @param hash function which hashes keys
+ * @param equals function which compares keys for equality
+ */
+Hashmap* hashmapCreateConcurrent(size_t initialCapacity,
+        int (*hash)(void* key), bool (*equals)(void* keyA, void* keyB));
+
+/**
+ * Returns the number of bytes hashmapCreateInBuffer() needs to hold
+ * capacity entries.
+ */
+size_t hashmapBufferSize(size_t capacity);
+
+/**
+ * Creates a hash map inside buffer, which must be pointer aligned and at
+ * least hashmapBufferSize(capacity) bytes.  The map never allocates
+ * memory: once it holds capacity entries, adding another fails as if
+ * memory allocation had failed.  hashmapFree() doesn't free the buffer.
+ *
+ * @param buffer memory for the map, such as a stack array or an arena
+ * @param capacity maximum number of entries
+ * @param hash function which hashes keys
+ * @param equals function which compares keys for equality
+ */
+Hashmap* hashmapCreateInBuffer(void* buffer, size_t capacity,
+        int (*hash)(void* key), bool (*equals)(void* keyA, void* keyB));
+
 /**
  * Frees the hash map. Does not free the keys or values themselves.
  */
@@ -95,7 +133,8 @@ size_t hashmapSize(Hashmap* map);
 
 /**
  * Invokes the given callback on each entry in the map. Stops iterating if
- * the callback returns false.
+ * the callback returns false. The callback may remove the entry it is
+ * given, but must not otherwise change the map.
  */
 void hashmapForEach(Hashmap* map, 
         bool (*callback)(void* key, void* value, void* context),
@@ -106,7 +145,9 @@ void hashmapForEach(Hashmap* map,
  */
 
 /**
- * Locks the hash map so only the current thread can access it.
+ * Locks the hash map so only the current thread can access it.  Maps made
+ * by hashmapCreateConcurrent() don't need this, and their functions don't
+ * take this lock.
  */
 void hashmapLock(Hashmap* map);
 
@@ -46,6 +46,22 @@ int property_set(const char *key, const char *value);
     
 int property_list(void (*propfn)(const char *key, const char *value, void *cookie), void *cookie);    
 
+/* property_cache_create: returns a handle for reading one property over
+** and over, or NULL if out of memory.
+**
+** property_cache_get behaves like property_get, but looks the property up
+** only once, and after that only re-reads it when its serial number shows
+** it has changed.  While the property doesn't exist, it looks again only
+** after some property has been added or changed.  Where properties don't
+** carry serial numbers, it just calls property_get.
+*/
+struct property_cache;
+
+struct property_cache *property_cache_create(const char *key);
+int property_cache_get(struct property_cache *cache, char *value,
+                       const char *default_value);
+void property_cache_free(struct property_cache *cache);
+
 
 #ifdef HAVE_SYSTEM_PROPERTY_SERVER
 /*
@@ -34,6 +34,10 @@ extern void record_stream_free(RecordStream *p_rs);
 extern int record_stream_get_next (RecordStream *p_rs, void ** p_outRecord, 
                                     size_t *p_outRecordLen);
 
+extern int record_stream_get_batch (RecordStream *p_rs, void **p_outRecords,
+                                    size_t *p_outRecordLens,
+                                    size_t maxRecords);
+
 #ifdef __cplusplus
 }
 #endif
@@ -45,6 +45,11 @@ typedef struct Selector Selector;
  * descriptor at a later time and invoke the onRemove() callback.
  * 
  * SelectableFd fields should only be modified from the selector loop.
+ *
+ * With the epoll backend, the selector only looks at an fd's callbacks
+ * when it's added, after one of its callbacks runs, and after
+ * selectorWakeUpFd() or selectorWakeUp(). Call selectorWakeUpFd() after
+ * changing an fd from anywhere else, such as another fd's callback.
  */
 typedef struct SelectableFd SelectableFd;
 struct SelectableFd {
@@ -63,7 +68,8 @@ struct SelectableFd {
 
     /** 
      * Invoked by the selector before calling select. You can set up other
-     * callbacks from here as necessary.
+     * callbacks from here as necessary. The epoll backend only calls it
+     * when it looks at the fd's callbacks, as described above.
      */
     void (*beforeSelect)(SelectableFd* self);
 
@@ -97,11 +103,31 @@ struct SelectableFd {
     Selector* selector;
 };
 
+/** The ways a selector can wait for its fds. */
+typedef enum {
+    /** 
+     * select(). Rebuilds its fd sets from every fd on each loop, and is
+     * limited to fds below FD_SETSIZE.
+     */
+    SELECTOR_SELECT,
+
+    /** 
+     * epoll, where available. Only fds whose callbacks may have changed
+     * are looked at on each loop. Falls back to select() elsewhere.
+     */
+    SELECTOR_EPOLL,
+} SelectorBackend;
+
 /** 
- * Creates a new selector. 
+ * Creates a new selector using select(). 
  */
 Selector* selectorCreate(void);
 
+/** 
+ * Creates a new selector using the given backend. 
+ */
+Selector* selectorCreateWithBackend(SelectorBackend backend);
+
 /** 
  * Creates a new selectable fd, adds it to the given selector and returns a 
  * pointer. Outside of 'selector' and 'fd', all fields are set to 0 or NULL 
@@ -116,6 +142,15 @@ SelectableFd* selectorAdd(Selector* selector, int fd);
  * to indicate that you're ready to write to a descriptor.
  */
 void selectorWakeUp(Selector* selector);
+
+/**
+ * Wakes up the selector to look at the callbacks of one fd, calling its
+ * beforeSelect(). Can be called from any thread until the fd's 'remove'
+ * flag is set, and from the selector thread after. With the epoll backend,
+ * this is cheaper than selectorWakeUp(), which has the selector look at
+ * every fd.
+ */
+void selectorWakeUpFd(SelectableFd* selectableFd);
     
 /** 
  * Loops continuously selecting file descriptors and firing events. 
@@ -18,6 +18,7 @@
 #define _ZIPFILE_ZIPFILE_H
 
 #include <stddef.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,7 +30,18 @@ typedef void* zipentry_t;
 // Provide a buffer.  Returns NULL on failure.
 zipfile_t init_zipfile(const void* data, size_t size);
 
-// Release the zipfile resources.
+// Map a zip file into memory.  Only the end of the central directory is
+// checked here; the entries are read by the first lookup or iteration,
+// which must not race with other calls on the same zipfile.  ZIP64
+// archives are supported.  Returns NULL on failure.
+zipfile_t open_zipfile(const char* path);
+
+// Like open_zipfile, for a file that's already open.  The fd isn't kept,
+// so the caller can close it straight away.
+zipfile_t open_zipfile_fd(int fd);
+
+// Release the zipfile resources, unmapping it if it came from
+// open_zipfile.
 void release_zipfile(zipfile_t file);
 
 // Get a named entry object.  Returns NULL if it doesn't exist
@@ -51,6 +63,45 @@ int decompress_zipentry(zipentry_t entry, void* buf, int bufsize);
 // a void* initialized to NULL to start.  Returns NULL when done
 zipentry_t iterate_zipfile(zipfile_t file, void** cookie);
 
+typedef void* zipreader_t;
+
+// Open an entry for reading a piece at a time, without needing a buffer
+// for all of it.  Returns NULL on failure.  The reader must be closed
+// before the zipfile is released.
+zipreader_t open_zipentry(zipentry_t entry);
+
+// Read up to len bytes from the current position.  Returns the number
+// of bytes read, 0 at the end of the entry, or -1 on failure.
+int read_zipentry(zipreader_t reader, void* buf, int len);
+
+// Move to offset in the uncompressed data.  Compressed entries are
+// inflated again from the closest checkpoint before offset, or from the
+// start.  Returns nonzero on failure.
+int seek_zipentry(zipreader_t reader, size_t offset);
+
+// Save the decompressor state every interval bytes as the entry is read,
+// so later seeks backwards are quicker.  Each checkpoint costs about
+// 40KB.  0 turns checkpoints off.  Returns nonzero on failure.
+int set_zipentry_checkpoints(zipreader_t reader, size_t interval);
+
+// Free the reader.
+void close_zipentry(zipreader_t reader);
+
+// Called by extract_zipfile for each entry, before any are extracted, to
+// say where the entry goes: *fd is the file to write it to and *offset
+// where it starts in that file.  Leaving *fd at -1 only checks the entry.
+// Return nonzero to skip the entry.
+typedef int (*zipentry_target_t)(zipentry_t entry, void* cookie,
+                                 int* fd, off_t* offset);
+
+// Inflate the entries on up to threads threads (0 for one per cpu),
+// check each one against the CRC in the central directory, and write them
+// out with positional writes where target says.  A NULL target checks
+// every entry without writing anything.  Returns the number of entries
+// that failed, or -1 if extraction couldn't run.
+int extract_zipfile(zipfile_t file, zipentry_target_t target, void* cookie,
+                    int threads);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
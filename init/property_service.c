@@ -188,10 +188,18 @@ static int init_property_area(void)
     return 0;
 }
 
+/*
+ * Readers that cache values (property_cache_get in libcutils) re-read a
+ * property only when its serial changes, and look for missing ones only
+ * when the area's serial does, so each serial must be bumped after the
+ * writes it covers are visible.
+ */
 static void update_prop_info(prop_info *pi, const char *value, unsigned len)
 {
     pi->serial = pi->serial | 1;
+    __sync_synchronize();
     memcpy(pi->value, value, len + 1);
+    __sync_synchronize();
     pi->serial = (len << 24) | ((pi->serial + 1) & 0xffffff);
     __futex_wake(&pi->serial, INT32_MAX);
 }
@@ -355,6 +363,7 @@ int property_set(const char *name, const char *value)
 
         pa = __system_property_area__;
         update_prop_info(pi, value, valuelen);
+        __sync_synchronize();
         pa->serial++;
         __futex_wake(&pa->serial, INT32_MAX);
     } else {
@@ -365,11 +374,14 @@ int property_set(const char *name, const char *value)
         pi->serial = (valuelen << 24);
         memcpy(pi->name, name, namelen + 1);
         memcpy(pi->value, value, valuelen + 1);
+        __sync_synchronize();
 
         pa->toc[pa->count] =
             (namelen << 24) | (((unsigned) pi) - ((unsigned) pa));
+        __sync_synchronize();
 
         pa->count++;
+        __sync_synchronize();
         pa->serial++;
         __futex_wake(&pa->serial, INT32_MAX);
     }
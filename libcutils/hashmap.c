@@ -18,59 +18,311 @@
 #include <assert.h>
 #include <errno.h>
 #include <cutils/threads.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <sys/types.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-typedef struct Entry Entry;
-struct Entry {
+/*
+ * Open addressing with a control byte per slot, as in Abseil's SwissTable.
+ * A full slot's control byte holds 7 bits of its hash, so one compare
+ * checks a whole group of slots at once, and the keys and values sit in
+ * one flat array with no allocation per entry.
+ *
+ * Slots are probed a group at a time.  Groups are aligned, and a probe
+ * visits group g, g + 1, g + 3, g + 6, ... which covers every group
+ * because the group count is a power of 2.  A lookup can stop at the first
+ * group with an empty slot.
+ *
+ * A concurrent map spreads its entries over SEGMENT_COUNT segments by the
+ * top bits of their hash.  Each segment is an ordinary map whose lock is
+ * held by writers, so writers to different segments, and a segment that
+ * is growing, don't hold each other up.  Readers take no lock.  A writer
+ * makes the segment's sequence number odd while it changes the segment, and
+ * a reader that sees the number change under it starts again, giving up
+ * and taking the lock after READ_ATTEMPTS tries.  Readers may still be
+ * probing a table after it's replaced, so a segment keeps its old tables
+ * until the map is freed; as tables double in size they add up to less
+ * than the current one.
+ */
+
+#define CTRL_EMPTY   ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xfe)
+
+#ifdef __SSE2__
+#define GROUP_WIDTH 16
+typedef uint32_t GroupMask;
+#else
+#define GROUP_WIDTH 8
+typedef uint64_t GroupMask;
+#endif
+
+#define SEGMENT_BITS 4
+#define SEGMENT_COUNT (1 << SEGMENT_BITS)
+#define READ_ATTEMPTS 16
+
+typedef struct Slot {
     void* key;
-    int hash;
     void* value;
-    Entry* next;
-};
+    int hash;
+} Slot;
+
+/**
+ * Header of a table allocation, which goes on to hold the control bytes and
+ * then the slots.
+ */
+typedef struct Table {
+    size_t slotCount;
+    // Next older table a concurrent segment has replaced.
+    struct Table* next;
+} Table;
 
 struct Hashmap {
-    Entry** buckets;
-    size_t bucketCount;
+    Table* table;
+    uint8_t* ctrl;
+    Slot* slots;
+    size_t slotCount;
+    size_t size;
+    // Empty slots that can still be used before the table has to grow.
+    size_t growthLeft;
     int (*hash)(void* key);
     bool (*equals)(void* keyA, void* keyB);
-    mutex_t lock; 
-    size_t size;
+    mutex_t lock;
+    // Maps made by hashmapCreateInBuffer never grow or free their table.
+    bool fixed;
+    size_t fixedCapacity;
+    // Set in concurrent maps, which keep their entries here.
+    Hashmap* segments;
+    // Set in the segments of a concurrent map.
+    bool segment;
+    unsigned int sequence;
+    Table* retired;
 };
 
+/*
+ * Bit masks over the slots of a group.  With SSE2 there's one bit per
+ * slot.  The portable version works on 8 control bytes in a uint64_t and
+ * keeps the top bit of each matching byte.
+ */
+#ifdef __SSE2__
+
+static inline GroupMask groupMatch(const uint8_t* ctrl, uint8_t h2) {
+    __m128i group = _mm_loadu_si128((const __m128i*) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(h2)));
+}
+
+static inline GroupMask groupMatchEmpty(const uint8_t* ctrl) {
+    return groupMatch(ctrl, CTRL_EMPTY);
+}
+
+static inline GroupMask groupMatchEmptyOrDeleted(const uint8_t* ctrl) {
+    // Only the empty and deleted bytes have their top bit set.
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) ctrl));
+}
+
+static inline size_t groupMaskFirst(GroupMask mask) {
+    return __builtin_ctz(mask);
+}
+
+#else
+
+#define GROUP_LSBS 0x0101010101010101ULL
+#define GROUP_MSBS 0x8080808080808080ULL
+
+static inline uint64_t groupLoad(const uint8_t* ctrl) {
+    uint64_t group;
+    memcpy(&group, ctrl, sizeof(group));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    group = __builtin_bswap64(group);
+#endif
+    return group;
+}
+
+static inline GroupMask groupMatch(const uint8_t* ctrl, uint8_t h2) {
+    // Can match a byte next to a real match; the hash compare catches it.
+    uint64_t x = groupLoad(ctrl) ^ (GROUP_LSBS * h2);
+    return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+}
+
+static inline GroupMask groupMatchEmpty(const uint8_t* ctrl) {
+    uint64_t group = groupLoad(ctrl);
+    return group & ~(group << 6) & GROUP_MSBS;
+}
+
+static inline GroupMask groupMatchEmptyOrDeleted(const uint8_t* ctrl) {
+    uint64_t group = groupLoad(ctrl);
+    return group & ~(group << 7) & GROUP_MSBS;
+}
+
+static inline size_t groupMaskFirst(GroupMask mask) {
+    return __builtin_ctzll(mask) >> 3;
+}
+
+#endif
+
+static inline GroupMask groupMaskNext(GroupMask mask) {
+    return mask & (mask - 1);
+}
+
+static inline uint8_t hashH2(int hash) {
+    return ((unsigned int) hash) & 0x7f;
+}
+
+static inline size_t hashGroup(Hashmap* map, int hash) {
+    return (((unsigned int) hash) >> 7) & (map->slotCount / GROUP_WIDTH - 1);
+}
+
+static inline Hashmap* segmentFor(Hashmap* map, int hash) {
+    return &map->segments[((unsigned int) hash) >> (32 - SEGMENT_BITS)];
+}
+
+static inline size_t nextGroup(Hashmap* map, size_t group, size_t step) {
+    return (group + step) & (map->slotCount / GROUP_WIDTH - 1);
+}
+
+/**
+ * Number of slots needed to hold capacity entries at a 7/8 load factor.
+ */
+static size_t slotCountFor(size_t capacity) {
+    size_t slotCount = GROUP_WIDTH;
+    while (slotCount * 7 / 8 < capacity) {
+        slotCount <<= 1;
+    }
+    return slotCount;
+}
+
+static size_t slotsOffset(size_t offset) {
+    return (offset + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+static size_t tableSize(size_t slotCount) {
+    return slotsOffset(sizeof(Table) + slotCount) + slotCount * sizeof(Slot);
+}
+
+static inline uint8_t* tableCtrl(Table* table) {
+    return (uint8_t*) (table + 1);
+}
+
+static inline Slot* tableSlots(Table* table) {
+    return (Slot*) ((char*) table
+            + slotsOffset(sizeof(Table) + table->slotCount));
+}
+
+static void initTable(Hashmap* map, Table* table, size_t slotCount) {
+    table->slotCount = slotCount;
+    table->next = NULL;
+    map->ctrl = tableCtrl(table);
+    map->slots = tableSlots(table);
+    map->slotCount = slotCount;
+    map->growthLeft = slotCount * 7 / 8;
+    memset(map->ctrl, CTRL_EMPTY, slotCount);
+    __atomic_store_n(&map->table, table, __ATOMIC_RELEASE);
+}
+
+static void initMap(Hashmap* map, int (*hash)(void* key),
+        bool (*equals)(void* keyA, void* keyB)) {
+    map->size = 0;
+    map->hash = hash;
+    map->equals = equals;
+    map->fixed = false;
+    map->fixedCapacity = 0;
+    map->segments = NULL;
+    map->segment = false;
+    map->sequence = 0;
+    map->retired = NULL;
+    mutex_init(&map->lock);
+}
+
 Hashmap* hashmapCreate(size_t initialCapacity,
         int (*hash)(void* key), bool (*equals)(void* keyA, void* keyB)) {
     assert(hash != NULL);
     assert(equals != NULL);
-    
+
     Hashmap* map = malloc(sizeof(Hashmap));
     if (map == NULL) {
         return NULL;
     }
-    
-    // 0.75 load factor.
-    size_t minimumBucketCount = initialCapacity * 4 / 3;
-    map->bucketCount = 1;
-    while (map->bucketCount <= minimumBucketCount) {
-        // Bucket count must be power of 2.
-        map->bucketCount <<= 1; 
+
+    size_t slotCount = slotCountFor(initialCapacity);
+    Table* table = malloc(tableSize(slotCount));
+    if (table == NULL) {
+        free(map);
+        return NULL;
+    }
+
+    initMap(map, hash, equals);
+    initTable(map, table, slotCount);
+
+    return map;
+}
+
+static void freeTables(Hashmap* map) {
+    free(map->table);
+    Table* table = map->retired;
+    while (table != NULL) {
+        Table* next = table->next;
+        free(table);
+        table = next;
     }
+}
 
-    map->buckets = calloc(map->bucketCount, sizeof(Entry*));
-    if (map->buckets == NULL) {
+Hashmap* hashmapCreateConcurrent(size_t initialCapacity,
+        int (*hash)(void* key), bool (*equals)(void* keyA, void* keyB)) {
+    assert(hash != NULL);
+    assert(equals != NULL);
+
+    Hashmap* map = calloc(1, sizeof(Hashmap));
+    Hashmap* segments = calloc(SEGMENT_COUNT, sizeof(Hashmap));
+    if (map == NULL || segments == NULL) {
         free(map);
+        free(segments);
         return NULL;
     }
-    
-    map->size = 0;
 
-    map->hash = hash;
-    map->equals = equals;
-    
-    mutex_init(&map->lock);
-    
+    initMap(map, hash, equals);
+    map->segments = segments;
+
+    size_t i;
+    for (i = 0; i < SEGMENT_COUNT; i++) {
+        initMap(&segments[i], hash, equals);
+        segments[i].segment = true;
+    }
+
+    size_t slotCount = slotCountFor(
+            (initialCapacity + SEGMENT_COUNT - 1) / SEGMENT_COUNT);
+    for (i = 0; i < SEGMENT_COUNT; i++) {
+        Table* table = malloc(tableSize(slotCount));
+        if (table == NULL) {
+            hashmapFree(map);
+            return NULL;
+        }
+        initTable(&segments[i], table, slotCount);
+    }
+
+    return map;
+}
+
+size_t hashmapBufferSize(size_t capacity) {
+    return slotsOffset(sizeof(Hashmap)) + tableSize(slotCountFor(capacity));
+}
+
+Hashmap* hashmapCreateInBuffer(void* buffer, size_t capacity,
+        int (*hash)(void* key), bool (*equals)(void* keyA, void* keyB)) {
+    assert(hash != NULL);
+    assert(equals != NULL);
+    assert(((uintptr_t) buffer & (sizeof(void*) - 1)) == 0);
+
+    Hashmap* map = buffer;
+    initMap(map, hash, equals);
+    initTable(map, (Table*) ((char*) buffer + slotsOffset(sizeof(Hashmap))),
+            slotCountFor(capacity));
+    map->fixed = true;
+    map->fixedCapacity = capacity;
+
     return map;
 }
 
@@ -78,55 +330,125 @@ Hashmap* hashmapCreate(size_t initialCapacity,
  * Hashes the given key.
  */
 static inline int hashKey(Hashmap* map, void* key) {
-    int h = map->hash(key);
+    unsigned int h = map->hash(key);
 
     // We apply this secondary hashing discovered by Doug Lea to defend
     // against bad hashes.
     h += ~(h << 9);
-    h ^= (((unsigned int) h) >> 14);
-    h += (h << 4);
-    h ^= (((unsigned int) h) >> 10);
-       
-    return h;
+    h ^= h >> 14;
+    h += h << 4;
+    h ^= h >> 10;
+
+    return (int) h;
 }
 
 size_t hashmapSize(Hashmap* map) {
+    if (map->segments != NULL) {
+        size_t size = 0;
+        size_t i;
+        for (i = 0; i < SEGMENT_COUNT; i++) {
+            size += __atomic_load_n(&map->segments[i].size, __ATOMIC_RELAXED);
+        }
+        return size;
+    }
     return map->size;
 }
 
-static inline size_t calculateIndex(size_t bucketCount, int hash) {
-    return ((size_t) hash) & (bucketCount - 1);
+/**
+ * Finds a slot that a new entry with the given hash can go in: the first
+ * empty or deleted slot along its probe sequence.
+ */
+static size_t findInsertSlot(Hashmap* map, int hash) {
+    size_t group = hashGroup(map, hash);
+    size_t step = 0;
+
+    while (true) {
+        GroupMask mask =
+                groupMatchEmptyOrDeleted(map->ctrl + group * GROUP_WIDTH);
+        if (mask) {
+            return group * GROUP_WIDTH + groupMaskFirst(mask);
+        }
+        group = nextGroup(map, group, ++step);
+    }
+}
+
+static void setSlot(Hashmap* map, size_t index, void* key, int hash,
+        void* value) {
+    if (map->ctrl[index] == CTRL_EMPTY) {
+        map->growthLeft--;
+    }
+    map->ctrl[index] = hashH2(hash);
+    map->slots[index].key = key;
+    map->slots[index].hash = hash;
+    map->slots[index].value = value;
+    map->size++;
 }
 
-static void expandIfNecessary(Hashmap* map) {
-    // If the load factor exceeds 0.75...
-    if (map->size > (map->bucketCount * 3 / 4)) {
-        // Start off with a 0.33 load factor.
-        size_t newBucketCount = map->bucketCount << 1;
-        Entry** newBuckets = calloc(newBucketCount, sizeof(Entry*));
-        if (newBuckets == NULL) {
-            // Abort expansion.
-            return;
+/**
+ * Moves every entry into a new table with the given number of slots.  This
+ * also clears out deleted slots.  Returns false if memory allocation fails.
+ */
+static bool resize(Hashmap* map, size_t slotCount) {
+    Table* oldTable = map->table;
+    uint8_t* oldCtrl = map->ctrl;
+    Slot* oldSlots = map->slots;
+    size_t oldSlotCount = map->slotCount;
+
+    // A segment rehashing at the same size can reuse the table it last
+    // replaced, since readers only need the memory to stay valid.
+    Table* table;
+    if (map->retired != NULL && map->retired->slotCount == slotCount) {
+        table = map->retired;
+        map->retired = table->next;
+    } else {
+        table = malloc(tableSize(slotCount));
+        if (table == NULL) {
+            return false;
         }
-        
-        // Move over existing entries.
-        size_t i;
-        for (i = 0; i < map->bucketCount; i++) {
-            Entry* entry = map->buckets[i];
-            while (entry != NULL) {
-                Entry* next = entry->next;
-                size_t index = calculateIndex(newBucketCount, entry->hash);
-                entry->next = newBuckets[index];
-                newBuckets[index] = entry;
-                entry = next;
-            }
+    }
+
+    initTable(map, table, slotCount);
+    map->size = 0;
+
+    size_t i;
+    for (i = 0; i < oldSlotCount; i++) {
+        if (!(oldCtrl[i] & CTRL_EMPTY)) {
+            Slot* slot = &oldSlots[i];
+            setSlot(map, findInsertSlot(map, slot->hash), slot->key,
+                    slot->hash, slot->value);
         }
+    }
+
+    if (map->segment) {
+        oldTable->next = map->retired;
+        map->retired = oldTable;
+    } else {
+        free(oldTable);
+    }
+    return true;
+}
+
+/**
+ * Makes sure there's room for one more entry.  Returns false if there
+ * isn't and the map can't grow.
+ */
+static bool reserveSlot(Hashmap* map) {
+    if (map->fixed) {
+        // Deleted slots are reused, so there's always a free slot until
+        // the map is full.
+        return map->size < map->fixedCapacity;
+    }
 
-        // Copy over internals.
-        free(map->buckets);
-        map->buckets = newBuckets;
-        map->bucketCount = newBucketCount;
+    if (map->growthLeft > 0) {
+        return true;
     }
+
+    // If most of the used slots are deleted, rehash at the same size
+    // rather than doubling.
+    if (map->size < map->slotCount * 7 / 16) {
+        return resize(map, map->slotCount);
+    }
+    return resize(map, map->slotCount << 1);
 }
 
 void hashmapLock(Hashmap* map) {
@@ -138,18 +460,19 @@ void hashmapUnlock(Hashmap* map) {
 }
 
 void hashmapFree(Hashmap* map) {
-    size_t i;
-    for (i = 0; i < map->bucketCount; i++) {
-        Entry* entry = map->buckets[i];
-        while (entry != NULL) {
-            Entry* next = entry->next;
-            free(entry);
-            entry = next;
+    mutex_destroy(&map->lock);
+    if (map->segments != NULL) {
+        size_t i;
+        for (i = 0; i < SEGMENT_COUNT; i++) {
+            mutex_destroy(&map->segments[i].lock);
+            freeTables(&map->segments[i]);
         }
+        free(map->segments);
+        free(map);
+    } else if (!map->fixed) {
+        free(map->table);
+        free(map);
     }
-    free(map->buckets);
-    mutex_destroy(&map->lock);
-    free(map);
 }
 
 int hashmapHash(void* key, size_t keySize) {
@@ -163,18 +486,6 @@ int hashmapHash(void* key, size_t keySize) {
     return h;
 }
 
-static Entry* createEntry(void* key, int hash, void* value) {
-    Entry* entry = malloc(sizeof(Entry));
-    if (entry == NULL) {
-        return NULL;
-    }
-    entry->key = key;
-    entry->hash = hash;
-    entry->value = value;
-    entry->next = NULL;
-    return entry;
-}
-
 static inline bool equalKeys(void* keyA, int hashA, void* keyB, int hashB,
         bool (*equals)(void*, void*)) {
     if (keyA == keyB) {
@@ -186,154 +497,328 @@ static inline bool equalKeys(void* keyA, int hashA, void* keyB, int hashB,
     return equals(keyA, keyB);
 }
 
-void* hashmapPut(Hashmap* map, void* key, void* value) {
-    int hash = hashKey(map, key);
-    size_t index = calculateIndex(map->bucketCount, hash);
+/**
+ * Returns the index of the slot holding key, or -1 if it isn't there.
+ */
+static ssize_t findSlot(Hashmap* map, void* key, int hash) {
+    uint8_t h2 = hashH2(hash);
+    size_t group = hashGroup(map, hash);
+    size_t groupCount = map->slotCount / GROUP_WIDTH;
+    size_t step;
+
+    for (step = 0; step < groupCount; step++) {
+        const uint8_t* ctrl = map->ctrl + group * GROUP_WIDTH;
+        GroupMask mask;
+        for (mask = groupMatch(ctrl, h2); mask; mask = groupMaskNext(mask)) {
+            size_t index = group * GROUP_WIDTH + groupMaskFirst(mask);
+            Slot* slot = &map->slots[index];
+            if (equalKeys(slot->key, slot->hash, key, hash, map->equals)) {
+                return index;
+            }
+        }
+        if (groupMatchEmpty(ctrl)) {
+            break;
+        }
+        group = nextGroup(map, group, step + 1);
+    }
 
-    Entry** p = &(map->buckets[index]);
-    while (true) {
-        Entry* current = *p;
-
-        // Add a new entry.
-        if (current == NULL) {
-            *p = createEntry(key, hash, value);
-            if (*p == NULL) {
-                errno = ENOMEM;
-                return NULL;
+    return -1;
+}
+
+/**
+ * Locks a segment of a concurrent map for a change, and tells readers one
+ * is under way.
+ */
+static void beginWrite(Hashmap* segment) {
+    mutex_lock(&segment->lock);
+    __atomic_store_n(&segment->sequence, segment->sequence + 1,
+            __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void endWrite(Hashmap* segment) {
+    __atomic_store_n(&segment->sequence, segment->sequence + 1,
+            __ATOMIC_RELEASE);
+    mutex_unlock(&segment->lock);
+}
+
+/**
+ * Returns true if no writer has changed the segment since a reader saw the
+ * given sequence number, so everything the reader has loaded is consistent.
+ */
+static inline bool readValid(Hashmap* segment, unsigned int sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+/**
+ * Looks key up in a segment without locking it.  Returns 1 and sets *value
+ * if the key is there, 0 if it isn't, or -1 if a writer got in the way.
+ */
+static int readSegment(Hashmap* segment, void* key, int hash,
+        unsigned int sequence, void** value) {
+    // A table's slot count never changes, and the table stays allocated
+    // while the map exists, so probing it is safe even if it's stale.
+    Table* table = __atomic_load_n(&segment->table, __ATOMIC_ACQUIRE);
+    const uint8_t* ctrl = tableCtrl(table);
+    Slot* slots = tableSlots(table);
+    size_t groupMask = table->slotCount / GROUP_WIDTH - 1;
+    uint8_t h2 = hashH2(hash);
+    size_t group = (((unsigned int) hash) >> 7) & groupMask;
+    size_t step;
+
+    for (step = 0; step <= groupMask; step++) {
+        const uint8_t* groupCtrl = ctrl + group * GROUP_WIDTH;
+        GroupMask mask;
+        for (mask = groupMatch(groupCtrl, h2); mask; mask = groupMaskNext(mask)) {
+            Slot* slot = &slots[group * GROUP_WIDTH + groupMaskFirst(mask)];
+            void* slotKey = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+            if (slotKey != key) {
+                if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash) {
+                    continue;
+                }
+                // Only hand equals a key that really was in the map.
+                if (!readValid(segment, sequence)) {
+                    return -1;
+                }
+                if (!segment->equals(slotKey, key)) {
+                    continue;
+                }
             }
-            map->size++;
-            expandIfNecessary(map);
-            return NULL;
+            *value = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+            return readValid(segment, sequence) ? 1 : -1;
+        }
+        if (groupMatchEmpty(groupCtrl)) {
+            break;
         }
+        group = (group + step + 1) & groupMask;
+    }
+
+    return readValid(segment, sequence) ? 0 : -1;
+}
 
-        // Replace existing entry.
-        if (equalKeys(current->key, current->hash, key, hash, map->equals)) {
-            void* oldValue = current->value;
-            current->value = value;
-            return oldValue;
+/**
+ * Looks key up in a concurrent map.  Returns true and sets *value if it's
+ * there.
+ */
+static bool getConcurrent(Hashmap* map, void* key, int hash, void** value) {
+    Hashmap* segment = segmentFor(map, hash);
+    int attempt;
+
+    for (attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+        unsigned int sequence =
+                __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            continue;
+        }
+        int found = readSegment(segment, key, hash, sequence, value);
+        if (found >= 0) {
+            return found;
         }
+    }
 
-        // Move to next entry.
-        p = &current->next;
+    // Writers kept getting in the way; wait for them instead.
+    mutex_lock(&segment->lock);
+    ssize_t index = findSlot(segment, key, hash);
+    if (index >= 0) {
+        *value = segment->slots[index].value;
     }
+    mutex_unlock(&segment->lock);
+    return index >= 0;
 }
 
-void* hashmapGet(Hashmap* map, void* key) {
-    int hash = hashKey(map, key);
-    size_t index = calculateIndex(map->bucketCount, hash);
-
-    Entry* entry = map->buckets[index];
-    while (entry != NULL) {
-        if (equalKeys(entry->key, entry->hash, key, hash, map->equals)) {
-            return entry->value;
-        }
-        entry = entry->next;
+static void* putHashed(Hashmap* map, void* key, int hash, void* value) {
+    // Replace existing entry.
+    ssize_t index = findSlot(map, key, hash);
+    if (index >= 0) {
+        void* oldValue = map->slots[index].value;
+        map->slots[index].value = value;
+        return oldValue;
     }
 
+    // Add a new entry.
+    if (!reserveSlot(map)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    setSlot(map, findInsertSlot(map, hash), key, hash, value);
     return NULL;
 }
 
-bool hashmapContainsKey(Hashmap* map, void* key) {
+void* hashmapPut(Hashmap* map, void* key, void* value) {
     int hash = hashKey(map, key);
-    size_t index = calculateIndex(map->bucketCount, hash);
+    if (map->segments != NULL) {
+        Hashmap* segment = segmentFor(map, hash);
+        beginWrite(segment);
+        void* oldValue = putHashed(segment, key, hash, value);
+        endWrite(segment);
+        return oldValue;
+    }
+    return putHashed(map, key, hash, value);
+}
 
-    Entry* entry = map->buckets[index];
-    while (entry != NULL) {
-        if (equalKeys(entry->key, entry->hash, key, hash, map->equals)) {
-            return true;
-        }
-        entry = entry->next;
+void* hashmapGet(Hashmap* map, void* key) {
+    if (map->segments != NULL) {
+        void* value;
+        return getConcurrent(map, key, hashKey(map, key), &value)
+                ? value : NULL;
     }
+    ssize_t index = findSlot(map, key, hashKey(map, key));
+    return index >= 0 ? map->slots[index].value : NULL;
+}
 
-    return false;
+bool hashmapContainsKey(Hashmap* map, void* key) {
+    if (map->segments != NULL) {
+        void* value;
+        return getConcurrent(map, key, hashKey(map, key), &value);
+    }
+    return findSlot(map, key, hashKey(map, key)) >= 0;
 }
 
-void* hashmapMemoize(Hashmap* map, void* key, 
+static void* memoizeHashed(Hashmap* map, void* key, int hash,
         void* (*initialValue)(void* key, void* context), void* context) {
-    int hash = hashKey(map, key);
-    size_t index = calculateIndex(map->bucketCount, hash);
+    // Return existing value.
+    ssize_t index = findSlot(map, key, hash);
+    if (index >= 0) {
+        return map->slots[index].value;
+    }
 
-    Entry** p = &(map->buckets[index]);
-    while (true) {
-        Entry* current = *p;
-
-        // Add a new entry.
-        if (current == NULL) {
-            *p = createEntry(key, hash, NULL);
-            if (*p == NULL) {
-                errno = ENOMEM;
-                return NULL;
-            }
-            void* value = initialValue(key, context);
-            (*p)->value = value;
-            map->size++;
-            expandIfNecessary(map);
+    // Add a new entry.
+    if (!reserveSlot(map)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* value = initialValue(key, context);
+    setSlot(map, findInsertSlot(map, hash), key, hash, value);
+    return value;
+}
+
+void* hashmapMemoize(Hashmap* map, void* key,
+        void* (*initialValue)(void* key, void* context), void* context) {
+    int hash = hashKey(map, key);
+    if (map->segments != NULL) {
+        // Look without the lock first, as most calls find the value.
+        void* value;
+        if (getConcurrent(map, key, hash, &value)) {
             return value;
         }
+        Hashmap* segment = segmentFor(map, hash);
+        beginWrite(segment);
+        value = memoizeHashed(segment, key, hash, initialValue, context);
+        endWrite(segment);
+        return value;
+    }
+    return memoizeHashed(map, key, hash, initialValue, context);
+}
 
-        // Return existing value.
-        if (equalKeys(current->key, current->hash, key, hash, map->equals)) {
-            return current->value;
-        }
+static void* removeHashed(Hashmap* map, void* key, int hash) {
+    ssize_t index = findSlot(map, key, hash);
+    if (index < 0) {
+        return NULL;
+    }
 
-        // Move to next entry.
-        p = &current->next;
+    // Lookups stop at a group with an empty slot, so if this group already
+    // has one, no probe for another key can have gone past it and the slot
+    // can be marked empty.  Otherwise leave a tombstone.
+    size_t group = index / GROUP_WIDTH;
+    if (groupMatchEmpty(map->ctrl + group * GROUP_WIDTH)) {
+        map->ctrl[index] = CTRL_EMPTY;
+        map->growthLeft++;
+    } else {
+        map->ctrl[index] = CTRL_DELETED;
     }
+    map->size--;
+
+    return map->slots[index].value;
 }
 
 void* hashmapRemove(Hashmap* map, void* key) {
     int hash = hashKey(map, key);
-    size_t index = calculateIndex(map->bucketCount, hash);
-
-    // Pointer to the current entry.
-    Entry** p = &(map->buckets[index]);
-    Entry* current;
-    while ((current = *p) != NULL) {
-        if (equalKeys(current->key, current->hash, key, hash, map->equals)) {
-            void* value = current->value;
-            *p = current->next;
-            free(current);
-            map->size--;
-            return value;
-        }
-
-        p = &current->next;
+    if (map->segments != NULL) {
+        Hashmap* segment = segmentFor(map, hash);
+        beginWrite(segment);
+        void* value = removeHashed(segment, key, hash);
+        endWrite(segment);
+        return value;
     }
-
-    return NULL;
+    return removeHashed(map, key, hash);
 }
 
-void hashmapForEach(Hashmap* map, 
+void hashmapForEach(Hashmap* map,
         bool (*callback)(void* key, void* value, void* context),
         void* context) {
+    if (map->segments != NULL) {
+        // Each segment stays locked while its entries are visited.
+        size_t i;
+        for (i = 0; i < SEGMENT_COUNT; i++) {
+            Hashmap* segment = &map->segments[i];
+            mutex_lock(&segment->lock);
+            bool more = true;
+            size_t j;
+            for (j = 0; j < segment->slotCount && more; j++) {
+                if (!(segment->ctrl[j] & CTRL_EMPTY)) {
+                    more = callback(segment->slots[j].key,
+                            segment->slots[j].value, context);
+                }
+            }
+            mutex_unlock(&segment->lock);
+            if (!more) {
+                return;
+            }
+        }
+        return;
+    }
+
+    // Removing entries doesn't move any others, so the callback can
+    // remove the entry it's given.
     size_t i;
-    for (i = 0; i < map->bucketCount; i++) {
-        Entry* entry = map->buckets[i];
-        while (entry != NULL) {
-            Entry *next = entry->next;
-            if (!callback(entry->key, entry->value, context)) {
+    for (i = 0; i < map->slotCount; i++) {
+        if (!(map->ctrl[i] & CTRL_EMPTY)) {
+            if (!callback(map->slots[i].key, map->slots[i].value, context)) {
                 return;
             }
-            entry = next;
         }
     }
 }
 
 size_t hashmapCurrentCapacity(Hashmap* map) {
-    size_t bucketCount = map->bucketCount;
-    return bucketCount * 3 / 4;
+    if (map->segments != NULL) {
+        size_t capacity = 0;
+        size_t i;
+        for (i = 0; i < SEGMENT_COUNT; i++) {
+            Hashmap* segment = &map->segments[i];
+            mutex_lock(&segment->lock);
+            capacity += hashmapCurrentCapacity(segment);
+            mutex_unlock(&segment->lock);
+        }
+        return capacity;
+    }
+    if (map->fixed) {
+        return map->fixedCapacity;
+    }
+    return map->slotCount * 7 / 8;
 }
 
 size_t hashmapCountCollisions(Hashmap* map) {
+    if (map->segments != NULL) {
+        size_t collisions = 0;
+        size_t i;
+        for (i = 0; i < SEGMENT_COUNT; i++) {
+            Hashmap* segment = &map->segments[i];
+            mutex_lock(&segment->lock);
+            collisions += hashmapCountCollisions(segment);
+            mutex_unlock(&segment->lock);
+        }
+        return collisions;
+    }
+
+    // Entries that didn't fit in the first group they probed.
     size_t collisions = 0;
     size_t i;
-    for (i = 0; i < map->bucketCount; i++) {
-        Entry* entry = map->buckets[i];
-        while (entry != NULL) {
-            if (entry->next != NULL) {
-                collisions++;
-            }
-            entry = entry->next;
+    for (i = 0; i < map->slotCount; i++) {
+        if (!(map->ctrl[i] & CTRL_EMPTY)
+                && i / GROUP_WIDTH != hashGroup(map, map->slots[i].hash)) {
+            collisions++;
         }
     }
     return collisions;
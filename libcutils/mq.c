@@ -39,6 +39,12 @@
 /** Number of dead peers to remember. */
 #define PEER_HISTORY (16)
 
+/** Most packets to send with one writev(). */
+#define MAX_BATCH (32)
+
+/** Bytes to try to read at once from a peer. */
+#define INPUT_BUFFER_SIZE (4096)
+
 typedef struct sockaddr SocketAddress;
 typedef struct sockaddr_un UnixAddress;
 
@@ -107,12 +113,15 @@ struct OutgoingPacket {
         /** Connection to peer. Used with CONNECTION. */
         int socket;
         
-        /** Buffer of bytes. Used with BYTES. */
-        Buffer* bytes;
+        /** Bytes to send, header.size of them. Used with BYTES. */
+        char* bytes;
     };
 
     /** Frees all resources associated with this packet. */
     void (*free)(OutgoingPacket* packet);
+
+    /** Frees shared bytes. Used by peerSendSharedBytes(). */
+    void (*freeBytes)(void* context);
    
     /** Optional context. */
     void* context;
@@ -164,9 +173,15 @@ struct PeerProxy {
     /** Credentials of the remote process. */
     Credentials credentials;
 
-    /** Keeps track of data coming in from the remote peer. */
+    /** 
+     * Keeps track of data coming in from the remote peer. The buffer holds
+     * 'size' bytes read from the socket, of which those from inputOffset
+     * on haven't been handled yet, and 'expected' is the size of the
+     * header or body we're waiting for.
+     */
     InputState inputState;
     Buffer* inputBuffer;
+    size_t inputOffset;
     PeerProxy* connecting;
 
     /** File descriptor for this peer. */
@@ -181,8 +196,8 @@ struct PeerProxy {
     OutgoingPacket* currentPacket;
     OutgoingPacket* lastPacket;
     
-    /** Used to write outgoing header. */
-    Buffer outgoingHeader;
+    /** Bytes of the current packet already written, header first. */
+    size_t written;
     
     /** True if this is the master's proxy. */
     bool master;
@@ -272,15 +287,17 @@ static void outgoingPacketFree(OutgoingPacket* packet) {
  */
 static void peerProxyExpectHeader(PeerProxy* peerProxy) {
     peerProxy->inputState = READING_HEADER;
-    bufferPrepareForRead(peerProxy->inputBuffer, sizeof(Header));
+    peerProxy->inputBuffer->expected = sizeof(Header);
 }
 
-/** Sets up the buffer for the outgoing header. */
-static void peerProxyPrepareOutgoingHeader(PeerProxy* peerProxy) {
-    peerProxy->outgoingHeader.data 
-        = (char*) &(peerProxy->currentPacket->header);
-    peerProxy->outgoingHeader.size = sizeof(Header);
-    bufferPrepareForWrite(&peerProxy->outgoingHeader);
+/** Returns the number of bytes a packet takes up on the wire. */
+static size_t outgoingPacketSize(OutgoingPacket* packet) {
+    if (packet->header.type == BYTES) {
+        return sizeof(Header) + packet->header.size;
+    }
+    // Connections are followed by a byte sent with the socket, but that's
+    // written separately by peerProxyWriteConnection().
+    return sizeof(Header);
 }
 
 /** Adds a packet to the end of the queue. Callers must have the mutex. */
@@ -291,10 +308,16 @@ static void peerProxyEnqueueOutgoingPacket(PeerProxy* peerProxy,
         // The queue is empty.
         peerProxy->currentPacket = newPacket;
         peerProxy->lastPacket = newPacket;
-        
-        peerProxyPrepareOutgoingHeader(peerProxy); 
+        peerProxy->written = 0;
     } else {
         peerProxy->lastPacket->nextPacket = newPacket;
+        peerProxy->lastPacket = newPacket;
+    }
+
+    // Have the selector call peerProxyBeforeSelect() to set up
+    // onWritable. A proxy without an fd gets one once it's connected.
+    if (peerProxy->fd != NULL) {
+        selectorWakeUpFd(peerProxy->fd);
     }
 }
 
@@ -325,6 +348,7 @@ static bool peerProxyNextPacket(PeerProxy* peerProxy) {
     
     OutgoingPacket* next = current->nextPacket;
     peerProxy->currentPacket = next;
+    peerProxy->written = 0;
     current->nextPacket = NULL;
     current->free(current);
     if (next == NULL) {
@@ -334,14 +358,42 @@ static bool peerProxyNextPacket(PeerProxy* peerProxy) {
         return false;
     } else {
         peerUnlock(peer);
-        peerProxyPrepareOutgoingHeader(peerProxy); 
-
-        // TODO: Start writing next packet? It would reduce the number of
-        // system calls, but we could also starve other peers.
         return true;
     }
 }
 
+/**
+ * Accounts for bytes written from the queue, freeing the packets they
+ * finished.
+ */
+static void peerProxyWrote(PeerProxy* peerProxy, size_t size) {
+    Peer* peer = peerProxy->peer;
+    peerLock(peer);
+
+    size_t written = peerProxy->written + size;
+    OutgoingPacket* current = peerProxy->currentPacket;
+    while (current != NULL) {
+        size_t packetSize = outgoingPacketSize(current);
+        if (written < packetSize || current->header.type == CONNECTION) {
+            // Still being written, or the socket has yet to go.
+            break;
+        }
+        written -= packetSize;
+
+        OutgoingPacket* next = current->nextPacket;
+        current->nextPacket = NULL;
+        current->free(current);
+        current = next;
+    }
+
+    peerProxy->currentPacket = current;
+    if (current == NULL) {
+        peerProxy->lastPacket = NULL;
+    }
+    peerProxy->written = written;
+    peerUnlock(peer);
+}
+
 /**
  * Checks whether a peer died recently.
  */
@@ -408,6 +460,7 @@ static void peerProxyKill(PeerProxy* peerProxy, bool errnoIsSet) {
     // Remove the fd from the selector.
     if (peerProxy->fd != NULL) {
         peerProxy->fd->remove = true;
+        selectorWakeUpFd(peerProxy->fd);
     }
 
     // Clear outgoing packet queue.
@@ -443,29 +496,6 @@ static void peerProxyHandleError(PeerProxy* peerProxy, char* functionName) {
     }
 }
 
-/**
- * Buffers output sent to a peer. May be called multiple times until the entire
- * buffer is filled. Returns true when the buffer is empty.
- */
-static bool peerProxyWriteFromBuffer(PeerProxy* peerProxy, Buffer* outgoing) {
-    ssize_t size = bufferWrite(outgoing, peerProxy->fd->fd);
-    if (size < 0) {
-        peerProxyHandleError(peerProxy, "write");
-        return false;
-    } else {
-        return bufferWriteComplete(outgoing);
-    }
-}
-
-/** Writes packet bytes to peer. */
-static void peerProxyWriteBytes(PeerProxy* peerProxy) {	
-	Buffer* buffer = peerProxy->currentPacket->bytes;
-	if (peerProxyWriteFromBuffer(peerProxy, buffer)) {
-        ALOGD("Bytes written.");
-        peerProxyNextPacket(peerProxy);
-    }    
-}
-
 /** Sends a socket to the peer. */
 static void peerProxyWriteConnection(PeerProxy* peerProxy) {
     int socket = peerProxy->currentPacket->socket;
@@ -510,48 +540,77 @@ static void peerProxyWriteConnection(PeerProxy* peerProxy) {
 }
 
 /**
- * Writes some outgoing data.
+ * Adds what's left of a packet to iov, skipping the first 'written' bytes.
+ * Returns the number of iovecs used.
  */
-static void peerProxyWrite(SelectableFd* fd) {
-    // TODO: Try to write header and body with one system call.
+static int outgoingPacketIovecs(OutgoingPacket* packet, size_t written,
+        struct iovec* iov) {
+    int count = 0;
+    if (written < sizeof(Header)) {
+        iov[count].iov_base = (char*) &packet->header + written;
+        iov[count].iov_len = sizeof(Header) - written;
+        count++;
+        written = 0;
+    } else {
+        written -= sizeof(Header);
+    }
+    if (packet->header.type == BYTES && packet->header.size > written) {
+        iov[count].iov_base = packet->bytes + written;
+        iov[count].iov_len = packet->header.size - written;
+        count++;
+    }
+    return count;
+}
 
+/**
+ * Writes some outgoing data. Queued packets go out together in one
+ * writev(), up to a connection, whose socket has to be sent on its own.
+ */
+static void peerProxyWrite(SelectableFd* fd) {
     PeerProxy* peerProxy = (PeerProxy*) fd->data;
-    OutgoingPacket* current = peerProxy->currentPacket;
-    
-    if (current == NULL) {
+    Peer* peer = peerProxy->peer;
+    struct iovec iov[MAX_BATCH * 2];
+    int iovCount = 0;
+
+    // Other threads add to the end of the queue, so walk it with the lock.
+    peerLock(peer);
+    OutgoingPacket* packet = peerProxy->currentPacket;
+    if (packet == NULL) {
         // We have nothing left to write.
+        peerUnlock(peer);
         return;
     }
-
-    // Write the header.
-    Buffer* outgoingHeader = &peerProxy->outgoingHeader;
-    bool headerWritten = bufferWriteComplete(outgoingHeader);
-    if (!headerWritten) {
-        ALOGD("Writing header...");
-        headerWritten = peerProxyWriteFromBuffer(peerProxy, outgoingHeader);
-        if (headerWritten) {
-            ALOGD("Header written.");
-        }
-    }    
-
-    // Write body.
-    if (headerWritten) {
-        PacketType type = current->header.type;
-        switch (type) {
-            case CONNECTION:
-                peerProxyWriteConnection(peerProxy);
-                break;
-            case BYTES:
-                peerProxyWriteBytes(peerProxy);
-                break;
-            case CONNECTION_REQUEST:
-            case CONNECTION_ERROR:
-                // These packets consist solely of a header.
-                peerProxyNextPacket(peerProxy);
-                break;
-            default:
-                LOG_ALWAYS_FATAL("Unknown packet type: %d", type); 
+    if (packet->header.type == CONNECTION
+            && peerProxy->written == sizeof(Header)) {
+        peerUnlock(peer);
+        peerProxyWriteConnection(peerProxy);
+        return;
+    }
+    size_t written = peerProxy->written;
+    int count;
+    for (count = 0; packet != NULL && count < MAX_BATCH; count++) {
+        iovCount += outgoingPacketIovecs(packet, written, iov + iovCount);
+        written = 0;
+        if (packet->header.type == CONNECTION) {
+            break;
         }
+        packet = packet->nextPacket;
+    }
+    peerUnlock(peer);
+
+    ALOGD("Writing %d iovecs...", iovCount);
+    ssize_t size = writev(fd->fd, iov, iovCount);
+    if (size < 0) {
+        peerProxyHandleError(peerProxy, "writev");
+        return;
+    }
+    peerProxyWrote(peerProxy, size);
+
+    // Send a connection's socket as soon as its header is out.
+    packet = peerProxy->currentPacket;
+    if (packet != NULL && packet->header.type == CONNECTION
+            && peerProxy->written == sizeof(Header)) {
+        peerProxyWriteConnection(peerProxy);
     }
 }
 
@@ -581,14 +640,9 @@ static void peerProxyBeforeSelect(SelectableFd* fd) {
 static void peerProxyExpectBytes(PeerProxy* peerProxy, Header* header) {
     ALOGD("Expecting %d bytes.", header->size);
 
+    // peerProxyFillInput() makes room for them.
     peerProxy->inputState = READING_BYTES;
-    if (bufferPrepareForRead(peerProxy->inputBuffer, header->size) == -1) {
-        ALOGW("Couldn't allocate memory for incoming data. Size: %u",
-                (unsigned int) header->size);    
-        
-        // TODO: Ignore the packet and log a warning?
-        peerProxyKill(peerProxy, false);
-    }
+    peerProxy->inputBuffer->expected = header->size;
 }
 
 /**
@@ -936,12 +990,39 @@ static void peerProxyHandleHeader(PeerProxy* peerProxy, Header* header) {
 }
 
 /**
- * Buffers input sent by peer. May be called multiple times until the entire
- * buffer is filled. Returns true when the buffer is full.
+ * Reads more input sent by the peer, making room for the whole header or
+ * body we're waiting for first. Returns false if nothing was read.
+ *
+ * Reads as much as fits, so one read can pick up several packets, except
+ * from the master, which follows a connection header with a socket that
+ * must be received with recvmsg().
  */
-static bool peerProxyBufferInput(PeerProxy* peerProxy) {
+static bool peerProxyFillInput(PeerProxy* peerProxy) {
     Buffer* in = peerProxy->inputBuffer;
-    ssize_t size = bufferRead(in, peerProxy->fd->fd);
+    bool greedy = !peerProxy->master;
+
+    // Move what's left to the front.
+    if (peerProxy->inputOffset > 0) {
+        memmove(in->data, in->data + peerProxy->inputOffset,
+                in->size - peerProxy->inputOffset);
+        in->size -= peerProxy->inputOffset;
+        peerProxy->inputOffset = 0;
+    }
+
+    if (in->expected > in->capacity) {
+        char* expanded = realloc(in->data, in->expected);
+        if (expanded == NULL) {
+            ALOGW("Couldn't allocate memory for incoming data. Size: %u",
+                    (unsigned int) in->expected);    
+            peerProxyKill(peerProxy, false);
+            return false;
+        }
+        in->data = expanded;
+        in->capacity = in->expected;
+    }
+
+    size_t wanted = (greedy ? in->capacity : in->expected) - in->size;
+    ssize_t size = read(peerProxy->fd->fd, in->data + in->size, wanted);
     if (size < 0) {
         peerProxyHandleError(peerProxy, "read");
         return false;
@@ -950,49 +1031,61 @@ static bool peerProxyBufferInput(PeerProxy* peerProxy) {
     	ALOGI("EOF");
         peerProxyKill(peerProxy, false);
         return false;
-    } else if (bufferReadComplete(in)) {
-        // We're done!
-        return true;
-    } else {
-        // Continue reading.
-        return false;
     }
+    in->size += size;
+    return true;
 }
 
 /**
- * Reads input from a peer process.
+ * Reads input from a peer process, and handles every complete packet it
+ * has.
  */
 static void peerProxyRead(SelectableFd* fd) {
     ALOGD("Reading...");
     PeerProxy* peerProxy = (PeerProxy*) fd->data;
-    int state = peerProxy->inputState;
-    Buffer* in = peerProxy->inputBuffer;
-    switch (state) {
-        case READING_HEADER:
-            if (peerProxyBufferInput(peerProxy)) {
+    bool filled = false;
+
+    // Killing the peer proxy frees it and marks fd for removal.
+    while (!fd->remove) {
+        int state = peerProxy->inputState;
+        if (state == ACCEPTING_CONNECTION) {
+            masterProxyAcceptConnection(peerProxy);
+            return;
+        }
+
+        Buffer* in = peerProxy->inputBuffer;
+        if (in->size - peerProxy->inputOffset < in->expected) {
+            // Read once per call, so one busy peer can't starve the others.
+            if (filled || !peerProxyFillInput(peerProxy)) {
+                return;
+            }
+            filled = true;
+            continue;
+        }
+
+        char* data = in->data + peerProxy->inputOffset;
+        size_t size = in->expected;
+        peerProxy->inputOffset += size;
+        switch (state) {
+            case READING_HEADER: {
                 ALOGD("Header read.");
-                // We've read the complete header.
-                Header* header = (Header*) in->data;
-                peerProxyHandleHeader(peerProxy, header);
+                // The buffer may not be aligned for a Header.
+                Header header;
+                memcpy(&header, data, sizeof(Header));
+                peerProxyHandleHeader(peerProxy, &header);
+                break;
             }
-            break;
-        case READING_BYTES:
-            ALOGD("Reading bytes...");
-            if (peerProxyBufferInput(peerProxy)) {
+            case READING_BYTES:
                 ALOGD("Bytes read.");
                 // We have the complete packet. Notify bytes listener.
-                peerProxy->peer->onBytes(peerProxy->credentials,
-                    in->data, in->size);
+                peerProxy->peer->onBytes(peerProxy->credentials, data, size);
                         
                 // Get ready for the next packet.
                 peerProxyExpectHeader(peerProxy);
-            }
-            break;
-        case ACCEPTING_CONNECTION:
-            masterProxyAcceptConnection(peerProxy);
-            break;
-        default:
-            LOG_ALWAYS_FATAL("Unknown state: %d", state);
+                break;
+            default:
+                LOG_ALWAYS_FATAL("Unknown state: %d", state);
+        }
     }
 }
 
@@ -1002,11 +1095,12 @@ static PeerProxy* peerProxyCreate(Peer* peer, Credentials credentials) {
         return NULL;
     }
    
-    peerProxy->inputBuffer = bufferCreate(sizeof(Header));
+    peerProxy->inputBuffer = bufferCreate(INPUT_BUFFER_SIZE);
     if (peerProxy->inputBuffer == NULL) {
         free(peerProxy);
         return NULL;
     }
+    peerProxy->inputBuffer->size = 0;
 
     peerProxy->peer = peer;
     peerProxy->credentials = credentials;
@@ -1096,7 +1190,7 @@ static Peer* peerCreate() {
         LOG_ALWAYS_FATAL("malloc() error.");
     }
     peer->peerProxies = hashmapCreate(10, &pidHash, &pidEquals);
-    peer->selector = selectorCreate();
+    peer->selector = selectorCreateWithBackend(SELECTOR_EPOLL);
     
     pthread_mutexattr_t attributes;
     if (pthread_mutexattr_init(&attributes) != 0) {
@@ -1116,12 +1210,6 @@ static Peer* peerCreate() {
 /** The local peer. */
 static Peer* localPeer;
 
-/** Frees a packet of bytes. */
-static void outgoingPacketFreeBytes(OutgoingPacket* packet) {
-    ALOGD("Freeing outgoing packet.");
-    bufferFree(packet->bytes);
-    free(packet);
-}
 
 /**
  * Sends a packet of bytes to a remote peer. Returns 0 on success.
@@ -1134,28 +1222,18 @@ int peerSendBytes(pid_t pid, const char* bytes, size_t size) {
 	Peer* peer = localPeer;
     assert(peer != NULL);
 
-    OutgoingPacket* packet = calloc(1, sizeof(OutgoingPacket));
+    // The copy of the bytes goes right after the packet.
+    OutgoingPacket* packet = calloc(1, sizeof(OutgoingPacket) + size);
     if (packet == NULL) {
         errno = ENOMEM;
         return -1;
     }
 
-    Buffer* copy = bufferCreate(size); 
-    if (copy == NULL) {
-        free(packet);
-        errno = ENOMEM;
-        return -1;
-    }
-
-    // Copy data.
-    memcpy(copy->data, bytes, size);
-    copy->size = size;
-    
-    packet->bytes = copy;
+    packet->bytes = (char*) (packet + 1);
+    memcpy(packet->bytes, bytes, size);
     packet->header.type = BYTES;
     packet->header.size = size;
-    packet->free = outgoingPacketFreeBytes;
-    bufferPrepareForWrite(packet->bytes);
+    packet->free = outgoingPacketFree;
     
     peerLock(peer);
     
@@ -1169,23 +1247,13 @@ int peerSendBytes(pid_t pid, const char* bytes, size_t size) {
     } else {
         peerProxyEnqueueOutgoingPacket(peerProxy, packet);
         peerUnlock(peer);
-        selectorWakeUp(peer->selector);
         return 0; 
     }
 }
 
-/** Keeps track of how to free shared bytes. */
-typedef struct {
-    void (*free)(void* context);
-    void* context;
-} SharedBytesFreer;
-
 /** Frees shared bytes. */
 static void outgoingPacketFreeSharedBytes(OutgoingPacket* packet) {
-    SharedBytesFreer* sharedBytesFreer 
-        = (SharedBytesFreer*) packet->context;
-    sharedBytesFreer->free(sharedBytesFreer->context);
-    free(sharedBytesFreer);
+    packet->freeBytes(packet->context);
     free(packet);
 }
 
@@ -1208,29 +1276,13 @@ int peerSendSharedBytes(pid_t pid, char* bytes, size_t size,
         return -1;
     }
 
-    Buffer* wrapper = bufferWrap(bytes, size, size);
-    if (wrapper == NULL) {
-        free(packet);
-        errno = ENOMEM;
-        return -1;
-    }
-
-    SharedBytesFreer* sharedBytesFreer = malloc(sizeof(SharedBytesFreer));
-    if (sharedBytesFreer == NULL) {
-        free(packet);
-        free(wrapper);
-        errno = ENOMEM;
-        return -1;
-    }
-    sharedBytesFreer->free = free;
-    sharedBytesFreer->context = context;
-    
-    packet->bytes = wrapper;
-    packet->context = sharedBytesFreer;
+    // The bytes are written straight from the caller's buffer.
+    packet->bytes = bytes;
+    packet->freeBytes = free;
+    packet->context = context;
     packet->header.type = BYTES;
     packet->header.size = size;
     packet->free = &outgoingPacketFreeSharedBytes;
-    bufferPrepareForWrite(packet->bytes);
     
     peerLock(peer);
     
@@ -1244,7 +1296,6 @@ int peerSendSharedBytes(pid_t pid, char* bytes, size_t size,
     } else {
         peerProxyEnqueueOutgoingPacket(peerProxy, packet);
         peerUnlock(peer);
-        selectorWakeUp(peer->selector);
         return 0; 
     }
 }
@@ -24,6 +24,7 @@
 #include <assert.h>
 
 #include <cutils/properties.h>
+#include <cutils/threads.h>
 #include "loghack.h"
 
 #ifdef HAVE_LIBC_SYSTEM_PROPERTIES
@@ -31,6 +32,8 @@
 #define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
 #include <sys/_system_properties.h>
 
+extern prop_area *__system_property_area__;
+
 int property_set(const char *key, const char *value)
 {
     return __system_property_set(key, value);
@@ -328,3 +331,106 @@ int property_list(void (*propfn)(const char *key, const char *value, void *cooki
 }
 
 #endif
+
+struct property_cache {
+    mutex_t lock;
+#ifdef HAVE_LIBC_SYSTEM_PROPERTIES
+    /* NULL until the property exists; prop_infos are never freed */
+    const prop_info *pi;
+    /* pi's serial, or the property area's while pi is NULL */
+    unsigned serial;
+#endif
+    /* -1 until the value has been read */
+    int len;
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+};
+
+struct property_cache *property_cache_create(const char *key)
+{
+    struct property_cache *cache;
+
+    if(strlen(key) >= PROPERTY_KEY_MAX) return NULL;
+
+    cache = calloc(1, sizeof(*cache));
+    if(cache == NULL) return NULL;
+
+    mutex_init(&cache->lock);
+    strcpy(cache->key, key);
+    cache->len = -1;
+    return cache;
+}
+
+void property_cache_free(struct property_cache *cache)
+{
+    mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+#ifdef HAVE_LIBC_SYSTEM_PROPERTIES
+
+/* Brings the cached value up to date. Call with the lock held. */
+static void property_cache_refresh(struct property_cache *cache)
+{
+    unsigned serial;
+
+    if(cache->pi == NULL) {
+        /* nothing can have been added if the area hasn't changed */
+        serial = __system_property_area__->serial;
+        if((cache->len >= 0) && (serial == cache->serial)) return;
+
+        cache->serial = serial;
+        cache->pi = __system_property_find(cache->key);
+        if(cache->pi == NULL) {
+            cache->value[0] = 0;
+            cache->len = 0;
+            return;
+        }
+        cache->len = -1;
+    }
+
+    /* read the serial first: if the value changes under us, the next
+    ** call sees a new serial and reads it again */
+    serial = ((volatile prop_info *) cache->pi)->serial;
+    if((cache->len >= 0) && (serial == cache->serial)) return;
+
+    cache->len = __system_property_read(cache->pi, NULL, cache->value);
+    cache->serial = serial;
+}
+
+int property_cache_get(struct property_cache *cache, char *value,
+                       const char *default_value)
+{
+    int len;
+
+    mutex_lock(&cache->lock);
+    property_cache_refresh(cache);
+    len = cache->len;
+    if(len > 0) {
+        memcpy(value, cache->value, len + 1);
+    }
+    mutex_unlock(&cache->lock);
+
+    if(len > 0) {
+        return len;
+    }
+
+    if(default_value) {
+        len = strlen(default_value);
+        memcpy(value, default_value, len + 1);
+    } else {
+        value[0] = 0;
+    }
+    return len;
+}
+
+#else
+
+/* no serial numbers to tell us when to re-read, so always do */
+int property_cache_get(struct property_cache *cache, char *value,
+                       const char *default_value)
+{
+    return property_get(cache->key, value, default_value);
+}
+
+#endif
@@ -26,10 +26,15 @@
 #include <winsock2.h>   /* for ntohl */
 #else
 #include <netinet/in.h>
+#include <sys/mman.h>
+#include <cutils/ashmem.h>
 #endif
 
 #define HEADER_SIZE 4
 
+/* smallest ring to read into, so one read() can pick up many records */
+#define MIN_RING_SIZE (64 * 1024)
+
 struct RecordStream {
     int fd;
     size_t maxRecordLen;
@@ -39,8 +44,55 @@ struct RecordStream {
     unsigned char *unconsumed;
     unsigned char *read_end;
     unsigned char *buffer_end;
+
+    /*
+     * Nonzero if buffer is a ring of this many bytes, mapped twice in a
+     * row so that anything up to ring_size bytes long starting in the
+     * first copy can be read straight through.  Then unconsumed is in
+     * the first copy, read_end is at most ring_size past it, and
+     * buffer_end isn't used.
+     */
+    size_t ring_size;
 };
 
+#ifndef HAVE_WINSOCK
+/*
+ * Maps an ashmem region of ring_size bytes twice, back to back.
+ * Returns NULL if it can't.
+ */
+static unsigned char *mapRing(size_t ring_size)
+{
+    unsigned char *ring;
+    int fd;
+
+    fd = ashmem_create_region("record_stream", ring_size);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    /* reserve room for both copies, then map the region over each half */
+    ring = mmap(NULL, ring_size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                -1, 0);
+    if (ring == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    if (mmap(ring, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fd, 0) == MAP_FAILED
+        || mmap(ring + ring_size, ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+    ) {
+        munmap(ring, ring_size * 2);
+        close(fd);
+        return NULL;
+    }
+
+    /* the mappings keep the region alive */
+    close(fd);
+    return ring;
+}
+#endif /* HAVE_WINSOCK */
 
 extern RecordStream *record_stream_new(int fd, size_t maxRecordLen)
 {
@@ -52,6 +104,28 @@ extern RecordStream *record_stream_new(int fd, size_t maxRecordLen)
 
     ret->fd = fd;
     ret->maxRecordLen = maxRecordLen;
+
+#ifndef HAVE_WINSOCK
+    {
+        size_t page_size = getpagesize();
+        size_t ring_size = maxRecordLen + HEADER_SIZE;
+
+        if (ring_size < MIN_RING_SIZE) {
+            ring_size = MIN_RING_SIZE;
+        }
+        ring_size = (ring_size + page_size - 1) & ~(page_size - 1);
+
+        ret->buffer = mapRing(ring_size);
+        if (ret->buffer != NULL) {
+            ret->ring_size = ring_size;
+            ret->unconsumed = ret->buffer;
+            ret->read_end = ret->buffer;
+            return ret;
+        }
+    }
+#endif
+
+    /* fall back to a flat buffer, moving partial records to its start */
     ret->buffer = (unsigned char *)malloc (maxRecordLen + HEADER_SIZE);
     
     ret->unconsumed = ret->buffer;
@@ -64,18 +138,33 @@ extern RecordStream *record_stream_new(int fd, size_t maxRecordLen)
 
 extern void record_stream_free(RecordStream *rs)
 {
+#ifndef HAVE_WINSOCK
+    if (rs->ring_size != 0) {
+        munmap(rs->buffer, rs->ring_size * 2);
+        free(rs);
+        return;
+    }
+#endif
     free(rs->buffer);
     free(rs);
 }
 
 
-/* returns NULL; if there isn't a full record in the buffer */
+/**
+ * returns NULL; if there isn't a full record in the buffer, or setting
+ * *p_tooLong, if the record is longer than maxRecordLen.  The ring may have
+ * room for more, but takes no more than the flat buffer could
+ */
 static unsigned char * getEndOfRecord (unsigned char *p_begin,
-                                            unsigned char *p_end)
+                                            unsigned char *p_end,
+                                            size_t maxRecordLen,
+                                            int *p_tooLong)
 {
     size_t len;
     unsigned char * p_ret;
 
+    *p_tooLong = 0;
+
     if (p_end < p_begin + HEADER_SIZE) {
         return NULL;
     }
@@ -83,6 +172,12 @@ static unsigned char * getEndOfRecord (unsigned char *p_begin,
     //First four bytes are length
     len = ntohl(*((uint32_t *)p_begin));
 
+    if (len > maxRecordLen) {
+        //ALOGE("max record length exceeded\n");
+        *p_tooLong = 1;
+        return NULL;
+    }
+
     p_ret = p_begin + HEADER_SIZE + len;
 
     if (p_end < p_ret) {
@@ -92,11 +187,19 @@ static unsigned char * getEndOfRecord (unsigned char *p_begin,
     return p_ret;
 }
 
-static void *getNextRecord (RecordStream *p_rs, size_t *p_outRecordLen)
+/**
+ * Returns 1 with the next record in *p_outRecord if it's all in the buffer,
+ * 0 with *p_outRecord NULL if it isn't yet, or -1 / errno = EFBIG with
+ * *p_outRecord NULL if it's longer than maxRecordLen
+ */
+static int getNextRecord (RecordStream *p_rs, void **p_outRecord,
+                          size_t *p_outRecordLen)
 {
     unsigned char *record_start, *record_end;
+    int tooLong;
 
-    record_end = getEndOfRecord (p_rs->unconsumed, p_rs->read_end);
+    record_end = getEndOfRecord (p_rs->unconsumed, p_rs->read_end,
+                                 p_rs->maxRecordLen, &tooLong);
 
     if (record_end != NULL) {
         /* one full line in the buffer */
@@ -104,11 +207,64 @@ static void *getNextRecord (RecordStream *p_rs, size_t *p_outRecordLen)
         p_rs->unconsumed = record_end;
 
         *p_outRecordLen = record_end - record_start;
+        *p_outRecord = record_start;
+
+        return 1;
+    }
+
+    *p_outRecord = NULL;
+
+    if (tooLong) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Makes room after read_end and reads into it once.
+ * Returns what read() did, or -1 / errno = EFBIG if there's no room
+ */
+static ssize_t fillBuffer (RecordStream *p_rs)
+{
+    size_t space;
+
+    if (p_rs->ring_size != 0) {
+        // everything past the first copy is also in it, at the same offset
+        if (p_rs->unconsumed >= p_rs->buffer + p_rs->ring_size) {
+            p_rs->unconsumed -= p_rs->ring_size;
+            p_rs->read_end -= p_rs->ring_size;
+        }
+
+        space = p_rs->unconsumed + p_rs->ring_size - p_rs->read_end;
+    } else {
+        if (p_rs->unconsumed != p_rs->buffer) {
+            // move remainder to the beginning of the buffer
+            size_t toMove;
+
+            toMove = p_rs->read_end - p_rs->unconsumed;
+            if (toMove) {
+                memmove(p_rs->buffer, p_rs->unconsumed, toMove);
+            }
 
-        return record_start;
+            p_rs->read_end = p_rs->buffer + toMove;
+            p_rs->unconsumed = p_rs->buffer;
+        }
+
+        space = p_rs->buffer_end - p_rs->read_end;
+    }
+
+    // if the buffer is full and we don't have a full record
+    if (space == 0) {
+        // this should never happen
+        //ALOGE("max record length exceeded\n");
+        assert (0);
+        errno = EFBIG;
+        return -1;
     }
 
-    return NULL;
+    return read (p_rs->fd, p_rs->read_end, space);
 }
 
 /**
@@ -123,64 +279,112 @@ static void *getNextRecord (RecordStream *p_rs, size_t *p_outRecordLen)
  * Return 0 on success, -1 on fail
  * Returns 0 with *p_outRecord set to NULL on end of stream
  * Returns -1 / errno = EAGAIN if it needs to read again
+ * Returns -1 / errno = EFBIG if the next record is longer than maxRecordLen
  */
 int record_stream_get_next (RecordStream *p_rs, void ** p_outRecord, 
                                     size_t *p_outRecordLen)
 {
-    void *ret;
+    int ret;
 
     ssize_t countRead;
 
     /* is there one record already in the buffer? */
-    ret = getNextRecord (p_rs, p_outRecordLen);
+    ret = getNextRecord (p_rs, p_outRecord, p_outRecordLen);
 
-    if (ret != NULL) {
-        *p_outRecord = ret;
-        return 0;
+    if (ret != 0) {
+        return ret > 0 ? 0 : -1;
     }
 
-    // if the buffer is full and we don't have a full record
-    if (p_rs->unconsumed == p_rs->buffer 
-        && p_rs->read_end == p_rs->buffer_end
-    ) {
-        // this should never happen
-        //ALOGE("max record length exceeded\n");
-        assert (0);
-        errno = EFBIG;
+    countRead = fillBuffer (p_rs);
+
+    if (countRead <= 0) {
+        /* note: end-of-stream drops through here too */
+        *p_outRecord = NULL;
+        return countRead;
+    }
+
+    p_rs->read_end += countRead;
+
+    ret = getNextRecord (p_rs, p_outRecord, p_outRecordLen);
+
+    if (ret < 0) {
         return -1;
     }
 
-    if (p_rs->unconsumed != p_rs->buffer) {
-        // move remainder to the beginning of the buffer
-        size_t toMove;
+    if (ret == 0) {
+        /* not enough of a buffer to for a whole command */
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Like record_stream_get_next, but returns up to maxRecords records at
+ * once, reading at most once to get them
+ *
+ * Records already in the buffer are returned without reading.  The
+ * records stay valid until the next call on p_rs
+ *
+ * Returns the number of records, 0 on end of stream, or -1 on fail
+ * Returns -1 / errno = EAGAIN if it needs to read again
+ * Returns -1 / errno = EFBIG if the next record is longer than maxRecordLen
+ */
+int record_stream_get_batch (RecordStream *p_rs, void **p_outRecords,
+                             size_t *p_outRecordLens, size_t maxRecords)
+{
+    ssize_t countRead;
+    size_t count = 0;
+    int ret = 0;
+
+    assert (maxRecords > 0);
 
-        toMove = p_rs->read_end - p_rs->unconsumed;
-        if (toMove) {
-            memmove(p_rs->buffer, p_rs->unconsumed, toMove);
+    while (count < maxRecords) {
+        ret = getNextRecord (p_rs, &p_outRecords[count],
+                             &p_outRecordLens[count]);
+        if (ret <= 0) {
+            break;
         }
+        count++;
+    }
 
-        p_rs->read_end = p_rs->buffer + toMove;
-        p_rs->unconsumed = p_rs->buffer;
+    /* an oversized record after these is reported on the next call */
+    if (count > 0) {
+        return count;
     }
 
-    countRead = read (p_rs->fd, p_rs->read_end, p_rs->buffer_end - p_rs->read_end);
+    if (ret < 0) {
+        return -1;
+    }
+
+    countRead = fillBuffer (p_rs);
 
     if (countRead <= 0) {
         /* note: end-of-stream drops through here too */
-        *p_outRecord = NULL;
         return countRead;
     }
 
     p_rs->read_end += countRead;
 
-    ret = getNextRecord (p_rs, p_outRecordLen);
+    while (count < maxRecords) {
+        ret = getNextRecord (p_rs, &p_outRecords[count],
+                             &p_outRecordLens[count]);
+        if (ret <= 0) {
+            break;
+        }
+        count++;
+    }
+
+    if (count == 0 && ret < 0) {
+        return -1;
+    }
 
-    if (ret == NULL) {
+    if (count == 0) {
         /* not enough of a buffer to for a whole command */
         errno = EAGAIN;
         return -1;
     }
 
-    *p_outRecord = ret;        
-    return 0;
+    return count;
 }
@@ -27,8 +27,35 @@
 #include <cutils/array.h>
 #include <cutils/selector.h>
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include "loghack.h"
 
+/** Events returned by one call to epoll_wait(). */
+#define MAX_EPOLL_EVENTS 64
+
+/**
+ * A SelectableFd as the epoll backend keeps it. The epoll set is only
+ * changed for fds on the pending list, so the loop never has to look at
+ * every fd.
+ */
+typedef struct EpollFd EpollFd;
+struct EpollFd {
+    SelectableFd selectableFd;
+
+    /** All the selector's fds. Only used by the selector thread. */
+    EpollFd* prev;
+    EpollFd* next;
+
+    /** Events this fd is registered for, or 0 if it isn't. */
+    unsigned int events;
+
+    /** True if it's on the pending list. Requires inSelectLock. */
+    bool pending;
+};
+
 struct Selector {
     Array* selectableFds;
     bool looping;
@@ -41,6 +68,20 @@ struct Selector {
 
     bool inSelect;
     pthread_mutex_t inSelectLock; 
+
+    /** The epoll backend's epoll fd, or -1 if this selector uses select(). */
+    int epollFd;
+    EpollFd* epollFds;
+
+    /** 
+     * Fds to call beforeSelect() on and update in the epoll set before the
+     * next wait, and whether to do that for every fd. Require inSelectLock.
+     */
+    Array* pendingFds;
+    bool refreshAll;
+
+    /** The pending list being handled. Only used by the selector thread. */
+    Array* takenFds;
 };
 
 /** Reads and ignores wake up data. */ 
@@ -68,12 +109,7 @@ static bool isInSelect(Selector* selector) {
     return inSelect;
 }
 
-void selectorWakeUp(Selector* selector) {
-    if (!isInSelect(selector)) {
-        // We only need to write wake-up data if we're blocked in select().
-        return;
-    }
-    
+static void writeWakeupData(Selector* selector) {
     static char garbage[1];
     if (write(selector->wakeupPipe[1], garbage, sizeof(garbage)) < 0) {
         if (errno == EINTR) {
@@ -84,12 +120,73 @@ void selectorWakeUp(Selector* selector) {
     }
 }
 
+/** Puts an fd on the pending list. Requires inSelectLock. */
+static void markPending(Selector* selector, EpollFd* epollFd) {
+    if (!epollFd->pending) {
+        epollFd->pending = true;
+        if (arrayAdd(selector->pendingFds, epollFd) < 0) {
+            LOG_ALWAYS_FATAL("malloc() error.");
+        }
+    }
+}
+
+void selectorWakeUp(Selector* selector) {
+    if (selector->epollFd >= 0) {
+        pthread_mutex_lock(&selector->inSelectLock);
+        selector->refreshAll = true;
+        pthread_mutex_unlock(&selector->inSelectLock);
+    }
+
+    if (!isInSelect(selector)) {
+        // We only need to write wake-up data if we're blocked in select().
+        return;
+    }
+    
+    writeWakeupData(selector);
+}
+
+void selectorWakeUpFd(SelectableFd* selectableFd) {
+    Selector* selector = selectableFd->selector;
+    if (selector->epollFd < 0) {
+        selectorWakeUp(selector);
+        return;
+    }
+
+    pthread_mutex_lock(&selector->inSelectLock);
+    markPending(selector, (EpollFd*) selectableFd);
+    bool inSelect = selector->inSelect;
+    pthread_mutex_unlock(&selector->inSelectLock);
+
+    if (inSelect) {
+        writeWakeupData(selector);
+    }
+}
+
 Selector* selectorCreate(void) {
+    return selectorCreateWithBackend(SELECTOR_SELECT);
+}
+
+Selector* selectorCreateWithBackend(SelectorBackend backend) {
     Selector* selector = calloc(1, sizeof(Selector));
     if (selector == NULL) {
         LOG_ALWAYS_FATAL("malloc() error.");
     }
     selector->selectableFds = arrayCreate();
+    selector->pendingFds = arrayCreate();
+    selector->takenFds = arrayCreate();
+    selector->epollFd = -1;
+    pthread_mutex_init(&selector->inSelectLock, NULL);
+
+    if (backend == SELECTOR_EPOLL) {
+#ifdef HAVE_EPOLL
+        selector->epollFd = epoll_create(MAX_EPOLL_EVENTS);
+        if (selector->epollFd < 0) {
+            LOG_ALWAYS_FATAL("epoll_create() error: %s", strerror(errno));
+        }
+#else
+        ALOGW("No epoll here, using select().");
+#endif
+    }
     
     // Set up wake-up pipe.
     if (pipe(selector->wakeupPipe) < 0) {
@@ -103,8 +200,6 @@ Selector* selectorCreate(void) {
         LOG_ALWAYS_FATAL("malloc() error.");
     }
     wakeupFd->onReadable = &eatWakeupData; 
-    
-    pthread_mutex_init(&selector->inSelectLock, NULL);
 
     return selector;
 }
@@ -112,6 +207,28 @@ Selector* selectorCreate(void) {
 SelectableFd* selectorAdd(Selector* selector, int fd) {
     assert(selector != NULL);
 
+    if (selector->epollFd >= 0) {
+        EpollFd* epollFd = calloc(1, sizeof(EpollFd));
+        if (epollFd == NULL) {
+            return NULL;
+        }
+        epollFd->selectableFd.selector = selector;
+        epollFd->selectableFd.fd = fd;
+
+        epollFd->next = selector->epollFds;
+        if (selector->epollFds != NULL) {
+            selector->epollFds->prev = epollFd;
+        }
+        selector->epollFds = epollFd;
+
+        // It's registered once its callbacks are set up.
+        pthread_mutex_lock(&selector->inSelectLock);
+        markPending(selector, epollFd);
+        pthread_mutex_unlock(&selector->inSelectLock);
+
+        return &epollFd->selectableFd;
+    }
+
     SelectableFd* selectableFd = calloc(1, sizeof(SelectableFd));
     if (selectableFd != NULL) {
         selectableFd->selector = selector;
@@ -226,12 +343,224 @@ static void fireEvents(Selector* selector) {
     }
 }
 
+#ifdef HAVE_EPOLL
+
+/** Removes an fd from the selector and frees it. */
+static void epollRemove(Selector* selector, EpollFd* epollFd) {
+    SelectableFd* selectableFd = &epollFd->selectableFd;
+
+    if (epollFd->events != 0) {
+        // Closing the fd already removed it if this fails.
+        epoll_ctl(selector->epollFd, EPOLL_CTL_DEL, selectableFd->fd, NULL);
+    }
+
+    // The selector thread may have woken it up again since it was taken
+    // off the pending list.
+    pthread_mutex_lock(&selector->inSelectLock);
+    if (epollFd->pending) {
+        int size = arraySize(selector->pendingFds);
+        int i;
+        for (i = 0; i < size; i++) {
+            if (arrayGet(selector->pendingFds, i) == epollFd) {
+                arrayRemove(selector->pendingFds, i);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&selector->inSelectLock);
+
+    if (epollFd->prev != NULL) {
+        epollFd->prev->next = epollFd->next;
+    } else {
+        selector->epollFds = epollFd->next;
+    }
+    if (epollFd->next != NULL) {
+        epollFd->next->prev = epollFd->prev;
+    }
+
+    if (selectableFd->onRemove != NULL) {
+        selectableFd->onRemove(selectableFd);
+    }
+    free(epollFd);
+}
+
+/**
+ * Gives a pending fd its beforeSelect() call and updates the events it's
+ * registered for to match its callbacks.
+ */
+static void epollUpdate(Selector* selector, EpollFd* epollFd) {
+    SelectableFd* selectableFd = &epollFd->selectableFd;
+
+    if (selectableFd->beforeSelect != NULL) {
+        selectableFd->beforeSelect(selectableFd);
+    }
+    if (selectableFd->remove) {
+        epollRemove(selector, epollFd);
+        return;
+    }
+
+    unsigned int events = 0;
+    if (selectableFd->onReadable != NULL) {
+        events |= EPOLLIN;
+    }
+    if (selectableFd->onWritable != NULL) {
+        events |= EPOLLOUT;
+    }
+    if (selectableFd->onExcept != NULL) {
+        events |= EPOLLPRI;
+    }
+    if (events == epollFd->events) {
+        return;
+    }
+
+    // Errors and hangups are always reported, so an fd that wants no
+    // events has to leave the set or it would wake us up forever.
+    struct epoll_event event;
+    int op;
+    if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    } else if (epollFd->events == 0) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    event.events = events;
+    event.data.ptr = epollFd;
+    if (epoll_ctl(selector->epollFd, op, selectableFd->fd, &event) < 0) {
+        LOG_ALWAYS_FATAL("epoll_ctl() error on fd %d: %s", selectableFd->fd,
+                strerror(errno));
+    }
+    epollFd->events = events;
+}
+
+/**
+ * Takes the pending list, leaving an empty one in its place, and marks the
+ * selector as waiting so that wake-ups from here on write to the pipe.
+ */
+static Array* epollTakePending(Selector* selector) {
+    pthread_mutex_lock(&selector->inSelectLock);
+    selector->inSelect = true;
+    if (selector->refreshAll) {
+        selector->refreshAll = false;
+        EpollFd* epollFd;
+        for (epollFd = selector->epollFds; epollFd != NULL;
+                epollFd = epollFd->next) {
+            markPending(selector, epollFd);
+        }
+    }
+    Array* pendingFds = selector->pendingFds;
+    int size = arraySize(pendingFds);
+    int i;
+    for (i = 0; i < size; i++) {
+        ((EpollFd*) arrayGet(pendingFds, i))->pending = false;
+    }
+    selector->pendingFds = selector->takenFds;
+    selector->takenFds = pendingFds;
+    pthread_mutex_unlock(&selector->inSelectLock);
+    return pendingFds;
+}
+
+/**
+ * Invokes a callback if the callback is non-null and the event happened.
+ */
+static inline void maybeInvokeEvent(SelectableFd* selectableFd,
+        void (*callback)(SelectableFd*), bool happened) {
+    if (callback != NULL && !selectableFd->remove && happened) {
+        ALOGD("Selected fd %d.", selectableFd->fd);
+        callback(selectableFd);
+    }
+}
+
+static void epollLoop(Selector* selector) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    
+    while (true) {
+        Array* pendingFds = epollTakePending(selector);
+
+        // Removals go first, in case an fd was closed and its number
+        // reused by one of the other pending fds.
+        int size = arraySize(pendingFds);
+        int i;
+        for (i = 0; i < size; i++) {
+            EpollFd* epollFd = arrayGet(pendingFds, i);
+            if (epollFd->selectableFd.remove) {
+                epollRemove(selector, epollFd);
+                arraySet(pendingFds, i, NULL);
+            }
+        }
+        for (i = 0; i < size; i++) {
+            EpollFd* epollFd = arrayGet(pendingFds, i);
+            if (epollFd != NULL) {
+                epollUpdate(selector, epollFd);
+            }
+        }
+        arraySetSize(pendingFds, 0);
+
+        // Fds added by those callbacks aren't registered yet, so don't
+        // block if there are any.
+        pthread_mutex_lock(&selector->inSelectLock);
+        int timeout = arraySize(selector->pendingFds) > 0 ? 0 : -1;
+        pthread_mutex_unlock(&selector->inSelectLock);
+
+        ALOGD("Entering epoll_wait().");
+
+        int result = epoll_wait(selector->epollFd, events, MAX_EPOLL_EVENTS,
+                timeout);
+
+        ALOGD("Exiting epoll_wait().");
+
+        setInSelect(selector, false);
+
+        if (result == -1) {
+            // Abort on everything except EINTR.
+            if (errno == EINTR) {
+                ALOGI("epoll_wait() interrupted.");
+            } else {
+                LOG_ALWAYS_FATAL("epoll_wait() error: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        // Fds are only freed while handling the pending list, so every
+        // event's fd is still around even if an earlier callback removed it.
+        for (i = 0; i < result; i++) {
+            SelectableFd* selectableFd = events[i].data.ptr;
+            unsigned int happened = events[i].events;
+            if (happened & (EPOLLERR | EPOLLHUP)) {
+                // select() reports errors as readable and writable.
+                happened |= EPOLLIN | EPOLLOUT;
+            }
+            maybeInvokeEvent(selectableFd, selectableFd->onExcept,
+                    happened & EPOLLPRI);
+            maybeInvokeEvent(selectableFd, selectableFd->onReadable,
+                    happened & EPOLLIN);
+            maybeInvokeEvent(selectableFd, selectableFd->onWritable,
+                    happened & EPOLLOUT);
+        }
+
+        // Their callbacks may have changed, so look at them again.
+        pthread_mutex_lock(&selector->inSelectLock);
+        for (i = 0; i < result; i++) {
+            markPending(selector, events[i].data.ptr);
+        }
+        pthread_mutex_unlock(&selector->inSelectLock);
+    }
+}
+
+#endif
+
 void selectorLoop(Selector* selector) {
     // Make sure we're not already looping.
     if (selector->looping) {
         LOG_ALWAYS_FATAL("Already looping.");
     }
     selector->looping = true;
+
+#ifdef HAVE_EPOLL
+    if (selector->epollFd >= 0) {
+        epollLoop(selector);
+    }
+#endif
     
     while (true) {
         setInSelect(selector, true);
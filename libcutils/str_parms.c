@@ -30,8 +30,18 @@
 
 #include <cutils/str_parms.h>
 
+/*
+ * A str_parms is one allocation holding this struct, then room for its
+ * map, then a copy of the string it was made from.  Keys and values parsed
+ * from the string point into the copy; only ones added later are
+ * allocated.  The map moves to the heap if added entries outgrow it.
+ */
 struct str_parms {
     Hashmap *map;
+    size_t map_capacity;
+    bool map_in_place;
+    char *buf;
+    size_t buf_len;
 };
 
 
@@ -51,23 +61,97 @@ static int str_hash_fn(void *str)
     return (int)hash;
 }
 
-struct str_parms *str_parms_create(void)
+static bool in_buf(struct str_parms *str_parms, const char *str)
+{
+    return str >= str_parms->buf && str < str_parms->buf + str_parms->buf_len;
+}
+
+static void free_str(struct str_parms *str_parms, void *str)
+{
+    if (!in_buf(str_parms, str))
+        free(str);
+}
+
+static struct str_parms *str_parms_alloc(size_t capacity, size_t buf_len)
 {
     struct str_parms *str_parms;
+    size_t map_offset;
+    size_t map_size;
+
+    map_offset = (sizeof(struct str_parms) + sizeof(void *) - 1) &
+            ~(sizeof(void *) - 1);
+    map_size = hashmapBufferSize(capacity);
 
-    str_parms = calloc(1, sizeof(struct str_parms));
+    str_parms = malloc(map_offset + map_size + buf_len);
     if (!str_parms)
         return NULL;
 
-    str_parms->map = hashmapCreate(5, str_hash_fn, str_eq);
-    if (!str_parms->map)
-        goto err;
+    str_parms->map = hashmapCreateInBuffer((char *)str_parms + map_offset,
+                                           capacity, str_hash_fn, str_eq);
+    str_parms->map_capacity = capacity;
+    str_parms->map_in_place = true;
+    str_parms->buf = (char *)str_parms + map_offset + map_size;
+    str_parms->buf_len = buf_len;
 
     return str_parms;
+}
 
-err:
-    free(str_parms);
-    return NULL;
+struct str_parms *str_parms_create(void)
+{
+    return str_parms_alloc(5, 0);
+}
+
+static bool copy_pair(void *key, void *value, void *context)
+{
+    Hashmap *map = context;
+    size_t size = hashmapSize(map);
+
+    hashmapPut(map, key, value);
+    return hashmapSize(map) > size;
+}
+
+/* Moves the map out of the str_parms allocation into a bigger one */
+static int grow_map(struct str_parms *str_parms)
+{
+    Hashmap *map;
+
+    map = hashmapCreate(str_parms->map_capacity * 2, str_hash_fn, str_eq);
+    if (!map)
+        return -ENOMEM;
+
+    hashmapForEach(str_parms->map, copy_pair, map);
+    if (hashmapSize(map) != hashmapSize(str_parms->map)) {
+        hashmapFree(map);
+        return -ENOMEM;
+    }
+
+    hashmapFree(str_parms->map);
+    str_parms->map = map;
+    str_parms->map_capacity *= 2;
+    str_parms->map_in_place = false;
+    return 0;
+}
+
+/*
+ * Puts value for key, setting *old_val to the value it replaced, if any.
+ * Returns 0, or -ENOMEM if the entry couldn't be added.
+ */
+static int put(struct str_parms *str_parms, char *key, char *value,
+               void **old_val)
+{
+    size_t size = hashmapSize(str_parms->map);
+
+    *old_val = hashmapPut(str_parms->map, key, value);
+    if (*old_val || hashmapSize(str_parms->map) > size)
+        return 0;
+
+    if (!str_parms->map_in_place || grow_map(str_parms))
+        return -ENOMEM;
+
+    *old_val = hashmapPut(str_parms->map, key, value);
+    if (*old_val || hashmapSize(str_parms->map) > size)
+        return 0;
+    return -ENOMEM;
 }
 
 struct remove_ctxt {
@@ -100,8 +184,8 @@ static bool remove_pair(void *key, void *value, void *context)
 
 do_remove:
     hashmapRemove(ctxt->str_parms->map, key);
-    free(key);
-    free(value);
+    free_str(ctxt->str_parms, key);
+    free_str(ctxt->str_parms, value);
     return should_continue;
 }
 
@@ -121,6 +205,7 @@ void str_parms_destroy(struct str_parms *str_parms)
     };
 
     hashmapForEach(str_parms->map, remove_pair, &ctxt);
+    /* an in place map is part of the str_parms allocation */
     hashmapFree(str_parms->map);
     free(str_parms);
 }
@@ -128,48 +213,46 @@ void str_parms_destroy(struct str_parms *str_parms)
 struct str_parms *str_parms_create_str(const char *_string)
 {
     struct str_parms *str_parms;
-    char *str;
+    size_t len = strlen(_string);
+    /* room for a few more to be added without moving the map */
+    size_t capacity = 1 + 4;
+    const char *p;
     char *kvpair;
     char *tmpstr;
     int items = 0;
 
-    str_parms = str_parms_create();
-    if (!str_parms)
-        goto err_create_str_parms;
+    /* there can't be more pairs than separators, plus one */
+    for (p = _string; *p; p++) {
+        if (*p == ';')
+            capacity++;
+    }
 
-    str = strdup(_string);
-    if (!str)
-        goto err_strdup;
+    str_parms = str_parms_alloc(capacity, len + 1);
+    if (!str_parms)
+        return NULL;
+    memcpy(str_parms->buf, _string, len + 1);
 
     ALOGV("%s: source string == '%s'\n", __func__, _string);
 
-    kvpair = strtok_r(str, ";", &tmpstr);
+    kvpair = strtok_r(str_parms->buf, ";", &tmpstr);
     while (kvpair && *kvpair) {
         char *eq = strchr(kvpair, '='); /* would love strchrnul */
         char *value;
-        char *key;
         void *old_val;
 
         if (eq == kvpair)
             goto next_pair;
 
+        /* a missing value is the empty string at the end of the key */
         if (eq) {
-            key = strndup(kvpair, eq - kvpair);
-            if (*(++eq))
-                value = strdup(eq);
-            else
-                value = strdup("");
+            *eq = '\0';
+            value = eq + 1;
         } else {
-            key = strdup(kvpair);
-            value = strdup("");
+            value = kvpair + strlen(kvpair);
         }
 
-        /* if we replaced a value, free it */
-        old_val = hashmapPut(str_parms->map, key, value);
-        if (old_val) {
-            free(old_val);
-            free(key);
-        }
+        /* both are in the buffer, so a replaced value needs no freeing */
+        put(str_parms, kvpair, value, &old_val);
 
         items++;
 next_pair:
@@ -179,36 +262,40 @@ next_pair:
     if (!items)
         ALOGV("%s: no items found in string\n", __func__);
 
-    free(str);
-
     return str_parms;
-
-err_strdup:
-    str_parms_destroy(str_parms);
-err_create_str_parms:
-    return NULL;
 }
 
 int str_parms_add_str(struct str_parms *str_parms, const char *key,
                       const char *value)
 {
     void *old_val;
-    void *tmp_key;
-    void *tmp_val;
+    char *tmp_key;
+    char *tmp_val;
+    int ret;
 
-    tmp_key = strdup(key);
     tmp_val = strdup(value);
-    old_val = hashmapPut(str_parms->map, tmp_key, tmp_val);
+    if (!tmp_val)
+        return -ENOMEM;
 
-    if (old_val) {
-        free(old_val);
-        free(tmp_key);
-    } else if (errno == ENOMEM) {
-        free(tmp_key);
+    /* the map keeps the key it has, so only copy a new one */
+    if (hashmapContainsKey(str_parms->map, (void *)key)) {
+        old_val = hashmapPut(str_parms->map, (void *)key, tmp_val);
+        free_str(str_parms, old_val);
+        return 0;
+    }
+
+    tmp_key = strdup(key);
+    if (!tmp_key) {
         free(tmp_val);
         return -ENOMEM;
     }
-    return 0;
+
+    ret = put(str_parms, tmp_key, tmp_val, &old_val);
+    if (ret) {
+        free(tmp_key);
+        free(tmp_val);
+    }
+    return ret;
 }
 
 int str_parms_add_int(struct str_parms *str_parms, const char *key, int value)
@@ -278,43 +365,60 @@ int str_parms_get_float(struct str_parms *str_parms, const char *key,
         return -ENOENT;
 
     out = strtof(value, &end);
-    if (*value != '\0' && *end == '\0')
+    if (*value != '\0' && *end == '\0') {
+        *val = out;
         return 0;
+    }
 
     return -EINVAL;
 }
 
-static bool combine_strings(void *key, void *value, void *context)
+static bool measure_pair(void *key, void *value, void *context)
 {
-    char **old_str = context;
-    char *new_str;
-    int ret;
+    size_t *len = context;
 
-    ret = asprintf(&new_str, "%s%s%s=%s",
-                   *old_str ? *old_str : "",
-                   *old_str ? ";" : "",
-                   (char *)key,
-                   (char *)value);
-    if (*old_str)
-        free(*old_str);
-
-    if (ret >= 0) {
-        *old_str = new_str;
-        return true;
-    }
+    /* with its '=', and a ';' or the final NUL */
+    *len += strlen(key) + strlen(value) + 2;
+    return true;
+}
 
-    *old_str = NULL;
-    return false;
+static bool write_pair(void *key, void *value, void *context)
+{
+    char **end = context;
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    char *p = *end;
+
+    memcpy(p, key, key_len);
+    p += key_len;
+    *p++ = '=';
+    memcpy(p, value, value_len);
+    p += value_len;
+    *p++ = ';';
+
+    *end = p;
+    return true;
 }
 
 char *str_parms_to_str(struct str_parms *str_parms)
 {
-    char *str = NULL;
+    size_t len = 0;
+    char *str;
+    char *end;
+
+    /* size the string first so it's allocated once */
+    hashmapForEach(str_parms->map, measure_pair, &len);
+
+    str = malloc(len ? len : 1);
+    if (!str)
+        return NULL;
 
-    if (hashmapSize(str_parms->map) > 0)
-        hashmapForEach(str_parms->map, combine_strings, &str);
-    else
-        str = strdup("");
+    end = str;
+    hashmapForEach(str_parms->map, write_pair, &end);
+    /* overwrite the last ';' */
+    if (end > str)
+        end--;
+    *end = '\0';
     return str;
 }
 
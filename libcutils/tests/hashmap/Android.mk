@@ -0,0 +1,28 @@
+# Copyright 2012 The Android Open Source Project
+
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	hashmap_bench.c \
+	hashmap_chained.c
+
+LOCAL_MODULE:= hashmap_bench
+
+LOCAL_STATIC_LIBRARIES := libcutils
+LOCAL_LDLIBS := -lpthread
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= hashmap_stress.c
+
+LOCAL_MODULE:= hashmap_stress
+
+LOCAL_STATIC_LIBRARIES := libcutils
+LOCAL_LDLIBS := -lpthread
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
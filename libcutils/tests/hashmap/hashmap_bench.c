@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compares the open addressing Hashmap in libcutils with the chained one it
+ * replaced: put, get, miss, forEach and remove throughput, and heap used
+ * per entry.  Before timing anything it runs the same random operations on
+ * both maps and checks they agree.  With -t it also times lookups from 1 up
+ * to the given number of threads, in a map guarded by hashmapLock() and in
+ * a concurrent one.
+ */
+
+#include <cutils/hashmap.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+typedef struct ChainedHashmap ChainedHashmap;
+
+ChainedHashmap* chainedHashmapCreate(size_t initialCapacity,
+        int (*hash)(void* key), bool (*equals)(void* keyA, void* keyB));
+void chainedHashmapFree(ChainedHashmap* map);
+void* chainedHashmapPut(ChainedHashmap* map, void* key, void* value);
+void* chainedHashmapGet(ChainedHashmap* map, void* key);
+void* chainedHashmapRemove(ChainedHashmap* map, void* key);
+size_t chainedHashmapSize(ChainedHashmap* map);
+void chainedHashmapForEach(ChainedHashmap* map,
+        bool (*callback)(void* key, void* value, void* context),
+        void* context);
+
+typedef struct MapOps {
+    const char* name;
+    void* (*create)(size_t initialCapacity,
+            int (*hash)(void* key), bool (*equals)(void* keyA, void* keyB));
+    void (*free)(void* map);
+    void* (*put)(void* map, void* key, void* value);
+    void* (*get)(void* map, void* key);
+    void* (*remove)(void* map, void* key);
+    size_t (*size)(void* map);
+    void (*forEach)(void* map,
+            bool (*callback)(void* key, void* value, void* context),
+            void* context);
+} MapOps;
+
+static const MapOps openOps = {
+    "open",
+    (void*) hashmapCreate,
+    (void*) hashmapFree,
+    (void*) hashmapPut,
+    (void*) hashmapGet,
+    (void*) hashmapRemove,
+    (void*) hashmapSize,
+    (void*) hashmapForEach,
+};
+
+static const MapOps chainedOps = {
+    "chained",
+    (void*) chainedHashmapCreate,
+    (void*) chainedHashmapFree,
+    (void*) chainedHashmapPut,
+    (void*) chainedHashmapGet,
+    (void*) chainedHashmapRemove,
+    (void*) chainedHashmapSize,
+    (void*) chainedHashmapForEach,
+};
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Large tables are mmapped rather than carved from the heap, so count both.
+static size_t heapUsed(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+#else
+    struct mallinfo info = mallinfo();
+#endif
+    return info.uordblks + info.hblkhd;
+}
+
+static bool countEntry(void* key, void* value, void* context) {
+    (*(size_t*) context) += (size_t) value & 1;
+    return true;
+}
+
+static bool removeEntry(void* key, void* value, void* context) {
+    void** map = (void**) context;
+    const MapOps* ops = (const MapOps*) map[1];
+    ops->remove(map[0], key);
+    return true;
+}
+
+/*
+ * Runs the same random puts, gets and removes on both maps and checks
+ * every result matches.  Returns 0 if they do.
+ */
+static int crossCheck(int* keys, int count) {
+    void* open = openOps.create(0, hashmapIntHash, hashmapIntEquals);
+    void* chained = chainedOps.create(0, hashmapIntHash, hashmapIntEquals);
+    int i;
+
+    srand(1);
+    for (i = 0; i < count * 4; i++) {
+        int* key = &keys[rand() % count];
+        void* value = (void*) (size_t) (rand() | 1);
+        void* a = NULL;
+        void* b = NULL;
+        switch (rand() % 3) {
+        case 0:
+            a = openOps.put(open, key, value);
+            b = chainedOps.put(chained, key, value);
+            break;
+        case 1:
+            a = openOps.get(open, key);
+            b = chainedOps.get(chained, key);
+            break;
+        case 2:
+            a = openOps.remove(open, key);
+            b = chainedOps.remove(chained, key);
+            break;
+        }
+        if (a != b || openOps.size(open) != chainedOps.size(chained)) {
+            fprintf(stderr, "maps disagree at operation %d\n", i);
+            return -1;
+        }
+    }
+
+    // Removing every entry from inside forEach must leave the map empty.
+    void* context[2] = { open, (void*) &openOps };
+    openOps.forEach(open, removeEntry, context);
+    if (openOps.size(open) != 0) {
+        fprintf(stderr, "%zu entries left after removing in forEach\n",
+                openOps.size(open));
+        return -1;
+    }
+
+    openOps.free(open);
+    chainedOps.free(chained);
+    return 0;
+}
+
+static void bench(const MapOps* ops, int* keys, int* misses, int count,
+        int rounds) {
+    double put = 0, get = 0, miss = 0, each = 0, remove = 0;
+    size_t bytes = 0;
+    int round, i;
+
+    for (round = 0; round < rounds; round++) {
+        size_t heap = heapUsed();
+        double start = now();
+        void* map = ops->create(0, hashmapIntHash, hashmapIntEquals);
+        for (i = 0; i < count; i++) {
+            ops->put(map, &keys[i], (void*) (size_t) (i | 1));
+        }
+        put += now() - start;
+        bytes = heapUsed() - heap;
+
+        start = now();
+        for (i = 0; i < count; i++) {
+            if (ops->get(map, &keys[i]) == NULL) {
+                fprintf(stderr, "%s: key %d missing\n", ops->name, keys[i]);
+                exit(1);
+            }
+        }
+        get += now() - start;
+
+        start = now();
+        for (i = 0; i < count; i++) {
+            ops->get(map, &misses[i]);
+        }
+        miss += now() - start;
+
+        start = now();
+        size_t seen = 0;
+        ops->forEach(map, countEntry, &seen);
+        each += now() - start;
+        if (seen != (size_t) count) {
+            fprintf(stderr, "%s: forEach saw %zu of %d\n", ops->name, seen,
+                    count);
+            exit(1);
+        }
+
+        start = now();
+        for (i = 0; i < count; i++) {
+            ops->remove(map, &keys[i]);
+        }
+        remove += now() - start;
+
+        ops->free(map);
+    }
+
+    double ops_count = (double) count * rounds / 1000000;
+    printf("%-8s put %7.1f  get %7.1f  miss %7.1f  forEach %8.1f  "
+            "remove %7.1f Mops/s  %5.1f bytes/entry\n", ops->name,
+            ops_count / put, ops_count / get, ops_count / miss,
+            ops_count / each, ops_count / remove, (double) bytes / count);
+}
+
+typedef struct Lookups {
+    pthread_t thread;
+    Hashmap* map;
+    bool locked;
+    int* keys;
+    int count;
+    int rounds;
+} Lookups;
+
+static void* lookupThread(void* arg) {
+    Lookups* lookups = arg;
+    int round, i;
+
+    for (round = 0; round < lookups->rounds; round++) {
+        for (i = 0; i < lookups->count; i++) {
+            if (lookups->locked) {
+                hashmapLock(lookups->map);
+            }
+            void* value = hashmapGet(lookups->map, &lookups->keys[i]);
+            if (lookups->locked) {
+                hashmapUnlock(lookups->map);
+            }
+            if (value == NULL) {
+                fprintf(stderr, "key %d missing\n", lookups->keys[i]);
+                exit(1);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Times threadCount threads each looking up every key rounds times.
+ * Returns millions of lookups per second.
+ */
+static double lookupRate(Hashmap* map, bool locked, int* keys, int count,
+        int rounds, int threadCount) {
+    Lookups* lookups = calloc(threadCount, sizeof(Lookups));
+    int i;
+
+    double start = now();
+    for (i = 0; i < threadCount; i++) {
+        lookups[i].map = map;
+        lookups[i].locked = locked;
+        lookups[i].keys = keys;
+        lookups[i].count = count;
+        lookups[i].rounds = rounds;
+        pthread_create(&lookups[i].thread, NULL, lookupThread, &lookups[i]);
+    }
+    for (i = 0; i < threadCount; i++) {
+        pthread_join(lookups[i].thread, NULL);
+    }
+    double elapsed = now() - start;
+
+    free(lookups);
+    return (double) count * rounds * threadCount / 1000000 / elapsed;
+}
+
+static void scaling(int* keys, int count, int rounds, int maxThreads) {
+    Hashmap* locked = hashmapCreate(0, hashmapIntHash, hashmapIntEquals);
+    Hashmap* concurrent =
+            hashmapCreateConcurrent(0, hashmapIntHash, hashmapIntEquals);
+    int threads, i;
+
+    for (i = 0; i < count; i++) {
+        hashmapPut(locked, &keys[i], (void*) (size_t) (i | 1));
+        hashmapPut(concurrent, &keys[i], (void*) (size_t) (i | 1));
+    }
+
+    printf("threads  locked get  concurrent get (Mops/s)\n");
+    for (threads = 1; threads <= maxThreads; threads <<= 1) {
+        double lockedRate =
+                lookupRate(locked, true, keys, count, rounds, threads);
+        double concurrentRate =
+                lookupRate(concurrent, false, keys, count, rounds, threads);
+        printf("%7d  %10.1f  %14.1f\n", threads, lockedRate, concurrentRate);
+    }
+
+    hashmapFree(locked);
+    hashmapFree(concurrent);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: hashmap_bench [-n <entries>] [-r <rounds>] "
+            "[-t <threads>]\n");
+}
+
+int main(int argc, char** argv) {
+    int count = 100000;
+    int rounds = 5;
+    int maxThreads = 0;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "n:r:t:")) != -1) {
+        switch (c) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 't':
+            maxThreads = atoi(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (count <= 0 || rounds <= 0) {
+        usage();
+        return 1;
+    }
+
+    int* keys = malloc(count * sizeof(int));
+    int* misses = malloc(count * sizeof(int));
+    if (keys == NULL || misses == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    // Distinct scattered keys: multiplying by an odd constant keeps them
+    // distinct and even, so the misses can be the odd numbers next to them.
+    for (i = 0; i < count; i++) {
+        keys[i] = (int) ((unsigned int) i * 2 * 2654435761u);
+        misses[i] = keys[i] | 1;
+    }
+
+    if (crossCheck(keys, count) != 0) {
+        return 1;
+    }
+
+    printf("%d entries, %d rounds\n", count, rounds);
+    bench(&chainedOps, keys, misses, count, rounds);
+    bench(&openOps, keys, misses, count, rounds);
+    if (maxThreads > 0) {
+        scaling(keys, count, rounds, maxThreads);
+    }
+
+    free(keys);
+    free(misses);
+    return 0;
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Hammers a concurrent Hashmap from several threads at once.  Writers add
+ * and remove keys of their own while the map grows under readers; readers
+ * check every value they see belongs to the key they looked up, and that
+ * keys nobody removes are always found.  Afterwards the map must hold
+ * exactly what the writers left in it.  Then every thread memoizes the same
+ * keys, and each initial value must have been made once.
+ */
+
+#include <cutils/hashmap.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define KEY_COUNT (1 << 16)
+// Keys below this are put before the threads start and never removed.
+#define STABLE_COUNT (KEY_COUNT / 4)
+
+static int keys[KEY_COUNT];
+static Hashmap* map;
+static int writerCount = 2;
+static volatile int stop;
+static volatile int failed;
+static int memoized;
+
+static void* valueFor(int i) {
+    return (void*) (((size_t) i << 1) | 1);
+}
+
+static void fail(const char* message, int i) {
+    fprintf(stderr, "key %d: %s\n", i, message);
+    failed = 1;
+    stop = 1;
+}
+
+typedef struct Writer {
+    pthread_t thread;
+    int id;
+    unsigned int seed;
+    // present[i] is set if this writer left churn key i in the map.
+    char* present;
+    long operations;
+} Writer;
+
+static void* writerThread(void* arg) {
+    Writer* writer = arg;
+
+    while (!stop) {
+        // Writers own the churn keys equal to their id modulo writerCount.
+        int i = STABLE_COUNT + rand_r(&writer->seed)
+                % ((KEY_COUNT - STABLE_COUNT) / writerCount) * writerCount
+                + writer->id;
+        if (rand_r(&writer->seed) % 2) {
+            void* old = hashmapPut(map, &keys[i], valueFor(i));
+            if (old != (writer->present[i] ? valueFor(i) : NULL)) {
+                fail("put returned the wrong old value", i);
+            }
+            writer->present[i] = 1;
+        } else {
+            void* old = hashmapRemove(map, &keys[i]);
+            if (old != (writer->present[i] ? valueFor(i) : NULL)) {
+                fail("remove returned the wrong value", i);
+            }
+            writer->present[i] = 0;
+        }
+        writer->operations++;
+    }
+    return NULL;
+}
+
+typedef struct Reader {
+    pthread_t thread;
+    unsigned int seed;
+    long operations;
+} Reader;
+
+static void* readerThread(void* arg) {
+    Reader* reader = arg;
+
+    while (!stop) {
+        int i = rand_r(&reader->seed) % KEY_COUNT;
+        void* value = hashmapGet(map, &keys[i]);
+        if (i < STABLE_COUNT && value != valueFor(i)) {
+            fail("stable key missing or wrong", i);
+        } else if (value != NULL && value != valueFor(i)) {
+            fail("got another key's value", i);
+        }
+        if (i < STABLE_COUNT && !hashmapContainsKey(map, &keys[i])) {
+            fail("stable key not contained", i);
+        }
+        reader->operations++;
+    }
+    return NULL;
+}
+
+static void* makeValue(void* key, void* context) {
+    __sync_fetch_and_add(&memoized, 1);
+    return valueFor((int*) key - keys);
+}
+
+static void* memoizeThread(void* arg) {
+    int i;
+    for (i = 0; i < KEY_COUNT; i++) {
+        if (hashmapMemoize(map, &keys[i], makeValue, NULL) != valueFor(i)) {
+            fail("memoize returned the wrong value", i);
+        }
+    }
+    return NULL;
+}
+
+static bool countEntry(void* key, void* value, void* context) {
+    if (value != valueFor((int*) key - keys)) {
+        fail("forEach saw the wrong value", (int*) key - keys);
+    }
+    (*(size_t*) context)++;
+    return true;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: hashmap_stress [-r <readers>] [-w <writers>] "
+            "[-s <seconds>]\n");
+}
+
+int main(int argc, char** argv) {
+    int readerCount = 4;
+    int seconds = 2;
+    int c, i, j;
+
+    while ((c = getopt(argc, argv, "r:w:s:")) != -1) {
+        switch (c) {
+        case 'r':
+            readerCount = atoi(optarg);
+            break;
+        case 'w':
+            writerCount = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (readerCount < 0 || writerCount <= 0 || seconds <= 0) {
+        usage();
+        return 1;
+    }
+
+    for (i = 0; i < KEY_COUNT; i++) {
+        keys[i] = (int) ((unsigned int) i * 2654435761u);
+    }
+
+    map = hashmapCreateConcurrent(0, hashmapIntHash, hashmapIntEquals);
+    if (map == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < STABLE_COUNT; i++) {
+        hashmapPut(map, &keys[i], valueFor(i));
+    }
+
+    Writer* writers = calloc(writerCount, sizeof(Writer));
+    Reader* readers = calloc(readerCount, sizeof(Reader));
+    for (i = 0; i < writerCount; i++) {
+        writers[i].id = i;
+        writers[i].seed = i + 1;
+        writers[i].present = calloc(KEY_COUNT, 1);
+        pthread_create(&writers[i].thread, NULL, writerThread, &writers[i]);
+    }
+    for (i = 0; i < readerCount; i++) {
+        readers[i].seed = 1000 + i;
+        pthread_create(&readers[i].thread, NULL, readerThread, &readers[i]);
+    }
+
+    sleep(seconds);
+    stop = 1;
+
+    long writes = 0, reads = 0;
+    for (i = 0; i < writerCount; i++) {
+        pthread_join(writers[i].thread, NULL);
+        writes += writers[i].operations;
+    }
+    for (i = 0; i < readerCount; i++) {
+        pthread_join(readers[i].thread, NULL);
+        reads += readers[i].operations;
+    }
+    printf("%d writers, %d readers: %ld writes, %ld reads\n", writerCount,
+            readerCount, writes, reads);
+
+    // The map must hold the stable keys and whatever the writers left.
+    size_t expected = STABLE_COUNT;
+    for (i = STABLE_COUNT; i < KEY_COUNT; i++) {
+        bool present = false;
+        for (j = 0; j < writerCount; j++) {
+            present |= writers[j].present[i];
+        }
+        expected += present;
+        if (hashmapContainsKey(map, &keys[i]) != present) {
+            fail("left in the wrong state", i);
+        }
+    }
+    size_t seen = 0;
+    hashmapForEach(map, countEntry, &seen);
+    if (hashmapSize(map) != expected || seen != expected) {
+        fprintf(stderr, "size %zu, forEach saw %zu, expected %zu\n",
+                hashmapSize(map), seen, expected);
+        failed = 1;
+    }
+
+    // Memoizing from every thread at once must make each value once.
+    stop = 0;
+    int before = expected;
+    for (i = 0; i < writerCount; i++) {
+        pthread_create(&writers[i].thread, NULL, memoizeThread, NULL);
+    }
+    for (i = 0; i < writerCount; i++) {
+        pthread_join(writers[i].thread, NULL);
+    }
+    if (memoized != KEY_COUNT - before) {
+        fprintf(stderr, "memoized %d values, expected %d\n", memoized,
+                KEY_COUNT - before);
+        failed = 1;
+    }
+
+    for (i = 0; i < writerCount; i++) {
+        free(writers[i].present);
+    }
+    free(writers);
+    free(readers);
+    hashmapFree(map);
+
+    if (failed) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
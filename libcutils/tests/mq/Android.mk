@@ -0,0 +1,13 @@
+# Copyright 2012 The Android Open Source Project
+
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= mq_bench.c
+
+LOCAL_MODULE:= mq_bench
+
+LOCAL_STATIC_LIBRARIES := libcutils
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
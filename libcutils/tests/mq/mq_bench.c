@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures how many messages per second one mq peer can send another.
+ * Forks a master, a receiving peer and a sending peer, which queues the
+ * messages as fast as it can, copied by peerSendBytes() or, with -z,
+ * handed over by peerSendSharedBytes().  The receiver checks every message
+ * arrives whole and in order, and exits after the last one.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* mq.c has no public header; these match its definitions. */
+typedef struct {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+} Credentials;
+typedef void BytesListener(Credentials credentials, char* bytes, size_t size);
+typedef void DeathListener(pid_t pid);
+
+void masterPeerInitialize(BytesListener* bytesListener,
+        DeathListener* deathListener);
+void peerInitialize(BytesListener* bytesListener,
+        DeathListener* deathListener);
+int peerSendBytes(pid_t pid, const char* bytes, size_t size);
+int peerSendSharedBytes(pid_t pid, char* bytes, size_t size,
+        void (*free)(void* context), void* context);
+void peerLoop();
+
+static int messageCount = 200000;
+static size_t messageSize = 64;
+static int received;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void ignoreBytes(Credentials credentials, char* bytes, size_t size) {
+}
+
+static void ignoreDeath(pid_t pid) {
+}
+
+/* The messages share one allocation, freed at the end. */
+static void keepBytes(void* context) {
+}
+
+/* Each message starts with its sequence number. */
+static void receiveBytes(Credentials credentials, char* bytes, size_t size) {
+    int sequence;
+    memcpy(&sequence, bytes, sizeof(sequence));
+    if (size != messageSize || sequence != received) {
+        fprintf(stderr, "got message %d of %zu bytes, expected %d of %zu\n",
+                sequence, size, received, messageSize);
+        exit(1);
+    }
+    if (++received == messageCount) {
+        exit(0);
+    }
+}
+
+static void* loopThread(void* arg) {
+    peerLoop();
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: mq_bench [-n <messages>] [-s <bytes>] [-z]\n");
+}
+
+int main(int argc, char** argv) {
+    int shared = 0;
+    int ready[2];
+    int c, i;
+
+    while ((c = getopt(argc, argv, "n:s:z")) != -1) {
+        switch (c) {
+        case 'n':
+            messageCount = atoi(optarg);
+            break;
+        case 's':
+            messageSize = atoi(optarg);
+            break;
+        case 'z':
+            shared = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (messageCount <= 0 || messageSize < sizeof(int)) {
+        usage();
+        return 1;
+    }
+
+    if (pipe(ready) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    pid_t master = fork();
+    if (master == 0) {
+        masterPeerInitialize(ignoreBytes, ignoreDeath);
+        write(ready[1], "m", 1);
+        peerLoop();
+        _exit(0);
+    }
+    read(ready[0], &c, 1);
+
+    pid_t receiver = fork();
+    if (receiver == 0) {
+        peerInitialize(receiveBytes, ignoreDeath);
+        write(ready[1], "r", 1);
+        peerLoop();
+        _exit(1);
+    }
+    read(ready[0], &c, 1);
+
+    char* messages = calloc(messageCount, messageSize);
+    if (messages == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < messageCount; i++) {
+        memcpy(messages + (size_t) i * messageSize, &i, sizeof(i));
+    }
+
+    // Give the master a moment to accept the receiver.
+    usleep(100000);
+
+    // The sender dies with the master, so it gets a process of its own too.
+    double start = now();
+    pid_t sender = fork();
+    if (sender == 0) {
+        peerInitialize(ignoreBytes, ignoreDeath);
+        pthread_t thread;
+        pthread_create(&thread, NULL, loopThread, NULL);
+        for (i = 0; i < messageCount; i++) {
+            char* message = messages + (size_t) i * messageSize;
+            int result = shared
+                    ? peerSendSharedBytes(receiver, message, messageSize,
+                            keepBytes, NULL)
+                    : peerSendBytes(receiver, message, messageSize);
+            if (result != 0) {
+                perror("send");
+                _exit(1);
+            }
+        }
+        pthread_join(thread, NULL);
+        _exit(1);
+    }
+    int status;
+    waitpid(receiver, &status, 0);
+    double elapsed = now() - start;
+
+    kill(sender, SIGKILL);
+    kill(master, SIGKILL);
+    waitpid(sender, NULL, 0);
+    waitpid(master, NULL, 0);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "receiver failed\n");
+        return 1;
+    }
+    fprintf(stderr, "%d messages of %zu bytes (%s): %.0f messages/s\n",
+            messageCount, messageSize, shared ? "shared" : "copied",
+            messageCount / elapsed);
+    free(messages);
+    return 0;
+}
@@ -0,0 +1,13 @@
+# Copyright 2012 The Android Open Source Project
+
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= properties_bench.c
+
+LOCAL_MODULE:= properties_bench
+
+LOCAL_SHARED_LIBRARIES := libcutils
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Times property_get() against property_cache_get() for a few properties
+ * (by default one early in the property area, one late and one missing),
+ * checking both return the same value.  Properties can be named on the
+ * command line instead.
+ */
+
+#include <cutils/properties.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static const char* defaultKeys[] = {
+    "ro.debuggable",
+    "debug.atrace.tags.enableflags",
+    "debug.properties_bench.missing",
+};
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int bench(const char* key, int count) {
+    char expected[PROPERTY_VALUE_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    int i;
+
+    struct property_cache* cache = property_cache_create(key);
+    if (cache == NULL) {
+        fprintf(stderr, "%s: couldn't create cache\n", key);
+        return -1;
+    }
+
+    property_get(key, expected, "default");
+    property_cache_get(cache, value, "default");
+    if (strcmp(expected, value) != 0) {
+        fprintf(stderr, "%s: property_get got '%s', cache got '%s'\n", key,
+                expected, value);
+        property_cache_free(cache);
+        return -1;
+    }
+
+    double start = now();
+    for (i = 0; i < count; i++) {
+        property_get(key, value, "default");
+    }
+    double uncached = now() - start;
+
+    start = now();
+    for (i = 0; i < count; i++) {
+        property_cache_get(cache, value, "default");
+    }
+    double cached = now() - start;
+
+    printf("%-40s get %7.1f ns  cached %6.1f ns\n", key,
+            uncached * 1e9 / count, cached * 1e9 / count);
+    property_cache_free(cache);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int count = 1000000;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: properties_bench [-n <lookups>] "
+                    "[<property>...]\n");
+            return 1;
+        }
+    }
+
+    int result = 0;
+    if (optind < argc) {
+        for (i = optind; i < argc; i++) {
+            result |= bench(argv[i], count);
+        }
+    } else {
+        for (i = 0; i < (int) (sizeof(defaultKeys) / sizeof(defaultKeys[0]));
+                i++) {
+            result |= bench(defaultKeys[i], count);
+        }
+    }
+    return result != 0;
+}
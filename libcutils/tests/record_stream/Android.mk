@@ -0,0 +1,14 @@
+# Copyright 2012 The Android Open Source Project
+
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= record_stream_bench.c
+
+LOCAL_MODULE:= record_stream_bench
+
+LOCAL_STATIC_LIBRARIES := libcutils
+LOCAL_LDLIBS := -lpthread
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
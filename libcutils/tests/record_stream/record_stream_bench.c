@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Streams length-prefixed records of random sizes through a pipe and reads
+ * them back with record_stream_get_next() and record_stream_get_batch(),
+ * checking each record's length and contents.  Prints records per second
+ * and how many read() calls each took.
+ */
+
+#include <arpa/inet.h>
+#include <cutils/record_stream.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define BATCH_SIZE 64
+
+static unsigned char* stream;
+static size_t streamSize;
+static int recordCount = 200000;
+static size_t maxRecordLen = 512;
+static long reads;
+
+/* Counts the reads record_stream makes. */
+ssize_t read(int fd, void* buf, size_t count) {
+    static ssize_t (*realRead)(int, void*, size_t);
+    if (realRead == NULL) {
+        realRead = (ssize_t (*)(int, void*, size_t)) dlsym(RTLD_NEXT, "read");
+    }
+    reads++;
+    return realRead(fd, buf, count);
+}
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Lays out every record: a big endian length, then bytes from its index. */
+static void makeStream(void) {
+    size_t offset = 0;
+    int i;
+
+    srand(1);
+    stream = malloc((size_t) recordCount * (maxRecordLen + 4));
+    if (stream == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < recordCount; i++) {
+        uint32_t len = rand() % (maxRecordLen + 1);
+        uint32_t header = htonl(len);
+        memcpy(stream + offset, &header, 4);
+        memset(stream + offset + 4, i & 0xff, len);
+        offset += 4 + len;
+    }
+    streamSize = offset;
+}
+
+static void* writerThread(void* arg) {
+    int fd = (int) (intptr_t) arg;
+    size_t offset = 0;
+    while (offset < streamSize) {
+        ssize_t written = write(fd, stream + offset, streamSize - offset);
+        if (written < 0) {
+            perror("write");
+            exit(1);
+        }
+        offset += written;
+    }
+    close(fd);
+    return NULL;
+}
+
+/* Checks record i against the stream, returning the offset after it. */
+static size_t check(int i, size_t offset, void* record, size_t len) {
+    uint32_t header;
+    memcpy(&header, stream + offset, 4);
+    if (len != ntohl(header) || (len > 0
+            && (((unsigned char*) record)[0] != (i & 0xff)
+                || ((unsigned char*) record)[len - 1] != (i & 0xff)))) {
+        fprintf(stderr, "record %d is wrong\n", i);
+        exit(1);
+    }
+    return offset + 4 + len;
+}
+
+static void bench(int batch) {
+    int fds[2];
+    pthread_t thread;
+    size_t offset = 0;
+    int i = 0;
+
+    pipe(fds);
+    RecordStream* rs = record_stream_new(fds[0], maxRecordLen);
+    pthread_create(&thread, NULL, writerThread, (void*) (intptr_t) fds[1]);
+
+    reads = 0;
+    double start = now();
+    while (1) {
+        void* records[BATCH_SIZE];
+        size_t lens[BATCH_SIZE];
+        int count, j;
+
+        if (batch) {
+            count = record_stream_get_batch(rs, records, lens, BATCH_SIZE);
+        } else {
+            count = record_stream_get_next(rs, records, lens);
+            if (count == 0) {
+                count = records[0] == NULL ? 0 : 1;
+            }
+        }
+        if (count < 0 && errno == EAGAIN) {
+            continue;
+        } else if (count < 0) {
+            perror("record_stream");
+            exit(1);
+        } else if (count == 0) {
+            break;
+        }
+        for (j = 0; j < count; j++) {
+            offset = check(i++, offset, records[j], lens[j]);
+        }
+    }
+    double elapsed = now() - start;
+
+    pthread_join(thread, NULL);
+    record_stream_free(rs);
+    close(fds[0]);
+    if (i != recordCount) {
+        fprintf(stderr, "got %d of %d records\n", i, recordCount);
+        exit(1);
+    }
+    printf("%-8s %8.0f records/s  %6.2f records/read\n",
+            batch ? "batch" : "next", recordCount / elapsed,
+            (double) recordCount / reads);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: record_stream_bench [-n <records>] "
+            "[-s <max record length>]\n");
+}
+
+int main(int argc, char** argv) {
+    int c;
+
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            recordCount = atoi(optarg);
+            break;
+        case 's':
+            maxRecordLen = atoi(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (recordCount <= 0 || maxRecordLen <= 0 || maxRecordLen > 0xffff) {
+        usage();
+        return 1;
+    }
+
+    makeStream();
+    printf("%d records of up to %zu bytes\n", recordCount, maxRecordLen);
+    bench(0);
+    bench(1);
+    free(stream);
+    return 0;
+}
@@ -0,0 +1,14 @@
+# Copyright 2012 The Android Open Source Project
+
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= str_parms_bench.c
+
+LOCAL_MODULE:= str_parms_bench
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Counts the heap allocations, and times, str_parms makes parsing and
+ * serializing audio HAL style parameter strings.  malloc and friends are
+ * replaced with counting wrappers around glibc's, so this only builds for
+ * glibc hosts.
+ */
+
+#include <cutils/str_parms.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static unsigned long allocations;
+
+void* malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+
+static const char* strings[] = {
+    "routing=2",
+    "screen_state=on;bt_headset_nrec=off",
+    "sampling_rate=48000;format=1;channels=3;frame_count=960;routing=2",
+    "g_sco_samplerate=16000;bt_wbs=on;bt_headset_name=Car Kit;"
+            "bt_headset_nrec=on;tty_mode=tty_off;fm_volume=0.5000000000;"
+            "hfp_enable=false;hfp_volume=11",
+};
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void bench(const char* string, int rounds) {
+    unsigned long parseAllocs = 0, serializeAllocs = 0, setAllocs = 0;
+    double parseTime = 0, serializeTime = 0;
+    int round;
+
+    for (round = 0; round < rounds; round++) {
+        unsigned long start = allocations;
+        double startTime = now();
+        struct str_parms* parms = str_parms_create_str(string);
+        parseTime += now() - startTime;
+        parseAllocs += allocations - start;
+
+        start = allocations;
+        startTime = now();
+        char* out = str_parms_to_str(parms);
+        serializeTime += now() - startTime;
+        serializeAllocs += allocations - start;
+
+        // Replacing a value, as a HAL does on set_parameters.
+        start = allocations;
+        str_parms_add_int(parms, "routing", round);
+        setAllocs += allocations - start;
+
+        free(out);
+        str_parms_destroy(parms);
+    }
+
+    printf("%3zu bytes: parse %5.1f allocs %6.2f us, serialize %5.1f allocs "
+            "%6.2f us, replace %4.1f allocs\n", strlen(string),
+            (double) parseAllocs / rounds, parseTime * 1000000 / rounds,
+            (double) serializeAllocs / rounds,
+            serializeTime * 1000000 / rounds, (double) setAllocs / rounds);
+}
+
+int main(int argc, char** argv) {
+    int rounds = 100000;
+    size_t i;
+
+    if (argc > 1) {
+        rounds = atoi(argv[1]);
+    }
+    if (rounds <= 0) {
+        fprintf(stderr, "Usage: str_parms_bench [rounds]\n");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        bench(strings[i], rounds);
+    }
+    return 0;
+}
@@ -38,6 +38,12 @@ static volatile int32_t atrace_is_enabled    = 1;
 static pthread_once_t   atrace_once_control  = PTHREAD_ONCE_INIT;
 static pthread_mutex_t  atrace_tags_mutex    = PTHREAD_MUTEX_INITIALIZER;
 
+// Caches for the properties read on every tag update, made by
+// atrace_init_once.  NULL if they couldn't be allocated.
+static struct property_cache* atrace_tags_property;
+static struct property_cache* atrace_debuggable_property;
+static struct property_cache* atrace_cmdlines_property;
+
 // Set whether this process is debuggable, which determines whether
 // application-level tracing is allowed when the ro.debuggable system property
 // is not set to '1'.
@@ -55,6 +61,17 @@ void atrace_set_tracing_enabled(bool enabled)
     atrace_update_tags();
 }
 
+// Read a property through its cache if it has one.
+static void atrace_property_get(struct property_cache* cache, const char* key,
+        char* value, const char* default_value)
+{
+    if (cache != NULL) {
+        property_cache_get(cache, value, default_value);
+    } else {
+        property_get(key, value, default_value);
+    }
+}
+
 // Check whether the given command line matches one of the comma-separated
 // values listed in the app_cmdlines property.
 static bool atrace_is_cmdline_match(const char* cmdline)
@@ -62,7 +79,8 @@ static bool atrace_is_cmdline_match(const char* cmdline)
     char value[PROPERTY_VALUE_MAX];
     char* start = value;
 
-    property_get("debug.atrace.app_cmdlines", value, "");
+    atrace_property_get(atrace_cmdlines_property, "debug.atrace.app_cmdlines",
+            value, "");
 
     while (start != NULL) {
         char* end = strchr(start, ',');
@@ -91,7 +109,8 @@ static bool atrace_is_app_tracing_enabled()
     bool result = false;
 
     // Check whether the system is debuggable.
-    property_get("ro.debuggable", value, "0");
+    atrace_property_get(atrace_debuggable_property, "ro.debuggable", value,
+            "0");
     if (value[0] == '1') {
         sys_debuggable = true;
     }
@@ -123,7 +142,8 @@ static uint64_t atrace_get_property()
     char *endptr;
     uint64_t tags;
 
-    property_get("debug.atrace.tags.enableflags", value, "0");
+    atrace_property_get(atrace_tags_property, "debug.atrace.tags.enableflags",
+            value, "0");
     errno = 0;
     tags = strtoull(value, &endptr, 0);
     if (value[0] == '\0' || *endptr != '\0') {
@@ -167,6 +187,12 @@ void atrace_update_tags()
 
 static void atrace_init_once()
 {
+    atrace_tags_property =
+            property_cache_create("debug.atrace.tags.enableflags");
+    atrace_debuggable_property = property_cache_create("ro.debuggable");
+    atrace_cmdlines_property =
+            property_cache_create("debug.atrace.app_cmdlines");
+
     atrace_marker_fd = open("/sys/kernel/debug/tracing/trace_marker", O_WRONLY);
     if (atrace_marker_fd == -1) {
         ALOGE("Error opening trace file: %s (%d)", strerror(errno), errno);
@@ -7,8 +7,12 @@ libsparse_src_files := \
         output_file.c \
         sparse.c \
         sparse_crc32.c \
+        sparse_decoder.c \
+        sparse_delta.c \
         sparse_err.c \
-        sparse_read.c
+        sparse_index.c \
+        sparse_read.c \
+        write_pipeline.c
 
 
 include $(CLEAR_VARS)
@@ -48,6 +52,7 @@ LOCAL_MODULE_STEM := simg2img
 LOCAL_STATIC_LIBRARIES := \
     libsparse_host \
     libz
+LOCAL_LDLIBS := -lpthread
 include $(BUILD_HOST_EXECUTABLE)
 
 
@@ -69,6 +74,7 @@ LOCAL_MODULE_STEM := img2simg
 LOCAL_STATIC_LIBRARIES := \
     libsparse_host \
     libz
+LOCAL_LDLIBS := -lpthread
 include $(BUILD_HOST_EXECUTABLE)
 
 
@@ -87,6 +93,43 @@ LOCAL_MODULE := simg2simg
 LOCAL_STATIC_LIBRARIES := \
     libsparse_host \
     libz
+LOCAL_LDLIBS := -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := simg_apply.c
+LOCAL_MODULE := simg_apply
+LOCAL_STATIC_LIBRARIES := \
+    libsparse_host \
+    libz
+include $(BUILD_HOST_EXECUTABLE)
+
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := simg_bench.c
+LOCAL_MODULE := simg_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_STATIC_LIBRARIES := \
+    libsparse_host \
+    libz
+LOCAL_LDLIBS := -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := sparse_crc32_test.c \
+	sparse_crc32.c
+LOCAL_MODULE := sparse_crc32_test
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := backed_block_bench.c \
+	backed_block.c
+LOCAL_MODULE := backed_block_bench
+LOCAL_MODULE_TAGS := optional
 include $(BUILD_HOST_EXECUTABLE)
 
 
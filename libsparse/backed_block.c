@@ -23,6 +23,16 @@
 #include "backed_block.h"
 #include "sparse_defs.h"
 
+/*
+ * Backed blocks are kept in a skiplist sorted by block number, so that adding
+ * blocks out of order doesn't have to walk the whole list.  next[0] is the
+ * plain sorted list that the iterators walk, next[1..height-1] are the express
+ * lanes.  Each level holds roughly 1 in SKIPLIST_P_INV of the blocks of the
+ * level below it.
+ */
+#define SKIPLIST_MAX_HEIGHT 16
+#define SKIPLIST_P_INV 4
+
 struct backed_block {
 	unsigned int block;
 	unsigned int len;
@@ -43,23 +53,25 @@ struct backed_block {
 			uint32_t val;
 		} fill;
 	};
-	struct backed_block *next;
+	unsigned int height;
+	struct backed_block *next[];
 };
 
 struct backed_block_list {
-	struct backed_block *data_blocks;
-	struct backed_block *last_used;
+	struct backed_block *head[SKIPLIST_MAX_HEIGHT];
+	unsigned int height;
+	uint32_t rand_state;
 	unsigned int block_size;
 };
 
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl)
 {
-	return bbl->data_blocks;
+	return bbl->head[0];
 }
 
 struct backed_block *backed_block_iter_next(struct backed_block *bb)
 {
-	return bb->next;
+	return bb->next[0];
 }
 
 unsigned int backed_block_len(struct backed_block *bb)
@@ -124,66 +136,165 @@ struct backed_block_list *backed_block_list_new(unsigned int block_size)
 {
 	struct backed_block_list *b = calloc(sizeof(struct backed_block_list), 1);
 	b->block_size = block_size;
+	b->height = 1;
+	b->rand_state = 0x2545f491;
 	return b;
 }
 
 void backed_block_list_destroy(struct backed_block_list *bbl)
 {
-	if (bbl->data_blocks) {
-		struct backed_block *bb = bbl->data_blocks;
-		while (bb) {
-			struct backed_block *next = bb->next;
-			backed_block_destroy(bb);
-			bb = next;
-		}
+	struct backed_block *bb = bbl->head[0];
+	while (bb) {
+		struct backed_block *next = bb->next[0];
+		backed_block_destroy(bb);
+		bb = next;
 	}
 
 	free(bbl);
 }
 
+/* Picks a height with P(height > n) = 1 / SKIPLIST_P_INV^n */
+static unsigned int random_height(struct backed_block_list *bbl)
+{
+	unsigned int height = 1;
+	uint32_t x;
+
+	/* xorshift32, so the layout is the same from run to run */
+	x = bbl->rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	bbl->rand_state = x;
+
+	while (height < SKIPLIST_MAX_HEIGHT && (x % SKIPLIST_P_INV) == 0) {
+		x /= SKIPLIST_P_INV;
+		height++;
+	}
+
+	return height;
+}
+
+static struct backed_block *backed_block_alloc(struct backed_block_list *bbl)
+{
+	unsigned int height = random_height(bbl);
+	struct backed_block *bb;
+
+	bb = calloc(1, sizeof(struct backed_block) +
+			height * sizeof(struct backed_block *));
+	if (bb == NULL) {
+		return NULL;
+	}
+
+	bb->height = height;
+
+	return bb;
+}
+
+/*
+ * Finds, at every level, the link that points at the first block numbered
+ * block or higher, and returns the last block numbered lower than block, or
+ * NULL if there is none.
+ */
+static struct backed_block *find_links(struct backed_block_list *bbl,
+		unsigned int block, struct backed_block **links[])
+{
+	struct backed_block **next = bbl->head;
+	struct backed_block *prev = NULL;
+	int i;
+
+	for (i = SKIPLIST_MAX_HEIGHT - 1; i >= 0; i--) {
+		if (i < (int)bbl->height) {
+			while (next[i] && next[i]->block < block) {
+				prev = next[i];
+				next = prev->next;
+			}
+		}
+		links[i] = &next[i];
+	}
+
+	return prev;
+}
+
+/* Links bb in at links, as returned by find_links for bb->block */
+static void link_bb(struct backed_block_list *bbl, struct backed_block *bb,
+		struct backed_block **links[])
+{
+	unsigned int i;
+
+	for (i = 0; i < bb->height; i++) {
+		bb->next[i] = *links[i];
+		*links[i] = bb;
+	}
+
+	if (bb->height > bbl->height) {
+		bbl->height = bb->height;
+	}
+}
+
+static void unlink_bb(struct backed_block_list *bbl, struct backed_block *bb)
+{
+	struct backed_block **links[SKIPLIST_MAX_HEIGHT];
+	struct backed_block **link;
+	unsigned int i;
+
+	find_links(bbl, bb->block, links);
+
+	/* Several blocks can start at the same block number, skip past the
+	 * ones that aren't bb */
+	for (i = 0; i < bb->height; i++) {
+		for (link = links[i]; *link != bb; link = &(*link)->next[i])
+			;
+		*link = bb->next[i];
+	}
+}
+
 void backed_block_list_move(struct backed_block_list *from,
 		struct backed_block_list *to, struct backed_block *start,
 		struct backed_block *end)
 {
+	struct backed_block **from_links[SKIPLIST_MAX_HEIGHT];
+	struct backed_block **to_links[SKIPLIST_MAX_HEIGHT];
+	struct backed_block *first[SKIPLIST_MAX_HEIGHT] = { NULL };
+	struct backed_block *last[SKIPLIST_MAX_HEIGHT] = { NULL };
+	struct backed_block **link;
 	struct backed_block *bb;
+	unsigned int i;
 
 	if (start == NULL) {
-		start = from->data_blocks;
-	}
-
-	if (!end) {
-		for (end = start; end && end->next; end = end->next)
-			;
+		start = from->head[0];
 	}
 
-	if (start == NULL || end == NULL) {
+	if (start == NULL) {
 		return;
 	}
 
-	from->last_used = NULL;
-	to->last_used = NULL;
-	if (from->data_blocks == start) {
-		from->data_blocks = end->next;
-	} else {
-		for (bb = from->data_blocks; bb; bb = bb->next) {
-			if (bb->next == start) {
-				bb->next = end->next;
-				break;
+	/* Find the first and last block of the range on every level */
+	for (bb = start; bb; bb = bb->next[0]) {
+		for (i = 0; i < bb->height; i++) {
+			if (!first[i]) {
+				first[i] = bb;
 			}
+			last[i] = bb;
+		}
+		if (bb == end) {
+			break;
 		}
 	}
 
-	if (!to->data_blocks) {
-		to->data_blocks = start;
-		end->next = NULL;
-	} else {
-		for (bb = to->data_blocks; bb; bb = bb->next) {
-			if (!bb->next || bb->next->block > start->block) {
-				end->next = bb->next;
-				bb->next = start;
-				break;
-			}
-		}
+	find_links(from, start->block, from_links);
+	find_links(to, start->block, to_links);
+
+	for (i = 0; i < SKIPLIST_MAX_HEIGHT && first[i]; i++) {
+		for (link = from_links[i]; *link != first[i]; link = &(*link)->next[i])
+			;
+		*link = last[i]->next[i];
+
+		last[i]->next[i] = *to_links[i];
+		*to_links[i] = first[i];
+	}
+
+	if (i > to->height) {
+		to->height = i;
 	}
 }
 
@@ -237,7 +348,7 @@ static int merge_bb(struct backed_block_list *bbl,
 	/* Blocks are compatible and adjacent, with a before b.  Merge b into a,
 	 * and free b */
 	a->len += b->len;
-	a->next = b->next;
+	unlink_bb(bbl, b);
 
 	backed_block_destroy(b);
 
@@ -246,40 +357,14 @@ static int merge_bb(struct backed_block_list *bbl,
 
 static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 {
-	struct backed_block *bb;
+	struct backed_block **links[SKIPLIST_MAX_HEIGHT];
+	struct backed_block *prev;
 
-	if (bbl->data_blocks == NULL) {
-		bbl->data_blocks = new_bb;
-		return 0;
-	}
+	prev = find_links(bbl, new_bb->block, links);
+	link_bb(bbl, new_bb, links);
 
-	if (bbl->data_blocks->block > new_bb->block) {
-		new_bb->next = bbl->data_blocks;
-		bbl->data_blocks = new_bb;
-		return 0;
-	}
-
-	/* Optimization: blocks are mostly queued in sequence, so save the
-	   pointer to the last bb that was added, and start searching from
-	   there if the next block number is higher */
-	if (bbl->last_used && new_bb->block > bbl->last_used->block)
-		bb = bbl->last_used;
-	else
-		bb = bbl->data_blocks;
-	bbl->last_used = new_bb;
-
-	for (; bb->next && bb->next->block < new_bb->block; bb = bb->next)
-		;
-
-	if (bb->next == NULL) {
-		bb->next = new_bb;
-	} else {
-		new_bb->next = bb->next;
-		bb->next = new_bb;
-	}
-
-	merge_bb(bbl, new_bb, new_bb->next);
-	merge_bb(bbl, bb, new_bb);
+	merge_bb(bbl, new_bb, new_bb->next[0]);
+	merge_bb(bbl, prev, new_bb);
 
 	return 0;
 }
@@ -288,7 +373,7 @@ static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_alloc(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -297,7 +382,6 @@ int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 	bb->len = len;
 	bb->type = BACKED_BLOCK_FILL;
 	bb->fill.val = fill_val;
-	bb->next = NULL;
 
 	return queue_bb(bbl, bb);
 }
@@ -306,7 +390,7 @@ int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 int backed_block_add_data(struct backed_block_list *bbl, void *data,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_alloc(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -315,7 +399,6 @@ int backed_block_add_data(struct backed_block_list *bbl, void *data,
 	bb->len = len;
 	bb->type = BACKED_BLOCK_DATA;
 	bb->data.data = data;
-	bb->next = NULL;
 
 	return queue_bb(bbl, bb);
 }
@@ -324,7 +407,7 @@ int backed_block_add_data(struct backed_block_list *bbl, void *data,
 int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 		int64_t offset, unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_alloc(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -334,7 +417,6 @@ int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 	bb->type = BACKED_BLOCK_FILE;
 	bb->file.filename = strdup(filename);
 	bb->file.offset = offset;
-	bb->next = NULL;
 
 	return queue_bb(bbl, bb);
 }
@@ -343,7 +425,7 @@ int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_alloc(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -353,7 +435,6 @@ int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
 	bb->type = BACKED_BLOCK_FD;
 	bb->fd.fd = fd;
 	bb->fd.offset = offset;
-	bb->next = NULL;
 
 	return queue_bb(bbl, bb);
 }
@@ -361,7 +442,9 @@ int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
 int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 		unsigned int max_len)
 {
+	struct backed_block **links[SKIPLIST_MAX_HEIGHT];
 	struct backed_block *new_bb;
+	unsigned int height;
 
 	max_len = ALIGN_DOWN(max_len, bbl->block_size);
 
@@ -369,17 +452,17 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 		return 0;
 	}
 
-	new_bb = malloc(sizeof(struct backed_block));
-	if (bb == NULL) {
+	new_bb = backed_block_alloc(bbl);
+	if (new_bb == NULL) {
 		return -ENOMEM;
 	}
 
-	*new_bb = *bb;
+	height = new_bb->height;
+	memcpy(new_bb, bb, sizeof(struct backed_block));
+	new_bb->height = height;
 
 	new_bb->len = bb->len - max_len;
 	new_bb->block = bb->block + max_len / bbl->block_size;
-	new_bb->next = bb->next;
-	bb->next = new_bb;
 	bb->len = max_len;
 
 	switch (bb->type) {
@@ -396,5 +479,8 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 		break;
 	}
 
+	find_links(bbl, new_bb->block, links);
+	link_bb(bbl, new_bb, links);
+
 	return 0;
 }
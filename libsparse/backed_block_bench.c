@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "backed_block.h"
+
+/*
+ * Adds blocks to a backed block list in sequential, reverse and random order
+ * and checks that iterating the list afterwards returns every block once, in
+ * order.  Every other block is a fill block with its own fill value, so that
+ * no two blocks can be merged and the list ends up with one entry per block.
+ */
+
+#define BLOCK_SIZE 4096
+
+void usage()
+{
+	fprintf(stderr, "Usage: backed_block_bench [-n <blocks>]\n");
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int check_list(struct backed_block_list *bbl, unsigned int count)
+{
+	struct backed_block *bb;
+	unsigned int n = 0;
+
+	for (bb = backed_block_iter_new(bbl); bb; bb = backed_block_iter_next(bb)) {
+		if (backed_block_block(bb) != n * 2) {
+			fprintf(stderr, "block %u out of order: %u\n", n,
+					backed_block_block(bb));
+			return -1;
+		}
+		n++;
+	}
+
+	if (n != count) {
+		fprintf(stderr, "expected %u blocks, found %u\n", count, n);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench(const char *name, unsigned int *order, unsigned int count)
+{
+	struct backed_block_list *bbl;
+	double start, elapsed;
+	unsigned int i;
+	int ret;
+
+	bbl = backed_block_list_new(BLOCK_SIZE);
+	if (!bbl) {
+		return -1;
+	}
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		ret = backed_block_add_fill(bbl, order[i], BLOCK_SIZE, order[i] * 2);
+		if (ret < 0) {
+			backed_block_list_destroy(bbl);
+			return ret;
+		}
+	}
+	elapsed = now() - start;
+
+	ret = check_list(bbl, count);
+	printf("%-10s %8u blocks %8.3f s %10.0f blocks/s%s\n", name, count,
+			elapsed, count / elapsed, ret ? "  FAILED" : "");
+
+	backed_block_list_destroy(bbl);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int count = 1000000;
+	unsigned int *order;
+	unsigned int i, j, tmp;
+	int ret = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			exit(-1);
+		}
+	}
+
+	order = malloc(count * sizeof(unsigned int));
+	if (!order) {
+		fprintf(stderr, "Cannot allocate %u blocks\n", count);
+		exit(-1);
+	}
+
+	for (i = 0; i < count; i++) {
+		order[i] = i;
+	}
+	if (bench("sequential", order, count) < 0) {
+		ret = -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		order[i] = count - i - 1;
+	}
+	if (bench("reverse", order, count) < 0) {
+		ret = -1;
+	}
+
+	srand(1);
+	for (i = count - 1; i > 0; i--) {
+		j = ((unsigned int)rand() * (RAND_MAX + 1u) + rand()) % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	if (bench("random", order, count) < 0) {
+		ret = -1;
+	}
+
+	free(order);
+
+	exit(ret);
+}
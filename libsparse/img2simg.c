@@ -40,7 +40,9 @@
 
 void usage()
 {
-    fprintf(stderr, "Usage: img2simg <raw_image_file> <sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "Usage: img2simg [-s] [-t <threads>] <raw_image_file> <sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "  -s  leave holes and blocks of zeros out of the sparse image\n");
+    fprintf(stderr, "  -t  write with a pipeline of this many reader threads, 0 for one per cpu\n");
 }
 
 int main(int argc, char *argv[])
@@ -52,6 +54,23 @@ int main(int argc, char *argv[])
 	struct sparse_file *s;
 	unsigned int block_size = 4096;
 	off64_t len;
+	enum sparse_read_mode mode = SPARSE_READ_MODE_NORMAL;
+	int threads = -1;
+
+	while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+		if (strcmp(argv[1], "-s") == 0) {
+			mode = SPARSE_READ_MODE_HOLE;
+		} else if (strcmp(argv[1], "-t") == 0 && argc > 2) {
+			threads = atoi(argv[2]);
+			argc--;
+			argv++;
+		} else {
+			usage();
+			exit(-1);
+		}
+		argc--;
+		argv++;
+	}
 
 	if (argc < 3 || argc > 4) {
 		usage();
@@ -97,13 +116,17 @@ int main(int argc, char *argv[])
 	}
 
 	sparse_file_verbose(s);
-	ret = sparse_file_read(s, in, false, false);
+	ret = sparse_file_read(s, in, mode, false);
 	if (ret) {
 		fprintf(stderr, "Failed to read file\n");
 		exit(-1);
 	}
 
-	ret = sparse_file_write(s, out, false, true, false);
+	if (threads >= 0) {
+		ret = sparse_file_write_threaded(s, out, false, true, false, threads);
+	} else {
+		ret = sparse_file_write(s, out, false, true, false);
+	}
 	if (ret) {
 		fprintf(stderr, "Failed to write sparse file\n");
 		exit(-1);
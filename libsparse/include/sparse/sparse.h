@@ -19,8 +19,11 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
+struct sparse_decoder;
 struct sparse_file;
+struct sparse_index;
 
 /**
  * sparse_file_new - create a new sparse file cookie
@@ -150,13 +153,39 @@ int sparse_file_add_fd(struct sparse_file *s,
  * sparse file format.  If sparse is false, the file will be written by seeking
  * over unused chunks, producing a smaller file if the filesystem supports
  * sparse files.  If crc is true, the crc of the expanded data will be
- * calculated and appended in a crc chunk.
+ * calculated and appended in a crc chunk.  If neither gz nor crc is true, the
+ * data of file and fd chunks is copied to fd inside the kernel where possible
+ * (copy_file_range or sendfile), without passing through user space.
  *
  * Returns 0 on success, negative errno on error.
  */
 int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
 		bool crc);
 
+/**
+ * sparse_file_write_threaded - write a sparse file to a file using a pipeline
+ *
+ * @s - sparse file cookie
+ * @fd - file descriptor to write to
+ * @gz - write a gzipped file
+ * @sparse - write in the Android sparse file format
+ * @crc - append a crc chunk
+ * @threads - number of threads reading chunk data, or 0 for one per cpu
+ *
+ * Writes a sparse file to a file, producing exactly the same output as
+ * sparse_file_write with the same options.  The data behind file and fd
+ * chunks is read by a pool of threads ahead of the output, each thread
+ * calculating the crc of the data it read, while the calling thread writes
+ * (and if gz is true, compresses) the output and combines the crcs in order.  Large chunks are read 1MB at a time,
+ * and at most 64MB of chunk data is held in memory at any time.
+ *
+ * Callers must link with pthreads.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_write_threaded(struct sparse_file *s, int fd, bool gz,
+		bool sparse, bool crc, int threads);
+
 /**
  * sparse_file_len - return the length of a sparse file if written to disk
  *
@@ -185,30 +214,76 @@ int64_t sparse_file_len(struct sparse_file *s, bool sparse, bool crc);
  * crc of the expanded data will be calculated and appended in a crc chunk.
  * The callback 'write' will be called with data and length for each data,
  * and with data==NULL to skip over a region (only used for non-sparse format).
- * The callback should return negative on error, 0 on success.
+ * The callback should return negative on error, 0 on success.  Data that
+ * comes from a file or fd is read and passed to the callback a window of at
+ * most 1MB at a time, so memory use doesn't grow with the size of the chunks.
  *
  * Returns 0 on success, negative errno on error.
  */
 int sparse_file_callback(struct sparse_file *s, bool sparse, bool crc,
 		int (*write)(void *priv, const void *data, int len), void *priv);
 
+/**
+ * sparse_file_callback_threaded - call a callback for blocks using a pipeline
+ *
+ * @s - sparse file cookie
+ * @sparse - write in the Android sparse file format
+ * @crc - append a crc chunk
+ * @write - function to call for each block
+ * @priv - value that will be passed as the first argument to write
+ * @threads - number of threads reading chunk data, or 0 for one per cpu
+ *
+ * Passes the callback exactly the same bytes as sparse_file_callback,
+ * always from the calling thread, while the data behind file and fd chunks is
+ * read ahead by a pool of threads as in sparse_file_write_threaded.
+ *
+ * Callers must link with pthreads.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_callback_threaded(struct sparse_file *s, bool sparse, bool crc,
+		int (*write)(void *priv, const void *data, int len), void *priv,
+		int threads);
+
+/**
+ * enum sparse_read_mode - how sparse_file_read interprets its input
+ *
+ * SPARSE_READ_MODE_NORMAL - a raw image.  Block aligned chunks of all zeros or
+ *   another 32 bit value become fill chunks, anything else data chunks.
+ * SPARSE_READ_MODE_SPARSE - an image in the Android sparse file format.
+ * SPARSE_READ_MODE_HOLE - a raw image, like SPARSE_READ_MODE_NORMAL, except
+ *   that holes in the file and blocks of all zeros are left out of the sparse
+ *   file, so they are written as don't care chunks.
+ *
+ * SPARSE_READ_MODE_NORMAL and SPARSE_READ_MODE_SPARSE have the values false
+ * and true, so callers passing a bool for the mode keep working.
+ */
+enum sparse_read_mode {
+	SPARSE_READ_MODE_NORMAL = false,
+	SPARSE_READ_MODE_SPARSE = true,
+	SPARSE_READ_MODE_HOLE,
+};
+
 /**
  * sparse_file_read - read a file into a sparse file cookie
  *
  * @s - sparse file cookie
  * @fd - file descriptor to read from
- * @sparse - read a file in the Android sparse file format
+ * @mode - one of the sparse_read_mode values
  * @crc - verify the crc of a file in the Android sparse file format
  *
- * Reads a file into a sparse file cookie.  If sparse is true, the file is
- * assumed to be in the Android sparse file format.  If sparse is false, the
+ * Reads a file into a sparse file cookie.  If mode is SPARSE_READ_MODE_SPARSE,
+ * the file is assumed to be in the Android sparse file format.  Otherwise the
  * file will be sparsed by looking for block aligned chunks of all zeros or
- * another 32 bit value.  If crc is true, the crc of the sparse file will be
- * verified.
+ * another 32 bit value, without reading any holes in the file if the
+ * filesystem can report them.  In SPARSE_READ_MODE_HOLE, holes and blocks of
+ * zeros are skipped instead of being added as fill chunks.  If crc is true,
+ * the crc of the sparse file will be verified.
  *
  * Returns 0 on success, negative errno on error.
  */
-int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc);
+int sparse_file_read(struct sparse_file *s, int fd, enum sparse_read_mode mode,
+		bool crc);
 
 /**
  * sparse_file_import - import an existing sparse file
@@ -255,6 +330,193 @@ struct sparse_file *sparse_file_import_auto(int fd, bool crc);
 int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
 		struct sparse_file **out_s, int out_s_count);
 
+/**
+ * sparse_index_new - index an existing sparse file for random access
+ *
+ * @fd - file descriptor of a file in the Android sparse file format
+ * @verbose - print verbose errors while reading the sparse file
+ *
+ * Builds an index mapping blocks of the expanded file to chunks of the sparse
+ * file, from a single pass over the chunk headers.  The data in raw chunks is
+ * never read while indexing.  The fd is only accessed with positioned reads,
+ * so its file offset is not used, and it must stay open until the index is
+ * destroyed.
+ *
+ * Returns the index on success, NULL on error.
+ */
+struct sparse_index *sparse_index_new(int fd, bool verbose);
+
+/**
+ * sparse_index_destroy - destroy a sparse file index
+ *
+ * @idx - sparse file index
+ */
+void sparse_index_destroy(struct sparse_index *idx);
+
+/**
+ * sparse_index_len - return the length of the expanded file
+ *
+ * @idx - sparse file index
+ */
+int64_t sparse_index_len(struct sparse_index *idx);
+
+/**
+ * sparse_index_block_size - return the block size of the sparse file
+ *
+ * @idx - sparse file index
+ */
+unsigned int sparse_index_block_size(struct sparse_index *idx);
+
+/**
+ * sparse_index_block_mapped - check whether a block is in a data chunk
+ *
+ * @idx - sparse file index
+ * @block - block number in the expanded file
+ *
+ * Returns true if the block is in a raw or fill chunk, false if it is in a
+ * don't care chunk or past the last chunk.  Flashing the sparse file leaves
+ * blocks that aren't mapped untouched.
+ */
+bool sparse_index_block_mapped(struct sparse_index *idx, unsigned int block);
+
+/**
+ * sparse_index_read_block - read one block of the expanded file
+ *
+ * @idx - sparse file index
+ * @block - block number in the expanded file
+ * @buf - buffer of at least the block size
+ *
+ * Reads a single block of the expanded file.  Finding the chunk takes
+ * O(log n) in the number of chunks.  Don't care blocks read as zeros.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_index_read_block(struct sparse_index *idx, unsigned int block,
+		void *buf);
+
+/**
+ * sparse_index_pread - read a range of the expanded file
+ *
+ * @idx - sparse file index
+ * @buf - buffer to read into
+ * @count - number of bytes to read
+ * @offset - byte offset in the expanded file
+ *
+ * Reads count bytes at any offset of the expanded file, like pread(2) on the
+ * raw image, so it can back the read callback of a FUSE filesystem or an nbd
+ * server directly.  Safe to call from several threads at once.  Don't care
+ * regions read as zeros.
+ *
+ * Returns the number of bytes read, which is only short at the end of the
+ * expanded file, or negative errno on error.
+ */
+ssize_t sparse_index_pread(struct sparse_index *idx, void *buf, size_t count,
+		int64_t offset);
+
+/**
+ * sparse_file_delta - drop the blocks a base image already has
+ *
+ * @s - sparse file cookie
+ * @base_fd - file descriptor of the base image, in raw or sparse format
+ *
+ * Compares every block of the sparse file cookie with the block at the same
+ * offset in the base image, and removes the blocks that are identical, so that
+ * they become don't care when the sparse file is written.  Writing the result
+ * over a copy of the base image, or flashing it to a partition that holds the
+ * base image, gives the same contents as the full image.  Don't care blocks of
+ * a sparse base image never match, since their contents on the device are
+ * unknown.  A sparse base image must have the same block size.  The base image
+ * is only accessed with positioned reads.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_delta(struct sparse_file *s, int base_fd);
+
+/**
+ * sparse_decoder_new - create a streaming sparse file decoder
+ *
+ * @data - function called with the contents of raw chunks
+ * @fill - function called for fill chunks
+ * @skip - function called for don't care chunks
+ * @priv - value passed as the first argument to the callbacks
+ * @crc - verify the crc chunk, if there is one
+ * @verbose - print verbose errors while decoding
+ *
+ * Creates a decoder for a file in the Android sparse file format that is fed
+ * through sparse_decoder_write in pieces of any size, for example as they are
+ * read from a pipe or a socket.  The callbacks are called in order of the
+ * offset (in bytes) in the expanded file: data with up to len bytes of a raw
+ * chunk at a time, straight from the buffer passed to sparse_decoder_write,
+ * fill with the length and fill value of a whole fill chunk, and skip with the
+ * length of a don't care region.  Any callback may be NULL.  Callbacks should
+ * return negative on error, 0 on success.
+ *
+ * The decoder never buffers chunk data, so its memory use is constant no
+ * matter how large the image or its chunks are.
+ *
+ * Returns the decoder, or NULL on error.
+ */
+struct sparse_decoder *sparse_decoder_new(
+		int (*data)(void *priv, int64_t off, const void *data, int len),
+		int (*fill)(void *priv, int64_t off, int64_t len, uint32_t fill_val),
+		int (*skip)(void *priv, int64_t off, int64_t len),
+		void *priv, bool crc, bool verbose);
+
+/**
+ * sparse_decoder_write - feed bytes of a sparse file to a decoder
+ *
+ * @dec - sparse decoder
+ * @data - next bytes of the sparse file
+ * @len - number of bytes in data
+ *
+ * Decodes len more bytes of the sparse file, calling the callbacks for the
+ * chunks, or parts of chunks, they complete.  Bytes after the last chunk are
+ * ignored.
+ *
+ * Returns 0 on success, negative errno on error.  Once an error has been
+ * returned, every later call returns it again.
+ */
+int sparse_decoder_write(struct sparse_decoder *dec, const void *data,
+		size_t len);
+
+/**
+ * sparse_decoder_finish - finish decoding a sparse file
+ *
+ * @dec - sparse decoder
+ *
+ * Checks that the whole sparse file has been decoded, and calls skip for any
+ * blocks after the last chunk.
+ *
+ * Returns 0 on success, -EINVAL if the sparse file was truncated, or the error
+ * that stopped decoding.
+ */
+int sparse_decoder_finish(struct sparse_decoder *dec);
+
+/**
+ * sparse_decoder_destroy - destroy a sparse decoder
+ *
+ * @dec - sparse decoder
+ */
+void sparse_decoder_destroy(struct sparse_decoder *dec);
+
+/**
+ * sparse_decoder_len - return the length of the expanded file
+ *
+ * @dec - sparse decoder
+ *
+ * Returns 0 until the sparse file header has been decoded.
+ */
+int64_t sparse_decoder_len(struct sparse_decoder *dec);
+
+/**
+ * sparse_decoder_block_size - return the block size of the sparse file
+ *
+ * @dec - sparse decoder
+ *
+ * Returns 0 until the sparse file header has been decoded.
+ */
+unsigned int sparse_decoder_block_size(struct sparse_decoder *dec);
+
 /**
  * sparse_file_verbose - set a sparse file cookie to print verbose errors
  *
@@ -264,6 +526,21 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
  */
 void sparse_file_verbose(struct sparse_file *s);
 
+/**
+ * sparse_file_punch_holes - punch holes when writing a normal file
+ *
+ * @s - sparse file cookie
+ * @punch - true to punch holes
+ *
+ * When the sparse file cookie is written to a file descriptor as a normal
+ * (non-sparse) file, regions that are not covered by any chunk, and chunks
+ * filled with zeros, are deallocated with fallocate(FALLOC_FL_PUNCH_HOLE)
+ * instead of being seeked over or written out as zeros.  They read back as
+ * zeros afterwards, even if the output already held other data.  Falls back to
+ * the normal behavior where hole punching is not supported.
+ */
+void sparse_file_punch_holes(struct sparse_file *s, bool punch);
+
 /**
  * sparse_print_verbose - function called to print verbose errors
  *
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #define _LARGEFILE64_SOURCE 1
 
@@ -39,6 +40,12 @@
 #define ftruncate64 ftruncate
 #endif
 
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
 #if defined(__APPLE__) && defined(__MACH__)
 #define lseek64 lseek
 #define ftruncate64 ftruncate
@@ -63,6 +70,13 @@ static inline void *mmap64(void *addr, size_t length, int prot, int flags,
 #define SPARSE_HEADER_LEN       (sizeof(sparse_header_t))
 #define CHUNK_HEADER_LEN (sizeof(chunk_header_t))
 
+/*
+ * Data backed by a file or fd is mapped and written this much at a time, so
+ * that writing a chunk doesn't need memory (or address space) for the whole
+ * chunk at once.  Must be a multiple of the page size.
+ */
+#define COPY_WINDOW_SIZE (1024 * 1024U)
+
 #define container_of(inner, outer_t, elem) \
 	((outer_t *)((char *)inner - offsetof(outer_t, elem)))
 
@@ -72,6 +86,10 @@ struct output_file_ops {
 	int (*pad)(struct output_file *, int64_t);
 	int (*write)(struct output_file *, void *, int);
 	void (*close)(struct output_file *);
+	/* Optional: copy from a file without passing through user space */
+	int (*copy)(struct output_file *, int fd, int64_t offset, unsigned int len);
+	/* Optional: skip over a region, leaving it reading as zeros */
+	int (*punch)(struct output_file *, int64_t);
 };
 
 struct sparse_file_ops {
@@ -80,7 +98,14 @@ struct sparse_file_ops {
 	int (*write_fill_chunk)(struct output_file *out, unsigned int len,
 			uint32_t fill_val);
 	int (*write_skip_chunk)(struct output_file *out, int64_t len);
+	int (*write_fd_chunk)(struct output_file *out, unsigned int len,
+			int fd, int64_t offset);
 	int (*write_end_chunk)(struct output_file *out);
+	/* A data chunk of len bytes, written a piece at a time */
+	int (*begin_data_chunk)(struct output_file *out, unsigned int len);
+	int (*write_data_part)(struct output_file *out, unsigned int len,
+			void *data);
+	int (*end_data_chunk)(struct output_file *out, unsigned int len);
 };
 
 struct output_file {
@@ -90,6 +115,8 @@ struct output_file {
 	struct output_file_ops *ops;
 	struct sparse_file_ops *sparse_ops;
 	int use_crc;
+	int external_crc;
+	int punch_holes;
 	unsigned int block_size;
 	int64_t len;
 	char *zero_buf;
@@ -180,12 +207,80 @@ static void file_close(struct output_file *out)
 	free(outn);
 }
 
+#ifdef __linux__
+/*
+ * Copies len bytes at offset in fd to the output with copy_file_range, or
+ * sendfile where that isn't possible (older kernels, pipes, copies across
+ * filesystems).  Returns -EOPNOTSUPP if neither works before anything was
+ * copied, so the caller can fall back to writing the data itself.
+ */
+static int file_copy(struct output_file *out, int fd, int64_t offset,
+		unsigned int len)
+{
+	struct output_file_normal *outn = to_output_file_normal(out);
+	off64_t in_off = offset;
+	unsigned int copied = 0;
+	ssize_t ret;
+
+#ifdef __NR_copy_file_range
+	while (copied < len) {
+		ret = syscall(__NR_copy_file_range, fd, &in_off, outn->fd, NULL,
+				(size_t)(len - copied), 0);
+		if (ret <= 0) {
+			break;
+		}
+		copied += ret;
+	}
+#endif
+
+	while (copied < len) {
+		ret = sendfile(outn->fd, fd, &in_off, len - copied);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			if (copied == 0 && (ret == 0 || errno == EINVAL ||
+					errno == ENOSYS)) {
+				return -EOPNOTSUPP;
+			}
+			error_errno("sendfile");
+			return -1;
+		}
+		copied += ret;
+	}
+
+	return 0;
+}
+
+static int file_punch(struct output_file *out, int64_t len)
+{
+	struct output_file_normal *outn = to_output_file_normal(out);
+	off64_t pos;
+
+	pos = lseek64(outn->fd, 0, SEEK_CUR);
+	if (pos < 0) {
+		return -errno;
+	}
+
+	if (fallocate(outn->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			pos, len) < 0) {
+		return -errno;
+	}
+
+	return file_skip(out, len);
+}
+#endif
+
 static struct output_file_ops file_ops = {
 	.open = file_open,
 	.skip = file_skip,
 	.pad = file_pad,
 	.write = file_write,
 	.close = file_close,
+#ifdef __linux__
+	.copy = file_copy,
+	.punch = file_punch,
+#endif
 };
 
 static int gz_file_open(struct output_file *out, int fd)
@@ -345,6 +440,140 @@ int read_all(int fd, void *buf, size_t len)
 	return 0;
 }
 
+/*
+ * Maps len bytes at offset in fd, returning a pointer to the data.  *map and
+ * *map_len describe what has to be passed to unmap_fd_region afterwards.
+ */
+static char *map_fd_region(int fd, int64_t offset, unsigned int len,
+		char **map, int *map_len)
+{
+	int64_t aligned_offset;
+	int aligned_diff;
+
+	aligned_offset = offset & ~(4096 - 1);
+	aligned_diff = offset - aligned_offset;
+	*map_len = len + aligned_diff;
+
+#ifndef USE_MINGW
+	*map = mmap64(NULL, *map_len, PROT_READ, MAP_SHARED, fd,
+			aligned_offset);
+	if (*map == MAP_FAILED) {
+		return NULL;
+	}
+	return *map + aligned_diff;
+#else
+	off64_t pos;
+	int ret;
+	*map = malloc(len);
+	if (!*map) {
+		return NULL;
+	}
+	pos = lseek64(fd, offset, SEEK_SET);
+	if (pos < 0) {
+		free(*map);
+		return NULL;
+	}
+	ret = read_all(fd, *map, len);
+	if (ret < 0) {
+		free(*map);
+		errno = -ret;
+		return NULL;
+	}
+	return *map;
+#endif
+}
+
+static void unmap_fd_region(char *map, int map_len)
+{
+#ifndef USE_MINGW
+	munmap(map, map_len);
+#else
+	free(map);
+#endif
+}
+
+/*
+ * Copies len bytes at offset in fd to the output, without reading them into
+ * user space if the output supports it and no crc is needed.  Otherwise the
+ * data is mapped a window at a time, and *crc is updated with it if crc is
+ * not NULL.
+ */
+static int output_file_copy(struct output_file *out, int fd, int64_t offset,
+		unsigned int len, uint32_t *crc)
+{
+	unsigned int window;
+	char *map;
+	int map_len;
+	char *ptr;
+	int ret;
+
+	if (out->ops->copy && !crc) {
+		ret = out->ops->copy(out, fd, offset, len);
+		if (ret != -EOPNOTSUPP) {
+			return ret;
+		}
+	}
+
+	while (len > 0) {
+		window = min(len, COPY_WINDOW_SIZE);
+
+		ptr = map_fd_region(fd, offset, window, &map, &map_len);
+		if (!ptr) {
+			return -errno;
+		}
+
+		if (crc) {
+			*crc = sparse_crc32(*crc, ptr, window);
+		}
+
+		ret = out->ops->write(out, ptr, window);
+
+		unmap_fd_region(map, map_len);
+
+		if (ret < 0) {
+			return ret;
+		}
+
+		offset += window;
+		len -= window;
+	}
+
+	return 0;
+}
+
+uint32_t output_file_data_crc(struct output_file *out, uint32_t crc,
+		unsigned int len, void *data)
+{
+	unsigned int zero_len = ALIGN(len, out->block_size) - len;
+
+	crc = sparse_crc32(crc, data, len);
+	if (zero_len)
+		crc = sparse_crc32(crc, out->zero_buf, zero_len);
+
+	return crc;
+}
+
+uint32_t output_file_fill_crc(struct output_file *out, uint32_t crc,
+		unsigned int len, uint32_t fill_val)
+{
+	int count = out->block_size / sizeof(uint32_t);
+
+	while (count--)
+		crc = sparse_crc32(crc, &fill_val, sizeof(uint32_t));
+
+	return crc;
+}
+
+void output_file_external_crc(struct output_file *out)
+{
+	out->external_crc = 1;
+}
+
+void output_file_set_crc(struct output_file *out, uint32_t crc)
+{
+	out->crc32 = crc;
+}
+
 static int write_sparse_skip_chunk(struct output_file *out, int64_t skip_len)
 {
 	chunk_header_t chunk_header;
@@ -375,7 +604,7 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len,
 		uint32_t fill_val)
 {
 	chunk_header_t chunk_header;
-	int rnd_up_len, zero_len, count;
+	int rnd_up_len, zero_len;
 	int ret;
 	unsigned int i;
 
@@ -395,11 +624,8 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len,
 	if (ret < 0)
 		return -1;
 
-	if (out->use_crc) {
-		count = out->block_size / sizeof(uint32_t);
-		while (count--)
-			out->crc32 = sparse_crc32(out->crc32, &fill_val, sizeof(uint32_t));
-	}
+	if (out->use_crc && !out->external_crc)
+		out->crc32 = output_file_fill_crc(out, out->crc32, len, fill_val);
 
 	out->cur_out_ptr += rnd_up_len;
 	out->chunk_cnt++;
@@ -407,38 +633,56 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len,
 	return 0;
 }
 
-static int write_sparse_data_chunk(struct output_file *out, unsigned int len,
-		void *data)
+static int write_sparse_begin_data_chunk(struct output_file *out,
+		unsigned int len)
 {
 	chunk_header_t chunk_header;
-	int rnd_up_len, zero_len;
+	int rnd_up_len;
 	int ret;
 
 	/* Round up the data length to a multiple of the block size */
 	rnd_up_len = ALIGN(len, out->block_size);
-	zero_len = rnd_up_len - len;
 
-	/* Finally we can safely emit a chunk of data */
 	chunk_header.chunk_type = CHUNK_TYPE_RAW;
 	chunk_header.reserved1 = 0;
 	chunk_header.chunk_sz = rnd_up_len / out->block_size;
 	chunk_header.total_sz = CHUNK_HEADER_LEN + rnd_up_len;
 	ret = out->ops->write(out, &chunk_header, sizeof(chunk_header));
-
 	if (ret < 0)
 		return -1;
+
+	return 0;
+}
+
+static int write_sparse_data_part(struct output_file *out, unsigned int len,
+		void *data)
+{
+	int ret;
+
 	ret = out->ops->write(out, data, len);
 	if (ret < 0)
 		return -1;
+
+	if (out->use_crc && !out->external_crc)
+		out->crc32 = sparse_crc32(out->crc32, data, len);
+
+	return 0;
+}
+
+static int write_sparse_end_data_chunk(struct output_file *out,
+		unsigned int len)
+{
+	int rnd_up_len, zero_len;
+	int ret;
+
+	rnd_up_len = ALIGN(len, out->block_size);
+	zero_len = rnd_up_len - len;
+
 	if (zero_len) {
 		ret = out->ops->write(out, out->zero_buf, zero_len);
 		if (ret < 0)
 			return -1;
-	}
-
-	if (out->use_crc) {
-		out->crc32 = sparse_crc32(out->crc32, data, len);
-		if (zero_len)
+		if (out->use_crc && !out->external_crc)
 			out->crc32 = sparse_crc32(out->crc32, out->zero_buf, zero_len);
 	}
 
@@ -448,6 +692,41 @@ static int write_sparse_data_chunk(struct output_file *out, unsigned int len,
 	return 0;
 }
 
+static int write_sparse_data_chunk(struct output_file *out, unsigned int len,
+		void *data)
+{
+	int ret;
+
+	ret = write_sparse_begin_data_chunk(out, len);
+	if (ret < 0)
+		return ret;
+	ret = write_sparse_data_part(out, len, data);
+	if (ret < 0)
+		return ret;
+
+	return write_sparse_end_data_chunk(out, len);
+}
+
+static int write_sparse_fd_chunk(struct output_file *out, unsigned int len,
+		int fd, int64_t offset)
+{
+	uint32_t *crc = NULL;
+	int ret;
+
+	ret = write_sparse_begin_data_chunk(out, len);
+	if (ret < 0)
+		return ret;
+
+	if (out->use_crc && !out->external_crc)
+		crc = &out->crc32;
+
+	ret = output_file_copy(out, fd, offset, len, crc);
+	if (ret < 0)
+		return -1;
+
+	return write_sparse_end_data_chunk(out, len);
+}
+
 int write_sparse_end_chunk(struct output_file *out)
 {
 	chunk_header_t chunk_header;
@@ -478,25 +757,48 @@ static struct sparse_file_ops sparse_file_ops = {
 		.write_data_chunk = write_sparse_data_chunk,
 		.write_fill_chunk = write_sparse_fill_chunk,
 		.write_skip_chunk = write_sparse_skip_chunk,
+		.write_fd_chunk = write_sparse_fd_chunk,
 		.write_end_chunk = write_sparse_end_chunk,
+		.begin_data_chunk = write_sparse_begin_data_chunk,
+		.write_data_part = write_sparse_data_part,
+		.end_data_chunk = write_sparse_end_data_chunk,
 };
 
+static int write_normal_begin_data_chunk(struct output_file *out,
+		unsigned int len)
+{
+	return 0;
+}
+
+static int write_normal_data_part(struct output_file *out, unsigned int len,
+		void *data)
+{
+	return out->ops->write(out, data, len);
+}
+
+static int write_normal_end_data_chunk(struct output_file *out,
+		unsigned int len)
+{
+	unsigned int rnd_up_len = ALIGN(len, out->block_size);
+
+	if (rnd_up_len > len) {
+		return out->ops->skip(out, rnd_up_len - len);
+	}
+
+	return 0;
+}
+
 static int write_normal_data_chunk(struct output_file *out, unsigned int len,
 		void *data)
 {
 	int ret;
-	unsigned int rnd_up_len = ALIGN(len, out->block_size);
 
-	ret = out->ops->write(out, data, len);
+	ret = write_normal_data_part(out, len, data);
 	if (ret < 0) {
 		return ret;
 	}
 
-	if (rnd_up_len > len) {
-		ret = out->ops->skip(out, rnd_up_len - len);
-	}
-
-	return ret;
+	return write_normal_end_data_chunk(out, len);
 }
 
 static int write_normal_fill_chunk(struct output_file *out, unsigned int len,
@@ -506,6 +808,13 @@ static int write_normal_fill_chunk(struct output_file *out, unsigned int len,
 	unsigned int i;
 	unsigned int write_len;
 
+	if (fill_val == 0 && out->punch_holes && out->ops->punch) {
+		ret = out->ops->punch(out, len);
+		if (ret == 0) {
+			return 0;
+		}
+	}
+
 	/* Initialize fill_buf with the fill_val */
 	for (i = 0; i < out->block_size / sizeof(uint32_t); i++) {
 		out->fill_buf[i] = fill_val;
@@ -526,9 +835,28 @@ static int write_normal_fill_chunk(struct output_file *out, unsigned int len,
 
 static int write_normal_skip_chunk(struct output_file *out, int64_t len)
 {
+	if (out->punch_holes && out->ops->punch) {
+		if (out->ops->punch(out, len) == 0) {
+			return 0;
+		}
+	}
+
 	return out->ops->skip(out, len);
 }
 
+static int write_normal_fd_chunk(struct output_file *out, unsigned int len,
+		int fd, int64_t offset)
+{
+	int ret;
+
+	ret = output_file_copy(out, fd, offset, len, NULL);
+	if (ret < 0) {
+		return ret;
+	}
+
+	return write_normal_end_data_chunk(out, len);
+}
+
 int write_normal_end_chunk(struct output_file *out)
 {
 	return out->ops->pad(out, out->len);
@@ -538,9 +866,18 @@ static struct sparse_file_ops normal_file_ops = {
 		.write_data_chunk = write_normal_data_chunk,
 		.write_fill_chunk = write_normal_fill_chunk,
 		.write_skip_chunk = write_normal_skip_chunk,
+		.write_fd_chunk = write_normal_fd_chunk,
 		.write_end_chunk = write_normal_end_chunk,
+		.begin_data_chunk = write_normal_begin_data_chunk,
+		.write_data_part = write_normal_data_part,
+		.end_data_chunk = write_normal_end_data_chunk,
 };
 
+void output_file_punch_holes(struct output_file *out)
+{
+	out->punch_holes = 1;
+}
+
 void output_file_close(struct output_file *out)
 {
 	int ret;
@@ -560,6 +897,8 @@ static int output_file_init(struct output_file *out, int block_size,
 	out->chunk_cnt = 0;
 	out->crc32 = 0;
 	out->use_crc = crc;
+	out->external_crc = 0;
+	out->punch_holes = 0;
 
 	out->zero_buf = calloc(block_size, 1);
 	if (!out->zero_buf) {
@@ -700,52 +1039,32 @@ int write_fill_chunk(struct output_file *out, unsigned int len,
 	return out->sparse_ops->write_fill_chunk(out, len, fill_val);
 }
 
-int write_fd_chunk(struct output_file *out, unsigned int len,
-		int fd, int64_t offset)
+/*
+ * Write a contiguous region of len bytes of data blocks a piece at a time:
+ * write_data_chunk_begin, then write_data_chunk_part for each piece in order,
+ * then write_data_chunk_end with the same len
+ */
+int write_data_chunk_begin(struct output_file *out, unsigned int len)
 {
-	int ret;
-	int64_t aligned_offset;
-	int aligned_diff;
-	int buffer_size;
-	char *ptr;
-
-	aligned_offset = offset & ~(4096 - 1);
-	aligned_diff = offset - aligned_offset;
-	buffer_size = len + aligned_diff;
-
-#ifndef USE_MINGW
-	char *data = mmap64(NULL, buffer_size, PROT_READ, MAP_SHARED, fd,
-			aligned_offset);
-	if (data == MAP_FAILED) {
-		return -errno;
-	}
-	ptr = data + aligned_diff;
-#else
-	off64_t pos;
-	char *data = malloc(len);
-	if (!data) {
-		return -errno;
-	}
-	pos = lseek64(fd, offset, SEEK_SET);
-	if (pos < 0) {
-		return -errno;
-	}
-	ret = read_all(fd, data, len);
-	if (ret < 0) {
-		return ret;
-	}
-	ptr = data;
-#endif
+	return out->sparse_ops->begin_data_chunk(out, len);
+}
 
-	ret = out->sparse_ops->write_data_chunk(out, len, ptr);
+int write_data_chunk_part(struct output_file *out, unsigned int len,
+		void *data)
+{
+	return out->sparse_ops->write_data_part(out, len, data);
+}
 
-#ifndef USE_MINGW
-	munmap(data, buffer_size);
-#else
-	free(data);
-#endif
+int write_data_chunk_end(struct output_file *out, unsigned int len)
+{
+	return out->sparse_ops->end_data_chunk(out, len);
+}
 
-	return ret;
+/* Write a contiguous region of data blocks from a fd */
+int write_fd_chunk(struct output_file *out, unsigned int len,
+		int fd, int64_t offset)
+{
+	return out->sparse_ops->write_fd_chunk(out, len, fd, offset);
 }
 
 /* Write a contiguous region of data blocks from a file */
@@ -27,6 +27,10 @@ struct output_file *output_file_open_callback(int (*write)(void *, const void *,
 		void *priv, unsigned int block_size, int64_t len, int gz, int sparse,
 		int chunks, int crc);
 int write_data_chunk(struct output_file *out, unsigned int len, void *data);
+int write_data_chunk_begin(struct output_file *out, unsigned int len);
+int write_data_chunk_part(struct output_file *out, unsigned int len,
+		void *data);
+int write_data_chunk_end(struct output_file *out, unsigned int len);
 int write_fill_chunk(struct output_file *out, unsigned int len,
 		uint32_t fill_val);
 int write_file_chunk(struct output_file *out, unsigned int len,
@@ -34,8 +38,23 @@ int write_file_chunk(struct output_file *out, unsigned int len,
 int write_fd_chunk(struct output_file *out, unsigned int len,
 		int fd, int64_t offset);
 int write_skip_chunk(struct output_file *out, int64_t len);
+void output_file_punch_holes(struct output_file *out);
 void output_file_close(struct output_file *out);
 
+/*
+ * Writers that compute the crc of the expanded image themselves (see
+ * write_pipeline.c) mark the output file with output_file_external_crc before
+ * writing any chunks, and hand over the result with output_file_set_crc before
+ * closing it.  output_file_data_crc and output_file_fill_crc account for a
+ * single chunk exactly the way the chunk writers do.
+ */
+void output_file_external_crc(struct output_file *out);
+void output_file_set_crc(struct output_file *out, uint32_t crc);
+uint32_t output_file_data_crc(struct output_file *out, uint32_t crc,
+		unsigned int len, void *data);
+uint32_t output_file_fill_crc(struct output_file *out, uint32_t crc,
+		unsigned int len, uint32_t fill_val);
+
 int read_all(int fd, void *buf, size_t len);
 
 #endif
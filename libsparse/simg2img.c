@@ -14,6 +14,9 @@
  * limitations under the License.
  */
 
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
 #include <sparse/sparse.h>
 
 #include <fcntl.h>
@@ -30,9 +33,123 @@
 #define O_BINARY 0
 #endif
 
+#if defined(__APPLE__) && defined(__MACH__)
+#define lseek64 lseek
+#define ftruncate64 ftruncate
+#endif
+
+#define STREAM_BUF_SIZE (1024 * 1024)
+
 void usage()
 {
-  fprintf(stderr, "Usage: simg2img <sparse_image_files> <raw_image_file>\n");
+  fprintf(stderr, "Usage: simg2img [-p] [-t <threads>] <sparse_image_files> <raw_image_file>\n");
+  fprintf(stderr, "  -p  punch holes for regions the first image doesn't cover\n");
+  fprintf(stderr, "  -t  write with a pipeline of this many reader threads, 0 for one per cpu\n");
+}
+
+/*
+ * Input that can't be seeked, like a pipe, can't be imported as a sparse file
+ * cookie because raw chunks refer back to the input.  It is decoded as it is
+ * read instead, writing each chunk to the output as it arrives.
+ */
+struct stream_out {
+	int fd;
+	bool punch;
+	uint32_t *fill_buf;
+};
+
+static int write_at(int fd, int64_t off, const void *data, int len)
+{
+	const char *ptr = data;
+	int ret;
+
+	if (lseek64(fd, off, SEEK_SET) < 0) {
+		return -1;
+	}
+
+	while (len > 0) {
+		ret = write(fd, ptr, len);
+		if (ret < 0) {
+			return -1;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int stream_data(void *priv, int64_t off, const void *data, int len)
+{
+	struct stream_out *so = priv;
+
+	return write_at(so->fd, off, data, len);
+}
+
+static int stream_fill(void *priv, int64_t off, int64_t len, uint32_t fill_val)
+{
+	struct stream_out *so = priv;
+	unsigned int i;
+	int n;
+
+	/* The output was just truncated, so unwritten blocks are already holes */
+	if (fill_val == 0 && so->punch) {
+		return 0;
+	}
+
+	for (i = 0; i < STREAM_BUF_SIZE / sizeof(uint32_t); i++) {
+		so->fill_buf[i] = fill_val;
+	}
+
+	while (len > 0) {
+		n = len < STREAM_BUF_SIZE ? len : STREAM_BUF_SIZE;
+		if (write_at(so->fd, off, so->fill_buf, n) < 0) {
+			return -1;
+		}
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int stream_sparse_file(int in, int out, bool punch)
+{
+	struct sparse_decoder *dec;
+	struct stream_out so = {
+		.fd = out,
+		.punch = punch,
+	};
+	char *buf;
+	int ret = -1;
+	int n;
+
+	buf = malloc(STREAM_BUF_SIZE);
+	so.fill_buf = malloc(STREAM_BUF_SIZE);
+	dec = sparse_decoder_new(stream_data, stream_fill, NULL, &so, false, true);
+	if (!buf || !so.fill_buf || !dec) {
+		goto out;
+	}
+
+	while ((n = read(in, buf, STREAM_BUF_SIZE)) > 0) {
+		if (sparse_decoder_write(dec, buf, n) < 0) {
+			goto out;
+		}
+	}
+
+	if (n < 0 || sparse_decoder_finish(dec) < 0) {
+		goto out;
+	}
+
+	ret = ftruncate64(out, sparse_decoder_len(dec));
+
+out:
+	if (dec) {
+		sparse_decoder_destroy(dec);
+	}
+	free(so.fill_buf);
+	free(buf);
+	return ret;
 }
 
 int main(int argc, char *argv[])
@@ -42,6 +159,23 @@ int main(int argc, char *argv[])
 	int i;
 	int ret;
 	struct sparse_file *s;
+	bool punch = false;
+	int threads = -1;
+
+	while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+		if (strcmp(argv[1], "-p") == 0) {
+			punch = true;
+		} else if (strcmp(argv[1], "-t") == 0 && argc > 2) {
+			threads = atoi(argv[2]);
+			argc--;
+			argv++;
+		} else {
+			usage();
+			exit(-1);
+		}
+		argc--;
+		argv++;
+	}
 
 	if (argc < 3) {
 		usage();
@@ -65,15 +199,37 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		if (lseek64(in, 0, SEEK_CUR) < 0) {
+			if (stream_sparse_file(in, out, punch && i == 1) < 0) {
+				fprintf(stderr, "Failed to stream sparse file\n");
+				exit(-1);
+			}
+			close(in);
+			continue;
+		}
+
 		s = sparse_file_import(in, true, false);
 		if (!s) {
 			fprintf(stderr, "Failed to read sparse file\n");
 			exit(-1);
 		}
 
+		/*
+		 * Later images are written over the earlier ones, so only the first
+		 * may punch holes without losing data
+		 */
+		if (punch && i == 1) {
+			sparse_file_punch_holes(s, true);
+		}
+
 		lseek(out, SEEK_SET, 0);
 
-		ret = sparse_file_write(s, out, false, false, false);
+		if (threads >= 0) {
+			ret = sparse_file_write_threaded(s, out, false, false, false,
+					threads);
+		} else {
+			ret = sparse_file_write(s, out, false, false, false);
+		}
 		if (ret < 0) {
 			fprintf(stderr, "Cannot write output file\n");
 			exit(-1);
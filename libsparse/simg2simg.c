@@ -28,6 +28,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifndef USE_MINGW
+#include <pthread.h>
+#endif
+
 #include <sparse/sparse.h>
 
 #ifndef O_BINARY
@@ -36,20 +40,139 @@
 
 void usage()
 {
-  fprintf(stderr, "Usage: simg2simg <sparse image file> <sparse_image_file> <max_size>\n");
+  fprintf(stderr, "Usage: simg2simg [-b <base_image_file>] <sparse image file> <sparse_image_file> <max_size>\n");
+  fprintf(stderr, "  -b  only keep blocks that differ from the base image (raw or sparse)\n");
 }
 
-int main(int argc, char *argv[])
+/*
+ * The pieces produced by sparse_file_resparse are independent sparse files
+ * that only read from the input fd at explicit offsets, so they can be
+ * written out in parallel.  Workers take the next unwritten piece until
+ * there are none left.
+ */
+struct write_pieces {
+	struct sparse_file **out_s;
+	const char *prefix;
+	int files;
+	int next;
+	int ret;
+#ifndef USE_MINGW
+	pthread_mutex_t lock;
+#endif
+};
+
+static int write_piece(struct write_pieces *w, int i)
 {
-	int in;
+	char filename[4096];
 	int out;
-	int i;
 	int ret;
+
+	ret = snprintf(filename, sizeof(filename), "%s.%d", w->prefix, i);
+	if (ret >= (int)sizeof(filename)) {
+		fprintf(stderr, "Filename too long\n");
+		return -1;
+	}
+
+	out = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+	if (out < 0) {
+		fprintf(stderr, "Cannot open output file %s\n", filename);
+		return -1;
+	}
+
+	ret = sparse_file_write(w->out_s[i], out, false, true, false);
+	close(out);
+	if (ret) {
+		fprintf(stderr, "Failed to write sparse file %s\n", filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *write_pieces_thread(void *arg)
+{
+	struct write_pieces *w = arg;
+	int i;
+
+	for (;;) {
+#ifndef USE_MINGW
+		pthread_mutex_lock(&w->lock);
+#endif
+		i = w->ret ? w->files : w->next++;
+#ifndef USE_MINGW
+		pthread_mutex_unlock(&w->lock);
+#endif
+		if (i >= w->files) {
+			break;
+		}
+
+		if (write_piece(w, i) < 0) {
+#ifndef USE_MINGW
+			pthread_mutex_lock(&w->lock);
+#endif
+			w->ret = -1;
+#ifndef USE_MINGW
+			pthread_mutex_unlock(&w->lock);
+#endif
+		}
+	}
+
+	return NULL;
+}
+
+static int write_pieces(struct sparse_file **out_s, int files,
+		const char *prefix)
+{
+	struct write_pieces w = {
+		.out_s = out_s,
+		.prefix = prefix,
+		.files = files,
+	};
+#ifndef USE_MINGW
+	pthread_t threads[16];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads;
+	int i;
+
+	nthreads = cpus > 16 ? 16 : cpus < 1 ? 1 : cpus;
+	if (nthreads > files) {
+		nthreads = files;
+	}
+
+	pthread_mutex_init(&w.lock, NULL);
+	/* The calling thread is one of the workers */
+	for (i = 0; i < nthreads - 1; i++) {
+		if (pthread_create(&threads[i], NULL, write_pieces_thread, &w)) {
+			break;
+		}
+	}
+	write_pieces_thread(&w);
+	while (i-- > 0) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&w.lock);
+#else
+	write_pieces_thread(&w);
+#endif
+
+	return w.ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int in;
+	int base;
 	struct sparse_file *s;
 	int64_t max_size;
 	struct sparse_file **out_s;
 	int files;
-	char filename[4096];
+	const char *base_file = NULL;
+
+	if (argc > 2 && strcmp(argv[1], "-b") == 0) {
+		base_file = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
 
 	if (argc != 4) {
 		usage();
@@ -70,6 +193,21 @@ int main(int argc, char *argv[])
 		exit(-1);
 	}
 
+	if (base_file) {
+		base = open(base_file, O_RDONLY | O_BINARY);
+		if (base < 0) {
+			fprintf(stderr, "Cannot open base file %s\n", base_file);
+			exit(-1);
+		}
+
+		if (sparse_file_delta(s, base) < 0) {
+			fprintf(stderr, "Failed to compare with base file %s\n", base_file);
+			exit(-1);
+		}
+
+		close(base);
+	}
+
 	files = sparse_file_resparse(s, max_size, NULL, 0);
 	if (files < 0) {
 		fprintf(stderr, "Failed to resparse\n");
@@ -88,25 +226,8 @@ int main(int argc, char *argv[])
 		exit(-1);
 	}
 
-	for (i = 0; i < files; i++) {
-		ret = snprintf(filename, sizeof(filename), "%s.%d", argv[2], i);
-		if (ret >= (int)sizeof(filename)) {
-			fprintf(stderr, "Filename too long\n");
-			exit(-1);
-		}
-
-		out = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
-		if (out < 0) {
-			fprintf(stderr, "Cannot open output file %s\n", argv[2]);
-			exit(-1);
-		}
-
-		ret = sparse_file_write(out_s[i], out, false, true, false);
-		if (ret) {
-			fprintf(stderr, "Failed to write sparse file\n");
-			exit(-1);
-		}
-		close(out);
+	if (write_pieces(out_s, files, argv[2]) < 0) {
+		exit(-1);
 	}
 
 	close(in);
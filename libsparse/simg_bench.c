@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define BLOCK_SIZE 4096
+
+/*
+ * Throughput benchmark for the img2simg and simg2img paths.  Generates a
+ * synthetic raw image with a mix of random data, zero and fill blocks, then
+ * converts it to a sparse image and back with sparse_file_write and
+ * sparse_file_write_threaded, checking that both writers produce the same
+ * bytes.
+ */
+
+void usage()
+{
+	fprintf(stderr, "Usage: simg_bench [-s <size_mb>] [-t <threads>] [-c] [-z] [<tmp_dir>]\n");
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int make_raw_image(const char *path, int64_t len)
+{
+	uint32_t *buf;
+	unsigned int i;
+	int64_t block;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0664);
+	if (fd < 0) {
+		return -1;
+	}
+
+	buf = malloc(BLOCK_SIZE);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+
+	srand(1);
+	for (block = 0; block < len / BLOCK_SIZE; block++) {
+		/* Runs of 16 blocks: 40% zeros, 10% fill, 50% data */
+		int kind = (block / 16) % 10;
+		for (i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++) {
+			if (kind < 4) {
+				buf[i] = 0;
+			} else if (kind < 5) {
+				buf[i] = 0xcafed00d;
+			} else {
+				buf[i] = rand();
+			}
+		}
+		if (write(fd, buf, BLOCK_SIZE) != BLOCK_SIZE) {
+			free(buf);
+			close(fd);
+			return -1;
+		}
+	}
+
+	free(buf);
+	fsync(fd);
+	close(fd);
+
+	return 0;
+}
+
+static int files_equal(const char *a, const char *b)
+{
+	char buf_a[65536];
+	char buf_b[65536];
+	int fd_a, fd_b;
+	int ret_a, ret_b;
+	int equal = 0;
+
+	fd_a = open(a, O_RDONLY | O_BINARY);
+	fd_b = open(b, O_RDONLY | O_BINARY);
+	if (fd_a < 0 || fd_b < 0) {
+		goto out;
+	}
+
+	for (;;) {
+		ret_a = read(fd_a, buf_a, sizeof(buf_a));
+		ret_b = read(fd_b, buf_b, sizeof(buf_b));
+		if (ret_a != ret_b || ret_a < 0 ||
+				memcmp(buf_a, buf_b, ret_a) != 0) {
+			break;
+		}
+		if (ret_a == 0) {
+			equal = 1;
+			break;
+		}
+	}
+
+out:
+	if (fd_a >= 0)
+		close(fd_a);
+	if (fd_b >= 0)
+		close(fd_b);
+	return equal;
+}
+
+/*
+ * Converts in to out: a raw image to a sparse image if sparse is true,
+ * otherwise a sparse image back to a raw image.  threads < 0 selects the
+ * serial writer.  Returns the time taken, or negative on error.
+ */
+static double convert(const char *in_path, const char *out_path, bool sparse,
+		bool gz, bool crc, int threads)
+{
+	struct sparse_file *s;
+	double start;
+	int64_t len;
+	int in, out;
+	int ret;
+
+	in = open(in_path, O_RDONLY | O_BINARY);
+	out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+	if (in < 0 || out < 0) {
+		return -1;
+	}
+
+	start = now();
+
+	if (sparse) {
+		len = lseek(in, 0, SEEK_END);
+		lseek(in, 0, SEEK_SET);
+		s = sparse_file_new(BLOCK_SIZE, len);
+		if (!s || sparse_file_read(s, in, SPARSE_READ_MODE_NORMAL, false) < 0) {
+			return -1;
+		}
+	} else {
+		s = sparse_file_import(in, true, false);
+		if (!s) {
+			return -1;
+		}
+	}
+
+	if (threads < 0) {
+		ret = sparse_file_write(s, out, sparse && gz, sparse, sparse && crc);
+	} else {
+		ret = sparse_file_write_threaded(s, out, sparse && gz, sparse,
+				sparse && crc, threads);
+	}
+	fsync(out);
+
+	sparse_file_destroy(s);
+	close(in);
+	close(out);
+
+	if (ret < 0) {
+		return -1;
+	}
+
+	return now() - start;
+}
+
+static int bench(const char *name, const char *in, const char *out,
+		const char *out_threaded, bool sparse, bool gz, bool crc, int threads,
+		int64_t len)
+{
+	double serial, threaded;
+	double mb = len / (1024.0 * 1024.0);
+
+	serial = convert(in, out, sparse, gz, crc, -1);
+	threaded = convert(in, out_threaded, sparse, gz, crc, threads);
+	if (serial < 0 || threaded < 0) {
+		fprintf(stderr, "%s: conversion failed\n", name);
+		return -1;
+	}
+
+	printf("%-9s serial %8.1f MB/s   threaded %8.1f MB/s   %s\n", name,
+			mb / serial, mb / threaded,
+			files_equal(out, out_threaded) ? "identical" : "MISMATCH");
+
+	return files_equal(out, out_threaded) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = "/tmp";
+	char raw[4096], simg[4096], simg_t[4096], raw_out[4096], raw_out_t[4096];
+	int64_t size_mb = 1024;
+	int threads = 0;
+	bool crc = false;
+	bool gz = false;
+	int ret = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:t:cz")) != -1) {
+		switch (c) {
+		case 's':
+			size_mb = atoll(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'c':
+			crc = true;
+			break;
+		case 'z':
+			gz = true;
+			break;
+		default:
+			usage();
+			exit(-1);
+		}
+	}
+
+	if (optind < argc) {
+		dir = argv[optind];
+	}
+
+	snprintf(raw, sizeof(raw), "%s/simg_bench.raw", dir);
+	snprintf(simg, sizeof(simg), "%s/simg_bench.simg", dir);
+	snprintf(simg_t, sizeof(simg_t), "%s/simg_bench.t.simg", dir);
+	snprintf(raw_out, sizeof(raw_out), "%s/simg_bench.out.raw", dir);
+	snprintf(raw_out_t, sizeof(raw_out_t), "%s/simg_bench.t.out.raw", dir);
+
+	if (make_raw_image(raw, size_mb * 1024 * 1024) < 0) {
+		fprintf(stderr, "Cannot create %s\n", raw);
+		exit(-1);
+	}
+
+	if (bench("img2simg", raw, simg, simg_t, true, gz, crc, threads,
+			size_mb * 1024 * 1024) < 0) {
+		ret = -1;
+	}
+
+	/* simg2img can't read gzipped images, so always start from a plain one */
+	if (gz && convert(raw, simg, true, false, crc, -1) < 0) {
+		ret = -1;
+	}
+
+	if (bench("simg2img", simg, raw_out, raw_out_t, false, false, false,
+			threads, size_mb * 1024 * 1024) < 0) {
+		ret = -1;
+	}
+
+	unlink(raw);
+	unlink(simg);
+	unlink(simg_t);
+	unlink(raw_out);
+	unlink(raw_out_t);
+
+	exit(ret);
+}
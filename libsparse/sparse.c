@@ -161,6 +161,9 @@ int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
 	if (!out)
 		return -ENOMEM;
 
+	if (s->punch_holes && !sparse)
+		output_file_punch_holes(out);
+
 	ret = write_all_blocks(s, out);
 
 	output_file_close(out);
@@ -196,13 +199,61 @@ static int out_counter_write(void *priv, const void *data, int len)
 	return 0;
 }
 
+/*
+ * Returns the number of bytes a chunk takes up in the sparse format, not
+ * counting any skip chunk in front of it.  Matches what the chunk writers in
+ * output_file.c produce, so sizes can be added up without a dry run.
+ */
+static int64_t sparse_chunk_len(struct sparse_file *s, struct backed_block *bb)
+{
+	switch (backed_block_type(bb)) {
+	case BACKED_BLOCK_DATA:
+	case BACKED_BLOCK_FILE:
+	case BACKED_BLOCK_FD:
+		return sizeof(chunk_header_t) +
+				ALIGN((int64_t)backed_block_len(bb), s->block_size);
+	case BACKED_BLOCK_FILL:
+		return sizeof(chunk_header_t) + sizeof(uint32_t);
+	}
+
+	return 0;
+}
+
 int64_t sparse_file_len(struct sparse_file *s, bool sparse, bool crc)
 {
 	int ret;
-	int chunks = sparse_count_chunks(s);
+	int chunks;
 	int64_t count = 0;
 	struct output_file *out;
+	struct backed_block *bb;
+	unsigned int last_block = 0;
+	int64_t pad;
+
+	if (sparse) {
+		count = sizeof(sparse_header_t);
+		for (bb = backed_block_iter_new(s->backed_block_list); bb;
+				bb = backed_block_iter_next(bb)) {
+			if (backed_block_block(bb) > last_block) {
+				count += sizeof(chunk_header_t);
+			}
+			count += sparse_chunk_len(s, bb);
+			last_block = backed_block_block(bb) +
+					DIV_ROUND_UP(backed_block_len(bb), s->block_size);
+		}
+
+		pad = s->len - (int64_t)last_block * s->block_size;
+		if (pad > 0 && pad % s->block_size == 0) {
+			count += sizeof(chunk_header_t);
+		}
+
+		if (crc) {
+			count += sizeof(chunk_header_t) + sizeof(uint32_t);
+		}
 
+		return count;
+	}
+
+	chunks = sparse_count_chunks(s);
 	out = output_file_open_callback(out_counter_write, &count,
 			s->block_size, s->len, false, sparse, chunks, crc);
 	if (!out) {
@@ -220,15 +271,19 @@ int64_t sparse_file_len(struct sparse_file *s, bool sparse, bool crc)
 	return count;
 }
 
-static struct backed_block *move_chunks_up_to_len(struct sparse_file *from,
-		struct sparse_file *to, unsigned int len)
+/*
+ * Finds the chunks, starting at start, that fit in a sparse file of at most
+ * len bytes, splitting the chunk that crosses the limit if that leaves the
+ * file reasonably full.  Sets *last_bb to the last chunk that fits, and returns
+ * the first chunk that doesn't, or NULL if all of them fit.
+ */
+static struct backed_block *find_chunks_up_to_len(struct sparse_file *from,
+		struct backed_block *start, unsigned int len,
+		struct backed_block **last_bb)
 {
-	int64_t count = 0;
-	struct output_file *out_counter;
-	struct backed_block *last_bb = NULL;
 	struct backed_block *bb;
-	struct backed_block *start;
 	int64_t file_len = 0;
+	int64_t count;
 
 	/*
 	 * overhead is sparse file header, initial skip chunk, split chunk, end
@@ -238,38 +293,30 @@ static struct backed_block *move_chunks_up_to_len(struct sparse_file *from,
 			sizeof(uint32_t);
 	len -= overhead;
 
-	start = backed_block_iter_new(from->backed_block_list);
-	out_counter = output_file_open_callback(out_counter_write, &count,
-			to->block_size, to->len, false, true, 0, false);
-	if (!out_counter) {
-		return NULL;
-	}
+	*last_bb = NULL;
 
 	for (bb = start; bb; bb = backed_block_iter_next(bb)) {
-		count = 0;
-		/* will call out_counter_write to update count */
-		sparse_file_write_block(out_counter, bb);
+		count = sparse_chunk_len(from, bb);
 		if (file_len + count > len) {
 			/*
 			 * If the remaining available size is more than 1/8th of the
 			 * requested size, split the chunk.  Results in sparse files that
 			 * are at least 7/8ths of the requested size
 			 */
-			if (!last_bb || (len - file_len > (len / 8))) {
+			if (!*last_bb || (len - file_len > (len / 8))) {
 				backed_block_split(from->backed_block_list, bb, len - file_len);
-				last_bb = bb;
+				*last_bb = bb;
 			}
-			goto out;
+			break;
 		}
 		file_len += count;
-		last_bb = bb;
+		*last_bb = bb;
 	}
 
-out:
-	backed_block_list_move(from->backed_block_list,
-		to->backed_block_list, start, last_bb);
-
-	output_file_close(out_counter);
+	if (bb && bb == *last_bb) {
+		/* The first part of bb went into this file */
+		bb = backed_block_iter_next(bb);
+	}
 
 	return bb;
 }
@@ -277,37 +324,38 @@ out:
 int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
 		struct sparse_file **out_s, int out_s_count)
 {
+	struct backed_block *start;
+	struct backed_block *last_bb;
 	struct backed_block *bb;
-	unsigned int overhead;
 	struct sparse_file *s;
-	struct sparse_file *tmp;
 	int c = 0;
 
-	tmp = sparse_file_new(in_s->block_size, in_s->len);
-	if (!tmp) {
-		return -ENOMEM;
-	}
+	start = backed_block_iter_new(in_s->backed_block_list);
 
+	/*
+	 * Sizes come from sparse_chunk_len, so planning a split is a single walk
+	 * over the chunks.  Only the chunks of files that are returned in out_s
+	 * are moved out of in_s, the rest stay where they are.
+	 */
 	do {
-		s = sparse_file_new(in_s->block_size, in_s->len);
-
-		bb = move_chunks_up_to_len(in_s, s, max_len);
+		bb = find_chunks_up_to_len(in_s, start, max_len, &last_bb);
 
 		if (c < out_s_count) {
+			s = sparse_file_new(in_s->block_size, in_s->len);
+			if (!s) {
+				return -ENOMEM;
+			}
+			if (last_bb) {
+				backed_block_list_move(in_s->backed_block_list,
+						s->backed_block_list, start, last_bb);
+			}
 			out_s[c] = s;
-		} else {
-			backed_block_list_move(s->backed_block_list, tmp->backed_block_list,
-					NULL, NULL);
-			sparse_file_destroy(s);
 		}
+
+		start = bb;
 		c++;
 	} while (bb);
 
-	backed_block_list_move(tmp->backed_block_list, in_s->backed_block_list,
-			NULL, NULL);
-
-	sparse_file_destroy(tmp);
-
 	return c;
 }
 
@@ -315,3 +363,8 @@ void sparse_file_verbose(struct sparse_file *s)
 {
 	s->verbose = true;
 }
+
+void sparse_file_punch_holes(struct sparse_file *s, bool punch)
+{
+	s->punch_holes = punch;
+}
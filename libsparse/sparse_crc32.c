@@ -43,7 +43,11 @@
  */
 
 /* Code taken from FreeBSD 8 */
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#include "sparse_crc32.h"
 
 static uint32_t crc32_tab[] = {
         0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -92,20 +96,269 @@ static uint32_t crc32_tab[] = {
 };
 
 /*
- * A function that calculates the CRC-32 based on the table above is
- * given below for documentation purposes. An equivalent implementation
- * of this function that's actually used in the kernel can be found
- * in sys/libkern.h, where it can be inlined.
+ * The table above is used a byte at a time for short buffers and unaligned
+ * tails.  Longer buffers go through slice-by-8 tables derived from it, and on
+ * x86-64 cpus with carry-less multiply, through PCLMULQDQ folding.  All of
+ * them compute exactly the same crc.
+ */
+
+#if defined(__x86_64__) && \
+		(defined(__clang__) || __GNUC__ > 4 || \
+		 (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SPARSE_CRC32_PCLMUL 1
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SPARSE_CRC32_SLICE8 1
+#endif
+
+#define CRC32_POLY 0xedb88320U
+
+static uint32_t crc32_slice_tab[8][256];
+
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *p, size_t size)
+{
+        while (size--)
+                crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        return crc;
+}
+
+#ifdef SPARSE_CRC32_SLICE8
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t size)
+{
+        uint32_t one, two;
+
+        /* Align to 4 bytes so the main loop does aligned loads */
+        while (size && ((uintptr_t)p & 3)) {
+                crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+                size--;
+        }
+
+        while (size >= 8) {
+                memcpy(&one, p, 4);
+                memcpy(&two, p + 4, 4);
+                one ^= crc;
+                crc = crc32_slice_tab[7][one & 0xFF] ^
+                      crc32_slice_tab[6][(one >> 8) & 0xFF] ^
+                      crc32_slice_tab[5][(one >> 16) & 0xFF] ^
+                      crc32_slice_tab[4][one >> 24] ^
+                      crc32_slice_tab[3][two & 0xFF] ^
+                      crc32_slice_tab[2][(two >> 8) & 0xFF] ^
+                      crc32_slice_tab[1][(two >> 16) & 0xFF] ^
+                      crc32_slice_tab[0][two >> 24];
+                p += 8;
+                size -= 8;
+        }
+
+        return crc32_bytewise(crc, p, size);
+}
+#else
+#define crc32_slice8 crc32_bytewise
+#endif
+
+#ifdef SPARSE_CRC32_PCLMUL
+/*
+ * Folds 64 bytes per iteration with carry-less multiplies, then reduces the
+ * remainder to 32 bits with a Barrett reduction.  size must be at least 64
+ * and a multiple of 16.  The constants are x^(k*32) mod P for the reflected
+ * polynomial, as described in Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction".
  */
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+        const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+        const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+        const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+        const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+        const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+        __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+        x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+        x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+        x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+        x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+        x0 = k1k2;
+        p += 64;
+        size -= 64;
+
+        while (size >= 64) {
+                x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+                x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+                x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+                x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+                x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+                x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+                x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+                x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+                y5 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+                y6 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+                y7 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+                y8 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+                x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+                x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+                x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+                x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+                p += 64;
+                size -= 64;
+        }
+
+        /* Fold the four lanes into one */
+        x0 = k3k4;
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+        while (size >= 16) {
+                x2 = _mm_loadu_si128((const __m128i *)p);
+                x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+                x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+                x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+                p += 16;
+                size -= 16;
+        }
+
+        /* Fold 128 bits to 64 bits */
+        x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+        x1 = _mm_srli_si128(x1, 8);
+        x1 = _mm_xor_si128(x1, x2);
+        x0 = k5k0;
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, mask32);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        /* Barrett reduction to 32 bits */
+        x0 = poly;
+        x2 = _mm_and_si128(x1, mask32);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+        x2 = _mm_and_si128(x2, mask32);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        return _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+static int crc32_have_pclmul;
+#endif
+
+__attribute__((constructor))
+static void sparse_crc32_init(void)
+{
+        uint32_t crc;
+        int i, j;
+
+        for (i = 0; i < 256; i++) {
+                crc = crc32_tab[i];
+                crc32_slice_tab[0][i] = crc;
+                for (j = 1; j < 8; j++) {
+                        crc = crc32_tab[crc & 0xFF] ^ (crc >> 8);
+                        crc32_slice_tab[j][i] = crc;
+                }
+        }
+
+#ifdef SPARSE_CRC32_PCLMUL
+        {
+                unsigned int eax, ebx, ecx, edx;
+                if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+                        crc32_have_pclmul = !!(ecx & bit_PCLMUL);
+                }
+        }
+#endif
+}
 
-uint32_t sparse_crc32(uint32_t crc_in, const void *buf, int size)
+uint32_t sparse_crc32(uint32_t crc_in, const void *buf, size_t size)
 {
         const uint8_t *p = buf;
         uint32_t crc;
+        size_t fold;
 
         crc = crc_in ^ ~0U;
-        while (size--)
-                crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+#ifdef SPARSE_CRC32_PCLMUL
+        if (crc32_have_pclmul && size >= 64) {
+                fold = size & ~(size_t)15;
+                crc = crc32_pclmul(crc, p, fold);
+                p += fold;
+                size -= fold;
+        }
+#endif
+        crc = crc32_slice8(crc, p, size);
         return crc ^ ~0U;
 }
 
+/*
+ * Combining works on the crc register as a linear function of its previous
+ * value: appending len2 bytes of zeros is multiplication by a 32x32 matrix
+ * over GF(2), raised to the power len2 by repeated squaring.  This follows
+ * crc32_combine from zlib.
+ */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+        uint32_t sum = 0;
+
+        while (vec) {
+                if (vec & 1)
+                        sum ^= *mat;
+                vec >>= 1;
+                mat++;
+        }
+        return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+        int n;
+
+        for (n = 0; n < 32; n++)
+                square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+uint32_t sparse_crc32_combine(uint32_t crc1, uint32_t crc2, int64_t len2)
+{
+        uint32_t even[32];
+        uint32_t odd[32];
+        uint32_t row;
+        int n;
+
+        if (len2 <= 0)
+                return crc1;
+
+        /* Operator for one zero bit in odd */
+        odd[0] = CRC32_POLY;
+        row = 1;
+        for (n = 1; n < 32; n++) {
+                odd[n] = row;
+                row <<= 1;
+        }
+
+        /* Two zero bits in even, then four zero bits in odd */
+        gf2_matrix_square(even, odd);
+        gf2_matrix_square(odd, even);
+
+        /* Apply len2 zero bytes to crc1, squaring up from one zero byte */
+        do {
+                gf2_matrix_square(even, odd);
+                if (len2 & 1)
+                        crc1 = gf2_matrix_times(even, crc1);
+                len2 >>= 1;
+                if (len2 == 0)
+                        break;
+
+                gf2_matrix_square(odd, even);
+                if (len2 & 1)
+                        crc1 = gf2_matrix_times(odd, crc1);
+                len2 >>= 1;
+        } while (len2 != 0);
+
+        return crc1 ^ crc2;
+}
@@ -14,7 +14,20 @@
  * limitations under the License.
  */
 
+#ifndef _LIBSPARSE_SPARSE_CRC32_H_
+#define _LIBSPARSE_SPARSE_CRC32_H_
+
+#include <stddef.h>
 #include <stdint.h>
 
 uint32_t sparse_crc32(uint32_t crc, const void *buf, size_t size);
 
+/*
+ * Returns the crc of the concatenation of two buffers, given crc1 of the
+ * first, and crc2 and length len2 of the second.  Lets the crcs of pieces be
+ * calculated independently and merged afterwards.
+ */
+uint32_t sparse_crc32_combine(uint32_t crc1, uint32_t crc2, int64_t len2);
+
+#endif
+
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "sparse_crc32.h"
+
+/*
+ * Checks sparse_crc32 and sparse_crc32_combine against a bit-at-a-time
+ * reference over random buffers, lengths, alignments and initial crcs, then
+ * compares the speed of sparse_crc32 with the byte-at-a-time table lookup it
+ * replaced.
+ */
+
+#define TEST_BUF_SIZE (64 * 1024)
+#define TEST_ITERATIONS 20000
+#define BENCH_BUF_SIZE (64 * 1024 * 1024)
+
+static uint32_t byte_tab[256];
+
+static uint32_t ref_crc32(uint32_t crc, const uint8_t *p, size_t size)
+{
+	int i;
+
+	crc = ~crc;
+	while (size--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320U & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/* The byte-at-a-time loop sparse_crc32 used before */
+static uint32_t bytewise_crc32(uint32_t crc, const uint8_t *p, size_t size)
+{
+	crc = ~crc;
+	while (size--)
+		crc = byte_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int test_exact(uint8_t *buf)
+{
+	uint32_t init, expected, got;
+	size_t off, len;
+	int i;
+
+	for (i = 0; i < TEST_ITERATIONS; i++) {
+		off = rand() % 64;
+		/* Mostly short buffers, where the engines switch over */
+		if (i % 4)
+			len = rand() % 300;
+		else
+			len = rand() % (TEST_BUF_SIZE - 64);
+		init = i % 3 ? (uint32_t)rand() : 0;
+
+		expected = ref_crc32(init, buf + off, len);
+		got = sparse_crc32(init, buf + off, len);
+		if (got != expected) {
+			fprintf(stderr, "crc mismatch: off %zu len %zu init %08x: "
+					"%08x != %08x\n", off, len, init, got, expected);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int test_combine(uint8_t *buf)
+{
+	uint32_t crc1, crc2, expected, got;
+	size_t len, split;
+	int i;
+
+	for (i = 0; i < TEST_ITERATIONS / 10; i++) {
+		len = rand() % TEST_BUF_SIZE;
+		split = len ? rand() % len : 0;
+
+		expected = ref_crc32(0, buf, len);
+		crc1 = sparse_crc32(0, buf, split);
+		crc2 = sparse_crc32(0, buf + split, len - split);
+		got = sparse_crc32_combine(crc1, crc2, len - split);
+		if (got != expected) {
+			fprintf(stderr, "combine mismatch: len %zu split %zu: "
+					"%08x != %08x\n", len, split, got, expected);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void bench(void)
+{
+	uint8_t *buf = malloc(BENCH_BUF_SIZE);
+	double start, bytewise, fast;
+	uint32_t crc_a, crc_b;
+	size_t i;
+
+	if (!buf) {
+		fprintf(stderr, "Cannot allocate benchmark buffer\n");
+		return;
+	}
+
+	for (i = 0; i < BENCH_BUF_SIZE; i++)
+		buf[i] = rand();
+
+	start = now();
+	crc_a = bytewise_crc32(0, buf, BENCH_BUF_SIZE);
+	bytewise = now() - start;
+
+	start = now();
+	crc_b = sparse_crc32(0, buf, BENCH_BUF_SIZE);
+	fast = now() - start;
+
+	printf("byte-at-a-time %8.1f MB/s\n",
+			BENCH_BUF_SIZE / bytewise / (1024 * 1024));
+	printf("sparse_crc32   %8.1f MB/s  (%.1fx)%s\n",
+			BENCH_BUF_SIZE / fast / (1024 * 1024), bytewise / fast,
+			crc_a == crc_b ? "" : "  MISMATCH");
+
+	free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t *buf;
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xedb88320U & -(crc & 1));
+		byte_tab[i] = crc;
+	}
+
+	srand(1);
+	buf = malloc(TEST_BUF_SIZE);
+	if (!buf) {
+		fprintf(stderr, "Cannot allocate test buffer\n");
+		exit(-1);
+	}
+	for (i = 0; i < TEST_BUF_SIZE; i++)
+		buf[i] = rand();
+
+	if (test_exact(buf) < 0 || test_combine(buf) < 0) {
+		printf("FAILED\n");
+		exit(-1);
+	}
+	printf("crc32 exactness and combine: OK\n");
+
+	free(buf);
+
+	bench();
+
+	exit(0);
+}
@@ -0,0 +1,441 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sparse/sparse.h>
+
+#include "sparse_crc32.h"
+#include "sparse_defs.h"
+#include "sparse_format.h"
+
+#define SPARSE_HEADER_MAJOR_VER 1
+#define SPARSE_HEADER_LEN       (sizeof(sparse_header_t))
+#define CHUNK_HEADER_LEN (sizeof(chunk_header_t))
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+
+/*
+ * The decoder is a state machine fed with arbitrarily sized pieces of a sparse
+ * file.  Headers and the 4 byte payloads of fill and crc chunks are collected
+ * in buf until they are complete, raw chunk payloads are passed straight
+ * through to the data callback from the caller's buffer.  The memory used
+ * doesn't depend on the size of the image or of its chunks.
+ */
+enum decoder_state {
+	STATE_SPARSE_HEADER,
+	STATE_CHUNK_HEADER,
+	STATE_DISCARD,
+	STATE_RAW,
+	STATE_FILL,
+	STATE_CRC,
+	STATE_DONE,
+	STATE_ERROR,
+};
+
+struct sparse_decoder {
+	int (*data)(void *priv, int64_t off, const void *data, int len);
+	int (*fill)(void *priv, int64_t off, int64_t len, uint32_t fill_val);
+	int (*skip)(void *priv, int64_t off, int64_t len);
+	void *priv;
+	bool verbose;
+
+	enum decoder_state state;
+	/* State to continue with after discarding padding in STATE_DISCARD */
+	enum decoder_state next_state;
+	sparse_header_t sparse_header;
+	chunk_header_t chunk_header;
+	unsigned int chunk;
+
+	union {
+		sparse_header_t sparse_header;
+		chunk_header_t chunk_header;
+		uint32_t val;
+		char bytes[1];
+	} buf;
+	unsigned int buf_len;
+	unsigned int buf_want;
+	int64_t remaining;
+
+	/* Offset in the expanded file of the current chunk */
+	int64_t offset;
+	int64_t len;
+
+	bool crc;
+	uint32_t crc32;
+	uint32_t *fill_buf;
+	int error;
+};
+
+struct sparse_decoder *sparse_decoder_new(
+		int (*data)(void *priv, int64_t off, const void *data, int len),
+		int (*fill)(void *priv, int64_t off, int64_t len, uint32_t fill_val),
+		int (*skip)(void *priv, int64_t off, int64_t len),
+		void *priv, bool crc, bool verbose)
+{
+	struct sparse_decoder *dec;
+
+	dec = calloc(1, sizeof(struct sparse_decoder));
+	if (!dec) {
+		return NULL;
+	}
+
+	dec->data = data;
+	dec->fill = fill;
+	dec->skip = skip;
+	dec->priv = priv;
+	dec->crc = crc;
+	dec->verbose = verbose;
+	dec->state = STATE_SPARSE_HEADER;
+	dec->buf_want = SPARSE_HEADER_LEN;
+
+	return dec;
+}
+
+void sparse_decoder_destroy(struct sparse_decoder *dec)
+{
+	free(dec->fill_buf);
+	free(dec);
+}
+
+unsigned int sparse_decoder_block_size(struct sparse_decoder *dec)
+{
+	return dec->sparse_header.blk_sz;
+}
+
+int64_t sparse_decoder_len(struct sparse_decoder *dec)
+{
+	return dec->len;
+}
+
+static int decoder_error(struct sparse_decoder *dec, int err, const char *what)
+{
+	if (dec->verbose) {
+		if (dec->state == STATE_SPARSE_HEADER) {
+			sparse_print_verbose("Bad sparse file header: %s\n", what);
+		} else {
+			sparse_print_verbose("Bad sparse file chunk %u: %s\n", dec->chunk,
+					what);
+		}
+	}
+
+	dec->state = STATE_ERROR;
+	dec->error = err;
+
+	return err;
+}
+
+/* Returns the state to continue with once the current chunk is done */
+static enum decoder_state chunk_done(struct sparse_decoder *dec)
+{
+	if (++dec->chunk == dec->sparse_header.total_chunks) {
+		return STATE_DONE;
+	}
+
+	return STATE_CHUNK_HEADER;
+}
+
+static void enter_state(struct sparse_decoder *dec, enum decoder_state state)
+{
+	dec->state = state;
+
+	switch (state) {
+	case STATE_CHUNK_HEADER:
+		dec->buf_len = 0;
+		dec->buf_want = CHUNK_HEADER_LEN;
+		break;
+	case STATE_FILL:
+	case STATE_CRC:
+		dec->buf_len = 0;
+		dec->buf_want = sizeof(uint32_t);
+		break;
+	case STATE_RAW:
+		dec->remaining = (int64_t)dec->chunk_header.chunk_sz *
+				dec->sparse_header.blk_sz;
+		if (dec->remaining == 0) {
+			enter_state(dec, chunk_done(dec));
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* Drops len bytes of the input, then enters state */
+static void enter_state_after(struct sparse_decoder *dec,
+		enum decoder_state state, int64_t len)
+{
+	if (len == 0) {
+		enter_state(dec, state);
+	} else {
+		dec->state = STATE_DISCARD;
+		dec->next_state = state;
+		dec->remaining = len;
+	}
+}
+
+static uint32_t fill_crc(struct sparse_decoder *dec, uint32_t crc,
+		int64_t len, uint32_t fill_val)
+{
+	unsigned int block_size = dec->sparse_header.blk_sz;
+	unsigned int i;
+
+	for (i = 0; i < block_size / sizeof(uint32_t); i++) {
+		dec->fill_buf[i] = fill_val;
+	}
+
+	while (len > 0) {
+		crc = sparse_crc32(crc, dec->fill_buf, block_size);
+		len -= block_size;
+	}
+
+	return crc;
+}
+
+static int process_sparse_header(struct sparse_decoder *dec)
+{
+	sparse_header_t *header = &dec->sparse_header;
+
+	*header = dec->buf.sparse_header;
+
+	if (header->magic != SPARSE_HEADER_MAGIC) {
+		return decoder_error(dec, -EINVAL, "magic");
+	}
+
+	if (header->major_version != SPARSE_HEADER_MAJOR_VER) {
+		return decoder_error(dec, -EINVAL, "major version");
+	}
+
+	if (header->file_hdr_sz < SPARSE_HEADER_LEN ||
+			header->chunk_hdr_sz < CHUNK_HEADER_LEN) {
+		return decoder_error(dec, -EINVAL, "header size");
+	}
+
+	if (header->blk_sz == 0 || header->blk_sz % sizeof(uint32_t)) {
+		return decoder_error(dec, -EINVAL, "block size");
+	}
+
+	dec->len = (int64_t)header->total_blks * header->blk_sz;
+
+	dec->fill_buf = malloc(header->blk_sz);
+	if (!dec->fill_buf) {
+		return decoder_error(dec, -ENOMEM, "fill buffer");
+	}
+
+	enter_state_after(dec,
+			header->total_chunks ? STATE_CHUNK_HEADER : STATE_DONE,
+			header->file_hdr_sz - SPARSE_HEADER_LEN);
+
+	return 0;
+}
+
+static int process_chunk_header(struct sparse_decoder *dec)
+{
+	chunk_header_t *chunk_header = &dec->chunk_header;
+	unsigned int block_size = dec->sparse_header.blk_sz;
+	unsigned int extra;
+	int64_t chunk_len;
+	int64_t data_len;
+	int ret;
+
+	*chunk_header = dec->buf.chunk_header;
+
+	if (chunk_header->total_sz < dec->sparse_header.chunk_hdr_sz) {
+		return decoder_error(dec, -EINVAL, "chunk size");
+	}
+
+	extra = dec->sparse_header.chunk_hdr_sz - CHUNK_HEADER_LEN;
+	data_len = chunk_header->total_sz - dec->sparse_header.chunk_hdr_sz;
+	chunk_len = (int64_t)chunk_header->chunk_sz * block_size;
+
+	if (dec->offset + chunk_len > dec->len) {
+		return decoder_error(dec, -EINVAL, "chunk past end of file");
+	}
+
+	switch (chunk_header->chunk_type) {
+	case CHUNK_TYPE_RAW:
+		if (data_len != chunk_len) {
+			return decoder_error(dec, -EINVAL, "raw chunk size");
+		}
+		enter_state_after(dec, STATE_RAW, extra);
+		break;
+	case CHUNK_TYPE_FILL:
+		if (data_len != sizeof(uint32_t)) {
+			return decoder_error(dec, -EINVAL, "fill chunk size");
+		}
+		enter_state_after(dec, STATE_FILL, extra);
+		break;
+	case CHUNK_TYPE_DONT_CARE:
+		if (dec->skip && chunk_len) {
+			ret = dec->skip(dec->priv, dec->offset, chunk_len);
+			if (ret < 0) {
+				return decoder_error(dec, ret, "skip callback");
+			}
+		}
+		if (dec->crc) {
+			dec->crc32 = fill_crc(dec, dec->crc32, chunk_len, 0);
+		}
+		dec->offset += chunk_len;
+		/* Any payload of a don't care chunk carries nothing */
+		enter_state_after(dec, chunk_done(dec), extra + data_len);
+		break;
+	case CHUNK_TYPE_CRC32:
+		if (data_len != sizeof(uint32_t)) {
+			return decoder_error(dec, -EINVAL, "crc chunk size");
+		}
+		enter_state_after(dec, STATE_CRC, extra);
+		break;
+	default:
+		return decoder_error(dec, -EINVAL, "unknown chunk type");
+	}
+
+	return 0;
+}
+
+static int process_fill(struct sparse_decoder *dec)
+{
+	int64_t chunk_len = (int64_t)dec->chunk_header.chunk_sz *
+			dec->sparse_header.blk_sz;
+	uint32_t fill_val = dec->buf.val;
+	int ret;
+
+	if (dec->fill && chunk_len) {
+		ret = dec->fill(dec->priv, dec->offset, chunk_len, fill_val);
+		if (ret < 0) {
+			return decoder_error(dec, ret, "fill callback");
+		}
+	}
+
+	if (dec->crc) {
+		dec->crc32 = fill_crc(dec, dec->crc32, chunk_len, fill_val);
+	}
+
+	dec->offset += chunk_len;
+	enter_state(dec, chunk_done(dec));
+
+	return 0;
+}
+
+static int process_crc(struct sparse_decoder *dec)
+{
+	if (dec->crc && dec->buf.val != dec->crc32) {
+		return decoder_error(dec, -EINVAL, "crc mismatch");
+	}
+
+	enter_state(dec, chunk_done(dec));
+
+	return 0;
+}
+
+int sparse_decoder_write(struct sparse_decoder *dec, const void *data,
+		size_t len)
+{
+	const char *ptr = data;
+	size_t n;
+	int ret;
+
+	while (len > 0) {
+		switch (dec->state) {
+		case STATE_SPARSE_HEADER:
+		case STATE_CHUNK_HEADER:
+		case STATE_FILL:
+		case STATE_CRC:
+			n = min(len, (size_t)(dec->buf_want - dec->buf_len));
+			memcpy(dec->buf.bytes + dec->buf_len, ptr, n);
+			dec->buf_len += n;
+			if (dec->buf_len < dec->buf_want) {
+				break;
+			}
+			if (dec->state == STATE_SPARSE_HEADER) {
+				ret = process_sparse_header(dec);
+			} else if (dec->state == STATE_CHUNK_HEADER) {
+				ret = process_chunk_header(dec);
+			} else if (dec->state == STATE_FILL) {
+				ret = process_fill(dec);
+			} else {
+				ret = process_crc(dec);
+			}
+			if (ret < 0) {
+				return ret;
+			}
+			break;
+		case STATE_DISCARD:
+			n = min((int64_t)len, dec->remaining);
+			dec->remaining -= n;
+			if (dec->remaining == 0) {
+				enter_state(dec, dec->next_state);
+			}
+			break;
+		case STATE_RAW:
+			n = min((int64_t)len, dec->remaining);
+			if (dec->data) {
+				ret = dec->data(dec->priv, dec->offset, ptr, n);
+				if (ret < 0) {
+					return decoder_error(dec, ret, "data callback");
+				}
+			}
+			if (dec->crc) {
+				dec->crc32 = sparse_crc32(dec->crc32, ptr, n);
+			}
+			dec->offset += n;
+			dec->remaining -= n;
+			if (dec->remaining == 0) {
+				enter_state(dec, chunk_done(dec));
+			}
+			break;
+		case STATE_DONE:
+			/* Anything after the last chunk is ignored */
+			return 0;
+		case STATE_ERROR:
+		default:
+			return dec->error;
+		}
+
+		ptr += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int sparse_decoder_finish(struct sparse_decoder *dec)
+{
+	int ret;
+
+	if (dec->state == STATE_ERROR) {
+		return dec->error;
+	}
+
+	if (dec->state != STATE_DONE) {
+		return decoder_error(dec, -EINVAL, "truncated");
+	}
+
+	/* Blocks past the last chunk are not part of any chunk */
+	if (dec->offset < dec->len && dec->skip) {
+		ret = dec->skip(dec->priv, dec->offset, dec->len - dec->offset);
+		if (ret < 0) {
+			return decoder_error(dec, ret, "skip callback");
+		}
+		dec->offset = dec->len;
+	}
+
+	return 0;
+}
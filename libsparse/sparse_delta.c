@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+#include "backed_block.h"
+#include "sparse_defs.h"
+#include "sparse_file.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define lseek64 lseek
+#define pread64 pread
+#define off64_t off_t
+#endif
+
+#ifdef USE_MINGW
+#define pread64 sparse_delta_emulate_pread
+static ssize_t sparse_delta_emulate_pread(int fd, void *buf, size_t count,
+		off64_t offset)
+{
+	if (lseek64(fd, offset, SEEK_SET) < 0) {
+		return -1;
+	}
+	return read(fd, buf, count);
+}
+#endif
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+
+/* Blocks are compared about this much at a time */
+#define DELTA_WINDOW_SIZE (1024 * 1024)
+
+struct delta {
+	unsigned int block_size;
+	unsigned int window_size;
+	struct backed_block_list *out;
+
+	/* The base image is either a sparse image or a raw one */
+	struct sparse_index *base_idx;
+	int base_fd;
+	int64_t base_len;
+
+	char *new_buf;
+	char *base_buf;
+};
+
+/*
+ * Reads up to len bytes at offset, stopping early only at the end of the file.
+ * Returns the number of bytes read, or negative errno.
+ */
+static ssize_t pread_full(int fd, void *buf, size_t len, int64_t offset)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread64(fd, (char *)buf + done, len - done, offset + done);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (ret == 0) {
+			break;
+		}
+		done += ret;
+	}
+
+	return done;
+}
+
+static ssize_t read_base(struct delta *d, size_t len, int64_t offset)
+{
+	if (d->base_idx) {
+		return sparse_index_pread(d->base_idx, d->base_buf, len, offset);
+	}
+
+	if (offset >= d->base_len) {
+		return 0;
+	}
+
+	return pread_full(d->base_fd, d->base_buf, min((int64_t)len,
+			d->base_len - offset), offset);
+}
+
+/* Queues the part of bb from off to off + len in the output list */
+static int keep_range(struct delta *d, struct backed_block *bb,
+		unsigned int off, unsigned int len)
+{
+	unsigned int block = backed_block_block(bb) + off / d->block_size;
+
+	switch (backed_block_type(bb)) {
+	case BACKED_BLOCK_DATA:
+		return backed_block_add_data(d->out,
+				(char *)backed_block_data(bb) + off, len, block);
+	case BACKED_BLOCK_FILL:
+		return backed_block_add_fill(d->out, backed_block_fill_val(bb), len,
+				block);
+	case BACKED_BLOCK_FILE:
+		return backed_block_add_file(d->out, backed_block_filename(bb),
+				backed_block_file_offset(bb) + off, len, block);
+	case BACKED_BLOCK_FD:
+		return backed_block_add_fd(d->out, backed_block_fd(bb),
+				backed_block_file_offset(bb) + off, len, block);
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Returns a pointer to len bytes of bb starting at off, reading them into
+ * new_buf if they aren't in memory already.
+ */
+static char *get_new_data(struct delta *d, struct backed_block *bb, int fd,
+		unsigned int off, unsigned int len)
+{
+	uint32_t fill_val;
+	uint32_t *fill_buf;
+	unsigned int i;
+	ssize_t ret;
+
+	switch (backed_block_type(bb)) {
+	case BACKED_BLOCK_DATA:
+		return (char *)backed_block_data(bb) + off;
+	case BACKED_BLOCK_FILL:
+		fill_val = backed_block_fill_val(bb);
+		fill_buf = (uint32_t *)d->new_buf;
+		for (i = 0; i < len / sizeof(uint32_t); i++) {
+			fill_buf[i] = fill_val;
+		}
+		return d->new_buf;
+	case BACKED_BLOCK_FILE:
+	case BACKED_BLOCK_FD:
+		ret = pread_full(fd, d->new_buf, len,
+				backed_block_file_offset(bb) + off);
+		if (ret < 0) {
+			errno = -ret;
+			return NULL;
+		}
+		if ((size_t)ret < len) {
+			errno = EINVAL;
+			return NULL;
+		}
+		return d->new_buf;
+	}
+
+	errno = EINVAL;
+	return NULL;
+}
+
+static int delta_backed_block(struct delta *d, struct backed_block *bb)
+{
+	unsigned int block_size = d->block_size;
+	unsigned int len = backed_block_len(bb);
+	int64_t base_offset = (int64_t)backed_block_block(bb) * block_size;
+	unsigned int run_start = 0;
+	bool in_run = false;
+	unsigned int window;
+	unsigned int off;
+	unsigned int i;
+	ssize_t base_read;
+	char *data;
+	int fd = -1;
+	int ret = 0;
+
+	if (backed_block_type(bb) == BACKED_BLOCK_FILE) {
+		fd = open(backed_block_filename(bb), O_RDONLY | O_BINARY);
+		if (fd < 0) {
+			return -errno;
+		}
+	} else if (backed_block_type(bb) == BACKED_BLOCK_FD) {
+		fd = backed_block_fd(bb);
+	}
+
+	for (off = 0; off < len; off += window) {
+		window = min(len - off, d->window_size);
+
+		data = get_new_data(d, bb, fd, off, window);
+		if (!data) {
+			ret = -errno;
+			goto out;
+		}
+
+		base_read = read_base(d, window, base_offset + off);
+		if (base_read < 0) {
+			ret = base_read;
+			goto out;
+		}
+
+		for (i = 0; i < window; i += block_size) {
+			/*
+			 * A block is unchanged only if all of it is in the base image
+			 * with the same contents.  A partial block at the end of bb is
+			 * padded with zeros when written, so it is always kept.  Don't
+			 * care blocks of a sparse base image hold whatever was there
+			 * before it was flashed, so they never match.
+			 */
+			bool changed = i + block_size > (unsigned int)base_read ||
+					(d->base_idx && !sparse_index_block_mapped(d->base_idx,
+							(base_offset + off + i) / block_size)) ||
+					memcmp(data + i, d->base_buf + i, block_size) != 0;
+
+			if (changed && !in_run) {
+				run_start = off + i;
+				in_run = true;
+			} else if (!changed && in_run) {
+				ret = keep_range(d, bb, run_start, off + i - run_start);
+				if (ret < 0) {
+					goto out;
+				}
+				in_run = false;
+			}
+		}
+	}
+
+	if (in_run) {
+		ret = keep_range(d, bb, run_start, len - run_start);
+	}
+
+out:
+	if (backed_block_type(bb) == BACKED_BLOCK_FILE) {
+		close(fd);
+	}
+	return ret;
+}
+
+int sparse_file_delta(struct sparse_file *s, int base_fd)
+{
+	struct backed_block *bb;
+	struct delta d;
+	int ret = 0;
+
+	memset(&d, 0, sizeof(d));
+	d.block_size = s->block_size;
+	d.window_size = ALIGN_DOWN(DELTA_WINDOW_SIZE, s->block_size);
+	if (d.window_size == 0) {
+		d.window_size = s->block_size;
+	}
+	d.base_fd = base_fd;
+
+	d.base_idx = sparse_index_new(base_fd, false);
+	if (d.base_idx && sparse_index_block_size(d.base_idx) != s->block_size) {
+		sparse_index_destroy(d.base_idx);
+		return -EINVAL;
+	}
+	if (!d.base_idx) {
+		d.base_len = lseek64(base_fd, 0, SEEK_END);
+		if (d.base_len < 0) {
+			return -errno;
+		}
+	}
+
+	d.out = backed_block_list_new(s->block_size);
+	d.new_buf = malloc(d.window_size);
+	d.base_buf = malloc(d.window_size);
+	if (!d.out || !d.new_buf || !d.base_buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (bb = backed_block_iter_new(s->backed_block_list); bb;
+			bb = backed_block_iter_next(bb)) {
+		ret = delta_backed_block(&d, bb);
+		if (ret < 0) {
+			goto out;
+		}
+	}
+
+	backed_block_list_destroy(s->backed_block_list);
+	s->backed_block_list = d.out;
+	d.out = NULL;
+
+out:
+	if (d.out) {
+		backed_block_list_destroy(d.out);
+	}
+	if (d.base_idx) {
+		sparse_index_destroy(d.base_idx);
+	}
+	free(d.new_buf);
+	free(d.base_buf);
+	return ret;
+}
@@ -23,10 +23,13 @@ struct sparse_file {
 	unsigned int block_size;
 	int64_t len;
 	bool verbose;
+	bool punch_holes;
 
 	struct backed_block_list *backed_block_list;
 	struct output_file *out;
 };
 
+unsigned int sparse_count_chunks(struct sparse_file *s);
+
 
 #endif /* _LIBSPARSE_SPARSE_FILE_H_ */
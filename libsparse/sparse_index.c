@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+#include "sparse_defs.h"
+#include "sparse_format.h"
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define pread64 pread
+#define off64_t off_t
+#endif
+
+#ifdef USE_MINGW
+#define pread64 sparse_index_emulate_pread
+static ssize_t sparse_index_emulate_pread(int fd, void *buf, size_t count,
+		off64_t offset)
+{
+	if (lseek64(fd, offset, SEEK_SET) < 0) {
+		return -1;
+	}
+	return read(fd, buf, count);
+}
+#endif
+
+#define SPARSE_HEADER_MAJOR_VER 1
+#define SPARSE_HEADER_LEN       (sizeof(sparse_header_t))
+#define CHUNK_HEADER_LEN (sizeof(chunk_header_t))
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+
+/*
+ * One entry per chunk that produces output, sorted by block.  For raw chunks
+ * offset is the position of the payload in the sparse image, for fill chunks
+ * fill_val is the 32 bit fill value.
+ */
+struct sparse_index_entry {
+	unsigned int block;
+	unsigned int blocks;
+	uint16_t type;
+	uint32_t fill_val;
+	int64_t offset;
+};
+
+struct sparse_index {
+	int fd;
+	unsigned int block_size;
+	unsigned int total_blocks;
+	struct sparse_index_entry *entries;
+	unsigned int count;
+};
+
+static int pread_all(int fd, void *buf, size_t len, int64_t offset)
+{
+	char *ptr = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pread64(fd, ptr, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (ret == 0) {
+			return -EINVAL;
+		}
+		ptr += ret;
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int index_add(struct sparse_index *idx, unsigned int *alloc,
+		struct sparse_index_entry *entry)
+{
+	struct sparse_index_entry *entries;
+
+	if (idx->count == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 64;
+		entries = realloc(idx->entries, *alloc * sizeof(*entries));
+		if (!entries) {
+			return -ENOMEM;
+		}
+		idx->entries = entries;
+	}
+
+	idx->entries[idx->count++] = *entry;
+
+	return 0;
+}
+
+static int index_build(struct sparse_index *idx, bool verbose)
+{
+	sparse_header_t sparse_header;
+	chunk_header_t chunk_header;
+	struct sparse_index_entry entry;
+	unsigned int alloc = 0;
+	unsigned int block = 0;
+	unsigned int data_size;
+	int64_t offset = 0;
+	unsigned int i;
+	int ret;
+
+	ret = pread_all(idx->fd, &sparse_header, sizeof(sparse_header), offset);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (sparse_header.magic != SPARSE_HEADER_MAGIC ||
+			sparse_header.major_version != SPARSE_HEADER_MAJOR_VER ||
+			sparse_header.file_hdr_sz < SPARSE_HEADER_LEN ||
+			sparse_header.chunk_hdr_sz < CHUNK_HEADER_LEN ||
+			sparse_header.blk_sz == 0) {
+		if (verbose) {
+			sparse_print_verbose("Invalid sparse file header\n");
+		}
+		return -EINVAL;
+	}
+
+	idx->block_size = sparse_header.blk_sz;
+	idx->total_blocks = sparse_header.total_blks;
+	offset += sparse_header.file_hdr_sz;
+
+	for (i = 0; i < sparse_header.total_chunks; i++) {
+		ret = pread_all(idx->fd, &chunk_header, sizeof(chunk_header), offset);
+		if (ret < 0) {
+			return ret;
+		}
+		offset += sparse_header.chunk_hdr_sz;
+
+		if (chunk_header.total_sz < sparse_header.chunk_hdr_sz) {
+			ret = -EINVAL;
+			goto err;
+		}
+		data_size = chunk_header.total_sz - sparse_header.chunk_hdr_sz;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.block = block;
+		entry.blocks = chunk_header.chunk_sz;
+		entry.type = chunk_header.chunk_type;
+
+		switch (chunk_header.chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (data_size != (int64_t)chunk_header.chunk_sz * idx->block_size) {
+				ret = -EINVAL;
+				goto err;
+			}
+			entry.offset = offset;
+			break;
+		case CHUNK_TYPE_FILL:
+			if (data_size != sizeof(entry.fill_val)) {
+				ret = -EINVAL;
+				goto err;
+			}
+			ret = pread_all(idx->fd, &entry.fill_val, sizeof(entry.fill_val),
+					offset);
+			if (ret < 0) {
+				return ret;
+			}
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+			break;
+		case CHUNK_TYPE_CRC32:
+			entry.blocks = 0;
+			break;
+		default:
+			ret = -EINVAL;
+			goto err;
+		}
+
+		/* Don't care chunks read as zeros, so they need no entry */
+		if (entry.blocks && entry.type != CHUNK_TYPE_DONT_CARE) {
+			ret = index_add(idx, &alloc, &entry);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+
+		block += entry.blocks;
+		offset += data_size;
+	}
+
+	if (block != sparse_header.total_blks) {
+		ret = -EINVAL;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	if (verbose) {
+		sparse_print_verbose("Invalid sparse file format at chunk %u\n", i);
+	}
+	return ret;
+}
+
+struct sparse_index *sparse_index_new(int fd, bool verbose)
+{
+	struct sparse_index *idx;
+	int ret;
+
+	idx = calloc(1, sizeof(struct sparse_index));
+	if (!idx) {
+		return NULL;
+	}
+
+	idx->fd = fd;
+
+	ret = index_build(idx, verbose);
+	if (ret < 0) {
+		sparse_index_destroy(idx);
+		return NULL;
+	}
+
+	return idx;
+}
+
+void sparse_index_destroy(struct sparse_index *idx)
+{
+	free(idx->entries);
+	free(idx);
+}
+
+unsigned int sparse_index_block_size(struct sparse_index *idx)
+{
+	return idx->block_size;
+}
+
+int64_t sparse_index_len(struct sparse_index *idx)
+{
+	return (int64_t)idx->total_blocks * idx->block_size;
+}
+
+/*
+ * Returns the index of the first entry that ends after block: the entry that
+ * contains block if there is one, otherwise the next entry after it.
+ */
+static unsigned int index_find(struct sparse_index *idx, unsigned int block)
+{
+	struct sparse_index_entry *entry;
+	unsigned int lo = 0;
+	unsigned int hi = idx->count;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		entry = &idx->entries[mid];
+		if (entry->block + entry->blocks <= block) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+bool sparse_index_block_mapped(struct sparse_index *idx, unsigned int block)
+{
+	unsigned int i = index_find(idx, block);
+
+	return i < idx->count && idx->entries[i].block <= block;
+}
+
+static void fill_buf(void *buf, size_t len, uint32_t fill_val,
+		unsigned int phase)
+{
+	unsigned char *ptr = buf;
+	unsigned char *fill = (unsigned char *)&fill_val;
+	size_t i;
+
+	if (fill_val == 0) {
+		memset(buf, 0, len);
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		ptr[i] = fill[(phase + i) % sizeof(fill_val)];
+	}
+}
+
+ssize_t sparse_index_pread(struct sparse_index *idx, void *buf, size_t count,
+		int64_t offset)
+{
+	struct sparse_index_entry *entry;
+	int64_t len = sparse_index_len(idx);
+	unsigned int block;
+	unsigned int in_block;
+	unsigned int i;
+	int64_t chunk_end;
+	size_t done = 0;
+	size_t n;
+	int ret;
+
+	if (offset < 0) {
+		return -EINVAL;
+	}
+
+	if (offset >= len) {
+		return 0;
+	}
+
+	count = min((int64_t)count, len - offset);
+
+	while (done < count) {
+		block = offset / idx->block_size;
+		in_block = offset % idx->block_size;
+		i = index_find(idx, block);
+		entry = i < idx->count ? &idx->entries[i] : NULL;
+
+		if (entry && entry->block <= block) {
+			chunk_end = (int64_t)(entry->block + entry->blocks) *
+					idx->block_size;
+		} else {
+			/* Zeros up to the start of the next entry */
+			chunk_end = entry ? (int64_t)entry->block * idx->block_size : len;
+			entry = NULL;
+		}
+
+		n = min((int64_t)(count - done), chunk_end - offset);
+
+		if (!entry) {
+			memset((char *)buf + done, 0, n);
+		} else if (entry->type == CHUNK_TYPE_FILL) {
+			fill_buf((char *)buf + done, n, entry->fill_val, in_block);
+		} else {
+			ret = pread_all(idx->fd, (char *)buf + done, n, entry->offset +
+					(offset - (int64_t)entry->block * idx->block_size));
+			if (ret < 0) {
+				return ret;
+			}
+		}
+
+		done += n;
+		offset += n;
+	}
+
+	return done;
+}
+
+int sparse_index_read_block(struct sparse_index *idx, unsigned int block,
+		void *buf)
+{
+	ssize_t ret;
+
+	if (block >= idx->total_blocks) {
+		return -EINVAL;
+	}
+
+	ret = sparse_index_pread(idx, buf, idx->block_size,
+			(int64_t)block * idx->block_size);
+	if (ret < 0) {
+		return ret;
+	}
+
+	return 0;
+}
@@ -19,6 +19,7 @@
 #define _LARGEFILE64_SOURCE 1
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -29,10 +30,17 @@
 
 #include <sparse/sparse.h>
 
+#include "output_file.h"
 #include "sparse_crc32.h"
 #include "sparse_file.h"
 #include "sparse_format.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #if defined(__APPLE__) && defined(__MACH__)
 #define lseek64 lseek
 #define off64_t off_t
@@ -201,7 +209,7 @@ static int process_skip_chunk(struct sparse_file *s, unsigned int chunk_size,
 	return 0;
 }
 
-static int process_crc32_chunk(int fd, unsigned int chunk_size, uint32_t crc32)
+static int process_crc32_chunk(int fd, unsigned int chunk_size, uint32_t *crc32)
 {
 	uint32_t file_crc32;
 	int ret;
@@ -215,7 +223,7 @@ static int process_crc32_chunk(int fd, unsigned int chunk_size, uint32_t crc32)
 		return ret;
 	}
 
-	if (file_crc32 != crc32) {
+	if (crc32 != NULL && file_crc32 != *crc32) {
 		return -EINVAL;
 	}
 
@@ -259,7 +267,7 @@ static int process_chunk(struct sparse_file *s, int fd, off64_t offset,
 			}
 			return chunk_header->chunk_sz;
 		case CHUNK_TYPE_CRC32:
-			ret = process_crc32_chunk(fd, chunk_data_size, *crc_ptr);
+			ret = process_crc32_chunk(fd, chunk_data_size, crc_ptr);
 			if (ret < 0) {
 				verbose_error(s->verbose, -EINVAL, "crc block at %lld",
 						offset);
@@ -356,67 +364,225 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
 	return 0;
 }
 
-static int sparse_file_read_normal(struct sparse_file *s, int fd)
+/*
+ * Returns true if a block consists of a single repeated 32 bit value.  Compares
+ * 64 bytes at a time and gives up at the first group that differs, as data
+ * blocks almost always differ within their first few bytes.
+ */
+static bool block_is_fill(const uint32_t *buf, unsigned int block_size)
+{
+	unsigned int words = block_size / sizeof(uint32_t);
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i val = _mm_set1_epi32(buf[0]);
+	__m128i x;
+
+	for (; i + 16 <= words; i += 16) {
+		x = _mm_or_si128(
+			_mm_or_si128(
+				_mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + i)), val),
+				_mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + i + 4)), val)),
+			_mm_or_si128(
+				_mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + i + 8)), val),
+				_mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + i + 12)), val)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(x, _mm_setzero_si128())) != 0xFFFF) {
+			return false;
+		}
+	}
+#elif defined(__ARM_NEON__)
+	const uint32x4_t val = vdupq_n_u32(buf[0]);
+	uint32x4_t x;
+	uint32x2_t r;
+
+	for (; i + 16 <= words; i += 16) {
+		x = vorrq_u32(
+			vorrq_u32(veorq_u32(vld1q_u32(buf + i), val),
+				veorq_u32(vld1q_u32(buf + i + 4), val)),
+			vorrq_u32(veorq_u32(vld1q_u32(buf + i + 8), val),
+				veorq_u32(vld1q_u32(buf + i + 12), val)));
+		r = vorr_u32(vget_low_u32(x), vget_high_u32(x));
+		if (vget_lane_u32(r, 0) | vget_lane_u32(r, 1)) {
+			return false;
+		}
+	}
+#endif
+
+	for (; i < words; i++) {
+		if (buf[i] != buf[0]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Finds the first region at or after offset that may contain data, using
+ * SEEK_DATA and SEEK_HOLE.  Everything between offset and *data is a hole.
+ * Returns false if the file or the platform can't report holes, in which case
+ * the whole file has to be read.
+ */
+static bool find_data(int fd, int64_t offset, int64_t len, int64_t *data,
+		int64_t *hole)
 {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off64_t ret;
+
+	ret = lseek64(fd, offset, SEEK_DATA);
+	if (ret < 0) {
+		if (errno == ENXIO) {
+			/* Nothing but a hole up to the end of the file */
+			*data = *hole = len;
+			return true;
+		}
+		return false;
+	}
+	*data = min(ret, len);
+
+	ret = lseek64(fd, *data, SEEK_HOLE);
+	if (ret < 0) {
+		return false;
+	}
+	*hole = min(ret, len);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Adds a run of zeros that was never read from the file */
+static int add_zero_blocks(struct sparse_file *s, int64_t offset, int64_t end)
+{
+	int64_t max_len = ALIGN_DOWN(INT_MAX, s->block_size);
+	unsigned int len;
 	int ret;
-	uint32_t *buf = malloc(s->block_size);
-	unsigned int block = 0;
-	int64_t remain = s->len;
-	int64_t offset = 0;
-	unsigned int to_read;
-	char *ptr;
-	unsigned int i;
-	bool sparse_block;
 
-	if (!buf) {
-		return -ENOMEM;
+	while (offset < end) {
+		len = min(end - offset, max_len);
+		ret = sparse_file_add_fill(s, 0, len, offset / s->block_size);
+		if (ret < 0) {
+			return ret;
+		}
+		offset += len;
 	}
 
-	while (remain > 0) {
-		to_read = min(remain, s->block_size);
+	return 0;
+}
+
+static int read_blocks(struct sparse_file *s, int fd, uint32_t *buf,
+		unsigned int buf_size, int64_t offset, int64_t end, bool hole_mode)
+{
+	unsigned int block_size = s->block_size;
+	unsigned int to_read;
+	unsigned int pos;
+	unsigned int len;
+	uint32_t *block_buf;
+	int ret;
+
+	/* Might fail for a pipe, which is read from the start anyway */
+	lseek64(fd, offset, SEEK_SET);
+
+	while (offset < end) {
+		to_read = min(end - offset, (int64_t)buf_size);
 		ret = read_all(fd, buf, to_read);
 		if (ret < 0) {
 			error("failed to read sparse file");
 			return ret;
 		}
 
-		if (to_read == s->block_size) {
-			sparse_block = true;
-			for (i = 1; i < s->block_size / sizeof(uint32_t); i++) {
-				if (buf[0] != buf[i]) {
-					sparse_block = false;
-					break;
+		for (pos = 0; pos < to_read; pos += block_size) {
+			len = min(to_read - pos, block_size);
+			block_buf = (uint32_t *)((char *)buf + pos);
+
+			if (len == block_size && block_is_fill(block_buf, block_size)) {
+				if (!hole_mode || block_buf[0] != 0) {
+					sparse_file_add_fill(s, block_buf[0], len,
+							(offset + pos) / block_size);
 				}
+			} else {
+				sparse_file_add_fd(s, fd, offset + pos, len,
+						(offset + pos) / block_size);
 			}
-		} else {
-			sparse_block = false;
 		}
 
-		if (sparse_block) {
-			/* TODO: add flag to use skip instead of fill for buf[0] == 0 */
-			sparse_file_add_fill(s, buf[0], to_read, block);
-		} else {
-			sparse_file_add_fd(s, fd, offset, to_read, block);
-		}
-
-		remain -= to_read;
 		offset += to_read;
-		block++;
 	}
 
 	return 0;
 }
 
-int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc)
+static int sparse_file_read_normal(struct sparse_file *s, int fd,
+		bool hole_mode)
 {
-	if (crc && !sparse) {
+	int ret = 0;
+	unsigned int block_size = s->block_size;
+	unsigned int buf_size = ALIGN_DOWN(COPY_BUF_SIZE, block_size);
+	uint32_t *buf;
+	int64_t offset = 0;
+	int64_t data;
+	int64_t hole;
+	int64_t end;
+	bool seek_holes = true;
+
+	if (buf_size == 0) {
+		buf_size = block_size;
+	}
+
+	buf = malloc(buf_size);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	while (offset < s->len) {
+		if (!seek_holes || !find_data(fd, offset, s->len, &data, &hole)) {
+			seek_holes = false;
+			data = offset;
+			hole = s->len;
+		}
+
+		/* Whole blocks up to the data are a hole, which reads as zeros */
+		end = ALIGN_DOWN(data, block_size);
+		if (end > offset) {
+			if (!hole_mode) {
+				ret = add_zero_blocks(s, offset, end);
+				if (ret < 0) {
+					break;
+				}
+			}
+			offset = end;
+		}
+
+		end = min(ALIGN(hole, block_size), s->len);
+		ret = read_blocks(s, fd, buf, buf_size, offset, end, hole_mode);
+		if (ret < 0) {
+			break;
+		}
+		offset = end;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+int sparse_file_read(struct sparse_file *s, int fd, enum sparse_read_mode mode,
+		bool crc)
+{
+	if (crc && mode != SPARSE_READ_MODE_SPARSE) {
 		return -EINVAL;
 	}
 
-	if (sparse) {
+	switch (mode) {
+	case SPARSE_READ_MODE_SPARSE:
 		return sparse_file_read_sparse(s, fd, crc);
-	} else {
-		return sparse_file_read_normal(s, fd);
+	case SPARSE_READ_MODE_NORMAL:
+		return sparse_file_read_normal(s, fd, false);
+	case SPARSE_READ_MODE_HOLE:
+		return sparse_file_read_normal(s, fd, true);
+	default:
+		return -EINVAL;
 	}
 }
 
@@ -467,7 +633,7 @@ struct sparse_file *sparse_file_import(int fd, bool verbose, bool crc)
 
 	s->verbose = verbose;
 
-	ret = sparse_file_read(s, fd, true, crc);
+	ret = sparse_file_read(s, fd, SPARSE_READ_MODE_SPARSE, crc);
 	if (ret < 0) {
 		sparse_file_destroy(s);
 		return NULL;
@@ -499,7 +665,7 @@ struct sparse_file *sparse_file_import_auto(int fd, bool crc)
 		return NULL;
 	}
 
-	ret = sparse_file_read_normal(s, fd);
+	ret = sparse_file_read_normal(s, fd, false);
 	if (ret < 0) {
 		sparse_file_destroy(s);
 		return NULL;
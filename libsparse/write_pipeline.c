@@ -0,0 +1,545 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <sparse/sparse.h>
+
+#include "output_file.h"
+#include "sparse_file.h"
+
+#ifndef USE_MINGW
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "backed_block.h"
+#include "sparse_crc32.h"
+#include "sparse_defs.h"
+
+#define O_BINARY 0
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define mmap64 mmap
+#define off64_t off_t
+#endif
+
+#ifdef __BIONIC__
+extern void*  __mmap2(void *, size_t, int, int, int, off_t);
+static inline void *mmap64(void *addr, size_t length, int prot, int flags,
+        int fd, off64_t offset)
+{
+    return __mmap2(addr, length, prot, flags, fd, offset >> 12);
+}
+#endif
+
+/*
+ * The pipelined writer splits sparse_file_write into two stages:
+ *
+ *  - a pool of reader threads maps the data behind file and fd chunks and
+ *    faults it in, several jobs ahead of the output, and calculates the crc
+ *    of each job on its own
+ *  - the calling thread writes (and, for gz files, compresses) the jobs in
+ *    order, through the same chunk writers as sparse_file_write, and merges
+ *    the job crcs into the crc of the expanded image
+ *
+ * A job is a whole chunk, or for file and fd chunks, at most
+ * PIPELINE_JOB_SIZE bytes of one, so a chunk of several GB goes through a
+ * piece at a time like it does in the serial writer.  Jobs are handed between
+ * the stages through a ring of PIPELINE_SLOTS job slots, and readers stop
+ * taking jobs while PIPELINE_MAX_INFLIGHT bytes are mapped, so no more than
+ * that and one job are mapped at any time.
+ */
+#define PIPELINE_SLOTS 64
+#define PIPELINE_JOB_SIZE (1024 * 1024)
+#define PIPELINE_MAX_INFLIGHT (64 * 1024 * 1024)
+#define PIPELINE_MAX_THREADS 16
+
+#define PIPELINE_PAGE_SIZE 4096
+
+enum pipeline_job_state {
+	JOB_FREE,
+	JOB_READING,
+	JOB_READ,
+};
+
+struct pipeline_job {
+	enum pipeline_job_state state;
+	struct backed_block *bb;
+	int64_t skip;
+	/* The part of the chunk this job covers, for file and fd chunks */
+	unsigned int offset;
+	unsigned int bytes;
+	bool last;
+	char *map;
+	size_t map_len;
+	char *data;
+	uint32_t crc32;
+	int64_t crc_len;
+	int err;
+};
+
+struct write_pipeline {
+	struct sparse_file *s;
+	struct output_file *out;
+	bool crc;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct pipeline_job jobs[PIPELINE_SLOTS];
+	unsigned int queued;
+	unsigned int written;
+	bool end;
+	bool abort;
+
+	struct backed_block *next_bb;
+	unsigned int next_offset;
+	unsigned int job_size;
+	unsigned int last_block;
+	int64_t inflight;
+
+	uint32_t crc32;
+};
+
+static struct pipeline_job *pipeline_job(struct write_pipeline *p,
+		unsigned int i)
+{
+	return &p->jobs[i % PIPELINE_SLOTS];
+}
+
+/*
+ * Returns how much of the data behind bb, starting at offset, the next job
+ * maps, or 0 if bb is not backed by a file or fd
+ */
+static unsigned int pipeline_job_bytes(struct write_pipeline *p,
+		struct backed_block *bb, unsigned int offset)
+{
+	unsigned int len;
+
+	switch (backed_block_type(bb)) {
+	case BACKED_BLOCK_FILE:
+	case BACKED_BLOCK_FD:
+		len = backed_block_len(bb) - offset;
+		return len > p->job_size ? p->job_size : len;
+	default:
+		return 0;
+	}
+}
+
+static int pipeline_map_job(struct pipeline_job *job)
+{
+	struct backed_block *bb = job->bb;
+	unsigned int len = job->bytes;
+	int64_t offset = backed_block_file_offset(bb) + job->offset;
+	int64_t aligned_offset;
+	volatile char *ptr;
+	size_t i;
+	int fd;
+
+	if (backed_block_type(bb) == BACKED_BLOCK_FILE) {
+		fd = open(backed_block_filename(bb), O_RDONLY | O_BINARY);
+		if (fd < 0) {
+			return -errno;
+		}
+	} else {
+		fd = backed_block_fd(bb);
+	}
+
+	aligned_offset = offset & ~(PIPELINE_PAGE_SIZE - 1);
+	job->map_len = len + (offset - aligned_offset);
+	job->map = mmap64(NULL, job->map_len, PROT_READ, MAP_SHARED, fd,
+			aligned_offset);
+	if (job->map == MAP_FAILED) {
+		job->map = NULL;
+		if (backed_block_type(bb) == BACKED_BLOCK_FILE) {
+			close(fd);
+		}
+		return -errno;
+	}
+
+	if (backed_block_type(bb) == BACKED_BLOCK_FILE) {
+		close(fd);
+	}
+
+	job->data = job->map + (offset - aligned_offset);
+
+	/* Do the actual reading here, instead of on the output thread */
+	madvise(job->map, job->map_len, MADV_WILLNEED);
+	ptr = job->map;
+	for (i = 0; i < job->map_len; i += PIPELINE_PAGE_SIZE) {
+		(void)ptr[i];
+	}
+
+	return 0;
+}
+
+static void pipeline_unmap_job(struct pipeline_job *job)
+{
+	if (job->map) {
+		munmap(job->map, job->map_len);
+		job->map = NULL;
+	}
+	job->data = NULL;
+}
+
+/*
+ * Calculates the crc of a single job, starting from zero, covering the same
+ * bytes the chunk writers would add to the image crc.  Only the last job of a
+ * chunk can end part way through a block.
+ */
+static void pipeline_crc_job(struct write_pipeline *p, struct pipeline_job *job)
+{
+	struct backed_block *bb = job->bb;
+	unsigned int len = backed_block_len(bb);
+
+	switch (backed_block_type(bb)) {
+	case BACKED_BLOCK_DATA:
+		job->crc32 = output_file_data_crc(p->out, 0, len,
+				backed_block_data(bb));
+		job->crc_len = ALIGN(len, p->s->block_size);
+		break;
+	case BACKED_BLOCK_FILE:
+	case BACKED_BLOCK_FD:
+		job->crc32 = output_file_data_crc(p->out, 0, job->bytes, job->data);
+		job->crc_len = ALIGN(job->bytes, p->s->block_size);
+		break;
+	case BACKED_BLOCK_FILL:
+		job->crc32 = output_file_fill_crc(p->out, 0, len,
+				backed_block_fill_val(bb));
+		job->crc_len = p->s->block_size;
+		break;
+	}
+}
+
+static void *pipeline_reader_thread(void *priv)
+{
+	struct write_pipeline *p = priv;
+	struct pipeline_job *job;
+	struct backed_block *bb;
+	unsigned int block_size = p->s->block_size;
+	int err;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->end && !p->abort &&
+				(p->queued - p->written == PIPELINE_SLOTS ||
+				 (p->inflight >= PIPELINE_MAX_INFLIGHT &&
+				  p->queued != p->written))) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+
+		if (p->end || p->abort) {
+			break;
+		}
+
+		bb = p->next_bb;
+		job = pipeline_job(p, p->queued++);
+		job->bb = bb;
+		job->offset = p->next_offset;
+		job->skip = 0;
+		if (job->offset == 0 && backed_block_block(bb) > p->last_block) {
+			job->skip = (int64_t)(backed_block_block(bb) - p->last_block) *
+					block_size;
+		}
+		job->bytes = pipeline_job_bytes(p, bb, job->offset);
+		job->last = job->offset + job->bytes == backed_block_len(bb) ||
+				job->bytes == 0;
+		job->map = NULL;
+		job->data = NULL;
+		job->err = 0;
+		job->state = JOB_READING;
+		p->inflight += job->bytes;
+		if (job->offset == 0) {
+			p->last_block = backed_block_block(bb) +
+					DIV_ROUND_UP(backed_block_len(bb), block_size);
+		}
+		if (job->last) {
+			p->next_bb = backed_block_iter_next(bb);
+			p->next_offset = 0;
+			if (!p->next_bb) {
+				p->end = true;
+			}
+		} else {
+			p->next_offset = job->offset + job->bytes;
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		err = 0;
+		if (job->bytes) {
+			err = pipeline_map_job(job);
+		}
+		if (!err && p->crc) {
+			pipeline_crc_job(p, job);
+		}
+
+		pthread_mutex_lock(&p->lock);
+		job->err = err;
+		job->state = JOB_READ;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+/*
+ * Waits until job i has reached state, or returns NULL if there is no job i
+ * because all chunks have been queued, or the pipeline was aborted.
+ * Called with the lock held.
+ */
+static struct pipeline_job *pipeline_wait_job(struct write_pipeline *p,
+		unsigned int i, enum pipeline_job_state state)
+{
+	for (;;) {
+		if (p->abort) {
+			return NULL;
+		}
+		if (i < p->queued && pipeline_job(p, i)->state == state) {
+			return pipeline_job(p, i);
+		}
+		if (p->end && i == p->queued) {
+			return NULL;
+		}
+		pthread_cond_wait(&p->cond, &p->lock);
+	}
+}
+
+static int pipeline_write_job(struct write_pipeline *p,
+		struct pipeline_job *job)
+{
+	struct backed_block *bb = job->bb;
+	int ret;
+
+	if (job->skip) {
+		ret = write_skip_chunk(p->out, job->skip);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	switch (backed_block_type(bb)) {
+	case BACKED_BLOCK_DATA:
+		return write_data_chunk(p->out, backed_block_len(bb),
+				backed_block_data(bb));
+	case BACKED_BLOCK_FILE:
+	case BACKED_BLOCK_FD:
+		if (job->offset == 0) {
+			ret = write_data_chunk_begin(p->out, backed_block_len(bb));
+			if (ret < 0) {
+				return ret;
+			}
+		}
+		ret = write_data_chunk_part(p->out, job->bytes, job->data);
+		if (ret < 0 || !job->last) {
+			return ret;
+		}
+		return write_data_chunk_end(p->out, backed_block_len(bb));
+	case BACKED_BLOCK_FILL:
+		return write_fill_chunk(p->out, backed_block_len(bb),
+				backed_block_fill_val(bb));
+	}
+
+	return -EINVAL;
+}
+
+static int write_all_blocks_pipelined(struct sparse_file *s,
+		struct output_file *out, bool crc, int threads)
+{
+	struct write_pipeline *p;
+	struct pipeline_job *job;
+	pthread_t readers[PIPELINE_MAX_THREADS];
+	int started = 0;
+	int64_t pad;
+	unsigned int i;
+	int ret = 0;
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads < 1) {
+		threads = 1;
+	} else if (threads > PIPELINE_MAX_THREADS) {
+		threads = PIPELINE_MAX_THREADS;
+	}
+
+	p = calloc(1, sizeof(struct write_pipeline));
+	if (!p) {
+		return -ENOMEM;
+	}
+
+	p->s = s;
+	p->out = out;
+	p->crc = crc;
+	p->next_bb = backed_block_iter_new(s->backed_block_list);
+	p->end = p->next_bb == NULL;
+	/* Jobs other than the last of a chunk end on a block boundary */
+	p->job_size = PIPELINE_JOB_SIZE - PIPELINE_JOB_SIZE % s->block_size;
+	if (p->job_size == 0) {
+		p->job_size = s->block_size;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	if (crc) {
+		output_file_external_crc(out);
+	}
+
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&readers[started], NULL, pipeline_reader_thread,
+				p)) {
+			break;
+		}
+	}
+	if (!started) {
+		ret = -ENOMEM;
+		goto join;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; (job = pipeline_wait_job(p, i, JOB_READ)) != NULL; i++) {
+		pthread_mutex_unlock(&p->lock);
+
+		ret = job->err;
+		if (!ret) {
+			ret = pipeline_write_job(p, job);
+		}
+		if (!ret && crc) {
+			p->crc32 = sparse_crc32_combine(p->crc32, job->crc32,
+					job->crc_len);
+		}
+		pipeline_unmap_job(job);
+
+		pthread_mutex_lock(&p->lock);
+		if (ret < 0) {
+			break;
+		}
+		p->inflight -= job->bytes;
+		job->state = JOB_FREE;
+		p->written++;
+		pthread_cond_broadcast(&p->cond);
+	}
+	if (ret < 0) {
+		p->abort = true;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+join:
+	if (ret < 0) {
+		pthread_mutex_lock(&p->lock);
+		p->abort = true;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	while (started--) {
+		pthread_join(readers[started], NULL);
+	}
+
+	if (crc) {
+		output_file_set_crc(out, p->crc32);
+	}
+
+	/* Release anything the readers mapped after an error */
+	for (i = p->written; i < p->queued; i++) {
+		pipeline_unmap_job(pipeline_job(p, i));
+	}
+
+	if (ret == 0) {
+		pad = s->len - (int64_t)p->last_block * s->block_size;
+		assert(pad >= 0);
+		if (pad > 0) {
+			ret = write_skip_chunk(out, pad);
+		}
+	}
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+
+	return ret;
+}
+
+#endif /* !USE_MINGW */
+
+/*
+ * These live here rather than in sparse.c so that only users of the pipeline
+ * link it in, along with pthreads.
+ */
+int sparse_file_write_threaded(struct sparse_file *s, int fd, bool gz,
+		bool sparse, bool crc, int threads)
+{
+#ifndef USE_MINGW
+	int ret;
+	int chunks;
+	struct output_file *out;
+
+	chunks = sparse_count_chunks(s);
+	out = output_file_open_fd(fd, s->block_size, s->len, gz, sparse, chunks, crc);
+
+	if (!out)
+		return -ENOMEM;
+
+	if (s->punch_holes && !sparse)
+		output_file_punch_holes(out);
+
+	ret = write_all_blocks_pipelined(s, out, sparse && crc, threads);
+
+	output_file_close(out);
+
+	return ret;
+#else
+	return sparse_file_write(s, fd, gz, sparse, crc);
+#endif
+}
+
+int sparse_file_callback_threaded(struct sparse_file *s, bool sparse, bool crc,
+		int (*write)(void *priv, const void *data, int len), void *priv,
+		int threads)
+{
+#ifndef USE_MINGW
+	int ret;
+	int chunks;
+	struct output_file *out;
+
+	chunks = sparse_count_chunks(s);
+	out = output_file_open_callback(write, priv, s->block_size, s->len, false,
+			sparse, chunks, crc);
+
+	if (!out)
+		return -ENOMEM;
+
+	ret = write_all_blocks_pipelined(s, out, sparse && crc, threads);
+
+	output_file_close(out);
+
+	return ret;
+#else
+	return sparse_file_callback(s, sparse, crc, write, priv);
+#endif
+}
@@ -5,6 +5,7 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
 	centraldir.c \
+	extract.c \
 	zipfile.c
 
 LOCAL_STATIC_LIBRARIES := \
@@ -21,6 +22,7 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
 	centraldir.c \
+	extract.c \
 	zipfile.c
 
 LOCAL_STATIC_LIBRARIES := \
@@ -45,4 +47,6 @@ LOCAL_MODULE := test_zipfile
 
 LOCAL_C_INCLUDES += external/zlib
 
+LOCAL_LDLIBS := -lpthread
+
 include $(BUILD_HOST_EXECUTABLE)
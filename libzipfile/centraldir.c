@@ -10,6 +10,17 @@ enum {
     MAX_COMMENT_LEN = 65535,
     MAX_EOCD_SEARCH = MAX_COMMENT_LEN + EOCD_LEN,
 
+    // ZIP64 end of central dir locator, just before the EOCD
+    LOCATOR_SIGNATURE = 0x07064b50,
+    LOCATOR_LEN = 20,
+
+    // ZIP64 end of central dir record, excl. extensible data
+    CD64_SIGNATURE = 0x06064b50,
+    EOCD64_LEN = 56,
+
+    // ZIP64 extra field in central dir entries
+    ZIP64_EXTRA_ID = 0x0001,
+
     // central directory entries
     ENTRY_SIGNATURE = 0x02014b50,
     ENTRY_LEN = 46,          // CentralDirEnt len, excl. var fields
@@ -30,6 +41,69 @@ read_le_short(const unsigned char* buf)
     return buf[0] | (buf[1] << 8);
 }
 
+uint64_t
+read_le_long(const unsigned char* buf)
+{
+    return read_le_int(buf) | ((uint64_t)read_le_int(buf + 4) << 32);
+}
+
+unsigned int
+hash_name(const unsigned char* name, size_t len)
+{
+    unsigned int hash = 0;
+
+    while (len--) {
+        hash = hash * 31 + *name++;
+    }
+    return hash;
+}
+
+/*
+ * Allocates the entries and their hash table in a single block.  The table
+ * is kept at most 3/4 full so probe sequences stay short.
+ */
+static int
+alloc_entries(Zipfile* file, unsigned int count)
+{
+    unsigned int size = 1;
+
+    while (size < count + count / 3 + 1) {
+        size <<= 1;
+    }
+
+    file->entryArena = calloc(1, count * sizeof(Zipentry)
+            + size * sizeof(Zipentry*));
+    if (file->entryArena == NULL) {
+        fprintf(stderr, "can't allocate %u zip entries\n", count);
+        return -1;
+    }
+
+    file->hashTable = (Zipentry**)(file->entryArena + count);
+    file->hashTableSize = size;
+    return 0;
+}
+
+static void
+add_to_hash(Zipfile* file, Zipentry* entry)
+{
+    unsigned int mask = file->hashTableSize - 1;
+    unsigned int i = entry->fileNameHash & mask;
+    Zipentry* other;
+
+    while ((other = file->hashTable[i]) != NULL) {
+        // Later entries with the same name replace earlier ones, as they
+        // did when lookups walked the list from the end
+        if (other->fileNameLength == entry->fileNameLength
+                && other->fileNameHash == entry->fileNameHash
+                && memcmp(other->fileName, entry->fileName,
+                        entry->fileNameLength) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    file->hashTable[i] = entry;
+}
+
 static int
 read_central_dir_values(Zipfile* file, const unsigned char* buf, int len)
 {
@@ -40,6 +114,7 @@ read_central_dir_values(Zipfile* file, const unsigned char* buf, int len)
         return -1;
     }
 
+    file->centralDirEnd = buf - file->buf;
     file->disknum = read_le_short(&buf[0x04]);
     file->diskWithCentralDir = read_le_short(&buf[0x06]);
     file->entryCount = read_le_short(&buf[0x08]);
@@ -60,30 +135,115 @@ read_central_dir_values(Zipfile* file, const unsigned char* buf, int len)
     return 0;
 }
 
+/*
+ * Archives too big for the EOCD fields put the real values in a ZIP64
+ * record, found through a locator just before the EOCD.
+ */
+static int
+read_central_dir_values64(Zipfile* file, const unsigned char* eocd)
+{
+    const unsigned char* locator = eocd - LOCATOR_LEN;
+    const unsigned char* buf;
+    uint64_t offset;
+    uint64_t entryCount;
+    uint64_t totalEntryCount;
+
+    if (eocd - file->buf < LOCATOR_LEN
+            || read_le_int(locator) != LOCATOR_SIGNATURE) {
+        return 0;
+    }
+
+    offset = read_le_long(&locator[0x08]);
+    if (offset > (uint64_t)(locator - file->buf)
+            || (uint64_t)(locator - file->buf) - offset < EOCD64_LEN) {
+        fprintf(stderr, "Zip64 EOCD offset %llu is out of range\n",
+                (unsigned long long)offset);
+        return -1;
+    }
+
+    buf = file->buf + offset;
+    if (read_le_int(buf) != CD64_SIGNATURE) {
+        fprintf(stderr, "Zip64 EOCD not found at %llu\n",
+                (unsigned long long)offset);
+        return -1;
+    }
+
+    file->disknum = read_le_int(&buf[0x10]);
+    file->diskWithCentralDir = read_le_int(&buf[0x14]);
+    entryCount = read_le_long(&buf[0x18]);
+    totalEntryCount = read_le_long(&buf[0x20]);
+    file->centralDirSize = read_le_long(&buf[0x28]);
+    file->centralDirOffest = read_le_long(&buf[0x30]);
+    file->centralDirEnd = offset;
+
+    if (entryCount > UINT32_MAX || totalEntryCount > UINT32_MAX) {
+        fprintf(stderr, "Zip64 entry count %llu is too big\n",
+                (unsigned long long)totalEntryCount);
+        return -1;
+    }
+    file->entryCount = entryCount;
+    file->totalEntryCount = totalEntryCount;
+
+    return 0;
+}
+
+/*
+ * Picks the ZIP64 values out of an entry's extra field.  Each one is only
+ * there if the 32 bit field it replaces is all ones.
+ */
+static int
+read_zip64_extra(Zipentry* entry, const unsigned char* extra, unsigned int len)
+{
+    unsigned int id, size;
+
+    while (len >= 4) {
+        id = read_le_short(&extra[0]);
+        size = read_le_short(&extra[2]);
+        extra += 4;
+        len -= 4;
+        if (size > len) {
+            break;
+        }
+
+        if (id == ZIP64_EXTRA_ID) {
+            if (entry->uncompressedSize == UINT32_MAX) {
+                if (size < 8) goto bad;
+                entry->uncompressedSize = read_le_long(extra);
+                extra += 8;
+                size -= 8;
+            }
+            if (entry->compressedSize == UINT32_MAX) {
+                if (size < 8) goto bad;
+                entry->compressedSize = read_le_long(extra);
+                extra += 8;
+                size -= 8;
+            }
+            if (entry->localHeaderOffset == UINT32_MAX) {
+                if (size < 8) goto bad;
+                entry->localHeaderOffset = read_le_long(extra);
+            }
+            return 0;
+        }
+
+        extra += size;
+        len -= size;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "Zip64 extra field is too short\n");
+    return -1;
+}
+
 static int
 read_central_directory_entry(Zipfile* file, Zipentry* entry,
                 const unsigned char** buf, ssize_t* len)
 {
     const unsigned char* p;
 
-    unsigned short  versionMadeBy;
-    unsigned short  versionToExtract;
-    unsigned short  gpBitFlag;
-    unsigned short  compressionMethod;
-    unsigned short  lastModFileTime;
-    unsigned short  lastModFileDate;
-    unsigned long   crc32;
     unsigned short  extraFieldLength;
     unsigned short  fileCommentLength;
-    unsigned short  diskNumberStart;
-    unsigned short  internalAttrs;
-    unsigned long   externalAttrs;
-    unsigned long   localHeaderRelOffset;
     const unsigned char*  extraField;
-    const unsigned char*  fileComment;
-    unsigned int dataOffset;
-    unsigned short lfhExtraFieldSize;
-
 
     p = *buf;
 
@@ -97,22 +257,21 @@ read_central_directory_entry(Zipfile* file, Zipentry* entry,
         return -1;
     }
 
-    versionMadeBy = read_le_short(&p[0x04]);
-    versionToExtract = read_le_short(&p[0x06]);
-    gpBitFlag = read_le_short(&p[0x08]);
+    entry->file = file;
     entry->compressionMethod = read_le_short(&p[0x0a]);
-    lastModFileTime = read_le_short(&p[0x0c]);
-    lastModFileDate = read_le_short(&p[0x0e]);
-    crc32 = read_le_int(&p[0x10]);
+    entry->crc32 = read_le_int(&p[0x10]);
     entry->compressedSize = read_le_int(&p[0x14]);
     entry->uncompressedSize = read_le_int(&p[0x18]);
     entry->fileNameLength = read_le_short(&p[0x1c]);
     extraFieldLength = read_le_short(&p[0x1e]);
     fileCommentLength = read_le_short(&p[0x20]);
-    diskNumberStart = read_le_short(&p[0x22]);
-    internalAttrs = read_le_short(&p[0x24]);
-    externalAttrs = read_le_int(&p[0x26]);
-    localHeaderRelOffset = read_le_int(&p[0x2a]);
+    entry->localHeaderOffset = read_le_int(&p[0x2a]);
+
+    if (*len < ENTRY_LEN + entry->fileNameLength + extraFieldLength
+            + fileCommentLength) {
+        fprintf(stderr, "cde entry variable fields run off the end\n");
+        return -1;
+    }
 
     p += ENTRY_LEN;
 
@@ -125,42 +284,63 @@ read_central_directory_entry(Zipfile* file, Zipentry* entry,
     p += entry->fileNameLength;
 
     // extra field
-    if (extraFieldLength != 0) {
-        extraField = p;
-    } else {
-        extraField = NULL;
-    }
+    extraField = p;
     p += extraFieldLength;
+    if (read_zip64_extra(entry, extraField, extraFieldLength) != 0) {
+        return -1;
+    }
 
     // comment, if any
-    if (fileCommentLength != 0) {
-        fileComment = p;
-    } else {
-        fileComment = NULL;
-    }
     p += fileCommentLength;
 
+    *len -= p - *buf;
     *buf = p;
 
+    // The local file header is only read when the data is first needed, so
+    // a lookup doesn't touch a page of the archive for every entry.
+    entry->data = NULL;
+    return 0;
+}
+
+const unsigned char*
+get_entry_data(Zipentry* entry)
+{
+    Zipfile* file = entry->file;
+    const unsigned char* p;
+    uint64_t dataOffset;
+
+    if (entry->data != NULL) {
+        return entry->data;
+    }
+
+    if (entry->localHeaderOffset > (uint64_t)file->bufsize
+            || (uint64_t)file->bufsize - entry->localHeaderOffset < LFH_SIZE) {
+        fprintf(stderr, "local header offset %llu is out of range\n",
+                (unsigned long long)entry->localHeaderOffset);
+        return NULL;
+    }
+
     // the size of the extraField in the central dir is how much data there is,
     // but the one in the local file header also contains some padding.
-    p = file->buf + localHeaderRelOffset;
-    extraFieldLength = read_le_short(&p[0x1c]);
+    p = file->buf + entry->localHeaderOffset;
+    dataOffset = entry->localHeaderOffset + LFH_SIZE
+        + read_le_short(&p[0x1a]) + read_le_short(&p[0x1c]);
+
+    if (dataOffset > (uint64_t)file->bufsize
+            || (uint64_t)file->bufsize - dataOffset < entry->compressedSize
+            || (entry->compressionMethod == STORED
+                && entry->compressedSize != entry->uncompressedSize)) {
+        fprintf(stderr, "data for '%.*s' runs off the end\n",
+                (int)entry->fileNameLength, entry->fileName);
+        return NULL;
+    }
 
-    dataOffset = localHeaderRelOffset + LFH_SIZE
-        + entry->fileNameLength + extraFieldLength;
     entry->data = file->buf + dataOffset;
-#if 0
-    printf("file->buf=%p entry->data=%p dataOffset=%x localHeaderRelOffset=%d "
-           "entry->fileNameLength=%d extraFieldLength=%d\n",
-           file->buf, entry->data, dataOffset, localHeaderRelOffset,
-           entry->fileNameLength, extraFieldLength);
-#endif
-    return 0;
+    return entry->data;
 }
 
 /*
- * Find the central directory and read the contents.
+ * Find the end of the central directory and check it makes sense.
  *
  * The fun thing about ZIP archives is that they may or may not be
  * readable from start to end.  In some cases, notably for archives
@@ -178,7 +358,7 @@ read_central_directory_entry(Zipfile* file, Zipentry* entry,
  * it though, so we're in pretty good company if this fails.
  */
 int
-read_central_dir(Zipfile *file)
+read_central_dir_end(Zipfile *file)
 {
     int err;
 
@@ -187,13 +367,11 @@ read_central_dir(Zipfile *file)
     const unsigned char* eocd;
     const unsigned char* p;
     const unsigned char* start;
-    ssize_t len;
-    int i;
 
     // too small to be a ZIP archive?
     if (bufsize < EOCD_LEN) {
         fprintf(stderr, "Length is %zd -- too small\n", bufsize);
-        goto bail;
+        return -1;
     }
 
     // find the end-of-central-dir magic
@@ -202,7 +380,7 @@ read_central_dir(Zipfile *file)
     } else {
         start = buf;
     }
-    p = buf + bufsize - 4;
+    p = buf + bufsize - EOCD_LEN;
     while (p >= start) {
         if (*p == 0x50 && read_le_int(p) == CD_SIGNATURE) {
             eocd = p;
@@ -212,42 +390,103 @@ read_central_dir(Zipfile *file)
     }
     if (p < start) {
         fprintf(stderr, "EOCD not found, not Zip\n");
-        goto bail;
+        return -1;
     }
 
     // extract eocd values
     err = read_central_dir_values(file, eocd, (buf+bufsize)-eocd);
     if (err != 0) {
-        goto bail;
+        return -1;
+    }
+
+    err = read_central_dir_values64(file, eocd);
+    if (err != 0) {
+        return -1;
     }
 
     if (file->disknum != 0
           || file->diskWithCentralDir != 0
           || file->entryCount != file->totalEntryCount) {
         fprintf(stderr, "Archive spanning not supported\n");
+        return -1;
+    }
+
+    if (file->centralDirOffest > file->centralDirEnd
+            || file->centralDirEnd - file->centralDirOffest
+                    < file->centralDirSize
+            || file->centralDirSize / ENTRY_LEN < file->totalEntryCount) {
+        fprintf(stderr, "central dir of %u entries at %llu doesn't fit\n",
+                file->totalEntryCount,
+                (unsigned long long)file->centralDirOffest);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Decode all the central dir entries.  Only done once, the first time
+ * anything needs them.
+ */
+int
+read_central_dir_entries(Zipfile *file)
+{
+    int err;
+
+    const unsigned char* p;
+    ssize_t len;
+    unsigned int i;
+
+    if (file->entriesRead) {
+        return file->entriesRead > 0 ? 0 : -1;
+    }
+    file->entriesRead = -1;
+
+    err = alloc_entries(file, file->totalEntryCount);
+    if (err != 0) {
         goto bail;
     }
 
     // Loop through and read the central dir entries.
-    p = buf + file->centralDirOffest;
-    len = (buf+bufsize)-p;
+    p = file->buf + file->centralDirOffest;
+    len = file->centralDirSize;
     for (i=0; i < file->totalEntryCount; i++) {
-        Zipentry* entry = malloc(sizeof(Zipentry));
-        memset(entry, 0, sizeof(Zipentry));
+        Zipentry* entry = &file->entryArena[i];
 
         err = read_central_directory_entry(file, entry, &p, &len);
         if (err != 0) {
             fprintf(stderr, "read_central_directory_entry failed\n");
-            free(entry);
             goto bail;
         }
+        entry->fileNameHash = hash_name(entry->fileName,
+                entry->fileNameLength);
 
-        // add it to our list
+        // add it to our list and the hash table
         entry->next = file->entries;
         file->entries = entry;
+        add_to_hash(file, entry);
     }
 
+    file->entriesRead = 1;
     return 0;
 bail:
+    free(file->entryArena);
+    file->entryArena = NULL;
+    file->hashTable = NULL;
+    file->hashTableSize = 0;
+    file->entries = NULL;
     return -1;
 }
+
+int
+read_central_dir(Zipfile *file)
+{
+    int err;
+
+    err = read_central_dir_end(file);
+    if (err != 0) {
+        return err;
+    }
+
+    return read_central_dir_entries(file);
+}
@@ -0,0 +1,277 @@
+#include <zipfile/zipfile.h>
+
+#include "private.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifndef USE_MINGW
+#include <pthread.h>
+#endif
+
+// Each thread inflates through a buffer this big
+#define EXTRACT_BUFFER_SIZE (64 * 1024)
+#define MAX_EXTRACT_THREADS 16
+
+typedef struct Extractjob {
+    Zipentry* entry;
+    int fd;
+    off_t offset;
+} Extractjob;
+
+typedef struct Extractor {
+    Extractjob* jobs;
+    int jobCount;
+    int nextJob;
+    int failed;
+#ifndef USE_MINGW
+    pthread_mutex_t lock;
+#endif
+} Extractor;
+
+static void
+lock_extractor(Extractor* x)
+{
+#ifndef USE_MINGW
+    pthread_mutex_lock(&x->lock);
+#endif
+}
+
+static void
+unlock_extractor(Extractor* x)
+{
+#ifndef USE_MINGW
+    pthread_mutex_unlock(&x->lock);
+#endif
+}
+
+static int
+write_all(int fd, const unsigned char* buf, size_t len, off_t offset)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+#ifdef USE_MINGW
+        // Only one thread extracts on windows, so nothing moves the offset
+        if (lseek(fd, offset, SEEK_SET) < 0) {
+            return -1;
+        }
+        ret = write(fd, buf, len);
+#else
+        ret = pwrite(fd, buf, len, offset);
+#endif
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int
+extract_entry(Extractjob* job, unsigned char* buf)
+{
+    Zipentry* entry = job->entry;
+    zipreader_t reader;
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    off_t offset = job->offset;
+    int len;
+
+    if (entry->compressionMethod == STORED) {
+        // Nothing to inflate, so write straight from the zip file
+        const unsigned char* data = entry->data;
+        uint64_t left = entry->uncompressedSize;
+
+        while (left > 0) {
+            unsigned int chunk = left > UINT_MAX ? UINT_MAX : left;
+            crc = crc32(crc, data, chunk);
+            data += chunk;
+            left -= chunk;
+        }
+        if (job->fd >= 0 && write_all(job->fd, entry->data,
+                    entry->uncompressedSize, offset) != 0) {
+            goto write_error;
+        }
+    } else {
+        reader = open_zipentry(entry);
+        if (reader == NULL) {
+            fprintf(stderr, "can't extract '%.*s'\n",
+                    (int)entry->fileNameLength, entry->fileName);
+            return -1;
+        }
+
+        while ((len = read_zipentry(reader, buf, EXTRACT_BUFFER_SIZE)) > 0) {
+            crc = crc32(crc, buf, len);
+            if (job->fd >= 0 && write_all(job->fd, buf, len, offset) != 0) {
+                close_zipentry(reader);
+                goto write_error;
+            }
+            offset += len;
+        }
+        close_zipentry(reader);
+
+        if (len < 0) {
+            fprintf(stderr, "error decompressing '%.*s'\n",
+                    (int)entry->fileNameLength, entry->fileName);
+            return -1;
+        }
+    }
+
+    if (crc != entry->crc32) {
+        fprintf(stderr, "'%.*s' has crc %08lx, expected %08lx\n",
+                (int)entry->fileNameLength, entry->fileName, crc, entry->crc32);
+        return -1;
+    }
+    return 0;
+
+write_error:
+    fprintf(stderr, "error writing '%.*s': %s\n",
+            (int)entry->fileNameLength, entry->fileName, strerror(errno));
+    return -1;
+}
+
+static void*
+extract_thread(void* arg)
+{
+    Extractor* x = (Extractor*)arg;
+    unsigned char* buf;
+    int i;
+
+    buf = malloc(EXTRACT_BUFFER_SIZE);
+    if (buf == NULL) {
+        // The calling thread always takes part, so it'll do this share
+        return NULL;
+    }
+
+    for (;;) {
+        lock_extractor(x);
+        i = x->nextJob++;
+        unlock_extractor(x);
+
+        if (i >= x->jobCount) {
+            break;
+        }
+
+        if (extract_entry(&x->jobs[i], buf) != 0) {
+            lock_extractor(x);
+            x->failed++;
+            unlock_extractor(x);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static int
+compare_jobs(const void* a, const void* b)
+{
+    const Extractjob* ja = (const Extractjob*)a;
+    const Extractjob* jb = (const Extractjob*)b;
+
+    // Biggest first, so no thread is left with a big entry at the end
+    if (ja->entry->uncompressedSize != jb->entry->uncompressedSize) {
+        return ja->entry->uncompressedSize > jb->entry->uncompressedSize
+                ? -1 : 1;
+    }
+    return 0;
+}
+
+static int
+extract_thread_count(int threads, int jobs)
+{
+#ifdef USE_MINGW
+    return 1;
+#else
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > MAX_EXTRACT_THREADS) {
+        threads = MAX_EXTRACT_THREADS;
+    }
+    if (threads > jobs) {
+        threads = jobs;
+    }
+    return threads < 1 ? 1 : threads;
+#endif
+}
+
+int
+extract_zipfile(zipfile_t file, zipentry_target_t target, void* cookie,
+        int threads)
+{
+    Zipfile* zip = (Zipfile*)file;
+    Zipentry* entry;
+    Extractor x;
+    int bad = 0;
+#ifndef USE_MINGW
+    pthread_t thread[MAX_EXTRACT_THREADS];
+    int started = 0;
+#endif
+    int i;
+
+    if (read_central_dir_entries(zip) != 0) {
+        return -1;
+    }
+
+    memset(&x, 0, sizeof(x));
+    x.jobs = malloc(zip->totalEntryCount * sizeof(Extractjob) + 1);
+    if (x.jobs == NULL) {
+        fprintf(stderr, "can't allocate %u extract jobs\n",
+                zip->totalEntryCount);
+        return -1;
+    }
+
+    for (entry = zip->entries; entry != NULL; entry = entry->next) {
+        Extractjob* job = &x.jobs[x.jobCount];
+
+        job->entry = entry;
+        job->fd = -1;
+        job->offset = 0;
+        if (target != NULL && target(entry, cookie, &job->fd, &job->offset)) {
+            continue;
+        }
+        // Find the data now, so the threads only ever read entries
+        if (get_entry_data(entry) == NULL) {
+            bad++;
+            continue;
+        }
+        x.jobCount++;
+    }
+
+    qsort(x.jobs, x.jobCount, sizeof(Extractjob), compare_jobs);
+    threads = extract_thread_count(threads, x.jobCount);
+
+#ifndef USE_MINGW
+    pthread_mutex_init(&x.lock, NULL);
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&thread[started], NULL, extract_thread, &x) == 0) {
+            started++;
+        }
+    }
+#endif
+
+    extract_thread(&x);
+
+#ifndef USE_MINGW
+    for (i = 0; i < started; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    pthread_mutex_destroy(&x.lock);
+#endif
+
+    // The calling thread couldn't get a buffer, so some jobs may not have run
+    if (x.nextJob < x.jobCount) {
+        x.failed = -1;
+    }
+
+    free(x.jobs);
+    return x.failed < 0 ? -1 : x.failed + bad;
+}
@@ -7,13 +7,24 @@
 #include <string.h>
 #include <stdlib.h>
 
+enum {
+    STORED = 0,
+    DEFLATED = 8
+};
+
+struct Zipfile;
+
 typedef struct Zipentry {
+    struct Zipfile* file;
     unsigned long fileNameLength;
     const unsigned char* fileName;
+    unsigned int fileNameHash;
     unsigned short compressionMethod;
-    unsigned int uncompressedSize;
-    unsigned int compressedSize;
-    const unsigned char* data;
+    uint64_t uncompressedSize;
+    uint64_t compressedSize;
+    unsigned long crc32;
+    uint64_t localHeaderOffset;
+    const unsigned char* data;  // NULL until get_entry_data finds it
     
     struct Zipentry* next;
 } Zipentry;
@@ -22,24 +33,41 @@ typedef struct Zipfile
 {
     const unsigned char *buf;
     ssize_t bufsize;
+    int mapped;                         // buf is ours, from open_zipfile_fd
 
     // Central directory
-    unsigned short  disknum;            //mDiskNumber;
-    unsigned short  diskWithCentralDir; //mDiskWithCentralDir;
-    unsigned short  entryCount;         //mNumEntries;
-    unsigned short  totalEntryCount;    //mTotalNumEntries;
-    unsigned int    centralDirSize;     //mCentralDirSize;
-    unsigned int    centralDirOffest;  // offset from first disk  //mCentralDirOffset;
+    unsigned int    disknum;            //mDiskNumber;
+    unsigned int    diskWithCentralDir; //mDiskWithCentralDir;
+    unsigned int    entryCount;         //mNumEntries;
+    unsigned int    totalEntryCount;    //mTotalNumEntries;
+    uint64_t        centralDirSize;     //mCentralDirSize;
+    uint64_t        centralDirOffest;  // offset from first disk  //mCentralDirOffset;
+    uint64_t        centralDirEnd;      // offset of the (ZIP64) EOCD
     unsigned short  commentLen;         //mCommentLen;
     const unsigned char*  comment;            //mComment;
 
+    // 0 until read_central_dir_entries has run, then 1 if it worked or -1
+    int entriesRead;
     Zipentry* entries;
+
+    // All the entries live in one allocation, followed by an open addressing
+    // hash table of hashTableSize (a power of 2) slots indexing them by name.
+    Zipentry* entryArena;
+    Zipentry** hashTable;
+    unsigned int hashTableSize;
 } Zipfile;
 
 int read_central_dir(Zipfile* file);
+int read_central_dir_end(Zipfile* file);
+int read_central_dir_entries(Zipfile* file);
+
+const unsigned char* get_entry_data(Zipentry* entry);
+
+unsigned int hash_name(const unsigned char* name, size_t len);
 
 unsigned int read_le_int(const unsigned char* buf);
 unsigned int read_le_short(const unsigned char* buf);
+uint64_t read_le_long(const unsigned char* buf);
 
 #endif // PRIVATE_H
 
@@ -2,9 +2,161 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 void dump_zipfile(FILE* to, zipfile_t file);
 
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Looks up every entry in the zip file by name, iterations times over, and
+// reports how fast lookup_zipentry is.
+static int
+bench_lookup(zipfile_t zip, int iterations)
+{
+    char** names = NULL;
+    int count = 0;
+    int alloc = 0;
+    void* cookie = NULL;
+    zipentry_t entry;
+    double start, elapsed;
+    int i, j;
+    int ret = 0;
+
+    while ((entry = iterate_zipfile(zip, &cookie)) != NULL) {
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            names = realloc(names, alloc * sizeof(char*));
+            if (names == NULL) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        names[count++] = get_zipentry_name(entry);
+    }
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < count; j++) {
+            if (lookup_zipentry(zip, names[j]) == NULL) {
+                fprintf(stderr, "lookup of '%s' failed\n", names[j]);
+                ret = 1;
+            }
+        }
+    }
+    elapsed = now() - start;
+
+    printf("%d entries, %d lookups in %.3f s: %.0f lookups/s\n", count,
+            count * iterations, elapsed,
+            elapsed > 0 ? count * iterations / elapsed : 0);
+
+    for (j = 0; j < count; j++) {
+        free(names[j]);
+    }
+    free(names);
+    return ret;
+}
+
+struct extract_bench {
+    int fd;
+    off_t next;
+};
+
+// Lays the entries out one after another in the output file
+static int
+bench_target(zipentry_t entry, void* cookie, int* fd, off_t* offset)
+{
+    struct extract_bench* b = (struct extract_bench*)cookie;
+
+    *fd = b->fd;
+    *offset = b->next;
+    b->next += get_zipentry_size(entry);
+    return 0;
+}
+
+// Extracts every entry with 1 to max_threads threads and reports the
+// throughput of each.  Entries are only checked unless there's a file to
+// write them to.
+static int
+bench_extract(zipfile_t zip, int max_threads, const char* out)
+{
+    struct extract_bench b;
+    void* cookie = NULL;
+    zipentry_t entry;
+    double total = 0;
+    double start, elapsed, base = 0;
+    int threads;
+    int failed;
+
+    while ((entry = iterate_zipfile(zip, &cookie)) != NULL) {
+        total += get_zipentry_size(entry);
+    }
+
+    b.fd = -1;
+    if (out != NULL) {
+        b.fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (b.fd < 0) {
+            fprintf(stderr, "can't open file for writing '%s'\n", out);
+            return 1;
+        }
+    }
+
+    for (threads = 1; threads <= max_threads; threads++) {
+        b.next = 0;
+        start = now();
+        failed = extract_zipfile(zip, out ? bench_target : NULL, &b, threads);
+        elapsed = now() - start;
+        if (failed != 0) {
+            fprintf(stderr, "%d entries failed\n", failed);
+            return 1;
+        }
+        if (threads == 1) {
+            base = elapsed;
+        }
+        printf("%2d threads: %8.1f MB/s  %5.2fx\n", threads,
+                total / (1024 * 1024) / elapsed, base / elapsed);
+    }
+
+    if (b.fd >= 0) {
+        close(b.fd);
+    }
+    return 0;
+}
+
+// Copies an entry to a file a piece at a time through a zipreader_t.
+static int
+stream_entry(zipentry_t entry, FILE* to)
+{
+    char buf[65536];
+    zipreader_t reader;
+    int len;
+
+    reader = open_zipentry(entry);
+    if (reader == NULL) {
+        fprintf(stderr, "can't open zip entry\n");
+        return 1;
+    }
+
+    while ((len = read_zipentry(reader, buf, sizeof(buf))) > 0) {
+        fwrite(buf, len, 1, to);
+    }
+    close_zipentry(reader);
+
+    if (len < 0) {
+        fprintf(stderr, "error decompressing file\n");
+        return 1;
+    }
+    return 0;
+}
+
 int
 main(int argc, char** argv)
 {
@@ -15,22 +167,61 @@ main(int argc, char** argv)
     zipfile_t zip;
     zipentry_t entry;
     int err;
-    enum { HUH, LIST, UNZIP } what = HUH;
+    int iterations = 10;
+    enum { HUH, LIST, UNZIP, STREAM, BENCH, EXTRACT } what = HUH;
 
-    if (strcmp(argv[2], "-l") == 0 && argc == 3) {
+    if (argc < 3) {
+        what = HUH;
+    }
+    else if (strcmp(argv[2], "-l") == 0 && argc == 3) {
         what = LIST;
     }
     else if (strcmp(argv[2], "-u") == 0 && argc == 5) {
         what = UNZIP;
     }
-    else {
+    else if (strcmp(argv[2], "-s") == 0 && argc == 5) {
+        what = STREAM;
+    }
+    else if (strcmp(argv[2], "-b") == 0 && (argc == 3 || argc == 4)) {
+        what = BENCH;
+        if (argc == 4) {
+            iterations = atoi(argv[3]);
+        }
+    }
+    else if (strcmp(argv[2], "-x") == 0 && (argc == 4 || argc == 5)) {
+        what = EXTRACT;
+    }
+
+    if (what == HUH) {
         fprintf(stderr, "usage: test_zipfile ZIPFILE -l\n"
                         "          lists the files in the zipfile\n"
                         "       test_zipfile ZIPFILE -u FILENAME SAVETO\n"
-                        "          saves FILENAME from the zip file into SAVETO\n");
+                        "          saves FILENAME from the zip file into SAVETO\n"
+                        "       test_zipfile ZIPFILE -s FILENAME SAVETO\n"
+                        "          like -u, but without holding all of FILENAME in memory\n"
+                        "       test_zipfile ZIPFILE -b [ITERATIONS]\n"
+                        "          times looking up every file ITERATIONS times\n"
+                        "       test_zipfile ZIPFILE -x THREADS [SAVETO]\n"
+                        "          times extracting every file with 1 to THREADS threads,\n"
+                        "          checking CRCs and writing them all to SAVETO if given\n");
         return 1;
     }
     
+    if (what != LIST && what != UNZIP) {
+        // The newer modes map the file instead
+        double start = now();
+        zip = open_zipfile(argv[1]);
+        if (zip == NULL) {
+            fprintf(stderr, "open_zipfile failed\n");
+            return 1;
+        }
+        if (what == BENCH) {
+            printf("open_zipfile took %.0f us\n", (now() - start) * 1000000);
+        }
+        buf = NULL;
+        goto opened;
+    }
+
     f = fopen(argv[1], "r");
     if (f == NULL) {
         fprintf(stderr, "couldn't open %s\n", argv[1]);
@@ -52,6 +243,7 @@ main(int argc, char** argv)
 
     fclose(f);
 
+opened:
 
     switch (what)
     {
@@ -61,6 +253,7 @@ main(int argc, char** argv)
             dump_zipfile(stdout, zip);
             break;
         case UNZIP:
+        case STREAM:
             entry = lookup_zipentry(zip, argv[3]);
             if (entry == NULL) {
                 fprintf(stderr, "zip file '%s' does not contain file '%s'\n",
@@ -72,6 +265,14 @@ main(int argc, char** argv)
                 fprintf(stderr, "can't open file for writing '%s'\n", argv[4]);
                 return 1;
             }
+            if (what == STREAM) {
+                err = stream_entry(entry, f);
+                fclose(f);
+                if (err != 0) {
+                    return 1;
+                }
+                break;
+            }
             unsize = get_zipentry_size(entry);
             size = unsize * 1.001;
             scratch = malloc(size);
@@ -85,6 +286,17 @@ main(int argc, char** argv)
             free(scratch);
             fclose(f);
             break;
+        case BENCH:
+        case EXTRACT:
+            if (what == BENCH) {
+                err = bench_lookup(zip, iterations);
+            } else {
+                err = bench_extract(zip, atoi(argv[3]),
+                        argc == 5 ? argv[4] : NULL);
+            }
+            release_zipfile(zip);
+            free(buf);
+            return err;
     }
     
     free(buf);
@@ -1,11 +1,22 @@
 #include <zipfile/zipfile.h>
 
 #include "private.h"
+#include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <zlib.h>
+#ifndef USE_MINGW
+#include <sys/mman.h>
+#endif
 #define DEF_MEM_LEVEL 8                // normally in zutil.h?
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 zipfile_t
 init_zipfile(const void* data, size_t size)
 {
@@ -26,16 +37,123 @@ fail:
     return NULL;
 }
 
+static int
+map_zipfile(Zipfile* file, int fd)
+{
+    struct stat st;
+    void* buf;
+
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "can't stat zip file\n");
+        return -1;
+    }
+    if (st.st_size < 0 || (uint64_t)st.st_size > SSIZE_MAX) {
+        fprintf(stderr, "zip file is too big to map\n");
+        return -1;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "Length is 0 -- too small\n");
+        return -1;
+    }
+
+#ifdef USE_MINGW
+    // No mmap, so read it all in instead
+    {
+        ssize_t done = 0;
+        ssize_t ret;
+
+        buf = malloc(st.st_size);
+        if (buf == NULL) {
+            fprintf(stderr, "can't allocate %lld bytes for zip file\n",
+                    (long long)st.st_size);
+            return -1;
+        }
+        if (lseek(fd, 0, SEEK_SET) < 0) {
+            free(buf);
+            return -1;
+        }
+        while (done < st.st_size) {
+            ret = read(fd, (char*)buf + done, st.st_size - done);
+            if (ret <= 0) {
+                fprintf(stderr, "can't read zip file\n");
+                free(buf);
+                return -1;
+            }
+            done += ret;
+        }
+    }
+#else
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "can't map zip file\n");
+        return -1;
+    }
+#endif
+
+    file->buf = buf;
+    file->bufsize = st.st_size;
+    file->mapped = 1;
+    return 0;
+}
+
+static void
+unmap_zipfile(Zipfile* file)
+{
+    if (file->mapped) {
+#ifdef USE_MINGW
+        free((void*)file->buf);
+#else
+        munmap((void*)file->buf, file->bufsize);
+#endif
+    }
+}
+
+zipfile_t
+open_zipfile_fd(int fd)
+{
+    int err;
+
+    Zipfile *file = malloc(sizeof(Zipfile));
+    if (file == NULL) return NULL;
+    memset(file, 0, sizeof(Zipfile));
+
+    err = map_zipfile(file, fd);
+    if (err != 0) goto fail;
+
+    // The entries are read the first time they're looked for
+    err = read_central_dir_end(file);
+    if (err != 0) goto fail;
+
+    return file;
+fail:
+    unmap_zipfile(file);
+    free(file);
+    return NULL;
+}
+
+zipfile_t
+open_zipfile(const char* path)
+{
+    zipfile_t file;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        fprintf(stderr, "can't open '%s'\n", path);
+        return NULL;
+    }
+
+    file = open_zipfile_fd(fd);
+    close(fd);
+    return file;
+}
+
 void
 release_zipfile(zipfile_t f)
 {
     Zipfile* file = (Zipfile*)f;
-    Zipentry* entry = file->entries;
-    while (entry) {
-        Zipentry* next = entry->next;
-        free(entry);
-        entry = next;
-    }
+    free(file->entryArena);
+    unmap_zipfile(file);
     free(file);
 }
 
@@ -43,12 +161,25 @@ zipentry_t
 lookup_zipentry(zipfile_t f, const char* entryName)
 {
     Zipfile* file = (Zipfile*)f;
-    Zipentry* entry = file->entries;
-    while (entry) {
-        if (0 == memcmp(entryName, entry->fileName, entry->fileNameLength)) {
+    size_t len = strlen(entryName);
+    unsigned int hash = hash_name((const unsigned char*)entryName, len);
+    unsigned int mask;
+    unsigned int i;
+    Zipentry* entry;
+
+    if (read_central_dir_entries(file) != 0) {
+        return NULL;
+    }
+
+    mask = file->hashTableSize - 1;
+    i = hash & mask;
+
+    while ((entry = file->hashTable[i]) != NULL) {
+        if (entry->fileNameHash == hash && entry->fileNameLength == len
+                && 0 == memcmp(entryName, entry->fileName, len)) {
             return entry;
         }
-        entry = entry->next;
+        i = (i + 1) & mask;
     }
     return NULL;
 }
@@ -70,11 +201,6 @@ get_zipentry_name(zipentry_t entry)
     return s;
 }
 
-enum {
-    STORED = 0,
-    DEFLATED = 8
-};
-
 static int
 uninflate(unsigned char* out, int unlen, const unsigned char* in, int clen)
 {
@@ -116,26 +242,312 @@ int
 decompress_zipentry(zipentry_t e, void* buf, int bufsize)
 {
     Zipentry* entry = (Zipentry*)e;
+    const unsigned char* data = get_entry_data(entry);
+
+    if (data == NULL || entry->compressedSize > INT_MAX
+            || entry->uncompressedSize > (unsigned int)bufsize) {
+        return -1;
+    }
+
     switch (entry->compressionMethod)
     {
         case STORED:
-            memcpy(buf, entry->data, entry->uncompressedSize);
+            memcpy(buf, data, entry->uncompressedSize);
             return 0;
         case DEFLATED:
-            return uninflate(buf, bufsize, entry->data, entry->compressedSize);
+            return uninflate(buf, bufsize, data, entry->compressedSize);
         default:
             return -1;
     }
 }
 
+// Inflated data that a seek skips over goes through a buffer this big
+#define SKIP_BUFFER_SIZE 8192
+
+typedef struct Zipcheckpoint {
+    size_t offset;
+    z_stream zstream;
+} Zipcheckpoint;
+
+typedef struct Zipreader {
+    Zipentry* entry;
+    size_t offset;
+    z_stream zstream;
+
+    // Copies of zstream, taken each checkpointInterval bytes and sorted by
+    // offset.  zlib keeps a pointer back to each z_stream, so they're
+    // allocated one at a time to stop them moving.
+    size_t checkpointInterval;
+    Zipcheckpoint** checkpoints;
+    int checkpointCount;
+    int checkpointAlloc;
+} Zipreader;
+
+static void
+free_checkpoints(Zipreader* reader)
+{
+    int i;
+
+    for (i=0; i<reader->checkpointCount; i++) {
+        inflateEnd(&reader->checkpoints[i]->zstream);
+        free(reader->checkpoints[i]);
+    }
+    free(reader->checkpoints);
+    reader->checkpoints = NULL;
+    reader->checkpointCount = 0;
+    reader->checkpointAlloc = 0;
+}
+
+static void
+add_checkpoint(Zipreader* reader)
+{
+    Zipcheckpoint** checkpoints;
+    Zipcheckpoint* checkpoint;
+
+    // Checkpoints only make seeks faster, so carry on without one if
+    // there's no memory for it
+    if (reader->checkpointCount == reader->checkpointAlloc) {
+        int alloc = reader->checkpointAlloc ? reader->checkpointAlloc * 2 : 16;
+        checkpoints = realloc(reader->checkpoints, alloc * sizeof(Zipcheckpoint*));
+        if (checkpoints == NULL) {
+            return;
+        }
+        reader->checkpoints = checkpoints;
+        reader->checkpointAlloc = alloc;
+    }
+
+    checkpoint = malloc(sizeof(Zipcheckpoint));
+    if (checkpoint == NULL) {
+        return;
+    }
+    if (inflateCopy(&checkpoint->zstream, &reader->zstream) != Z_OK) {
+        free(checkpoint);
+        return;
+    }
+    checkpoint->offset = reader->offset;
+    reader->checkpoints[reader->checkpointCount++] = checkpoint;
+}
+
+static int
+inflate_some(Zipreader* reader, unsigned char* out, size_t len)
+{
+    size_t interval = reader->checkpointInterval;
+    size_t done = 0;
+    size_t chunk;
+    size_t next;
+    int zerr;
+
+    while (done < len) {
+        chunk = len - done;
+        if (interval) {
+            // Stop at the next checkpoint so it's taken at an exact offset
+            next = (reader->offset / interval + 1) * interval;
+            if (chunk > next - reader->offset) {
+                chunk = next - reader->offset;
+            }
+        }
+
+        if (reader->zstream.avail_in == 0) {
+            // avail_in is only 32 bits, so ZIP64 entries go in a piece at
+            // a time
+            uint64_t left = reader->entry->compressedSize
+                    - (reader->zstream.next_in - reader->entry->data);
+            reader->zstream.avail_in = left > UINT_MAX ? UINT_MAX : left;
+        }
+
+        reader->zstream.next_out = out + done;
+        reader->zstream.avail_out = chunk;
+        zerr = inflate(&reader->zstream, Z_NO_FLUSH);
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            fprintf(stderr, "zerr=%d total_out=%lu\n", zerr,
+                    reader->zstream.total_out);
+            return -1;
+        }
+
+        chunk -= reader->zstream.avail_out;
+        if (chunk == 0) {
+            // The stream ended before uncompressedSize bytes
+            fprintf(stderr, "zip entry is truncated at %lu bytes\n",
+                    reader->zstream.total_out);
+            return -1;
+        }
+        done += chunk;
+        reader->offset += chunk;
+
+        if (interval && reader->offset % interval == 0
+                && (reader->checkpointCount == 0
+                    || reader->checkpoints[reader->checkpointCount - 1]->offset
+                            < reader->offset)) {
+            add_checkpoint(reader);
+        }
+    }
+
+    return done;
+}
+
+static void
+rewind_zipreader(Zipreader* reader)
+{
+    reader->zstream.next_in = (void*)reader->entry->data;
+    reader->zstream.avail_in = 0;
+    reader->offset = 0;
+}
+
+zipreader_t
+open_zipentry(zipentry_t e)
+{
+    Zipentry* entry = (Zipentry*)e;
+    Zipreader* reader;
+
+    if (entry->compressionMethod != STORED
+            && entry->compressionMethod != DEFLATED) {
+        return NULL;
+    }
+    if (get_entry_data(entry) == NULL || entry->uncompressedSize > SIZE_MAX) {
+        return NULL;
+    }
+
+    reader = malloc(sizeof(Zipreader));
+    if (reader == NULL) return NULL;
+    memset(reader, 0, sizeof(Zipreader));
+    reader->entry = entry;
+
+    if (entry->compressionMethod == DEFLATED) {
+        reader->zstream.data_type = Z_UNKNOWN;
+
+        // As in uninflate, there's no zlib header
+        if (inflateInit2(&reader->zstream, -MAX_WBITS) != Z_OK) {
+            free(reader);
+            return NULL;
+        }
+        rewind_zipreader(reader);
+    }
+
+    return reader;
+}
+
+int
+read_zipentry(zipreader_t r, void* buf, int len)
+{
+    Zipreader* reader = (Zipreader*)r;
+    Zipentry* entry = reader->entry;
+    size_t left = entry->uncompressedSize - reader->offset;
+
+    if (len < 0) {
+        return -1;
+    }
+    if ((size_t)len > left) {
+        len = left;
+    }
+
+    if (entry->compressionMethod == STORED) {
+        memcpy(buf, entry->data + reader->offset, len);
+        reader->offset += len;
+        return len;
+    }
+
+    return inflate_some(reader, buf, len);
+}
+
+int
+seek_zipentry(zipreader_t r, size_t offset)
+{
+    Zipreader* reader = (Zipreader*)r;
+    Zipentry* entry = reader->entry;
+    Zipcheckpoint* checkpoint = NULL;
+    unsigned char scratch[SKIP_BUFFER_SIZE];
+    size_t chunk;
+    int i;
+
+    if (offset > entry->uncompressedSize) {
+        return -1;
+    }
+
+    if (entry->compressionMethod == STORED) {
+        reader->offset = offset;
+        return 0;
+    }
+
+    for (i=reader->checkpointCount - 1; i>=0; i--) {
+        if (reader->checkpoints[i]->offset <= offset) {
+            checkpoint = reader->checkpoints[i];
+            break;
+        }
+    }
+
+    if (checkpoint != NULL
+            && (checkpoint->offset > reader->offset || offset < reader->offset)) {
+        inflateEnd(&reader->zstream);
+        if (inflateCopy(&reader->zstream, &checkpoint->zstream) == Z_OK) {
+            reader->offset = checkpoint->offset;
+        } else {
+            // Out of memory, fall back to starting over
+            memset(&reader->zstream, 0, sizeof(reader->zstream));
+            if (inflateInit2(&reader->zstream, -MAX_WBITS) != Z_OK) {
+                return -1;
+            }
+            rewind_zipreader(reader);
+        }
+    } else if (offset < reader->offset) {
+        inflateReset(&reader->zstream);
+        rewind_zipreader(reader);
+    }
+
+    while (reader->offset < offset) {
+        chunk = offset - reader->offset;
+        if (chunk > sizeof(scratch)) {
+            chunk = sizeof(scratch);
+        }
+        if (inflate_some(reader, scratch, chunk) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+set_zipentry_checkpoints(zipreader_t r, size_t interval)
+{
+    Zipreader* reader = (Zipreader*)r;
+
+    if (reader->entry->compressionMethod == STORED) {
+        // Seeks are free already
+        return 0;
+    }
+
+    if (interval != reader->checkpointInterval) {
+        free_checkpoints(reader);
+        reader->checkpointInterval = interval;
+    }
+    return 0;
+}
+
+void
+close_zipentry(zipreader_t r)
+{
+    Zipreader* reader = (Zipreader*)r;
+
+    if (reader->entry->compressionMethod == DEFLATED) {
+        free_checkpoints(reader);
+        inflateEnd(&reader->zstream);
+    }
+    free(reader);
+}
+
 void
 dump_zipfile(FILE* to, zipfile_t file)
 {
     Zipfile* zip = (Zipfile*)file;
-    Zipentry* entry = zip->entries;
-    int i;
+    Zipentry* entry;
+    unsigned int i;
 
-    fprintf(to, "entryCount=%d\n", zip->entryCount);
+    if (read_central_dir_entries(zip) != 0) {
+        return;
+    }
+    entry = zip->entries;
+
+    fprintf(to, "entryCount=%u\n", zip->entryCount);
     for (i=0; i<zip->entryCount; i++) {
         fprintf(to, "  file \"");
         fwrite(entry->fileName, entry->fileNameLength, 1, to);
@@ -150,6 +562,9 @@ iterate_zipfile(zipfile_t file, void** cookie)
     Zipentry* entry = (Zipentry*)*cookie;
     if (entry == NULL) {
         Zipfile* zip = (Zipfile*)file;
+        if (read_central_dir_entries(zip) != 0) {
+            return NULL;
+        }
         *cookie = zip->entries;
         return *cookie;
     } else {